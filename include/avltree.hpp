@@ -1,19 +1,43 @@
+#pragma once
+
+#include "node_pool.hpp"
+#include "parallel.hpp"
+#include "tree_stats.hpp"
+#include <algorithm>
 #include <cmath>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-template <typename TKey> class AvlTree;
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+class AvlTree;
 template <typename T> class AvlTreeConstIterator;
 
+// How many elements the node of a key stands for in the subtree sizes, which
+// size, select and rank count. One unless specialized; the entries of
+// MultiSet weigh as many as their copies. kUnit tells that every key weighs
+// one, so size() is also the number of nodes. The weight of a key in a tree
+// only changes through AvlTree::addOrUpdate and AvlTree::updateOrRemove.
+template <typename TKey> struct KeyWeight {
+  static constexpr bool kUnit = true;
+  static size_t of(const TKey &) { return 1; }
+};
+
 template <typename TKey> class TreeNode {
 public:
-  TreeNode(TKey key, int height = 1)
-      : m_Key(key), m_Height(height), m_LeftChild(nullptr),
+  template <typename... Args>
+  explicit TreeNode(std::in_place_t, Args &&...args)
+      : m_Key(std::forward<Args>(args)...), m_Height(1), m_LeftChild(nullptr),
         m_RightChild(nullptr), m_Prev(nullptr), m_Next(nullptr),
         m_LeftmostNode(this), m_RightmostNode(this), m_TreeSize(1) {}
-  friend AvlTree<TKey>;
+  template <typename, typename, typename, typename> friend class AvlTree;
   friend AvlTreeConstIterator<TKey>;
 
   const TreeNode *getPrev() { return m_Prev; }
@@ -31,82 +55,274 @@ protected:
   size_t m_TreeSize;
 };
 
-template <typename TKey> class AvlTree {
+// Keys are ordered by Compare. Lookup methods are templates, so with a
+// transparent comparator they accept anything comparable with TKey.
+//
+// Nodes are taken from a NodePool built on top of Allocator, so the tree works
+// with any std::allocator-compatible allocator, including
+// std::pmr::polymorphic_allocator.
+//
+// Stats is the policy counting what the tree does, see tree_stats.hpp. It is a
+// base class, so the default NoTreeStats takes no space, and its hooks are
+// empty inline functions that compile away.
+template <typename TKey, typename Compare = std::less<TKey>,
+          typename Allocator = std::allocator<TKey>,
+          typename Stats = NoTreeStats>
+class AvlTree : private Stats {
 public:
   typedef AvlTreeConstIterator<TKey> const_iterator;
-
-  AvlTree() : m_Root(nullptr) {}
-  AvlTree(const AvlTree<TKey> &other);
-  ~AvlTree() { removeAll(m_Root); }
-
-  void add(TKey);
-  const TreeNode<TKey> *next(TKey) const;
-  const TreeNode<TKey> *prev(TKey) const;
-  bool exists(TKey) const;
-  void remove(TKey);
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  explicit AvlTree(const Compare &comp = Compare(),
+                   const Allocator &alloc = Allocator())
+      : m_Root(nullptr), m_Compare(comp), m_Pool(alloc) {}
+  explicit AvlTree(const Allocator &alloc)
+      : m_Root(nullptr), m_Compare(), m_Pool(alloc) {}
+  AvlTree(const AvlTree &other);
+  AvlTree(AvlTree &&other) noexcept;
+  ~AvlTree() { removeAll(); }
+
+  void add(const TKey &);
+  void add(TKey &&);
+  template <typename... Args> void emplace(Args &&...args);
+  template <typename K> const_iterator addHint(const_iterator, K &&);
+  template <typename... Args>
+  const_iterator emplaceHint(const_iterator, Args &&...args);
+  template <typename K, typename... Args>
+  std::pair<const_iterator, bool> tryEmplace(const K &, Args &&...args);
+  template <typename K, typename Update, typename... Args>
+  const_iterator addOrUpdate(const K &, Update, Args &&...args);
+  template <typename K, typename Update> bool updateOrRemove(const K &, Update);
+  template <typename K> void addLast(K &&);
+  template <typename K> const TreeNode<TKey> *next(const K &) const;
+  template <typename K> const TreeNode<TKey> *prev(const K &) const;
+  template <typename K> bool exists(const K &) const;
+  template <typename K> void remove(const K &);
+  template <typename InputIterator>
+  void assign(InputIterator first, InputIterator last);
+  template <typename InputIterator>
+  void assignSorted(InputIterator first, InputIterator last);
+  template <typename InputIterator>
+  void assignParallel(InputIterator first, InputIterator last,
+                      size_t threadsNum);
+  template <typename InputIterator>
+  void addMany(InputIterator first, InputIterator last);
+  template <typename InputIterator>
+  void addSorted(InputIterator first, InputIterator last);
+  template <typename K> AvlTree splitOff(const K &);
+  void concat(AvlTree &&);
+  void unionWith(AvlTree &&, size_t threadsNum = 1);
+  void intersectWith(AvlTree &&, size_t threadsNum = 1);
+  void differenceWith(AvlTree &&, size_t threadsNum = 1);
+  void symmetricDifferenceWith(AvlTree &&, size_t threadsNum = 1);
   void clear();
+  void reserve(size_t);
   size_t size() const;
+  key_compare key_comp() const { return m_Compare; }
+  allocator_type get_allocator() const { return m_Pool.get_allocator(); }
 
   const_iterator begin() const;
   const_iterator end() const;
-  const_iterator find(TKey) const;
-  const_iterator lower_bound(TKey) const;
-
-  AvlTree<TKey> &operator=(const AvlTree<TKey> &other);
+  template <typename K> const_iterator find(const K &) const;
+  template <typename K> const_iterator lower_bound(const K &) const;
+  template <typename K> const_iterator upper_bound(const K &) const;
+  const_iterator select(size_t) const;
+  const_iterator select(size_t, size_t &) const;
+  template <typename K> size_t rank(const K &) const;
+  size_t rank(const_iterator) const;
+  template <typename ForwardIterator, typename Visitor>
+  void lowerBoundMany(ForwardIterator, ForwardIterator, Visitor) const;
+  TreeStats stats() const;
+  MemoryUsage memoryUsage() const;
+
+  AvlTree &operator=(const AvlTree &other);
+  AvlTree &operator=(AvlTree &&other);
+  void swap(AvlTree &other) noexcept;
 
 private:
+  typedef std::allocator_traits<Allocator> AllocatorTraits;
+  static constexpr bool kPropagateOnCopyAssignment =
+      AllocatorTraits::propagate_on_container_copy_assignment::value;
+  static constexpr bool kPropagateOnMoveAssignment =
+      AllocatorTraits::propagate_on_container_move_assignment::value;
+  static constexpr size_t kBatchLanes = 16;
+  static constexpr size_t kMergeRebuildRatio = 4;
+  // An AVL tree of height 128 would hold more than 2^88 keys.
+  static constexpr size_t kMaxHeight = 128;
+  static constexpr size_t kFingerSteps = 8;
+  // Smaller parts of a parallel operation are not worth a thread.
+  static constexpr size_t kParallelGrain = 1 << 14;
+  // The parallel build allocates from several threads at once, which is only
+  // known to be safe for std::allocator: a std::pmr memory resource, say, may
+  // not be thread-safe.
+  static constexpr bool kParallelAllocation = kUsesMalloc<Allocator>;
+
+  // Nodes dropped by a set operation, chained through m_Next. They are
+  // destroyed once the operation is over, since the pool cannot be used from
+  // parallel tasks.
+  struct DroppedNodes {
+    void push(TreeNode<TKey> *node) {
+      node->m_Next = nullptr;
+      if (m_Tail == nullptr) {
+        m_Head = node;
+      } else {
+        m_Tail->m_Next = node;
+      }
+      m_Tail = node;
+    }
+    void append(const DroppedNodes &other) {
+      if (other.m_Head == nullptr) {
+        return;
+      }
+      if (m_Tail == nullptr) {
+        m_Head = other.m_Head;
+      } else {
+        m_Tail->m_Next = other.m_Head;
+      }
+      m_Tail = other.m_Tail;
+    }
+
+    TreeNode<TKey> *m_Head = nullptr;
+    TreeNode<TKey> *m_Tail = nullptr;
+  };
+
   TreeNode<TKey> *m_Root;
-  static void removeAll(TreeNode<TKey> *root);
-  static TreeNode<TKey> *add(TKey, TreeNode<TKey> *);
-  static const TreeNode<TKey> *lower_bound(TKey, const TreeNode<TKey> *);
-  static TreeNode<TKey> *remove(TKey, TreeNode<TKey> *);
-  static const TreeNode<TKey> *findMax(const TreeNode<TKey> *);
-  static TreeNode<TKey> *balance(TreeNode<TKey> *);
+  Compare m_Compare;
+  NodePool<TreeNode<TKey>, Allocator> m_Pool;
+  template <typename... Args> TreeNode<TKey> *createNode(Args &&...);
+  // Heap memory owned by key as tracked by MemoryCounters, see
+  // trackedKeyHeapBytes. Keys with trivial destructors cannot own any and are
+  // not asked.
+  static size_t ownedBytes(const TKey &key) {
+    if constexpr (std::is_trivially_destructible<TKey>::value) {
+      return 0;
+    } else {
+      return trackedKeyHeapBytes(key);
+    }
+  }
+  static constexpr bool kUnitWeights = KeyWeight<TKey>::kUnit;
+  static size_t weight(const TKey &key) { return KeyWeight<TKey>::of(key); }
+  size_t nodesNum() const;
+  void destroyNode(TreeNode<TKey> *);
+  void removeAll();
+  template <typename K> void add(K &&);
+  template <typename K>
+  TreeNode<TKey> **findLink(const K &, TreeNode<TKey> **[], size_t &);
+  template <typename K>
+  TreeNode<TKey> **findHintLink(const TreeNode<TKey> *, const K &,
+                                TreeNode<TKey> **[], size_t &);
+  TreeNode<TKey> **findSpineLink(bool, TreeNode<TKey> **[], size_t &);
+  void insertLeaf(TreeNode<TKey> *, TreeNode<TKey> **, TreeNode<TKey> **[],
+                  size_t);
+  void removeLink(TreeNode<TKey> **, TreeNode<TKey> **[], size_t);
+  static void fixPathSizes(TreeNode<TKey> **[], size_t);
+  template <typename K>
+  const TreeNode<TKey> *lower_bound(const K &, const TreeNode<TKey> *,
+                                    size_t &) const;
+  // m_Compare for the searches reported to Stats, counting the calls.
+  template <typename L, typename R>
+  bool countedLess(const L &lhs, const R &rhs, size_t &comparisons) const {
+    ++comparisons;
+    return m_Compare(lhs, rhs);
+  }
+  void rebalanceAfterRemove(TreeNode<TKey> **[], size_t);
+  TreeNode<TKey> *rebalanceSubtree(TreeNode<TKey> *) const;
+  TreeNode<TKey> *balance(TreeNode<TKey> *) const;
   static int getBalance(const TreeNode<TKey> *);
-  static TreeNode<TKey> *smallLeftRotate(TreeNode<TKey> *);
-  static TreeNode<TKey> *smallRightRotate(TreeNode<TKey> *);
+  TreeNode<TKey> *smallLeftRotate(TreeNode<TKey> *) const;
+  TreeNode<TKey> *smallRightRotate(TreeNode<TKey> *) const;
   static int getChildrenNum(const TreeNode<TKey> *);
   static int getHeight(const TreeNode<TKey> *);
-  static void fixNode(TreeNode<TKey> *);
-  static TreeNode<TKey> *copy(TreeNode<TKey> *);
+  static size_t getSize(const TreeNode<TKey> *);
+  void fixNode(TreeNode<TKey> *) const;
+  static void fixSizeAndEnds(TreeNode<TKey> *);
+  TreeNode<TKey> *copy(TreeNode<TKey> *);
+  template <typename InputIterator>
+  bool buildSorted(InputIterator &first, InputIterator last);
+  TreeNode<TKey> *buildBalanced(TreeNode<TKey> *&, size_t) const;
+  void mergeSorted(std::vector<TKey> &&);
+  void mergeRebuild(const std::vector<TreeNode<TKey> *> &);
+  TreeNode<TKey> *mergeNodes(TreeNode<TKey> *, TreeNode<TKey> **,
+                             TreeNode<TKey> **);
+  TreeNode<TKey> *adopt(AvlTree &);
+  static void fixBounds(TreeNode<TKey> *);
+  TreeNode<TKey> *join(TreeNode<TKey> *, TreeNode<TKey> *,
+                       TreeNode<TKey> *) const;
+  TreeNode<TKey> *join(TreeNode<TKey> *, TreeNode<TKey> *) const;
+  TreeNode<TKey> *extractMin(TreeNode<TKey> *, TreeNode<TKey> *&) const;
+  template <typename K>
+  TreeNode<TKey> *split(TreeNode<TKey> *, const K &, TreeNode<TKey> *&,
+                        TreeNode<TKey> *&) const;
+  AvlTree buildParallel(TKey *, TKey *, size_t) const;
+  static size_t forkThreads(size_t threadsNum, size_t nodesNum) {
+    return nodesNum < kParallelGrain ? 1 : threadsNum;
+  }
+  TreeNode<TKey> *unite(TreeNode<TKey> *, TreeNode<TKey> *, size_t,
+                        DroppedNodes &);
+  TreeNode<TKey> *intersect(TreeNode<TKey> *, TreeNode<TKey> *, size_t,
+                            DroppedNodes &);
+  TreeNode<TKey> *subtract(TreeNode<TKey> *, TreeNode<TKey> *, size_t,
+                           DroppedNodes &);
+  TreeNode<TKey> *symmetricSubtract(TreeNode<TKey> *, TreeNode<TKey> *, size_t,
+                                    DroppedNodes &);
+  static void dropSubtree(TreeNode<TKey> *, DroppedNodes &);
+  void destroyDropped(const DroppedNodes &);
+  void destroySubtree(TreeNode<TKey> *);
+  const_iterator makeIterator(const TreeNode<TKey> *) const;
+  template <typename ForwardIterator, typename Visitor>
+  void lowerBoundInterleaved(ForwardIterator, ForwardIterator, Visitor) const;
+  template <typename ForwardIterator, typename Visitor>
+  void lowerBoundSorted(ForwardIterator, ForwardIterator, Visitor) const;
 };
 
-template <typename TKey>
-typename AvlTree<TKey>::const_iterator AvlTree<TKey>::begin() const {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::begin() const {
   if (m_Root != nullptr) {
-    return AvlTree<TKey>::const_iterator(m_Root->m_LeftmostNode, nullptr);
+    return const_iterator(m_Root->m_LeftmostNode, nullptr);
   }
-  return AvlTree<TKey>::const_iterator(nullptr, nullptr);
+  return const_iterator(nullptr, nullptr);
 }
 
-template <typename TKey>
-typename AvlTree<TKey>::const_iterator AvlTree<TKey>::end() const {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::end() const {
   if (m_Root != nullptr) {
-    return AvlTree<TKey>::const_iterator(nullptr, m_Root->m_RightmostNode);
+    return const_iterator(nullptr, m_Root->m_RightmostNode);
   }
-  return AvlTree<TKey>::const_iterator(nullptr, nullptr);
+  return const_iterator(nullptr, nullptr);
 }
 
-template <typename TKey>
-typename AvlTree<TKey>::const_iterator AvlTree<TKey>::find(TKey key) const {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::find(const K &key) const {
   if (m_Root == nullptr) {
     return AvlTreeConstIterator<TKey>(nullptr, nullptr);
   }
-  const TreeNode<TKey> *resNode = lower_bound(key, m_Root);
-  if (resNode == nullptr || (resNode->m_Key < key || key < resNode->m_Key)) {
+  size_t comparisons = 0;
+  const TreeNode<TKey> *resNode = lower_bound(key, m_Root, comparisons);
+  bool found =
+      resNode != nullptr && !countedLess(key, resNode->m_Key, comparisons);
+  this->onLookup(comparisons);
+  if (!found) {
     return AvlTreeConstIterator<TKey>(nullptr, m_Root->m_RightmostNode);
   }
 
   return AvlTreeConstIterator<TKey>(resNode, resNode->m_Prev);
 }
 
-template <typename TKey>
-typename AvlTree<TKey>::const_iterator
-AvlTree<TKey>::lower_bound(TKey key) const {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::lower_bound(const K &key) const {
   if (m_Root == nullptr) {
     return AvlTreeConstIterator<TKey>(nullptr, nullptr);
   }
-  const TreeNode<TKey> *resNode = lower_bound(key, m_Root);
+  size_t comparisons = 0;
+  const TreeNode<TKey> *resNode = lower_bound(key, m_Root, comparisons);
+  this->onLookup(comparisons);
   if (resNode == nullptr) {
     return AvlTreeConstIterator<TKey>(nullptr, m_Root->m_RightmostNode);
   }
@@ -114,189 +330,1534 @@ AvlTree<TKey>::lower_bound(TKey key) const {
   return AvlTreeConstIterator<TKey>(resNode, resNode->m_Prev);
 }
 
-template <typename TKey>
-TreeNode<TKey> *AvlTree<TKey>::copy(TreeNode<TKey> *root) {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::upper_bound(const K &key) const {
+  const TreeNode<TKey> *resNode = next(key);
+  if (resNode == nullptr) {
+    return end();
+  }
+
+  return AvlTreeConstIterator<TKey>(resNode, resNode->m_Prev);
+}
+
+// Returns the iterator to the k-th smallest key or end() if there are not
+// enough keys. Descends by subtree sizes in O(log n).
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::select(size_t k) const {
+  size_t offset = 0;
+  return select(k, offset);
+}
+
+// select for keys weighing more than one, see KeyWeight: the k-th element is
+// the copy number offset of the returned key.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::select(size_t k,
+                                                 size_t &offset) const {
+  if (k >= size()) {
+    return end();
+  }
+
+  const TreeNode<TKey> *node = m_Root;
+  while (node != nullptr) {
+    size_t leftSize = getSize(node->m_LeftChild);
+    size_t nodeWeight = weight(node->m_Key);
+    if (k < leftSize) {
+      node = node->m_LeftChild;
+    } else if (k >= leftSize + nodeWeight) {
+      k -= leftSize + nodeWeight;
+      node = node->m_RightChild;
+    } else {
+      k -= leftSize;
+      break;
+    }
+  }
+
+  offset = k;
+  return AvlTreeConstIterator<TKey>(node, node->m_Prev);
+}
+
+// Returns the number of keys less than key.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+size_t AvlTree<TKey, Compare, Allocator, Stats>::rank(const K &key) const {
+  size_t result = 0;
+  size_t comparisons = 0;
+  const TreeNode<TKey> *node = m_Root;
+  while (node != nullptr) {
+    if (countedLess(node->m_Key, key, comparisons)) {
+      result += getSize(node->m_LeftChild) + weight(node->m_Key);
+      node = node->m_RightChild;
+    } else {
+      node = node->m_LeftChild;
+    }
+  }
+  this->onLookup(comparisons);
+  return result;
+}
+
+// Returns the position of it in the sorted order, size() for end().
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+size_t AvlTree<TKey, Compare, Allocator, Stats>::rank(const_iterator it) const {
+  if (it.m_Node == nullptr) {
+    return size();
+  }
+  return rank(it.m_Node->m_Key);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename... Args>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::createNode(Args &&...args) {
+  TreeNode<TKey> *node = m_Pool.allocate();
+  try {
+    ::new (static_cast<void *>(node))
+        TreeNode<TKey>(std::in_place, std::forward<Args>(args)...);
+  } catch (...) {
+    m_Pool.deallocate(node);
+    throw;
+  }
+  if constexpr (!kUnitWeights) {
+    node->m_TreeSize = weight(node->m_Key);
+  }
+  MemoryCounters::addKeyHeapBytes(ownedBytes(node->m_Key));
+  this->onAllocation();
+  return node;
+}
+
+// size() unless the keys have weights, then the nodes are counted in O(n).
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+size_t AvlTree<TKey, Compare, Allocator, Stats>::nodesNum() const {
+  if (kUnitWeights || m_Root == nullptr) {
+    return size();
+  }
+  size_t result = 0;
+  for (const TreeNode<TKey> *node = m_Root->m_LeftmostNode; node != nullptr;
+       node = node->m_Next) {
+    ++result;
+  }
+  return result;
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::destroyNode(
+    TreeNode<TKey> *node) {
+  MemoryCounters::removeKeyHeapBytes(ownedBytes(node->m_Key));
+  node->~TreeNode<TKey>();
+  m_Pool.deallocate(node);
+  this->onDeallocation(1);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::copy(TreeNode<TKey> *root) {
   if (root == nullptr) {
     return nullptr;
   }
 
-  TreeNode<TKey> *result = new TreeNode<TKey>(root->m_Key, root->m_Height);
-  result->m_LeftChild = copy(root->m_LeftChild);
-  result->m_RightChild = copy(root->m_RightChild);
+  TreeNode<TKey> *result = createNode(root->m_Key);
+  try {
+    result->m_LeftChild = copy(root->m_LeftChild);
+    result->m_RightChild = copy(root->m_RightChild);
+  } catch (...) {
+    destroySubtree(result);
+    throw;
+  }
 
   fixNode(result);
   return result;
 }
 
-template <typename TKey> void AvlTree<TKey>::removeAll(TreeNode<TKey> *root) {
+// All nodes live in the pool, so they are released together with its slabs.
+// Keys with non-trivial destructors are still destroyed one by one, walking
+// the threaded list instead of recursing over the tree. That walk counts the
+// nodes for Stats too, since they cannot be read once destroyed; otherwise
+// they are counted by nodesNum, which only walks for weighted keys.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::removeAll() {
+  size_t destroyedNum = 0;
+  if (!std::is_trivially_destructible<TKey>::value && m_Root != nullptr) {
+    TreeNode<TKey> *node = m_Root->m_LeftmostNode;
+    while (node != nullptr) {
+      TreeNode<TKey> *next = node->m_Next;
+      MemoryCounters::removeKeyHeapBytes(ownedBytes(node->m_Key));
+      node->~TreeNode<TKey>();
+      node = next;
+      ++destroyedNum;
+    }
+  } else {
+    destroyedNum = nodesNum();
+  }
+  this->onDeallocation(destroyedNum);
+  m_Root = nullptr;
+  m_Pool.release();
+}
+
+// Replaces the contents with the keys from [first, last). The sorted prefix of
+// the input is built into a balanced tree in linear time, the rest (if any) is
+// inserted key by key.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename InputIterator>
+void AvlTree<TKey, Compare, Allocator, Stats>::assign(InputIterator first,
+                                                      InputIterator last) {
+  if (buildSorted(first, last)) {
+    return;
+  }
+
+  for (; first != last; ++first) {
+    add(*first);
+  }
+}
+
+// Replaces the contents with the keys from the sorted range [first, last) in
+// linear time. Equal keys are allowed and skipped, unsorted input results in
+// an empty tree and std::invalid_argument.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename InputIterator>
+void AvlTree<TKey, Compare, Allocator, Stats>::assignSorted(
+    InputIterator first, InputIterator last) {
+  if (!buildSorted(first, last)) {
+    removeAll();
+    throw std::invalid_argument("AvlTree::assignSorted: input is not sorted");
+  }
+}
+
+// Same as assign, with the work spread over up to threadsNum threads. The
+// keys are cut into one chunk per thread, every thread sorts its chunk and
+// builds it into a tree with a pool of its own, and the trees are united
+// pairwise, each union itself running in parallel. Sorted input is cut into
+// disjoint chunks, and their union takes O(log n) per join. With allocators
+// other than std::allocator the build runs on the calling thread only, see
+// kParallelAllocation.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename InputIterator>
+void AvlTree<TKey, Compare, Allocator, Stats>::assignParallel(
+    InputIterator first, InputIterator last, size_t threadsNum) {
+  std::vector<TKey> keys(first, last);
+  removeAll();
+  if (threadsNum <= 1 || keys.size() < kParallelGrain ||
+      !kParallelAllocation) {
+    std::sort(keys.begin(), keys.end(), m_Compare);
+    auto begin = std::make_move_iterator(keys.begin());
+    buildSorted(begin, std::make_move_iterator(keys.end()));
+    return;
+  }
+  threadsNum = std::min(threadsNum, keys.size() / kParallelGrain);
+  *this = buildParallel(keys.data(), keys.data() + keys.size(), threadsNum);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+AvlTree<TKey, Compare, Allocator, Stats>
+AvlTree<TKey, Compare, Allocator, Stats>::buildParallel(TKey *first, TKey *last,
+                                                 size_t threadsNum) const {
+  AvlTree left(m_Compare, get_allocator());
+  if (threadsNum <= 1) {
+    std::sort(first, last, m_Compare);
+    auto begin = std::make_move_iterator(first);
+    left.buildSorted(begin, std::make_move_iterator(last));
+    return left;
+  }
+
+  size_t leftThreadsNum = parallel::leftThreads(threadsNum);
+  TKey *middle = first + (last - first) * leftThreadsNum / threadsNum;
+  AvlTree right(m_Compare, get_allocator());
+  parallel::forkJoin(
+      threadsNum,
+      [&] { left = buildParallel(first, middle, leftThreadsNum); },
+      [&] {
+        right = buildParallel(middle, last, parallel::rightThreads(threadsNum));
+      });
+  left.unionWith(std::move(right), threadsNum);
+  return left;
+}
+
+// Inserts the keys of [first, last). The batch is sorted and deduplicated
+// first and then merged into the tree in one pass, see mergeSorted.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename InputIterator>
+void AvlTree<TKey, Compare, Allocator, Stats>::addMany(InputIterator first,
+                                                       InputIterator last) {
+  std::vector<TKey> batch(first, last);
+  std::sort(batch.begin(), batch.end(), m_Compare);
+  mergeSorted(std::move(batch));
+}
+
+// Same as addMany for a batch that is already sorted, equal keys are allowed.
+// Unsorted input throws std::invalid_argument and leaves the tree unchanged.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename InputIterator>
+void AvlTree<TKey, Compare, Allocator, Stats>::addSorted(InputIterator first,
+                                                         InputIterator last) {
+  std::vector<TKey> batch(first, last);
+  if (!std::is_sorted(batch.begin(), batch.end(), m_Compare)) {
+    throw std::invalid_argument("AvlTree::addSorted: input is not sorted");
+  }
+  mergeSorted(std::move(batch));
+}
+
+// The new nodes are created up front, so a throwing key constructor leaves the
+// tree intact. A batch that is large compared to the tree is merged with the
+// threaded list and the whole tree is rebuilt in O(n + m). A small one is
+// distributed over the tree top-down, see mergeNodes. Neither way searches
+// the tree from the root once per key or rebalances after every insertion.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::mergeSorted(
+    std::vector<TKey> &&batch) {
+  batch.erase(std::unique(batch.begin(), batch.end(),
+                          [this](const TKey &lhs, const TKey &rhs) {
+                            return !m_Compare(lhs, rhs);
+                          }),
+              batch.end());
+  if (batch.empty()) {
+    return;
+  }
+
+  std::vector<TreeNode<TKey> *> nodes;
+  nodes.reserve(batch.size());
+  m_Pool.reserve(size() + batch.size());
+  try {
+    for (TKey &key : batch) {
+      nodes.push_back(createNode(std::move(key)));
+    }
+  } catch (...) {
+    for (TreeNode<TKey> *node : nodes) {
+      destroyNode(node);
+    }
+    throw;
+  }
+
+  if (size() <= kMergeRebuildRatio * nodes.size()) {
+    mergeRebuild(nodes);
+  } else {
+    m_Root = mergeNodes(m_Root, nodes.data(), nodes.data() + nodes.size());
+    fixBounds(m_Root);
+  }
+}
+
+// Links the tree nodes and the new ones into one sorted m_Next chain, dropping
+// new nodes whose keys are already present, and builds a balanced tree of it.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::mergeRebuild(
+    const std::vector<TreeNode<TKey> *> &nodes) {
+  TreeNode<TKey> *head = nullptr;
+  TreeNode<TKey> **tail = &head;
+  TreeNode<TKey> *node = m_Root == nullptr ? nullptr : m_Root->m_LeftmostNode;
+  size_t nodesNum = size();
+  for (TreeNode<TKey> *newNode : nodes) {
+    while (node != nullptr && m_Compare(node->m_Key, newNode->m_Key)) {
+      *tail = node;
+      tail = &node->m_Next;
+      node = node->m_Next;
+    }
+    if (node != nullptr && !m_Compare(newNode->m_Key, node->m_Key)) {
+      destroyNode(newNode);
+      continue;
+    }
+    *tail = newNode;
+    tail = &newNode->m_Next;
+    ++nodesNum;
+  }
+  *tail = node;
+
+  TreeNode<TKey> *cursor = head;
+  m_Root = buildBalanced(cursor, nodesNum);
+}
+
+// Inserts the sorted nodes [first, last) into the subtree of root. The range
+// is split by the root key with a binary search and each part goes down its
+// own side, so the comparisons are shared between the keys near the top of
+// the tree. Parts that reach an empty place are built into balanced subtrees,
+// and join restores the balance on the way back up.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *AvlTree<TKey, Compare, Allocator, Stats>::mergeNodes(
+    TreeNode<TKey> *root, TreeNode<TKey> **first, TreeNode<TKey> **last) {
+  if (first == last) {
+    return root;
+  }
+  if (root == nullptr) {
+    for (TreeNode<TKey> **node = first; node + 1 != last; ++node) {
+      (*node)->m_Next = *(node + 1);
+    }
+    TreeNode<TKey> *cursor = *first;
+    return buildBalanced(cursor, last - first);
+  }
+
+  TreeNode<TKey> **middle = std::lower_bound(
+      first, last, root,
+      [this](const TreeNode<TKey> *lhs, const TreeNode<TKey> *rhs) {
+        return m_Compare(lhs->m_Key, rhs->m_Key);
+      });
+  TreeNode<TKey> **rightFirst = middle;
+  if (middle != last && !m_Compare(root->m_Key, (*middle)->m_Key)) {
+    destroyNode(*middle);
+    ++rightFirst;
+  }
+
+  TreeNode<TKey> *left = mergeNodes(root->m_LeftChild, first, middle);
+  TreeNode<TKey> *right = mergeNodes(root->m_RightChild, rightFirst, last);
+  return join(left, root, right);
+}
+
+// Replaces the contents with the longest sorted prefix of [first, last).
+// Nodes are created in order and chained through m_Next, then linked into a
+// perfectly balanced tree, so neither searches nor rotations are needed.
+// Returns false if it stopped at a key smaller than the previous one, in which
+// case first points to that key.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename InputIterator>
+bool AvlTree<TKey, Compare, Allocator, Stats>::buildSorted(InputIterator &first,
+                                                           InputIterator last) {
+  typedef typename std::iterator_traits<InputIterator>::iterator_category
+      IteratorCategory;
+  removeAll();
+  if constexpr (std::is_base_of<std::random_access_iterator_tag,
+                                IteratorCategory>::value) {
+    m_Pool.reserve(last - first);
+  }
+
+  TreeNode<TKey> *head = nullptr;
+  TreeNode<TKey> *tail = nullptr;
+  size_t nodesNum = 0;
+  bool sorted = true;
+  try {
+    for (; first != last; ++first) {
+      if (tail != nullptr && !m_Compare(tail->m_Key, *first)) {
+        if (m_Compare(*first, tail->m_Key)) {
+          sorted = false;
+          break;
+        }
+        continue;
+      }
+
+      TreeNode<TKey> *node = createNode(*first);
+      if (tail == nullptr) {
+        head = node;
+      } else {
+        tail->m_Next = node;
+      }
+      tail = node;
+      ++nodesNum;
+    }
+  } catch (...) {
+    while (head != nullptr) {
+      TreeNode<TKey> *next = head->m_Next;
+      destroyNode(head);
+      head = next;
+    }
+    throw;
+  }
+
+  m_Root = buildBalanced(head, nodesNum);
+  return sorted;
+}
+
+// Links the next nodesNum nodes of the m_Next chain starting at cursor into a
+// balanced subtree and advances cursor past them.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::buildBalanced(TreeNode<TKey> *&cursor,
+                                                        size_t nodesNum) const {
+  if (nodesNum == 0) {
+    return nullptr;
+  }
+
+  size_t leftNodesNum = nodesNum / 2;
+  TreeNode<TKey> *leftChild = buildBalanced(cursor, leftNodesNum);
+  TreeNode<TKey> *root = cursor;
+  cursor = cursor->m_Next;
+  root->m_LeftChild = leftChild;
+  root->m_RightChild = buildBalanced(cursor, nodesNum - leftNodesNum - 1);
+
+  fixNode(root);
+  return root;
+}
+
+// Set operations below follow the join-based algorithms of Blelloch, Ferizovic
+// and Sun ("Just Join for Parallel Ordered Sets"): the second tree is split by
+// the root key of the first one and the results for both halves are joined
+// back. This takes O(m log(n / m + 1)) time for trees of sizes m <= n and
+// reuses the nodes of both trees. Both trees are expected to use the same
+// ordering, other is left empty.
+
+// Moves the keys not less than key into the returned tree. The split itself
+// takes O(log n), but every tree owns its node pool and slabs cannot be
+// divided between pools, so the smaller part is copied: the whole operation
+// is O(log n + min(m, n - m)) for m keys moved. The bigger part keeps its
+// nodes, the pool goes to the returned tree if that is the bigger one.
+//
+// The copy is made before anything is detached: if a key copy throws, the
+// halves are joined back and the tree is left as it was. The counters of
+// Stats go with the pool.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+AvlTree<TKey, Compare, Allocator, Stats>
+AvlTree<TKey, Compare, Allocator, Stats>::splitOff(const K &key) {
+  AvlTree result(m_Compare, get_allocator());
+  TreeNode<TKey> *left = nullptr;
+  TreeNode<TKey> *right = nullptr;
+  TreeNode<TKey> *equalNode = split(m_Root, key, left, right);
+  if (equalNode != nullptr) {
+    right = join(nullptr, equalNode, right);
+  }
+
+  bool copyRight = getSize(left) >= getSize(right);
+  AvlTree smaller(m_Compare, get_allocator());
+  try {
+    smaller.m_Root = smaller.copy(copyRight ? right : left);
+  } catch (...) {
+    m_Root = join(left, right);
+    fixBounds(m_Root);
+    throw;
+  }
+
+  if (copyRight) {
+    m_Root = left;
+    destroySubtree(right);
+    result.swap(smaller);
+  } else {
+    result.m_Pool.swap(m_Pool);
+    result.absorb(*this);
+    result.m_Root = right;
+    result.destroySubtree(left);
+    m_Root = nullptr;
+    swap(smaller);
+  }
+  fixBounds(m_Root);
+  fixBounds(result.m_Root);
+  return result;
+}
+
+// Appends the keys of right, which all have to be greater than the keys of
+// this tree. O(log n) plus the cost of taking over the nodes of right.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::concat(AvlTree &&right) {
+  if (m_Root != nullptr && right.m_Root != nullptr &&
+      !m_Compare(m_Root->m_RightmostNode->m_Key,
+                 right.m_Root->m_LeftmostNode->m_Key)) {
+    throw std::invalid_argument("AvlTree::concat: trees overlap");
+  }
+  m_Root = join(m_Root, adopt(right));
+  fixBounds(m_Root);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::unionWith(AvlTree &&other,
+                                                   size_t threadsNum) {
+  DroppedNodes dropped;
+  m_Root = unite(m_Root, adopt(other), threadsNum, dropped);
+  destroyDropped(dropped);
+  fixBounds(m_Root);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::intersectWith(AvlTree &&other,
+                                                   size_t threadsNum) {
+  DroppedNodes dropped;
+  m_Root = intersect(m_Root, adopt(other), threadsNum, dropped);
+  destroyDropped(dropped);
+  fixBounds(m_Root);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::differenceWith(AvlTree &&other,
+                                                   size_t threadsNum) {
+  DroppedNodes dropped;
+  m_Root = subtract(m_Root, adopt(other), threadsNum, dropped);
+  destroyDropped(dropped);
+  fixBounds(m_Root);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::symmetricDifferenceWith(
+    AvlTree &&other, size_t threadsNum) {
+  DroppedNodes dropped;
+  m_Root = symmetricSubtract(m_Root, adopt(other), threadsNum, dropped);
+  destroyDropped(dropped);
+  fixBounds(m_Root);
+}
+
+// Detaches the nodes of other and makes them nodes of this tree. Slabs are
+// taken over if both pools use equal allocators, otherwise the keys are
+// copied.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::adopt(AvlTree &other) {
+  if (this == &other) {
+    AvlTree tmp(*this);
+    return adopt(tmp);
+  }
+  if (get_allocator() != other.get_allocator()) {
+    AvlTree tmp(m_Compare, get_allocator());
+    tmp.m_Pool.reserve(other.size());
+    tmp.m_Root = tmp.copy(other.m_Root);
+    other.clear();
+    return adopt(tmp);
+  }
+
+  m_Pool.splice(other.m_Pool);
+  this->absorb(other);
+  TreeNode<TKey> *root = other.m_Root;
+  other.m_Root = nullptr;
+  return root;
+}
+
+// Split and join leave the outermost nodes of a tree linked to their former
+// neighbours, so the ends of the threaded list are reset at the top level.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::fixBounds(TreeNode<TKey> *root) {
   if (root == nullptr) {
     return;
   }
-  auto leftChild = root->m_LeftChild;
-  auto rightChild = root->m_RightChild;
-  delete root;
-  removeAll(leftChild);
-  removeAll(rightChild);
+  root->m_LeftmostNode->m_Prev = nullptr;
+  root->m_RightmostNode->m_Next = nullptr;
 }
 
-template <typename TKey> void AvlTree<TKey>::clear() {
-  removeAll(m_Root);
-  m_Root = nullptr;
+// Returns the root of the tree made of left, node and right, where all keys of
+// left are less and all keys of right are greater than the key of node. Walks
+// down the spine of the higher tree, so it takes O(|h(left) - h(right)| + 1).
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::join(TreeNode<TKey> *left,
+                                               TreeNode<TKey> *node,
+                                               TreeNode<TKey> *right) const {
+  int leftHeight = getHeight(left);
+  int rightHeight = getHeight(right);
+  if (leftHeight > rightHeight + 1) {
+    left->m_RightChild = join(left->m_RightChild, node, right);
+    fixNode(left);
+    return balance(left);
+  }
+  if (rightHeight > leftHeight + 1) {
+    right->m_LeftChild = join(left, node, right->m_LeftChild);
+    fixNode(right);
+    return balance(right);
+  }
+
+  node->m_LeftChild = left;
+  node->m_RightChild = right;
+  fixNode(node);
+  return node;
 }
 
-template <typename TKey> AvlTree<TKey>::AvlTree(const AvlTree<TKey> &other) {
+// Same as above without a middle node.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::join(TreeNode<TKey> *left,
+                                               TreeNode<TKey> *right) const {
+  if (left == nullptr) {
+    return right;
+  }
+  if (right == nullptr) {
+    return left;
+  }
+
+  TreeNode<TKey> *minNode = nullptr;
+  right = extractMin(right, minNode);
+  return join(left, minNode, right);
+}
+
+// Unlinks the node with the smallest key from the tree and stores it to
+// minNode. Returns the root pointer to the modified tree.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::extractMin(
+    TreeNode<TKey> *root, TreeNode<TKey> *&minNode) const {
+  if (root->m_LeftChild == nullptr) {
+    minNode = root;
+    return root->m_RightChild;
+  }
+
+  root->m_LeftChild = extractMin(root->m_LeftChild, minNode);
+  fixNode(root);
+  return balance(root);
+}
+
+// Splits the tree into the keys less than key (left) and greater than key
+// (right). Returns the node equal to key, if any, with its children unlinked
+// into left and right.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+TreeNode<TKey> *AvlTree<TKey, Compare, Allocator, Stats>::split(
+    TreeNode<TKey> *root, const K &key, TreeNode<TKey> *&left,
+    TreeNode<TKey> *&right) const {
+  if (root == nullptr) {
+    left = nullptr;
+    right = nullptr;
+    return nullptr;
+  }
+
+  TreeNode<TKey> *equalNode = nullptr;
+  if (m_Compare(key, root->m_Key)) {
+    TreeNode<TKey> *rightPart = nullptr;
+    equalNode = split(root->m_LeftChild, key, left, rightPart);
+    right = join(rightPart, root, root->m_RightChild);
+  } else if (m_Compare(root->m_Key, key)) {
+    TreeNode<TKey> *leftPart = nullptr;
+    equalNode = split(root->m_RightChild, key, leftPart, right);
+    left = join(root->m_LeftChild, root, leftPart);
+  } else {
+    left = root->m_LeftChild;
+    right = root->m_RightChild;
+    equalNode = root;
+    equalNode->m_LeftChild = nullptr;
+    equalNode->m_RightChild = nullptr;
+  }
+  return equalNode;
+}
+
+// With threadsNum > 1 the two halves left after a split are processed in
+// parallel: they hold disjoint nodes, and join and split never touch nodes
+// outside the trees they are given. Dropped nodes are collected in dropped.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *AvlTree<TKey, Compare, Allocator, Stats>::unite(
+    TreeNode<TKey> *first, TreeNode<TKey> *second, size_t threadsNum,
+    DroppedNodes &dropped) {
+  if (first == nullptr) {
+    return second;
+  }
+  if (second == nullptr) {
+    return first;
+  }
+
+  size_t nodesNum = getSize(first) + getSize(second);
+  TreeNode<TKey> *secondLeft = nullptr;
+  TreeNode<TKey> *secondRight = nullptr;
+  TreeNode<TKey> *equalNode =
+      split(second, first->m_Key, secondLeft, secondRight);
+  if (equalNode != nullptr) {
+    dropped.push(equalNode);
+  }
+
+  TreeNode<TKey> *left = nullptr;
+  TreeNode<TKey> *right = nullptr;
+  DroppedNodes leftDropped;
+  parallel::forkJoin(
+      forkThreads(threadsNum, nodesNum),
+      [&] {
+        left = unite(first->m_LeftChild, secondLeft,
+                     parallel::leftThreads(threadsNum), leftDropped);
+      },
+      [&] {
+        right = unite(first->m_RightChild, secondRight,
+                      parallel::rightThreads(threadsNum), dropped);
+      });
+  dropped.append(leftDropped);
+  return join(left, first, right);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *AvlTree<TKey, Compare, Allocator, Stats>::intersect(
+    TreeNode<TKey> *first, TreeNode<TKey> *second, size_t threadsNum,
+    DroppedNodes &dropped) {
+  if (first == nullptr || second == nullptr) {
+    dropSubtree(first, dropped);
+    dropSubtree(second, dropped);
+    return nullptr;
+  }
+
+  size_t nodesNum = getSize(first) + getSize(second);
+  TreeNode<TKey> *secondLeft = nullptr;
+  TreeNode<TKey> *secondRight = nullptr;
+  TreeNode<TKey> *equalNode =
+      split(second, first->m_Key, secondLeft, secondRight);
+
+  TreeNode<TKey> *left = nullptr;
+  TreeNode<TKey> *right = nullptr;
+  DroppedNodes leftDropped;
+  parallel::forkJoin(
+      forkThreads(threadsNum, nodesNum),
+      [&] {
+        left = intersect(first->m_LeftChild, secondLeft,
+                         parallel::leftThreads(threadsNum), leftDropped);
+      },
+      [&] {
+        right = intersect(first->m_RightChild, secondRight,
+                          parallel::rightThreads(threadsNum), dropped);
+      });
+  dropped.append(leftDropped);
+  if (equalNode != nullptr) {
+    dropped.push(equalNode);
+    return join(left, first, right);
+  }
+  dropped.push(first);
+  return join(left, right);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *AvlTree<TKey, Compare, Allocator, Stats>::subtract(
+    TreeNode<TKey> *first, TreeNode<TKey> *second, size_t threadsNum,
+    DroppedNodes &dropped) {
+  if (first == nullptr || second == nullptr) {
+    dropSubtree(second, dropped);
+    return first;
+  }
+
+  size_t nodesNum = getSize(first) + getSize(second);
+  TreeNode<TKey> *firstLeft = nullptr;
+  TreeNode<TKey> *firstRight = nullptr;
+  TreeNode<TKey> *equalNode =
+      split(first, second->m_Key, firstLeft, firstRight);
+  if (equalNode != nullptr) {
+    dropped.push(equalNode);
+  }
+
+  TreeNode<TKey> *left = nullptr;
+  TreeNode<TKey> *right = nullptr;
+  DroppedNodes leftDropped;
+  parallel::forkJoin(
+      forkThreads(threadsNum, nodesNum),
+      [&] {
+        left = subtract(firstLeft, second->m_LeftChild,
+                        parallel::leftThreads(threadsNum), leftDropped);
+      },
+      [&] {
+        right = subtract(firstRight, second->m_RightChild,
+                         parallel::rightThreads(threadsNum), dropped);
+      });
+  dropped.append(leftDropped);
+  dropped.push(second);
+  return join(left, right);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *AvlTree<TKey, Compare, Allocator, Stats>::symmetricSubtract(
+    TreeNode<TKey> *first, TreeNode<TKey> *second, size_t threadsNum,
+    DroppedNodes &dropped) {
+  if (first == nullptr) {
+    return second;
+  }
+  if (second == nullptr) {
+    return first;
+  }
+
+  size_t nodesNum = getSize(first) + getSize(second);
+  TreeNode<TKey> *secondLeft = nullptr;
+  TreeNode<TKey> *secondRight = nullptr;
+  TreeNode<TKey> *equalNode =
+      split(second, first->m_Key, secondLeft, secondRight);
+
+  TreeNode<TKey> *left = nullptr;
+  TreeNode<TKey> *right = nullptr;
+  DroppedNodes leftDropped;
+  parallel::forkJoin(
+      forkThreads(threadsNum, nodesNum),
+      [&] {
+        left = symmetricSubtract(first->m_LeftChild, secondLeft,
+                                 parallel::leftThreads(threadsNum),
+                                 leftDropped);
+      },
+      [&] {
+        right = symmetricSubtract(first->m_RightChild, secondRight,
+                                  parallel::rightThreads(threadsNum), dropped);
+      });
+  dropped.append(leftDropped);
+  if (equalNode != nullptr) {
+    dropped.push(equalNode);
+    dropped.push(first);
+    return join(left, right);
+  }
+  return join(left, first, right);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::dropSubtree(
+    TreeNode<TKey> *root, DroppedNodes &dropped) {
+  if (root == nullptr) {
+    return;
+  }
+  dropSubtree(root->m_LeftChild, dropped);
+  dropSubtree(root->m_RightChild, dropped);
+  dropped.push(root);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::destroyDropped(
+    const DroppedNodes &dropped) {
+  TreeNode<TKey> *node = dropped.m_Head;
+  while (node != nullptr) {
+    TreeNode<TKey> *next = node->m_Next;
+    destroyNode(node);
+    node = next;
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::destroySubtree(
+    TreeNode<TKey> *root) {
+  if (root == nullptr) {
+    return;
+  }
+  destroySubtree(root->m_LeftChild);
+  destroySubtree(root->m_RightChild);
+  destroyNode(root);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::clear() {
+  removeAll();
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::reserve(size_t nodesNum) {
+  m_Pool.reserve(nodesNum);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+AvlTree<TKey, Compare, Allocator, Stats>::AvlTree(const AvlTree &other)
+    : m_Root(nullptr), m_Compare(other.m_Compare),
+      m_Pool(AllocatorTraits::select_on_container_copy_construction(
+          other.get_allocator())) {
+  m_Pool.reserve(other.size());
   m_Root = copy(other.m_Root);
 }
 
-template <typename TKey>
-AvlTree<TKey> &AvlTree<TKey>::operator=(const AvlTree<TKey> &other) {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+AvlTree<TKey, Compare, Allocator, Stats>::AvlTree(AvlTree &&other) noexcept
+    : m_Root(other.m_Root), m_Compare(std::move(other.m_Compare)),
+      m_Pool(std::move(other.m_Pool)) {
+  other.m_Root = nullptr;
+  this->absorb(other);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+AvlTree<TKey, Compare, Allocator, Stats> &
+AvlTree<TKey, Compare, Allocator, Stats>::operator=(const AvlTree &other) {
   if (this == &other) {
     return *this;
   }
-  removeAll(m_Root);
+  removeAll();
+  m_Compare = other.m_Compare;
+  if constexpr (kPropagateOnCopyAssignment) {
+    m_Pool.reset(other.get_allocator());
+  }
+  m_Pool.reserve(other.size());
   m_Root = copy(other.m_Root);
   return *this;
 }
 
-template <typename TKey> void AvlTree<TKey>::add(TKey key) {
-  this->m_Root = add(key, this->m_Root);
+// Nodes can only be stolen when both trees allocate from the same place,
+// otherwise the keys are copied into nodes of this tree.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+AvlTree<TKey, Compare, Allocator, Stats> &
+AvlTree<TKey, Compare, Allocator, Stats>::operator=(AvlTree &&other) {
+  if (this == &other) {
+    return *this;
+  }
+  removeAll();
+  m_Compare = std::move(other.m_Compare);
+  if constexpr (kPropagateOnMoveAssignment) {
+    m_Pool = std::move(other.m_Pool);
+  } else {
+    if (get_allocator() != other.get_allocator()) {
+      m_Pool.reserve(other.size());
+      m_Root = copy(other.m_Root);
+      other.clear();
+      return *this;
+    }
+    m_Pool.swap(other.m_Pool);
+  }
+  std::swap(m_Root, other.m_Root);
+  this->absorb(other);
+  return *this;
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::swap(AvlTree &other) noexcept {
+  std::swap(m_Root, other.m_Root);
+  std::swap(m_Compare, other.m_Compare);
+  m_Pool.swap(other.m_Pool);
+  Stats stats;
+  stats.absorb(*this);
+  this->absorb(other);
+  other.absorb(stats);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::add(const TKey &key) {
+  add<const TKey &>(key);
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::add(TKey &&key) {
+  add<TKey>(std::move(key));
 }
 
-template <typename TKey> void AvlTree<TKey>::remove(TKey key) {
-  this->m_Root = remove(key, this->m_Root);
+// The key is passed down by reference and only copied or moved into the new
+// node once its place is known.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+void AvlTree<TKey, Compare, Allocator, Stats>::add(K &&key) {
+  TreeNode<TKey> **path[kMaxHeight];
+  size_t depth = 0;
+  TreeNode<TKey> **link = findLink(key, path, depth);
+  if (*link == nullptr) {
+    insertLeaf(createNode(std::forward<K>(key)), link, path, depth);
+  }
+}
+
+// The key has to be constructed before its place in the tree is known, so the
+// node is built first and dropped if an equal key is already present.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename... Args>
+void AvlTree<TKey, Compare, Allocator, Stats>::emplace(Args &&...args) {
+  TreeNode<TKey> *node = createNode(std::forward<Args>(args)...);
+  TreeNode<TKey> **path[kMaxHeight];
+  size_t depth = 0;
+  TreeNode<TKey> **link = findLink(node->m_Key, path, depth);
+  if (*link == nullptr) {
+    insertLeaf(node, link, path, depth);
+  } else {
+    destroyNode(node);
+  }
 }
 
-// Returns the root pointer to the modified tree.
-template <typename TKey>
-TreeNode<TKey> *AvlTree<TKey>::add(TKey key, TreeNode<TKey> *node) {
+// Inserts key like add and returns the iterator to it or to the equal key
+// that was already there. The tree has no parent links, so the hint only saves
+// the descent when it is end() and key is greater than all the keys, or it is
+// begin() and key is less than all of them; then a single comparison is made.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::addHint(const_iterator hint,
+                                                  K &&key) {
+  TreeNode<TKey> **path[kMaxHeight];
+  size_t depth = 0;
+  TreeNode<TKey> **link = findHintLink(hint.m_Node, key, path, depth);
+  TreeNode<TKey> *node = *link;
   if (node == nullptr) {
-    return new TreeNode<TKey>(key);
+    node = createNode(std::forward<K>(key));
+    insertLeaf(node, link, path, depth);
   }
+  return makeIterator(node);
+}
 
-  if (key < node->m_Key) {
-    node->m_LeftChild = add(key, node->m_LeftChild);
-  } else if (node->m_Key < key) {
-    node->m_RightChild = add(key, node->m_RightChild);
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename... Args>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::emplaceHint(const_iterator hint,
+                                                      Args &&...args) {
+  TreeNode<TKey> *node = createNode(std::forward<Args>(args)...);
+  TreeNode<TKey> **path[kMaxHeight];
+  size_t depth = 0;
+  TreeNode<TKey> **link = findHintLink(hint.m_Node, node->m_Key, path, depth);
+  if (*link != nullptr) {
+    destroyNode(node);
+    return makeIterator(*link);
   }
+  insertLeaf(node, link, path, depth);
+  return makeIterator(node);
+}
 
-  fixNode(node);
+// Constructs a node from args only if there is no key equal to key, which has
+// to be the key the node would get. Returns the iterator to the node with the
+// key and whether it was inserted.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K, typename... Args>
+std::pair<typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator,
+          bool>
+AvlTree<TKey, Compare, Allocator, Stats>::tryEmplace(const K &key,
+                                                     Args &&...args) {
+  TreeNode<TKey> **path[kMaxHeight];
+  size_t depth = 0;
+  TreeNode<TKey> **link = findLink(key, path, depth);
+  if (*link != nullptr) {
+    return {makeIterator(*link), false};
+  }
+  TreeNode<TKey> *node = createNode(std::forward<Args>(args)...);
+  insertLeaf(node, link, path, depth);
+  return {makeIterator(node), true};
+}
+
+// tryEmplace that calls update(key) on the key already present instead. update
+// must keep the order of the key but may change its weight (see KeyWeight):
+// the sizes on the way to the node are fixed, with no rebalancing needed.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K, typename Update, typename... Args>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::addOrUpdate(const K &key,
+                                                      Update update,
+                                                      Args &&...args) {
+  TreeNode<TKey> **path[kMaxHeight];
+  size_t depth = 0;
+  TreeNode<TKey> **link = findLink(key, path, depth);
+  TreeNode<TKey> *node = *link;
+  if (node == nullptr) {
+    node = createNode(std::forward<Args>(args)...);
+    insertLeaf(node, link, path, depth);
+  } else {
+    update(node->m_Key);
+    path[depth++] = link;
+    fixPathSizes(path, depth);
+  }
+  return makeIterator(node);
+}
+
+// Calls update(key) on the key equal to key like addOrUpdate does, and
+// removes the node if update returns false. Returns false if there is no such
+// key.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K, typename Update>
+bool AvlTree<TKey, Compare, Allocator, Stats>::updateOrRemove(const K &key,
+                                                              Update update) {
+  TreeNode<TKey> **path[kMaxHeight];
+  size_t depth = 0;
+  TreeNode<TKey> **link = findLink(key, path, depth);
+  if (*link == nullptr) {
+    return false;
+  }
+  if (update((*link)->m_Key)) {
+    path[depth++] = link;
+    fixPathSizes(path, depth);
+  } else {
+    removeLink(link, path, depth);
+  }
+  return true;
+}
+
+// Recomputes the sizes from the bottom of path up to the root.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::fixPathSizes(
+    TreeNode<TKey> **path[], size_t depth) {
+  for (size_t i = depth; i-- > 0;) {
+    fixSizeAndEnds(*path[i]);
+  }
+}
+
+// Appends key that has to be greater than all the keys of the tree, otherwise
+// std::invalid_argument is thrown.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+void AvlTree<TKey, Compare, Allocator, Stats>::addLast(K &&key) {
+  if (m_Root != nullptr && !m_Compare(m_Root->m_RightmostNode->m_Key, key)) {
+    throw std::invalid_argument(
+        "AvlTree::addLast: key is not greater than the last one");
+  }
+  TreeNode<TKey> **path[kMaxHeight];
+  size_t depth = 0;
+  TreeNode<TKey> **link = findSpineLink(true, path, depth);
+  insertLeaf(createNode(std::forward<K>(key)), link, path, depth);
+}
 
-  return balance(node);
+// findLink that goes down the right or left spine without comparing keys if
+// key belongs at end() or begin() and the hint points there.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+TreeNode<TKey> **AvlTree<TKey, Compare, Allocator, Stats>::findHintLink(
+    const TreeNode<TKey> *hintNode, const K &key, TreeNode<TKey> **path[],
+    size_t &depth) {
+  if (m_Root != nullptr) {
+    if (hintNode == nullptr) {
+      if (m_Compare(m_Root->m_RightmostNode->m_Key, key)) {
+        return findSpineLink(true, path, depth);
+      }
+    } else if (hintNode == m_Root->m_LeftmostNode &&
+               m_Compare(key, hintNode->m_Key)) {
+      return findSpineLink(false, path, depth);
+    }
+  }
+  return findLink(key, path, depth);
+}
+
+// Returns the empty link past the rightmost (or leftmost) node.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> **
+AvlTree<TKey, Compare, Allocator, Stats>::findSpineLink(bool right,
+                                                        TreeNode<TKey> **path[],
+                                                        size_t &depth) {
+  TreeNode<TKey> **link = &m_Root;
+  while (*link != nullptr) {
+    path[depth++] = link;
+    link = right ? &(*link)->m_RightChild : &(*link)->m_LeftChild;
+  }
+  return link;
+}
+
+// Walks down from the root and returns the link (the child pointer of the
+// parent, or m_Root) that holds the node equal to key, or the empty link where
+// such a node would be attached. The links leading to it are stored to path.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+TreeNode<TKey> **
+AvlTree<TKey, Compare, Allocator, Stats>::findLink(const K &key,
+                                                   TreeNode<TKey> **path[],
+                                                   size_t &depth) {
+  TreeNode<TKey> **link = &m_Root;
+  size_t comparisons = 0;
+  while (*link != nullptr) {
+    TreeNode<TKey> *node = *link;
+    if (countedLess(key, node->m_Key, comparisons)) {
+      path[depth++] = link;
+      link = &node->m_LeftChild;
+    } else if (countedLess(node->m_Key, key, comparisons)) {
+      path[depth++] = link;
+      link = &node->m_RightChild;
+    } else {
+      break;
+    }
+  }
+  this->onLookup(comparisons);
+  return link;
+}
+
+// Hangs newNode on the empty link below path and threads it next to its
+// parent. Going back up, sizes and leftmost/rightmost nodes are updated on the
+// whole path, but heights only until one of them stays the same or a rotation
+// restores it; no fixNode calls are needed.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::insertLeaf(
+    TreeNode<TKey> *newNode, TreeNode<TKey> **link, TreeNode<TKey> **path[],
+    size_t depth) {
+  *link = newNode;
+  if (depth > 0) {
+    TreeNode<TKey> *parent = *path[depth - 1];
+    if (link == &parent->m_LeftChild) {
+      newNode->m_Prev = parent->m_Prev;
+      newNode->m_Next = parent;
+    } else {
+      newNode->m_Prev = parent;
+      newNode->m_Next = parent->m_Next;
+    }
+    if (newNode->m_Prev != nullptr) {
+      newNode->m_Prev->m_Next = newNode;
+    }
+    if (newNode->m_Next != nullptr) {
+      newNode->m_Next->m_Prev = newNode;
+    }
+  }
+
+  bool heightChanged = true;
+  for (size_t i = depth; i-- > 0;) {
+    TreeNode<TKey> *node = *path[i];
+    fixSizeAndEnds(node);
+    if (!heightChanged) {
+      continue;
+    }
+    int height = std::max(getHeight(node->m_LeftChild),
+                          getHeight(node->m_RightChild)) +
+                 1;
+    if (height == node->m_Height) {
+      heightChanged = false;
+      continue;
+    }
+    node->m_Height = height;
+    if (std::abs(getBalance(node)) == 2) {
+      *path[i] = rebalanceSubtree(node);
+      heightChanged = false;
+    }
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+void AvlTree<TKey, Compare, Allocator, Stats>::remove(const K &key) {
+  TreeNode<TKey> **path[kMaxHeight];
+  size_t depth = 0;
+  TreeNode<TKey> **link = findLink(key, path, depth);
+  if (*link != nullptr) {
+    removeLink(link, path, depth);
+  }
+}
+
+// Unlinks and destroys the node on link found by findLink with path.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::removeLink(
+    TreeNode<TKey> **link, TreeNode<TKey> **path[], size_t depth) {
+  TreeNode<TKey> *target = *link;
+  if (target->m_Prev != nullptr) {
+    target->m_Prev->m_Next = target->m_Next;
+  }
+  if (target->m_Next != nullptr) {
+    target->m_Next->m_Prev = target->m_Prev;
+  }
+
+  if (target->m_LeftChild == nullptr || target->m_RightChild == nullptr) {
+    *link = target->m_LeftChild != nullptr ? target->m_LeftChild
+                                           : target->m_RightChild;
+  } else {
+    // The predecessor is unlinked from the bottom of the left subtree and
+    // put in place of target, no keys are copied.
+    size_t targetDepth = depth;
+    path[depth++] = link;
+    TreeNode<TKey> **predLink = &target->m_LeftChild;
+    while ((*predLink)->m_RightChild != nullptr) {
+      path[depth++] = predLink;
+      predLink = &(*predLink)->m_RightChild;
+    }
+    TreeNode<TKey> *pred = *predLink;
+    *predLink = pred->m_LeftChild;
+    pred->m_LeftChild = target->m_LeftChild;
+    pred->m_RightChild = target->m_RightChild;
+    pred->m_Height = target->m_Height;
+    *link = pred;
+    if (depth > targetDepth + 1) {
+      path[targetDepth + 1] = &pred->m_LeftChild;
+    }
+  }
+
+  destroyNode(target);
+  rebalanceAfterRemove(path, depth);
 }
 
-template <typename TKey>
-const TreeNode<TKey> *AvlTree<TKey>::lower_bound(TKey key,
-                                                 const TreeNode<TKey> *root) {
+// Unlike insertion, removal may need a rotation on every level, so heights are
+// fixed until one of them stays the same.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::rebalanceAfterRemove(
+    TreeNode<TKey> **path[], size_t depth) {
+  bool heightChanged = true;
+  for (size_t i = depth; i-- > 0;) {
+    TreeNode<TKey> *node = *path[i];
+    fixSizeAndEnds(node);
+    if (!heightChanged) {
+      continue;
+    }
+    int oldHeight = node->m_Height;
+    node->m_Height = std::max(getHeight(node->m_LeftChild),
+                              getHeight(node->m_RightChild)) +
+                     1;
+    if (std::abs(getBalance(node)) == 2) {
+      node = rebalanceSubtree(node);
+      *path[i] = node;
+    }
+    heightChanged = node->m_Height != oldHeight;
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+const TreeNode<TKey> *AvlTree<TKey, Compare, Allocator, Stats>::lower_bound(
+    const K &key, const TreeNode<TKey> *root, size_t &comparisons) const {
   if (root == nullptr) {
     return nullptr;
   }
 
-  if (key < root->m_Key) {
-    auto res = AvlTree<TKey>::lower_bound(key, root->m_LeftChild);
+  if (countedLess(key, root->m_Key, comparisons)) {
+    auto res = lower_bound(key, root->m_LeftChild, comparisons);
     if (res == nullptr) {
       return root;
     }
 
     return res;
-  } else if (root->m_Key < key) {
-    return AvlTree<TKey>::lower_bound(key, root->m_RightChild);
+  } else if (countedLess(root->m_Key, key, comparisons)) {
+    return lower_bound(key, root->m_RightChild, comparisons);
   } else {
     return root;
   }
 }
 
-template <typename TKey> bool AvlTree<TKey>::exists(TKey key) const {
-  const TreeNode<TKey> *resNode = lower_bound(key, this->m_Root);
-
-  return resNode != nullptr && resNode->m_Key == key;
+// Lower bound as an iterator, nullptr stands for end().
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+typename AvlTree<TKey, Compare, Allocator, Stats>::const_iterator
+AvlTree<TKey, Compare, Allocator, Stats>::makeIterator(
+    const TreeNode<TKey> *node) const {
+  if (node == nullptr) {
+    return end();
+  }
+  return const_iterator(node, node->m_Prev);
 }
 
-// Returns the root pointer to the modified tree.
-template <typename TKey>
-TreeNode<TKey> *AvlTree<TKey>::remove(TKey key, TreeNode<TKey> *root) {
-  if (root == nullptr) {
-    return nullptr;
+// Calls visit(lower_bound(key), found) for every key of [first, last) in
+// order, where found tells whether the lower bound is equal to key.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename ForwardIterator, typename Visitor>
+void AvlTree<TKey, Compare, Allocator, Stats>::lowerBoundMany(
+    ForwardIterator first, ForwardIterator last, Visitor visit) const {
+  if (std::is_sorted(first, last, m_Compare)) {
+    lowerBoundSorted(first, last, visit);
+  } else {
+    lowerBoundInterleaved(first, last, visit);
   }
+}
 
-  if (key < root->m_Key) {
-    root->m_LeftChild = remove(key, root->m_LeftChild);
-  } else if (key > root->m_Key) {
-    root->m_RightChild = remove(key, root->m_RightChild);
-  } else {
-    TreeNode<TKey> tmp = *root;
-    if (root->m_LeftChild == nullptr && root->m_RightChild == nullptr) {
-      delete root;
-      root = nullptr;
-    } else if (root->m_LeftChild != nullptr && root->m_RightChild == nullptr) {
-      delete root;
-      root = tmp.m_LeftChild;
-    } else if (root->m_LeftChild == nullptr && root->m_RightChild != nullptr) {
-      delete root;
-      root = tmp.m_RightChild;
-    } else {
-      const TreeNode<TKey> *leftMax = findMax(root->m_LeftChild);
-      if (leftMax != nullptr) {
-        root->m_Key = leftMax->m_Key;
-        root->m_LeftChild = remove(leftMax->m_Key, root->m_LeftChild);
+// Runs kBatchLanes searches in lockstep: each round moves every unfinished
+// search one level down and prefetches its next node, so the cache misses of
+// different searches are waited for at the same time instead of one after
+// another.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename ForwardIterator, typename Visitor>
+void AvlTree<TKey, Compare, Allocator, Stats>::lowerBoundInterleaved(
+    ForwardIterator first, ForwardIterator last, Visitor visit) const {
+  ForwardIterator keys[kBatchLanes];
+  const TreeNode<TKey> *cursors[kBatchLanes];
+  const TreeNode<TKey> *results[kBatchLanes];
+  bool found[kBatchLanes];
+  size_t comparisons[kBatchLanes];
+
+  while (first != last) {
+    size_t lanesNum = 0;
+    for (; lanesNum < kBatchLanes && first != last; ++lanesNum, ++first) {
+      keys[lanesNum] = first;
+      cursors[lanesNum] = m_Root;
+      results[lanesNum] = nullptr;
+      found[lanesNum] = false;
+      comparisons[lanesNum] = 0;
+    }
+
+    for (size_t activeNum = lanesNum; activeNum > 0;) {
+      activeNum = 0;
+      for (size_t i = 0; i < lanesNum; ++i) {
+        const TreeNode<TKey> *node = cursors[i];
+        if (node == nullptr) {
+          continue;
+        }
+        if (countedLess(node->m_Key, *keys[i], comparisons[i])) {
+          node = node->m_RightChild;
+        } else {
+          results[i] = node;
+          found[i] = !countedLess(*keys[i], node->m_Key, comparisons[i]);
+          node = found[i] ? nullptr : node->m_LeftChild;
+        }
+        if (node != nullptr) {
+          __builtin_prefetch(node);
+          ++activeNum;
+        }
+        cursors[i] = node;
       }
     }
-  }
 
-  if (root != nullptr) {
-    fixNode(root);
+    for (size_t i = 0; i < lanesNum; ++i) {
+      this->onLookup(comparisons[i]);
+      visit(makeIterator(results[i]), found[i]);
+    }
   }
-
-  return balance(root);
 }
-template <typename TKey>
-const TreeNode<TKey> *AvlTree<TKey>::findMax(const TreeNode<TKey> *root) {
-  if (root == nullptr) {
-    return nullptr;
-  }
 
-  if (root->m_RightChild == nullptr) {
-    return root;
+// For sorted keys the answer never moves backwards. It is looked for among
+// the next kFingerSteps nodes of the threaded list first, and the tree is
+// searched from the root only for longer jumps. Each key is one lookup for
+// Stats, the steps along the list count as its comparisons too.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename ForwardIterator, typename Visitor>
+void AvlTree<TKey, Compare, Allocator, Stats>::lowerBoundSorted(
+    ForwardIterator first, ForwardIterator last, Visitor visit) const {
+  const TreeNode<TKey> *node =
+      m_Root == nullptr ? nullptr : m_Root->m_LeftmostNode;
+  for (; first != last; ++first) {
+    const auto &key = *first;
+    size_t comparisons = 0;
+    size_t steps = 0;
+    while (node != nullptr && countedLess(node->m_Key, key, comparisons) &&
+           steps++ < kFingerSteps) {
+      node = node->m_Next;
+    }
+    if (node != nullptr && countedLess(node->m_Key, key, comparisons)) {
+      node = lower_bound(key, m_Root, comparisons);
+    }
+    bool found =
+        node != nullptr && !countedLess(key, node->m_Key, comparisons);
+    this->onLookup(comparisons);
+    visit(makeIterator(node), found);
   }
+}
 
-  return AvlTree<TKey>::findMax(root->m_RightChild);
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+bool AvlTree<TKey, Compare, Allocator, Stats>::exists(const K &key) const {
+  size_t comparisons = 0;
+  const TreeNode<TKey> *resNode = lower_bound(key, this->m_Root, comparisons);
+  bool found =
+      resNode != nullptr && !countedLess(key, resNode->m_Key, comparisons);
+  this->onLookup(comparisons);
+  return found;
 }
-template <typename TKey>
-const TreeNode<TKey> *AvlTree<TKey>::next(TKey key) const {
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+const TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::next(const K &key) const {
   TreeNode<TKey> *current_node = this->m_Root;
   TreeNode<TKey> *res = nullptr;
+  size_t comparisons = 0;
   while (current_node != nullptr) {
-    if (key < current_node->m_Key) {
+    if (countedLess(key, current_node->m_Key, comparisons)) {
       res = current_node;
       current_node = current_node->m_LeftChild;
     } else {
       current_node = current_node->m_RightChild;
     }
   }
+  this->onLookup(comparisons);
   return res;
 }
-template <typename TKey>
-const TreeNode<TKey> *AvlTree<TKey>::prev(TKey key) const {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+const TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::prev(const K &key) const {
   TreeNode<TKey> *currentNode = this->m_Root;
   TreeNode<TKey> *res = nullptr;
+  size_t comparisons = 0;
   while (currentNode != nullptr) {
-    if (key > currentNode->m_Key) {
+    if (countedLess(currentNode->m_Key, key, comparisons)) {
       res = currentNode;
       currentNode = currentNode->m_RightChild;
     } else {
       currentNode = currentNode->m_LeftChild;
     }
   }
+  this->onLookup(comparisons);
   return res;
 }
-template <typename TKey> size_t AvlTree<TKey>::size() const {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+size_t AvlTree<TKey, Compare, Allocator, Stats>::size() const {
   if (m_Root == nullptr) {
     return 0;
   }
   return m_Root->m_TreeSize;
 }
 
-template <typename TKey>
-TreeNode<TKey> *AvlTree<TKey>::balance(TreeNode<TKey> *root) {
+// The node storage is summed over the slabs of the pool, the memory owned by
+// keys over all keys, so this is O(n) for keys with destructors only.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+MemoryUsage AvlTree<TKey, Compare, Allocator, Stats>::memoryUsage() const {
+  MemoryUsage result;
+  result.m_NodesNum = nodesNum();
+  result.m_BytesPerNode = sizeof(TreeNode<TKey>);
+  result.m_NodeBytes = m_Pool.bytes();
+  result.m_AllocatorOverheadBytes = m_Pool.overheadBytes();
+  if (!std::is_trivially_destructible<TKey>::value && m_Root != nullptr) {
+    for (const TreeNode<TKey> *node = m_Root->m_LeftmostNode; node != nullptr;
+         node = node->m_Next) {
+      result.m_KeyHeapBytes += keyHeapBytes(node->m_Key);
+    }
+  }
+  result.m_TotalBytes = sizeof(*this) + result.m_NodeBytes +
+                        result.m_AllocatorOverheadBytes +
+                        result.m_KeyHeapBytes;
+  return result;
+}
+
+// The counters of Stats together with the height and the depth histogram,
+// which are computed here by a walk over the whole tree in O(n).
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeStats AvlTree<TKey, Compare, Allocator, Stats>::stats() const {
+  TreeStats result;
+  this->collect(result);
+  result.m_Height = getHeight(m_Root);
+  result.m_DepthHistogram.assign(result.m_Height, 0);
+  std::vector<std::pair<const TreeNode<TKey> *, size_t>> stack;
+  if (m_Root != nullptr) {
+    stack.emplace_back(m_Root, 0);
+  }
+  while (!stack.empty()) {
+    const TreeNode<TKey> *node = stack.back().first;
+    size_t depth = stack.back().second;
+    stack.pop_back();
+    ++result.m_DepthHistogram[depth];
+    if (node->m_LeftChild != nullptr) {
+      stack.emplace_back(node->m_LeftChild, depth + 1);
+    }
+    if (node->m_RightChild != nullptr) {
+      stack.emplace_back(node->m_RightChild, depth + 1);
+    }
+  }
+  return result;
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::balance(TreeNode<TKey> *root) const {
   if (root == nullptr) {
     return nullptr;
   }
@@ -318,16 +1879,19 @@ TreeNode<TKey> *AvlTree<TKey>::balance(TreeNode<TKey> *root) {
   }
 }
 
-template <typename TKey>
-int AvlTree<TKey>::getBalance(const TreeNode<TKey> *root) {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+int AvlTree<TKey, Compare, Allocator, Stats>::getBalance(
+    const TreeNode<TKey> *root) {
   if (root == nullptr) {
     return 0;
   }
 
   return getHeight(root->m_LeftChild) - getHeight(root->m_RightChild);
 }
-template <typename TKey>
-TreeNode<TKey> *AvlTree<TKey>::smallLeftRotate(TreeNode<TKey> *root) {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::smallLeftRotate(
+    TreeNode<TKey> *root) const {
   if (root == nullptr) {
     return nullptr;
   }
@@ -339,14 +1903,17 @@ TreeNode<TKey> *AvlTree<TKey>::smallLeftRotate(TreeNode<TKey> *root) {
 
   root->m_RightChild = newRoot->m_LeftChild;
   newRoot->m_LeftChild = root;
+  this->onRotation();
 
   fixNode(root);
   fixNode(newRoot);
 
   return newRoot;
 }
-template <typename TKey>
-TreeNode<TKey> *AvlTree<TKey>::smallRightRotate(TreeNode<TKey> *root) {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::smallRightRotate(
+    TreeNode<TKey> *root) const {
   if (root == nullptr) {
     return nullptr;
   }
@@ -358,6 +1925,7 @@ TreeNode<TKey> *AvlTree<TKey>::smallRightRotate(TreeNode<TKey> *root) {
 
   root->m_LeftChild = newRoot->m_RightChild;
   newRoot->m_RightChild = root;
+  this->onRotation();
 
   fixNode(root);
   fixNode(newRoot);
@@ -365,15 +1933,18 @@ TreeNode<TKey> *AvlTree<TKey>::smallRightRotate(TreeNode<TKey> *root) {
   return newRoot;
 }
 
-template <typename TKey> void AvlTree<TKey>::fixNode(TreeNode<TKey> *node) {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::fixNode(
+    TreeNode<TKey> *node) const {
   if (node == nullptr) {
     return;
   }
+  this->onFixNode();
 
   node->m_Height =
       std::max(getHeight(node->m_LeftChild), getHeight(node->m_RightChild)) + 1;
 
-  node->m_TreeSize = 1;
+  node->m_TreeSize = weight(node->m_Key);
 
   node->m_Prev = nullptr;
   node->m_Next = nullptr;
@@ -397,22 +1968,63 @@ template <typename TKey> void AvlTree<TKey>::fixNode(TreeNode<TKey> *node) {
   }
 }
 
-template <typename TKey>
-int AvlTree<TKey>::getChildrenNum(const TreeNode<TKey> *node) {
+// balance for a subtree hanging inside the tree. The rotations rethread the
+// nodes from their children, which leaves the outer neighbours of the subtree
+// unknown, so they are restored afterwards.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+TreeNode<TKey> *
+AvlTree<TKey, Compare, Allocator, Stats>::rebalanceSubtree(
+    TreeNode<TKey> *node) const {
+  TreeNode<TKey> *first = node->m_LeftmostNode;
+  TreeNode<TKey> *last = node->m_RightmostNode;
+  TreeNode<TKey> *prev = first->m_Prev;
+  TreeNode<TKey> *next = last->m_Next;
+  node = balance(node);
+  first->m_Prev = prev;
+  last->m_Next = next;
+  return node;
+}
+
+// The part of fixNode that does not touch the threading, for nodes whose
+// neighbours in key order have not changed.
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+void AvlTree<TKey, Compare, Allocator, Stats>::fixSizeAndEnds(
+    TreeNode<TKey> *node) {
+  node->m_TreeSize = weight(node->m_Key) + getSize(node->m_LeftChild) +
+                     getSize(node->m_RightChild);
+  node->m_LeftmostNode = node->m_LeftChild != nullptr
+                             ? node->m_LeftChild->m_LeftmostNode
+                             : node;
+  node->m_RightmostNode = node->m_RightChild != nullptr
+                              ? node->m_RightChild->m_RightmostNode
+                              : node;
+}
+
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+int AvlTree<TKey, Compare, Allocator, Stats>::getChildrenNum(
+    const TreeNode<TKey> *node) {
   if (node == nullptr) {
     return 0;
   }
 
   return node->m_LeftChildren_num + node->m_RightChildren_num;
 }
-template <typename TKey>
-
-int AvlTree<TKey>::getHeight(const TreeNode<TKey> *node) {
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+int AvlTree<TKey, Compare, Allocator, Stats>::getHeight(
+    const TreeNode<TKey> *node) {
   if (node == nullptr) {
     return 0;
   }
   return node->m_Height;
 }
+template <typename TKey, typename Compare, typename Allocator, typename Stats>
+size_t AvlTree<TKey, Compare, Allocator, Stats>::getSize(
+    const TreeNode<TKey> *node) {
+  if (node == nullptr) {
+    return 0;
+  }
+  return node->m_TreeSize;
+}
 
 template <typename T> class AvlTreeConstIterator {
 public:
@@ -432,7 +2044,7 @@ public:
 
   bool operator==(const AvlTreeConstIterator &) const;
   bool operator!=(const AvlTreeConstIterator &) const;
-  friend AvlTree<T>;
+  template <typename, typename, typename, typename> friend class AvlTree;
 
 private:
   AvlTreeConstIterator(const TreeNode<T> *node, const TreeNode<T> *prevNode)
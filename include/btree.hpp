@@ -0,0 +1,771 @@
+#pragma once
+
+#include "node_pool.hpp"
+#include "simd_search.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename TLeaf> class BTreeConstIterator;
+
+struct BTreeNodeHeader {
+  uint16_t m_Count;
+  bool m_IsLeaf;
+};
+
+// Leaves hold the keys and are linked into a list in key order.
+template <typename TKey, size_t kSlots> struct BTreeLeaf : BTreeNodeHeader {
+  typedef TKey key_type;
+
+  TKey *keys() { return reinterpret_cast<TKey *>(m_Keys); }
+  const TKey *keys() const { return reinterpret_cast<const TKey *>(m_Keys); }
+
+  BTreeLeaf *m_Prev;
+  BTreeLeaf *m_Next;
+  typename std::aligned_storage<sizeof(TKey), alignof(TKey)>::type
+      m_Keys[kSlots];
+};
+
+// Inner nodes hold m_Count separators and m_Count + 1 children. Every key of
+// m_Children[i] is not greater than separator i and less than every key of
+// m_Children[i + 1].
+template <typename TKey, size_t kSlots> struct BTreeInner : BTreeNodeHeader {
+  TKey *keys() { return reinterpret_cast<TKey *>(m_Keys); }
+  const TKey *keys() const { return reinterpret_cast<const TKey *>(m_Keys); }
+
+  typename std::aligned_storage<sizeof(TKey), alignof(TKey)>::type
+      m_Keys[kSlots];
+  BTreeNodeHeader *m_Children[kSlots + 1];
+};
+
+// B+ tree whose nodes take about NodeSize bytes, so a lookup touches a few
+// cache lines per level instead of one node per comparison. Keys live in the
+// leaves only, inner nodes keep copies of some of them as separators. Searching
+// inside a node goes through simd_search::lowerBound.
+template <typename TKey, typename Compare = std::less<TKey>,
+          typename Allocator = std::allocator<TKey>, size_t NodeSize = 256>
+class BTree {
+public:
+  static constexpr size_t kLeafSlots = std::max<size_t>(
+      4, (NodeSize - sizeof(BTreeNodeHeader) - 2 * sizeof(void *)) /
+             sizeof(TKey));
+  static constexpr size_t kInnerSlots = std::max<size_t>(
+      4, (NodeSize - sizeof(BTreeNodeHeader) - sizeof(void *)) /
+             (sizeof(TKey) + sizeof(void *)));
+  static_assert(kLeafSlots < UINT16_MAX && kInnerSlots < UINT16_MAX,
+                "BTree: NodeSize is too big");
+
+  typedef BTreeLeaf<TKey, kLeafSlots> Leaf;
+  typedef BTreeInner<TKey, kInnerSlots> Inner;
+  typedef BTreeConstIterator<Leaf> const_iterator;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  explicit BTree(const Compare &comp = Compare(),
+                 const Allocator &alloc = Allocator())
+      : m_Root(nullptr), m_Size(0), m_Compare(comp), m_LeafPool(alloc),
+        m_InnerPool(alloc) {}
+  BTree(const BTree &other);
+  BTree(BTree &&other) noexcept;
+  ~BTree() { removeAll(); }
+
+  void add(const TKey &key) { insert(key); }
+  void add(TKey &&key) { insert(std::move(key)); }
+  template <typename... Args> void emplace(Args &&...args) {
+    insert(TKey(std::forward<Args>(args)...));
+  }
+  template <typename K> bool exists(const K &) const;
+  template <typename K> void remove(const K &);
+  void clear() { removeAll(); }
+  size_t size() const { return m_Size; }
+  key_compare key_comp() const { return m_Compare; }
+  allocator_type get_allocator() const { return m_LeafPool.get_allocator(); }
+
+  const_iterator begin() const;
+  const_iterator end() const;
+  template <typename K> const_iterator find(const K &) const;
+  template <typename K> const_iterator lower_bound(const K &) const;
+  template <typename K> const_iterator upper_bound(const K &) const;
+
+  BTree &operator=(const BTree &other);
+  BTree &operator=(BTree &&other);
+  void swap(BTree &other) noexcept;
+
+private:
+  typedef std::allocator_traits<Allocator> AllocatorTraits;
+  static constexpr bool kPropagateOnCopyAssignment =
+      AllocatorTraits::propagate_on_container_copy_assignment::value;
+  static constexpr bool kPropagateOnMoveAssignment =
+      AllocatorTraits::propagate_on_container_move_assignment::value;
+  static constexpr size_t kMinLeafKeys = kLeafSlots / 2;
+  static constexpr size_t kMinInnerKeys = kInnerSlots / 2;
+
+  BTreeNodeHeader *m_Root;
+  size_t m_Size;
+  Compare m_Compare;
+  NodePool<Leaf, Allocator> m_LeafPool;
+  NodePool<Inner, Allocator> m_InnerPool;
+
+  static Leaf *asLeaf(BTreeNodeHeader *node) {
+    return static_cast<Leaf *>(node);
+  }
+  static const Leaf *asLeaf(const BTreeNodeHeader *node) {
+    return static_cast<const Leaf *>(node);
+  }
+  static Inner *asInner(BTreeNodeHeader *node) {
+    return static_cast<Inner *>(node);
+  }
+  static const Inner *asInner(const BTreeNodeHeader *node) {
+    return static_cast<const Inner *>(node);
+  }
+  template <typename K>
+  size_t searchNode(const TKey *keys, size_t count, const K &key) const {
+    return simd_search::lowerBound(keys, count, key, m_Compare);
+  }
+
+  Leaf *createLeaf();
+  Inner *createInner();
+  void destroyNode(BTreeNodeHeader *);
+  void removeAll();
+  BTreeNodeHeader *copy(const BTreeNodeHeader *, Leaf *&);
+  template <typename K> void insert(K &&);
+  template <typename K>
+  BTreeNodeHeader *insert(BTreeNodeHeader *, K &&, std::optional<TKey> &,
+                          bool &);
+  template <typename K> bool remove(BTreeNodeHeader *, const K &);
+  void fixUnderflow(Inner *, size_t);
+  void borrowFromLeft(Inner *, size_t);
+  void borrowFromRight(Inner *, size_t);
+  void merge(Inner *, size_t);
+  template <typename K>
+  std::pair<const Leaf *, size_t> findLeaf(const K &) const;
+  static const_iterator makeIterator(const Leaf *, size_t);
+
+  template <typename... Args>
+  static void insertAt(TKey *keys, size_t count, size_t pos, Args &&...args);
+  static void eraseAt(TKey *keys, size_t count, size_t pos);
+  template <typename T>
+  static void insertAt(T **items, size_t count, size_t pos, T *item);
+  template <typename T>
+  static void eraseAt(T **items, size_t count, size_t pos);
+};
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+BTree<TKey, Compare, Allocator, NodeSize>::BTree(const BTree &other)
+    : m_Root(nullptr), m_Size(0), m_Compare(other.m_Compare),
+      m_LeafPool(AllocatorTraits::select_on_container_copy_construction(
+          other.get_allocator())),
+      m_InnerPool(m_LeafPool.get_allocator()) {
+  Leaf *lastLeaf = nullptr;
+  m_Root = copy(other.m_Root, lastLeaf);
+  m_Size = other.m_Size;
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+BTree<TKey, Compare, Allocator, NodeSize>::BTree(BTree &&other) noexcept
+    : m_Root(other.m_Root), m_Size(other.m_Size),
+      m_Compare(std::move(other.m_Compare)),
+      m_LeafPool(std::move(other.m_LeafPool)),
+      m_InnerPool(std::move(other.m_InnerPool)) {
+  other.m_Root = nullptr;
+  other.m_Size = 0;
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+BTree<TKey, Compare, Allocator, NodeSize> &
+BTree<TKey, Compare, Allocator, NodeSize>::operator=(const BTree &other) {
+  if (this == &other) {
+    return *this;
+  }
+  removeAll();
+  m_Compare = other.m_Compare;
+  if constexpr (kPropagateOnCopyAssignment) {
+    m_LeafPool.reset(other.get_allocator());
+    m_InnerPool.reset(other.get_allocator());
+  }
+  Leaf *lastLeaf = nullptr;
+  m_Root = copy(other.m_Root, lastLeaf);
+  m_Size = other.m_Size;
+  return *this;
+}
+
+// Same rules as AvlTree: nodes are stolen only if both trees allocate from
+// the same place.
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+BTree<TKey, Compare, Allocator, NodeSize> &
+BTree<TKey, Compare, Allocator, NodeSize>::operator=(BTree &&other) {
+  if (this == &other) {
+    return *this;
+  }
+  removeAll();
+  m_Compare = std::move(other.m_Compare);
+  if constexpr (kPropagateOnMoveAssignment) {
+    m_LeafPool = std::move(other.m_LeafPool);
+    m_InnerPool = std::move(other.m_InnerPool);
+  } else {
+    if (get_allocator() != other.get_allocator()) {
+      Leaf *lastLeaf = nullptr;
+      m_Root = copy(other.m_Root, lastLeaf);
+      m_Size = other.m_Size;
+      other.clear();
+      return *this;
+    }
+    m_LeafPool.swap(other.m_LeafPool);
+    m_InnerPool.swap(other.m_InnerPool);
+  }
+  std::swap(m_Root, other.m_Root);
+  std::swap(m_Size, other.m_Size);
+  return *this;
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+void BTree<TKey, Compare, Allocator, NodeSize>::swap(BTree &other) noexcept {
+  std::swap(m_Root, other.m_Root);
+  std::swap(m_Size, other.m_Size);
+  std::swap(m_Compare, other.m_Compare);
+  m_LeafPool.swap(other.m_LeafPool);
+  m_InnerPool.swap(other.m_InnerPool);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+typename BTree<TKey, Compare, Allocator, NodeSize>::Leaf *
+BTree<TKey, Compare, Allocator, NodeSize>::createLeaf() {
+  Leaf *leaf = m_LeafPool.allocate();
+  leaf->m_Count = 0;
+  leaf->m_IsLeaf = true;
+  leaf->m_Prev = nullptr;
+  leaf->m_Next = nullptr;
+  return leaf;
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+typename BTree<TKey, Compare, Allocator, NodeSize>::Inner *
+BTree<TKey, Compare, Allocator, NodeSize>::createInner() {
+  Inner *inner = m_InnerPool.allocate();
+  inner->m_Count = 0;
+  inner->m_IsLeaf = false;
+  return inner;
+}
+
+// Destroys the keys of node and returns it to its pool, children are left
+// alone.
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+void BTree<TKey, Compare, Allocator, NodeSize>::destroyNode(
+    BTreeNodeHeader *node) {
+  if (node->m_IsLeaf) {
+    std::destroy_n(asLeaf(node)->keys(), node->m_Count);
+    m_LeafPool.deallocate(asLeaf(node));
+  } else {
+    std::destroy_n(asInner(node)->keys(), node->m_Count);
+    m_InnerPool.deallocate(asInner(node));
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+void BTree<TKey, Compare, Allocator, NodeSize>::removeAll() {
+  if (!std::is_trivially_destructible<TKey>::value && m_Root != nullptr) {
+    std::vector<BTreeNodeHeader *> stack{m_Root};
+    while (!stack.empty()) {
+      BTreeNodeHeader *node = stack.back();
+      stack.pop_back();
+      if (node->m_IsLeaf) {
+        std::destroy_n(asLeaf(node)->keys(), node->m_Count);
+      } else {
+        std::destroy_n(asInner(node)->keys(), node->m_Count);
+        stack.insert(stack.end(), asInner(node)->m_Children,
+                     asInner(node)->m_Children + node->m_Count + 1);
+      }
+    }
+  }
+  m_LeafPool.release();
+  m_InnerPool.release();
+  m_Root = nullptr;
+  m_Size = 0;
+}
+
+// Copies the subtree in key order, so the leaves can be linked as they are
+// created.
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+BTreeNodeHeader *
+BTree<TKey, Compare, Allocator, NodeSize>::copy(const BTreeNodeHeader *node,
+                                                Leaf *&lastLeaf) {
+  if (node == nullptr) {
+    return nullptr;
+  }
+  if (node->m_IsLeaf) {
+    Leaf *leaf = createLeaf();
+    std::uninitialized_copy_n(asLeaf(node)->keys(), node->m_Count,
+                              leaf->keys());
+    leaf->m_Count = node->m_Count;
+    leaf->m_Prev = lastLeaf;
+    if (lastLeaf != nullptr) {
+      lastLeaf->m_Next = leaf;
+    }
+    lastLeaf = leaf;
+    return leaf;
+  }
+  Inner *inner = createInner();
+  std::uninitialized_copy_n(asInner(node)->keys(), node->m_Count,
+                            inner->keys());
+  inner->m_Count = node->m_Count;
+  for (size_t i = 0; i <= node->m_Count; ++i) {
+    inner->m_Children[i] = copy(asInner(node)->m_Children[i], lastLeaf);
+  }
+  return inner;
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename... Args>
+void BTree<TKey, Compare, Allocator, NodeSize>::insertAt(TKey *keys,
+                                                        size_t count,
+                                                        size_t pos,
+                                                        Args &&...args) {
+  if (pos == count) {
+    ::new (static_cast<void *>(keys + count))
+        TKey(std::forward<Args>(args)...);
+    return;
+  }
+  TKey key(std::forward<Args>(args)...);
+  ::new (static_cast<void *>(keys + count)) TKey(std::move(keys[count - 1]));
+  std::move_backward(keys + pos, keys + count - 1, keys + count);
+  keys[pos] = std::move(key);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+void BTree<TKey, Compare, Allocator, NodeSize>::eraseAt(TKey *keys,
+                                                       size_t count,
+                                                       size_t pos) {
+  std::move(keys + pos + 1, keys + count, keys + pos);
+  std::destroy_at(keys + count - 1);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename T>
+void BTree<TKey, Compare, Allocator, NodeSize>::insertAt(T **items,
+                                                        size_t count,
+                                                        size_t pos, T *item) {
+  std::move_backward(items + pos, items + count, items + count + 1);
+  items[pos] = item;
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename T>
+void BTree<TKey, Compare, Allocator, NodeSize>::eraseAt(T **items,
+                                                       size_t count,
+                                                       size_t pos) {
+  std::move(items + pos + 1, items + count, items + pos);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename K>
+void BTree<TKey, Compare, Allocator, NodeSize>::insert(K &&key) {
+  if (m_Root == nullptr) {
+    m_Root = createLeaf();
+  }
+  std::optional<TKey> separator;
+  bool inserted = false;
+  BTreeNodeHeader *right =
+      insert(m_Root, std::forward<K>(key), separator, inserted);
+  if (right != nullptr) {
+    Inner *root = createInner();
+    ::new (static_cast<void *>(root->keys())) TKey(std::move(*separator));
+    root->m_Count = 1;
+    root->m_Children[0] = m_Root;
+    root->m_Children[1] = right;
+    m_Root = root;
+  }
+  if (inserted) {
+    ++m_Size;
+  }
+}
+
+// Inserts key into the subtree of node. A full node is split in two halves
+// before the new key or separator goes in; the new right half is returned and
+// the key that separates it from node is put into separator.
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename K>
+BTreeNodeHeader *BTree<TKey, Compare, Allocator, NodeSize>::insert(
+    BTreeNodeHeader *node, K &&key, std::optional<TKey> &separator,
+    bool &inserted) {
+  if (node->m_IsLeaf) {
+    Leaf *leaf = asLeaf(node);
+    size_t pos = searchNode(leaf->keys(), leaf->m_Count, key);
+    if (pos < leaf->m_Count && !m_Compare(key, leaf->keys()[pos])) {
+      return nullptr;
+    }
+    inserted = true;
+    if (leaf->m_Count < kLeafSlots) {
+      insertAt(leaf->keys(), leaf->m_Count++, pos, std::forward<K>(key));
+      return nullptr;
+    }
+
+    Leaf *right = createLeaf();
+    size_t half = leaf->m_Count / 2;
+    std::uninitialized_move(leaf->keys() + half, leaf->keys() + leaf->m_Count,
+                            right->keys());
+    std::destroy(leaf->keys() + half, leaf->keys() + leaf->m_Count);
+    right->m_Count = leaf->m_Count - half;
+    leaf->m_Count = half;
+    right->m_Next = leaf->m_Next;
+    if (right->m_Next != nullptr) {
+      right->m_Next->m_Prev = right;
+    }
+    right->m_Prev = leaf;
+    leaf->m_Next = right;
+
+    if (pos <= half) {
+      insertAt(leaf->keys(), leaf->m_Count++, pos, std::forward<K>(key));
+    } else {
+      insertAt(right->keys(), right->m_Count++, pos - half,
+               std::forward<K>(key));
+    }
+    separator.emplace(leaf->keys()[leaf->m_Count - 1]);
+    return right;
+  }
+
+  Inner *inner = asInner(node);
+  size_t pos = searchNode(inner->keys(), inner->m_Count, key);
+  BTreeNodeHeader *child = insert(inner->m_Children[pos],
+                                  std::forward<K>(key), separator, inserted);
+  if (child == nullptr) {
+    return nullptr;
+  }
+  if (inner->m_Count < kInnerSlots) {
+    insertAt(inner->keys(), inner->m_Count, pos, std::move(*separator));
+    insertAt(inner->m_Children, inner->m_Count + 1, pos + 1, child);
+    ++inner->m_Count;
+    return nullptr;
+  }
+
+  // Keys [0, half) stay, key half moves up, keys (half, count) go right.
+  Inner *right = createInner();
+  size_t half = inner->m_Count / 2;
+  std::uninitialized_move(inner->keys() + half + 1,
+                          inner->keys() + inner->m_Count, right->keys());
+  std::copy(inner->m_Children + half + 1,
+            inner->m_Children + inner->m_Count + 1, right->m_Children);
+  right->m_Count = inner->m_Count - half - 1;
+  TKey middle(std::move(inner->keys()[half]));
+  std::destroy(inner->keys() + half, inner->keys() + inner->m_Count);
+  inner->m_Count = half;
+
+  Inner *target = inner;
+  if (pos > half) {
+    target = right;
+    pos -= half + 1;
+  }
+  insertAt(target->keys(), target->m_Count, pos, std::move(*separator));
+  insertAt(target->m_Children, target->m_Count + 1, pos + 1, child);
+  ++target->m_Count;
+  separator.emplace(std::move(middle));
+  return right;
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename K>
+void BTree<TKey, Compare, Allocator, NodeSize>::remove(const K &key) {
+  if (m_Root == nullptr || !remove(m_Root, key)) {
+    return;
+  }
+  --m_Size;
+  if (m_Root->m_Count > 0) {
+    return;
+  }
+  BTreeNodeHeader *oldRoot = m_Root;
+  m_Root = m_Root->m_IsLeaf ? nullptr : asInner(m_Root)->m_Children[0];
+  destroyNode(oldRoot);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename K>
+bool BTree<TKey, Compare, Allocator, NodeSize>::remove(BTreeNodeHeader *node,
+                                                      const K &key) {
+  if (node->m_IsLeaf) {
+    Leaf *leaf = asLeaf(node);
+    size_t pos = searchNode(leaf->keys(), leaf->m_Count, key);
+    if (pos == leaf->m_Count || m_Compare(key, leaf->keys()[pos])) {
+      return false;
+    }
+    eraseAt(leaf->keys(), leaf->m_Count--, pos);
+    return true;
+  }
+
+  Inner *inner = asInner(node);
+  size_t pos = searchNode(inner->keys(), inner->m_Count, key);
+  if (!remove(inner->m_Children[pos], key)) {
+    return false;
+  }
+  BTreeNodeHeader *child = inner->m_Children[pos];
+  if (child->m_Count < (child->m_IsLeaf ? kMinLeafKeys : kMinInnerKeys)) {
+    fixUnderflow(inner, pos);
+  }
+  return true;
+}
+
+// Refills child pos of node from a sibling that has keys to spare, or merges
+// it with one. Separators of the removed keys may stay in the inner nodes,
+// they still separate the subtrees correctly.
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+void BTree<TKey, Compare, Allocator, NodeSize>::fixUnderflow(Inner *node,
+                                                            size_t pos) {
+  size_t minKeys =
+      node->m_Children[pos]->m_IsLeaf ? kMinLeafKeys : kMinInnerKeys;
+  if (pos > 0 && node->m_Children[pos - 1]->m_Count > minKeys) {
+    borrowFromLeft(node, pos);
+  } else if (pos < node->m_Count &&
+             node->m_Children[pos + 1]->m_Count > minKeys) {
+    borrowFromRight(node, pos);
+  } else if (pos > 0) {
+    merge(node, pos - 1);
+  } else {
+    merge(node, pos);
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+void BTree<TKey, Compare, Allocator, NodeSize>::borrowFromLeft(Inner *node,
+                                                              size_t pos) {
+  TKey &separator = node->keys()[pos - 1];
+  if (node->m_Children[pos]->m_IsLeaf) {
+    Leaf *left = asLeaf(node->m_Children[pos - 1]);
+    Leaf *child = asLeaf(node->m_Children[pos]);
+    insertAt(child->keys(), child->m_Count++, 0,
+             std::move(left->keys()[left->m_Count - 1]));
+    std::destroy_at(left->keys() + --left->m_Count);
+    separator = left->keys()[left->m_Count - 1];
+    return;
+  }
+  Inner *left = asInner(node->m_Children[pos - 1]);
+  Inner *child = asInner(node->m_Children[pos]);
+  insertAt(child->keys(), child->m_Count, 0, std::move(separator));
+  insertAt(child->m_Children, child->m_Count + 1, 0,
+           left->m_Children[left->m_Count]);
+  ++child->m_Count;
+  separator = std::move(left->keys()[left->m_Count - 1]);
+  std::destroy_at(left->keys() + --left->m_Count);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+void BTree<TKey, Compare, Allocator, NodeSize>::borrowFromRight(Inner *node,
+                                                               size_t pos) {
+  TKey &separator = node->keys()[pos];
+  if (node->m_Children[pos]->m_IsLeaf) {
+    Leaf *child = asLeaf(node->m_Children[pos]);
+    Leaf *right = asLeaf(node->m_Children[pos + 1]);
+    ::new (static_cast<void *>(child->keys() + child->m_Count++))
+        TKey(std::move(right->keys()[0]));
+    eraseAt(right->keys(), right->m_Count--, 0);
+    separator = child->keys()[child->m_Count - 1];
+    return;
+  }
+  Inner *child = asInner(node->m_Children[pos]);
+  Inner *right = asInner(node->m_Children[pos + 1]);
+  ::new (static_cast<void *>(child->keys() + child->m_Count))
+      TKey(std::move(separator));
+  child->m_Children[++child->m_Count] = right->m_Children[0];
+  separator = std::move(right->keys()[0]);
+  eraseAt(right->keys(), right->m_Count, 0);
+  eraseAt(right->m_Children, right->m_Count + 1, 0);
+  --right->m_Count;
+}
+
+// Merges child pos + 1 of node into child pos.
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+void BTree<TKey, Compare, Allocator, NodeSize>::merge(Inner *node,
+                                                     size_t pos) {
+  if (node->m_Children[pos]->m_IsLeaf) {
+    Leaf *left = asLeaf(node->m_Children[pos]);
+    Leaf *right = asLeaf(node->m_Children[pos + 1]);
+    std::uninitialized_move_n(right->keys(), right->m_Count,
+                              left->keys() + left->m_Count);
+    left->m_Count += right->m_Count;
+    left->m_Next = right->m_Next;
+    if (left->m_Next != nullptr) {
+      left->m_Next->m_Prev = left;
+    }
+  } else {
+    Inner *left = asInner(node->m_Children[pos]);
+    Inner *right = asInner(node->m_Children[pos + 1]);
+    ::new (static_cast<void *>(left->keys() + left->m_Count))
+        TKey(std::move(node->keys()[pos]));
+    std::uninitialized_move_n(right->keys(), right->m_Count,
+                              left->keys() + left->m_Count + 1);
+    std::copy_n(right->m_Children, right->m_Count + 1,
+                left->m_Children + left->m_Count + 1);
+    left->m_Count += right->m_Count + 1;
+  }
+  destroyNode(node->m_Children[pos + 1]);
+  eraseAt(node->keys(), node->m_Count, pos);
+  eraseAt(node->m_Children, node->m_Count + 1, pos + 1);
+  --node->m_Count;
+}
+
+// Returns the leaf where key would be and the position of its lower bound in
+// it, which may be the end of the leaf.
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename K>
+std::pair<const typename BTree<TKey, Compare, Allocator, NodeSize>::Leaf *,
+          size_t>
+BTree<TKey, Compare, Allocator, NodeSize>::findLeaf(const K &key) const {
+  const BTreeNodeHeader *node = m_Root;
+  while (!node->m_IsLeaf) {
+    const Inner *inner = asInner(node);
+    node = inner->m_Children[searchNode(inner->keys(), inner->m_Count, key)];
+  }
+  const Leaf *leaf = asLeaf(node);
+  return {leaf, searchNode(leaf->keys(), leaf->m_Count, key)};
+}
+
+// The end of a leaf is the first key of the next one; the end of the last leaf
+// is end().
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+typename BTree<TKey, Compare, Allocator, NodeSize>::const_iterator
+BTree<TKey, Compare, Allocator, NodeSize>::makeIterator(const Leaf *leaf,
+                                                        size_t pos) {
+  if (pos == leaf->m_Count && leaf->m_Next != nullptr) {
+    return const_iterator(leaf->m_Next, 0);
+  }
+  return const_iterator(leaf, pos);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename K>
+bool BTree<TKey, Compare, Allocator, NodeSize>::exists(const K &key) const {
+  if (m_Root == nullptr) {
+    return false;
+  }
+  auto [leaf, pos] = findLeaf(key);
+  return pos < leaf->m_Count && !m_Compare(key, leaf->keys()[pos]);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+typename BTree<TKey, Compare, Allocator, NodeSize>::const_iterator
+BTree<TKey, Compare, Allocator, NodeSize>::begin() const {
+  if (m_Root == nullptr) {
+    return const_iterator();
+  }
+  const BTreeNodeHeader *node = m_Root;
+  while (!node->m_IsLeaf) {
+    node = asInner(node)->m_Children[0];
+  }
+  return const_iterator(asLeaf(node), 0);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+typename BTree<TKey, Compare, Allocator, NodeSize>::const_iterator
+BTree<TKey, Compare, Allocator, NodeSize>::end() const {
+  if (m_Root == nullptr) {
+    return const_iterator();
+  }
+  const BTreeNodeHeader *node = m_Root;
+  while (!node->m_IsLeaf) {
+    node = asInner(node)->m_Children[node->m_Count];
+  }
+  return const_iterator(asLeaf(node), node->m_Count);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename K>
+typename BTree<TKey, Compare, Allocator, NodeSize>::const_iterator
+BTree<TKey, Compare, Allocator, NodeSize>::find(const K &key) const {
+  if (m_Root == nullptr) {
+    return end();
+  }
+  auto [leaf, pos] = findLeaf(key);
+  if (pos == leaf->m_Count || m_Compare(key, leaf->keys()[pos])) {
+    return end();
+  }
+  return const_iterator(leaf, pos);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename K>
+typename BTree<TKey, Compare, Allocator, NodeSize>::const_iterator
+BTree<TKey, Compare, Allocator, NodeSize>::lower_bound(const K &key) const {
+  if (m_Root == nullptr) {
+    return end();
+  }
+  auto [leaf, pos] = findLeaf(key);
+  return makeIterator(leaf, pos);
+}
+
+template <typename TKey, typename Compare, typename Allocator, size_t NodeSize>
+template <typename K>
+typename BTree<TKey, Compare, Allocator, NodeSize>::const_iterator
+BTree<TKey, Compare, Allocator, NodeSize>::upper_bound(const K &key) const {
+  if (m_Root == nullptr) {
+    return end();
+  }
+  auto [leaf, pos] = findLeaf(key);
+  if (pos < leaf->m_Count && !m_Compare(key, leaf->keys()[pos])) {
+    ++pos;
+  }
+  return makeIterator(leaf, pos);
+}
+
+// Position in the linked list of leaves. end() points past the last key of the
+// last leaf, an empty tree has a single null iterator.
+template <typename TLeaf> class BTreeConstIterator {
+public:
+  typedef typename TLeaf::key_type T;
+  typedef std::ptrdiff_t difference_type;
+  typedef T value_type;
+  typedef const T &reference;
+  typedef const T &const_reference;
+  typedef const T *pointer;
+  typedef const T *const_pointer;
+  typedef std::bidirectional_iterator_tag iterator_category;
+
+  BTreeConstIterator() : m_Leaf(nullptr), m_Index(0) {}
+  const T &operator*() const { return m_Leaf->keys()[m_Index]; }
+  const T *operator->() const { return m_Leaf->keys() + m_Index; }
+
+  BTreeConstIterator &operator++() {
+    if (++m_Index == m_Leaf->m_Count && m_Leaf->m_Next != nullptr) {
+      m_Leaf = m_Leaf->m_Next;
+      m_Index = 0;
+    }
+    return *this;
+  }
+  BTreeConstIterator operator++(int) {
+    auto res = *this;
+    ++*this;
+    return res;
+  }
+  BTreeConstIterator &operator--() {
+    if (m_Index == 0) {
+      m_Leaf = m_Leaf->m_Prev;
+      m_Index = m_Leaf->m_Count;
+    }
+    --m_Index;
+    return *this;
+  }
+  BTreeConstIterator operator--(int) {
+    auto res = *this;
+    --*this;
+    return res;
+  }
+
+  bool operator==(const BTreeConstIterator &other) const {
+    return m_Leaf == other.m_Leaf && m_Index == other.m_Index;
+  }
+  bool operator!=(const BTreeConstIterator &other) const {
+    return !(*this == other);
+  }
+
+  template <typename, typename, typename, size_t> friend class BTree;
+
+private:
+  BTreeConstIterator(const TLeaf *leaf, size_t index)
+      : m_Leaf(leaf), m_Index(index) {}
+
+  const TLeaf *m_Leaf;
+  size_t m_Index;
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "btree.hpp"
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <utility>
+
+// Ordered set with the interface of Set stored in a BTree, for large sets of
+// small keys where the cache misses of a binary tree dominate. Iterators are
+// const and bidirectional, every step is O(1), and as with Set any insert or
+// erase invalidates them. Order statistics, set algebra and split/join are
+// not provided. Code that only needs the common part can switch containers
+// with a typedef:
+//
+//   typedef BTreeSet<int> IdSet; // or Set<int>
+template <typename T, typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>, size_t NodeSize = 256>
+class BTreeSet {
+public:
+  typedef BTree<T, Compare, Allocator, NodeSize> tree_type;
+  typedef typename tree_type::const_iterator const_iterator;
+  typedef typename tree_type::const_iterator iterator;
+  typedef std::ptrdiff_t difference_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  BTreeSet() : m_Tree() {}
+  explicit BTreeSet(const Compare &comp, const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {}
+  explicit BTreeSet(const Allocator &alloc) : m_Tree(Compare(), alloc) {}
+  template <typename InputIterator>
+  BTreeSet(InputIterator first, InputIterator last,
+           const Compare &comp = Compare(),
+           const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {
+    for (; first != last; ++first) {
+      m_Tree.add(*first);
+    }
+  }
+  template <typename InputIterator>
+  BTreeSet(InputIterator first, InputIterator last, const Allocator &alloc)
+      : BTreeSet(first, last, Compare(), alloc) {}
+  BTreeSet(std::initializer_list<T> initList, const Compare &comp = Compare(),
+           const Allocator &alloc = Allocator())
+      : BTreeSet(initList.begin(), initList.end(), comp, alloc) {}
+  BTreeSet(std::initializer_list<T> initList, const Allocator &alloc)
+      : BTreeSet(initList, Compare(), alloc) {}
+
+  const_iterator begin() const { return m_Tree.begin(); }
+  const_iterator end() const { return m_Tree.end(); }
+  const_iterator find(const T &key) const { return m_Tree.find(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator find(const K &key) const {
+    return m_Tree.find(key);
+  }
+  const_iterator lower_bound(const T &key) const {
+    return m_Tree.lower_bound(key);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator lower_bound(const K &key) const {
+    return m_Tree.lower_bound(key);
+  }
+  const_iterator upper_bound(const T &key) const {
+    return m_Tree.upper_bound(key);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator upper_bound(const K &key) const {
+    return m_Tree.upper_bound(key);
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const T &key) const {
+    return {lower_bound(key), upper_bound(key)};
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K &key) const {
+    return {lower_bound(key), upper_bound(key)};
+  }
+
+  void insert(const T &key) { m_Tree.add(key); }
+  void insert(T &&key) { m_Tree.add(std::move(key)); }
+  template <typename... Args> void emplace(Args &&...args) {
+    m_Tree.emplace(std::forward<Args>(args)...);
+  }
+  void erase(const T &key) { m_Tree.remove(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  void erase(const K &key) {
+    m_Tree.remove(key);
+  }
+  bool contains(const T &key) const { return m_Tree.exists(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool contains(const K &key) const {
+    return m_Tree.exists(key);
+  }
+  void clear() { m_Tree.clear(); }
+  void swap(BTreeSet &other) noexcept { m_Tree.swap(other.m_Tree); }
+
+  size_t size() const { return m_Tree.size(); }
+  bool empty() const { return m_Tree.size() == 0; }
+  key_compare key_comp() const { return m_Tree.key_comp(); }
+  allocator_type get_allocator() const { return m_Tree.get_allocator(); }
+
+private:
+  tree_type m_Tree;
+};
+
+template <typename T, typename Compare, typename Allocator, size_t NodeSize>
+void swap(BTreeSet<T, Compare, Allocator, NodeSize> &lhs,
+          BTreeSet<T, Compare, Allocator, NodeSize> &rhs) noexcept {
+  lhs.swap(rhs);
+}
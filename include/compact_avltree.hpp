@@ -0,0 +1,533 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+template <typename TTree> class CompactAvlTreeConstIterator;
+
+// AVL tree stored in one contiguous array of nodes that refer to each other by
+// 32-bit indices. A node holds the key, the left and right child indices and
+// the parent index; the 6-bit height is split between the spare top bits of the
+// child indices. There are no prev/next links or leftmost/rightmost caches:
+// iterators walk the parent links, which is O(1) amortized per step.
+//
+// That makes the per-element cost sizeof(TKey) + 12 bytes rounded up to the
+// key alignment (16 bytes for int, 24 for 64-bit keys) plus the unused
+// capacity of the array, against 64 bytes and more for TreeNode. Erasing moves
+// the last node into the freed slot, so the array stays dense. Up to 2^29 - 1
+// keys are supported.
+template <typename TKey, typename Compare = std::less<TKey>,
+          typename Allocator = std::allocator<TKey>>
+class CompactAvlTree {
+public:
+  typedef CompactAvlTreeConstIterator<CompactAvlTree> const_iterator;
+  typedef TKey key_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  static constexpr uint32_t kIndexBits = 29;
+  static constexpr uint32_t kNil = (1u << kIndexBits) - 1;
+  static constexpr size_t kMaxSize = kNil;
+
+  struct Node {
+    template <typename... Args>
+    explicit Node(uint32_t parent, Args &&...args)
+        : m_Key(std::forward<Args>(args)...), m_Left(kNil), m_Right(kNil),
+          m_Parent(parent) {}
+
+    TKey m_Key;
+    uint32_t m_Left;
+    uint32_t m_Right;
+    uint32_t m_Parent;
+  };
+
+  static constexpr size_t kNodeSize = sizeof(Node);
+
+  explicit CompactAvlTree(const Compare &comp = Compare(),
+                          const Allocator &alloc = Allocator())
+      : m_Root(kNil), m_Compare(comp), m_Nodes(NodeAllocator(alloc)) {}
+
+  template <typename K> void add(K &&key);
+  template <typename K> void remove(const K &key);
+  template <typename K> bool exists(const K &key) const;
+  void clear();
+  void reserve(size_t nodesNum) { m_Nodes.reserve(nodesNum); }
+  void shrinkToFit() { m_Nodes.shrink_to_fit(); }
+  size_t size() const { return m_Nodes.size(); }
+  size_t capacity() const { return m_Nodes.capacity(); }
+  key_compare key_comp() const { return m_Compare; }
+  allocator_type get_allocator() const {
+    return allocator_type(m_Nodes.get_allocator());
+  }
+
+  const_iterator begin() const;
+  const_iterator end() const { return const_iterator(this, kNil); }
+  template <typename K> const_iterator find(const K &) const;
+  template <typename K> const_iterator lower_bound(const K &) const;
+  template <typename K> const_iterator upper_bound(const K &) const;
+
+  void swap(CompactAvlTree &other) noexcept;
+
+  friend const_iterator;
+
+private:
+  typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Node>
+      NodeAllocator;
+
+  static constexpr uint32_t kIndexMask = kNil;
+  static constexpr uint32_t kHeightShift = kIndexBits;
+  static constexpr uint32_t kHalfHeightBits = 32 - kIndexBits;
+  static constexpr uint32_t kHalfHeightMask = (1u << kHalfHeightBits) - 1;
+
+  uint32_t m_Root;
+  Compare m_Compare;
+  std::vector<Node, NodeAllocator> m_Nodes;
+
+  uint32_t left(uint32_t node) const {
+    return m_Nodes[node].m_Left & kIndexMask;
+  }
+  uint32_t right(uint32_t node) const {
+    return m_Nodes[node].m_Right & kIndexMask;
+  }
+  uint32_t parent(uint32_t node) const { return m_Nodes[node].m_Parent; }
+  int height(uint32_t node) const;
+  void setLeft(uint32_t node, uint32_t child);
+  void setRight(uint32_t node, uint32_t child);
+  void setHeight(uint32_t node, int height);
+  int getBalance(uint32_t node) const;
+  bool fixHeight(uint32_t node);
+  void replaceChild(uint32_t parentNode, uint32_t oldChild, uint32_t newChild);
+  uint32_t rotateLeft(uint32_t node);
+  uint32_t rotateRight(uint32_t node);
+  uint32_t balance(uint32_t node);
+  void retraceInsert(uint32_t node);
+  void retraceRemove(uint32_t node);
+  void releaseSlot(uint32_t node);
+  uint32_t leftmost(uint32_t node) const;
+  uint32_t rightmost(uint32_t node) const;
+  uint32_t successor(uint32_t node) const;
+  uint32_t predecessor(uint32_t node) const;
+  template <typename K> uint32_t lowerBound(const K &key) const;
+};
+
+template <typename TKey, typename Compare, typename Allocator>
+int CompactAvlTree<TKey, Compare, Allocator>::height(uint32_t node) const {
+  if (node == kNil) {
+    return 0;
+  }
+  const Node &n = m_Nodes[node];
+  return (int)((n.m_Left >> kHeightShift) |
+               ((n.m_Right >> kHeightShift) << kHalfHeightBits));
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void CompactAvlTree<TKey, Compare, Allocator>::setLeft(uint32_t node,
+                                                       uint32_t child) {
+  Node &n = m_Nodes[node];
+  n.m_Left = (n.m_Left & ~kIndexMask) | child;
+  if (child != kNil) {
+    m_Nodes[child].m_Parent = node;
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void CompactAvlTree<TKey, Compare, Allocator>::setRight(uint32_t node,
+                                                        uint32_t child) {
+  Node &n = m_Nodes[node];
+  n.m_Right = (n.m_Right & ~kIndexMask) | child;
+  if (child != kNil) {
+    m_Nodes[child].m_Parent = node;
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void CompactAvlTree<TKey, Compare, Allocator>::setHeight(uint32_t node,
+                                                         int height) {
+  Node &n = m_Nodes[node];
+  uint32_t value = (uint32_t)height;
+  n.m_Left =
+      (n.m_Left & kIndexMask) | ((value & kHalfHeightMask) << kHeightShift);
+  n.m_Right = (n.m_Right & kIndexMask) |
+              ((value >> kHalfHeightBits) << kHeightShift);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+int CompactAvlTree<TKey, Compare, Allocator>::getBalance(uint32_t node) const {
+  return height(left(node)) - height(right(node));
+}
+
+// Recomputes the height of node, returns true if it has changed.
+template <typename TKey, typename Compare, typename Allocator>
+bool CompactAvlTree<TKey, Compare, Allocator>::fixHeight(uint32_t node) {
+  int newHeight = std::max(height(left(node)), height(right(node))) + 1;
+  if (newHeight == height(node)) {
+    return false;
+  }
+  setHeight(node, newHeight);
+  return true;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void CompactAvlTree<TKey, Compare, Allocator>::replaceChild(uint32_t parentNode,
+                                                            uint32_t oldChild,
+                                                            uint32_t newChild) {
+  if (parentNode == kNil) {
+    m_Root = newChild;
+    if (newChild != kNil) {
+      m_Nodes[newChild].m_Parent = kNil;
+    }
+  } else if (left(parentNode) == oldChild) {
+    setLeft(parentNode, newChild);
+  } else {
+    setRight(parentNode, newChild);
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+uint32_t CompactAvlTree<TKey, Compare, Allocator>::rotateLeft(uint32_t node) {
+  uint32_t newRoot = right(node);
+  replaceChild(parent(node), node, newRoot);
+  setRight(node, left(newRoot));
+  setLeft(newRoot, node);
+  fixHeight(node);
+  fixHeight(newRoot);
+  return newRoot;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+uint32_t CompactAvlTree<TKey, Compare, Allocator>::rotateRight(uint32_t node) {
+  uint32_t newRoot = left(node);
+  replaceChild(parent(node), node, newRoot);
+  setLeft(node, right(newRoot));
+  setRight(newRoot, node);
+  fixHeight(node);
+  fixHeight(newRoot);
+  return newRoot;
+}
+
+// Returns the index of the node that takes the place of node.
+template <typename TKey, typename Compare, typename Allocator>
+uint32_t CompactAvlTree<TKey, Compare, Allocator>::balance(uint32_t node) {
+  int nodeBalance = getBalance(node);
+  if (nodeBalance == 2) {
+    if (getBalance(left(node)) < 0) {
+      rotateLeft(left(node));
+    }
+    return rotateRight(node);
+  }
+  if (nodeBalance == -2) {
+    if (getBalance(right(node)) > 0) {
+      rotateRight(right(node));
+    }
+    return rotateLeft(node);
+  }
+  return node;
+}
+
+// After an insertion at most one (double) rotation is needed, and nothing
+// above a node whose height has not changed has to be touched.
+template <typename TKey, typename Compare, typename Allocator>
+void CompactAvlTree<TKey, Compare, Allocator>::retraceInsert(uint32_t node) {
+  while (node != kNil) {
+    int nodeBalance = getBalance(node);
+    if (nodeBalance == 2 || nodeBalance == -2) {
+      balance(node);
+      return;
+    }
+    if (!fixHeight(node)) {
+      return;
+    }
+    node = parent(node);
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void CompactAvlTree<TKey, Compare, Allocator>::retraceRemove(uint32_t node) {
+  while (node != kNil) {
+    int oldHeight = height(node);
+    fixHeight(node);
+    node = balance(node);
+    if (height(node) == oldHeight) {
+      return;
+    }
+    node = parent(node);
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+void CompactAvlTree<TKey, Compare, Allocator>::add(K &&key) {
+  uint32_t parentNode = kNil;
+  uint32_t node = m_Root;
+  bool toLeft = false;
+  while (node != kNil) {
+    parentNode = node;
+    if (m_Compare(key, m_Nodes[node].m_Key)) {
+      toLeft = true;
+      node = left(node);
+    } else if (m_Compare(m_Nodes[node].m_Key, key)) {
+      toLeft = false;
+      node = right(node);
+    } else {
+      return;
+    }
+  }
+
+  if (m_Nodes.size() >= kMaxSize) {
+    throw std::length_error("CompactAvlTree: too many keys");
+  }
+  uint32_t newNode = (uint32_t)m_Nodes.size();
+  m_Nodes.emplace_back(parentNode, std::forward<K>(key));
+  setHeight(newNode, 1);
+  if (parentNode == kNil) {
+    m_Root = newNode;
+    return;
+  }
+  if (toLeft) {
+    setLeft(parentNode, newNode);
+  } else {
+    setRight(parentNode, newNode);
+  }
+  retraceInsert(parentNode);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+void CompactAvlTree<TKey, Compare, Allocator>::remove(const K &key) {
+  uint32_t node = lowerBound(key);
+  if (node == kNil || m_Compare(key, m_Nodes[node].m_Key)) {
+    return;
+  }
+
+  // A node with two children swaps keys with its successor, which has no left
+  // child, and the successor is unlinked instead.
+  if (left(node) != kNil && right(node) != kNil) {
+    uint32_t next = leftmost(right(node));
+    using std::swap;
+    swap(m_Nodes[node].m_Key, m_Nodes[next].m_Key);
+    node = next;
+  }
+
+  uint32_t child = left(node) != kNil ? left(node) : right(node);
+  uint32_t parentNode = parent(node);
+  replaceChild(parentNode, node, child);
+  retraceRemove(parentNode);
+  releaseSlot(node);
+}
+
+// Moves the last node of the array into the unlinked slot node, keeping the
+// array dense.
+template <typename TKey, typename Compare, typename Allocator>
+void CompactAvlTree<TKey, Compare, Allocator>::releaseSlot(uint32_t node) {
+  uint32_t last = (uint32_t)m_Nodes.size() - 1;
+  if (node != last) {
+    uint32_t lastParent = parent(last);
+    uint32_t lastLeft = left(last);
+    uint32_t lastRight = right(last);
+    m_Nodes[node] = std::move(m_Nodes[last]);
+    if (lastParent == kNil) {
+      m_Root = node;
+    } else if (left(lastParent) == last) {
+      setLeft(lastParent, node);
+    } else {
+      setRight(lastParent, node);
+    }
+    if (lastLeft != kNil) {
+      m_Nodes[lastLeft].m_Parent = node;
+    }
+    if (lastRight != kNil) {
+      m_Nodes[lastRight].m_Parent = node;
+    }
+  }
+  m_Nodes.pop_back();
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void CompactAvlTree<TKey, Compare, Allocator>::clear() {
+  m_Nodes.clear();
+  m_Root = kNil;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void CompactAvlTree<TKey, Compare, Allocator>::swap(
+    CompactAvlTree &other) noexcept {
+  std::swap(m_Root, other.m_Root);
+  std::swap(m_Compare, other.m_Compare);
+  m_Nodes.swap(other.m_Nodes);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool CompactAvlTree<TKey, Compare, Allocator>::exists(const K &key) const {
+  uint32_t node = lowerBound(key);
+  return node != kNil && !m_Compare(key, m_Nodes[node].m_Key);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+uint32_t CompactAvlTree<TKey, Compare, Allocator>::lowerBound(
+    const K &key) const {
+  uint32_t result = kNil;
+  uint32_t node = m_Root;
+  while (node != kNil) {
+    if (m_Compare(m_Nodes[node].m_Key, key)) {
+      node = right(node);
+    } else {
+      result = node;
+      node = left(node);
+    }
+  }
+  return result;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename CompactAvlTree<TKey, Compare, Allocator>::const_iterator
+CompactAvlTree<TKey, Compare, Allocator>::begin() const {
+  if (m_Root == kNil) {
+    return end();
+  }
+  return const_iterator(this, leftmost(m_Root));
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename CompactAvlTree<TKey, Compare, Allocator>::const_iterator
+CompactAvlTree<TKey, Compare, Allocator>::find(const K &key) const {
+  uint32_t node = lowerBound(key);
+  if (node == kNil || m_Compare(key, m_Nodes[node].m_Key)) {
+    return end();
+  }
+  return const_iterator(this, node);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename CompactAvlTree<TKey, Compare, Allocator>::const_iterator
+CompactAvlTree<TKey, Compare, Allocator>::lower_bound(const K &key) const {
+  return const_iterator(this, lowerBound(key));
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename CompactAvlTree<TKey, Compare, Allocator>::const_iterator
+CompactAvlTree<TKey, Compare, Allocator>::upper_bound(const K &key) const {
+  uint32_t result = kNil;
+  uint32_t node = m_Root;
+  while (node != kNil) {
+    if (m_Compare(key, m_Nodes[node].m_Key)) {
+      result = node;
+      node = left(node);
+    } else {
+      node = right(node);
+    }
+  }
+  return const_iterator(this, result);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+uint32_t
+CompactAvlTree<TKey, Compare, Allocator>::leftmost(uint32_t node) const {
+  while (left(node) != kNil) {
+    node = left(node);
+  }
+  return node;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+uint32_t
+CompactAvlTree<TKey, Compare, Allocator>::rightmost(uint32_t node) const {
+  while (right(node) != kNil) {
+    node = right(node);
+  }
+  return node;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+uint32_t
+CompactAvlTree<TKey, Compare, Allocator>::successor(uint32_t node) const {
+  if (right(node) != kNil) {
+    return leftmost(right(node));
+  }
+  uint32_t parentNode = parent(node);
+  while (parentNode != kNil && right(parentNode) == node) {
+    node = parentNode;
+    parentNode = parent(node);
+  }
+  return parentNode;
+}
+
+// The predecessor of end() is the rightmost node.
+template <typename TKey, typename Compare, typename Allocator>
+uint32_t
+CompactAvlTree<TKey, Compare, Allocator>::predecessor(uint32_t node) const {
+  if (node == kNil) {
+    return m_Root == kNil ? kNil : rightmost(m_Root);
+  }
+  if (left(node) != kNil) {
+    return rightmost(left(node));
+  }
+  uint32_t parentNode = parent(node);
+  while (parentNode != kNil && left(parentNode) == node) {
+    node = parentNode;
+    parentNode = parent(node);
+  }
+  return parentNode;
+}
+
+template <typename TTree> class CompactAvlTreeConstIterator {
+public:
+  typedef typename TTree::key_type T;
+  typedef std::ptrdiff_t difference_type;
+  typedef T value_type;
+  typedef const T &reference;
+  typedef const T &const_reference;
+  typedef const T *pointer;
+  typedef const T *const_pointer;
+  typedef std::bidirectional_iterator_tag iterator_category;
+
+  CompactAvlTreeConstIterator() : m_Tree(nullptr), m_Node(TTree::kNil) {}
+  const T &operator*() const { return m_Tree->m_Nodes[m_Node].m_Key; }
+  const T *operator->() const { return &m_Tree->m_Nodes[m_Node].m_Key; }
+
+  CompactAvlTreeConstIterator &operator++() {
+    m_Node = m_Tree->successor(m_Node);
+    return *this;
+  }
+  CompactAvlTreeConstIterator operator++(int) {
+    auto res = *this;
+    ++*this;
+    return res;
+  }
+  CompactAvlTreeConstIterator &operator--() {
+    m_Node = m_Tree->predecessor(m_Node);
+    return *this;
+  }
+  CompactAvlTreeConstIterator operator--(int) {
+    auto res = *this;
+    --*this;
+    return res;
+  }
+
+  bool operator==(const CompactAvlTreeConstIterator &other) const {
+    return m_Node == other.m_Node;
+  }
+  bool operator!=(const CompactAvlTreeConstIterator &other) const {
+    return !(*this == other);
+  }
+
+  friend TTree;
+
+private:
+  CompactAvlTreeConstIterator(const TTree *tree, uint32_t node)
+      : m_Tree(tree), m_Node(node) {}
+
+  const TTree *m_Tree;
+  uint32_t m_Node;
+};
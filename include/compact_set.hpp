@@ -0,0 +1,125 @@
+#pragma once
+
+#include "compact_avltree.hpp"
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// Ordered set with the same basic interface as Set, stored in a
+// CompactAvlTree: about sizeof(T) + 12 bytes per element instead of a 64-byte
+// node. It has no order statistics, set algebra or split/join; iterators move
+// in O(1) amortized rather than O(1) worst case.
+//
+// Unlike those of Set, iterators do not survive erasure: the nodes are kept
+// dense in one array, and erase moves the last node into the freed slot, so
+// every erase invalidates all iterators. They are array indices and do survive
+// insertion, but references and pointers to elements do not, since the array
+// may grow.
+template <typename T, typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class CompactSet {
+public:
+  typedef CompactAvlTree<T, Compare, Allocator> tree_type;
+  typedef typename tree_type::const_iterator const_iterator;
+  typedef typename tree_type::const_iterator iterator;
+  typedef std::ptrdiff_t difference_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  // Bytes taken by one element, not counting the unused capacity.
+  static constexpr size_t kBytesPerElement = tree_type::kNodeSize;
+
+  CompactSet() : m_Tree() {}
+  explicit CompactSet(const Compare &comp,
+                      const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {}
+  explicit CompactSet(const Allocator &alloc) : m_Tree(Compare(), alloc) {}
+  template <typename InputIterator>
+  CompactSet(InputIterator first, InputIterator last,
+             const Compare &comp = Compare(),
+             const Allocator &alloc = Allocator());
+  CompactSet(std::initializer_list<T> initList,
+             const Compare &comp = Compare(),
+             const Allocator &alloc = Allocator())
+      : CompactSet(initList.begin(), initList.end(), comp, alloc) {}
+
+  const_iterator begin() const { return m_Tree.begin(); }
+  const_iterator end() const { return m_Tree.end(); }
+  const_iterator find(const T &key) const { return m_Tree.find(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator find(const K &key) const {
+    return m_Tree.find(key);
+  }
+  const_iterator lower_bound(const T &key) const {
+    return m_Tree.lower_bound(key);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator lower_bound(const K &key) const {
+    return m_Tree.lower_bound(key);
+  }
+  const_iterator upper_bound(const T &key) const {
+    return m_Tree.upper_bound(key);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator upper_bound(const K &key) const {
+    return m_Tree.upper_bound(key);
+  }
+
+  void insert(const T &key) { m_Tree.add(key); }
+  void insert(T &&key) { m_Tree.add(std::move(key)); }
+  void erase(const T &key) { m_Tree.remove(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  void erase(const K &key) {
+    m_Tree.remove(key);
+  }
+  bool contains(const T &key) const { return m_Tree.exists(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool contains(const K &key) const {
+    return m_Tree.exists(key);
+  }
+  void clear() { m_Tree.clear(); }
+  void reserve(size_t elementsNum) { m_Tree.reserve(elementsNum); }
+  void shrink_to_fit() { m_Tree.shrinkToFit(); }
+  void swap(CompactSet &other) noexcept { m_Tree.swap(other.m_Tree); }
+
+  size_t size() const { return m_Tree.size(); }
+  bool empty() const { return m_Tree.size() == 0; }
+  size_t capacity() const { return m_Tree.capacity(); }
+  key_compare key_comp() const { return m_Tree.key_comp(); }
+  allocator_type get_allocator() const { return m_Tree.get_allocator(); }
+
+private:
+  tree_type m_Tree;
+};
+
+template <typename T, typename Compare, typename Allocator>
+template <typename InputIterator>
+CompactSet<T, Compare, Allocator>::CompactSet(InputIterator first,
+                                              InputIterator last,
+                                              const Compare &comp,
+                                              const Allocator &alloc)
+    : m_Tree(comp, alloc) {
+  if constexpr (std::is_base_of<std::forward_iterator_tag,
+                                typename std::iterator_traits<
+                                    InputIterator>::iterator_category>::value) {
+    m_Tree.reserve(std::distance(first, last));
+  }
+  for (; first != last; ++first) {
+    m_Tree.add(*first);
+  }
+}
+
+template <typename T, typename Compare, typename Allocator>
+void swap(CompactSet<T, Compare, Allocator> &lhs,
+          CompactSet<T, Compare, Allocator> &rhs) noexcept {
+  lhs.swap(rhs);
+}
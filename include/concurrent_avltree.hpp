@@ -0,0 +1,1000 @@
+#pragma once
+
+#include "epoch.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+// AVL tree that many threads can use at once, after Bronson, Casper, Chafi
+// and Olukotun, "A Practical Concurrent Binary Search Tree" (PPoPP 2010).
+//
+// Readers take no locks. Every node carries a version that a rotation bumps
+// when the node moves down; a search reads a child, then checks that the
+// parent's version has not changed, so a node that was rotated away under it
+// is noticed and the search is retried from the last valid node.
+//
+// Writers lock only the nodes they change: the parent of a new leaf, the
+// parent and the node for an unlink, and at most four nodes top-down for a
+// rotation. Erasing a node with two children only marks it as absent (a
+// routing node), it is unlinked later when it has at most one child left.
+// Heights are fixed after the update by walking up, so the balance is relaxed
+// while writers race and exact when the tree is quiet.
+//
+// Unlinked nodes are released through epoch-based reclamation, see epoch.hpp.
+// Allocator has to be safe to call from several threads.
+template <typename TKey, typename Compare = std::less<TKey>,
+          typename Allocator = std::allocator<TKey>>
+class ConcurrentAvlTree {
+public:
+  typedef TKey key_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  explicit ConcurrentAvlTree(const Compare &comp = Compare(),
+                             const Allocator &alloc = Allocator())
+      : m_Holder(nullptr), m_Compare(comp), m_Alloc(alloc) {}
+  ConcurrentAvlTree(const ConcurrentAvlTree &) = delete;
+  ConcurrentAvlTree &operator=(const ConcurrentAvlTree &) = delete;
+  ~ConcurrentAvlTree();
+
+  // add and remove return whether the tree has changed.
+  template <typename K> bool add(K &&key);
+  template <typename K> bool remove(const K &key);
+  template <typename K> bool exists(const K &key) const;
+  // Smallest key not less than key. Found by searches that are each atomic,
+  // but a key erased during the call may be skipped for a greater one.
+  template <typename K> std::optional<TKey> lowerBound(const K &key) const;
+  key_compare key_comp() const { return m_Compare; }
+  allocator_type get_allocator() const { return allocator_type(m_Alloc); }
+
+private:
+  struct NodeBase {
+    explicit NodeBase(NodeBase *parent)
+        : m_Version(0), m_Height(1), m_Present(true), m_Parent(parent),
+          m_LeftChild(nullptr), m_RightChild(nullptr) {}
+
+    NodeBase *child(int dir) const {
+      return dir < 0 ? m_LeftChild.load() : m_RightChild.load();
+    }
+    void setChild(int dir, NodeBase *node) {
+      (dir < 0 ? m_LeftChild : m_RightChild).store(node);
+    }
+
+    std::atomic<uint64_t> m_Version;
+    std::atomic<int> m_Height;
+    std::atomic<bool> m_Present;
+    std::atomic<NodeBase *> m_Parent;
+    std::atomic<NodeBase *> m_LeftChild;
+    std::atomic<NodeBase *> m_RightChild;
+    std::mutex m_Mutex;
+  };
+
+  struct Node : NodeBase {
+    template <typename K>
+    Node(NodeBase *parent, K &&key)
+        : NodeBase(parent), m_Key(std::forward<K>(key)) {}
+
+    const TKey m_Key;
+  };
+
+  typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Node>
+      NodeAllocator;
+  typedef std::allocator_traits<NodeAllocator> NodeAllocatorTraits;
+
+  enum class Attempt { kNo, kYes, kRetry };
+
+  // Version bits: an unlinked node has version kUnlinked forever, a node that
+  // is being rotated down has kShrinking set, and every finished rotation
+  // adds kShrinkCount.
+  static constexpr uint64_t kUnlinked = 1;
+  static constexpr uint64_t kShrinking = 2;
+  static constexpr uint64_t kShrinkCount = 4;
+  static constexpr int kSpinsBeforeLock = 100;
+  static constexpr size_t kRetireBatch = 64;
+  // nodeCondition results, non-negative values are the height to set.
+  static constexpr int kUnlinkRequired = -1;
+  static constexpr int kRebalanceRequired = -2;
+  static constexpr int kNothingRequired = -3;
+
+  // The root is the right child of m_Holder, so every node has a parent to
+  // lock.
+  mutable NodeBase m_Holder;
+  Compare m_Compare;
+  NodeAllocator m_Alloc;
+  epoch::RetireList<NodeBase> m_Retired;
+
+  template <typename K> Node *createNode(NodeBase *, K &&);
+  void destroyNode(NodeBase *);
+  void destroySubtree(NodeBase *);
+  void collectRetired();
+  template <typename K> int direction(const K &, const NodeBase *) const;
+  static bool isShrinkingOrUnlinked(uint64_t version) {
+    return (version & (kShrinking | kUnlinked)) != 0;
+  }
+  static bool isUnlinked(uint64_t version) { return version == kUnlinked; }
+  static void waitUntilShrinkCompleted(NodeBase *, uint64_t);
+  static int height(const NodeBase *node) {
+    return node == nullptr ? 0 : node->m_Height.load();
+  }
+
+  template <typename K>
+  Attempt attemptGet(const K &, NodeBase *, int, uint64_t) const;
+  template <typename K> NodeBase *findBound(const K &, bool) const;
+  template <typename K>
+  Attempt attemptBound(const K &, bool, NodeBase *, uint64_t, NodeBase *,
+                       NodeBase *&) const;
+  template <typename K> Attempt attemptAdd(K &&, NodeBase *, uint64_t);
+  Attempt attemptRevive(NodeBase *);
+  template <typename K>
+  Attempt attemptRemove(const K &, NodeBase *, NodeBase *, uint64_t);
+  Attempt attemptRemoveNode(NodeBase *, NodeBase *);
+  bool attemptUnlinkLocked(NodeBase *, NodeBase *);
+
+  static int nodeCondition(NodeBase *);
+  void fixHeightAndRebalance(NodeBase *);
+  static NodeBase *fixHeightLocked(NodeBase *);
+  NodeBase *rebalanceLocked(NodeBase *, NodeBase *);
+  NodeBase *rebalanceToRightLocked(NodeBase *, NodeBase *, NodeBase *, int);
+  NodeBase *rebalanceToLeftLocked(NodeBase *, NodeBase *, NodeBase *, int);
+  static NodeBase *rotateRightLocked(NodeBase *, NodeBase *, NodeBase *, int,
+                                     int, NodeBase *, int);
+  static NodeBase *rotateLeftLocked(NodeBase *, NodeBase *, int, NodeBase *,
+                                    NodeBase *, int, int);
+  static NodeBase *rotateRightOverLeftLocked(NodeBase *, NodeBase *,
+                                             NodeBase *, int, int, NodeBase *,
+                                             int);
+  static NodeBase *rotateLeftOverRightLocked(NodeBase *, NodeBase *, int,
+                                             NodeBase *, NodeBase *, int, int);
+};
+
+template <typename TKey, typename Compare, typename Allocator>
+ConcurrentAvlTree<TKey, Compare, Allocator>::~ConcurrentAvlTree() {
+  destroySubtree(m_Holder.m_RightChild.load());
+  m_Retired.releaseAll([this](NodeBase *node) { destroyNode(node); });
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::Node *
+ConcurrentAvlTree<TKey, Compare, Allocator>::createNode(NodeBase *parent,
+                                                        K &&key) {
+  Node *node = NodeAllocatorTraits::allocate(m_Alloc, 1);
+  try {
+    NodeAllocatorTraits::construct(m_Alloc, node, parent,
+                                   std::forward<K>(key));
+  } catch (...) {
+    NodeAllocatorTraits::deallocate(m_Alloc, node, 1);
+    throw;
+  }
+  return node;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void ConcurrentAvlTree<TKey, Compare, Allocator>::destroyNode(NodeBase *node) {
+  Node *fullNode = static_cast<Node *>(node);
+  NodeAllocatorTraits::destroy(m_Alloc, fullNode);
+  NodeAllocatorTraits::deallocate(m_Alloc, fullNode, 1);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void ConcurrentAvlTree<TKey, Compare, Allocator>::destroySubtree(
+    NodeBase *node) {
+  if (node == nullptr) {
+    return;
+  }
+  destroySubtree(node->m_LeftChild.load());
+  destroySubtree(node->m_RightChild.load());
+  destroyNode(node);
+}
+
+// Called by writers outside of their critical sections.
+template <typename TKey, typename Compare, typename Allocator>
+void ConcurrentAvlTree<TKey, Compare, Allocator>::collectRetired() {
+  m_Retired.collect(kRetireBatch,
+                    [this](NodeBase *node) { destroyNode(node); });
+}
+
+// -1 if key goes to the left of node, 1 if to the right, 0 if equal.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+int ConcurrentAvlTree<TKey, Compare, Allocator>::direction(
+    const K &key, const NodeBase *node) const {
+  const TKey &nodeKey = static_cast<const Node *>(node)->m_Key;
+  if (m_Compare(key, nodeKey)) {
+    return -1;
+  }
+  return m_Compare(nodeKey, key) ? 1 : 0;
+}
+
+// The rotation holds the lock of the shrinking node, so after a short spin
+// taking the lock waits for it to finish.
+template <typename TKey, typename Compare, typename Allocator>
+void ConcurrentAvlTree<TKey, Compare, Allocator>::waitUntilShrinkCompleted(
+    NodeBase *node, uint64_t version) {
+  if ((version & kShrinking) == 0) {
+    return;
+  }
+  for (int i = 0; i < kSpinsBeforeLock; ++i) {
+    if (node->m_Version.load() != version) {
+      return;
+    }
+  }
+  std::lock_guard<std::mutex> lock(node->m_Mutex);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool ConcurrentAvlTree<TKey, Compare, Allocator>::exists(const K &key) const {
+  epoch::Guard guard;
+  while (true) {
+    NodeBase *root = m_Holder.m_RightChild.load();
+    if (root == nullptr) {
+      return false;
+    }
+    int dir = direction(key, root);
+    if (dir == 0) {
+      return root->m_Present.load();
+    }
+    uint64_t version = root->m_Version.load();
+    if (isShrinkingOrUnlinked(version)) {
+      waitUntilShrinkCompleted(root, version);
+    } else if (root == m_Holder.m_RightChild.load()) {
+      Attempt res = attemptGet(key, root, dir, version);
+      if (res != Attempt::kRetry) {
+        return res == Attempt::kYes;
+      }
+    }
+  }
+}
+
+// Searches the subtree of node in direction dir. node had version when its
+// parent was checked; if it changed, the caller retries.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::Attempt
+ConcurrentAvlTree<TKey, Compare, Allocator>::attemptGet(
+    const K &key, NodeBase *node, int dir, uint64_t version) const {
+  while (true) {
+    NodeBase *child = node->child(dir);
+    if (child == nullptr) {
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+      return Attempt::kNo;
+    }
+
+    int childDir = direction(key, child);
+    if (childDir == 0) {
+      return child->m_Present.load() ? Attempt::kYes : Attempt::kNo;
+    }
+    uint64_t childVersion = child->m_Version.load();
+    if (isShrinkingOrUnlinked(childVersion)) {
+      waitUntilShrinkCompleted(child, childVersion);
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+    } else if (child != node->child(dir)) {
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+    } else {
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+      Attempt res = attemptGet(key, child, childDir, childVersion);
+      if (res != Attempt::kRetry) {
+        return res;
+      }
+    }
+  }
+}
+
+// Routing nodes are skipped by searching again past them.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+std::optional<TKey>
+ConcurrentAvlTree<TKey, Compare, Allocator>::lowerBound(const K &key) const {
+  epoch::Guard guard;
+  NodeBase *node = findBound(key, false);
+  while (node != nullptr && !node->m_Present.load()) {
+    node = findBound(static_cast<Node *>(node)->m_Key, true);
+  }
+  if (node == nullptr) {
+    return std::nullopt;
+  }
+  return static_cast<Node *>(node)->m_Key;
+}
+
+// The first node, present or not, greater than key if strict, not less than
+// key otherwise.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::NodeBase *
+ConcurrentAvlTree<TKey, Compare, Allocator>::findBound(const K &key,
+                                                       bool strict) const {
+  while (true) {
+    NodeBase *root = m_Holder.m_RightChild.load();
+    if (root == nullptr) {
+      return nullptr;
+    }
+    uint64_t version = root->m_Version.load();
+    if (isShrinkingOrUnlinked(version)) {
+      waitUntilShrinkCompleted(root, version);
+    } else if (root == m_Holder.m_RightChild.load()) {
+      NodeBase *res = nullptr;
+      if (attemptBound(key, strict, root, version, nullptr, res) !=
+          Attempt::kRetry) {
+        return res;
+      }
+    }
+  }
+}
+
+// Same validation as attemptGet, candidate is the last node on the path that
+// is a bound of key.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::Attempt
+ConcurrentAvlTree<TKey, Compare, Allocator>::attemptBound(
+    const K &key, bool strict, NodeBase *node, uint64_t version,
+    NodeBase *candidate, NodeBase *&result) const {
+  const TKey &nodeKey = static_cast<Node *>(node)->m_Key;
+  int dir = 1;
+  if (strict ? m_Compare(key, nodeKey) : !m_Compare(nodeKey, key)) {
+    dir = -1;
+    candidate = node;
+  }
+  while (true) {
+    NodeBase *child = node->child(dir);
+    if (child == nullptr) {
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+      result = candidate;
+      return Attempt::kYes;
+    }
+
+    uint64_t childVersion = child->m_Version.load();
+    if (isShrinkingOrUnlinked(childVersion)) {
+      waitUntilShrinkCompleted(child, childVersion);
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+    } else if (child != node->child(dir)) {
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+    } else {
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+      Attempt res =
+          attemptBound(key, strict, child, childVersion, candidate, result);
+      if (res != Attempt::kRetry) {
+        return res;
+      }
+    }
+  }
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool ConcurrentAvlTree<TKey, Compare, Allocator>::add(K &&key) {
+  bool res = false;
+  {
+    epoch::Guard guard;
+    while (true) {
+      NodeBase *root = m_Holder.m_RightChild.load();
+      if (root == nullptr) {
+        std::lock_guard<std::mutex> lock(m_Holder.m_Mutex);
+        if (m_Holder.m_RightChild.load() == nullptr) {
+          m_Holder.m_RightChild.store(
+              createNode(&m_Holder, std::forward<K>(key)));
+          m_Holder.m_Height.store(2);
+          res = true;
+          break;
+        }
+        continue;
+      }
+      uint64_t version = root->m_Version.load();
+      if (isShrinkingOrUnlinked(version)) {
+        waitUntilShrinkCompleted(root, version);
+      } else if (root == m_Holder.m_RightChild.load()) {
+        Attempt attempt = attemptAdd(std::forward<K>(key), root, version);
+        if (attempt != Attempt::kRetry) {
+          res = attempt == Attempt::kYes;
+          break;
+        }
+      }
+    }
+  }
+  collectRetired();
+  return res;
+}
+
+// key is forwarded down the recursion but only moved from when the new node
+// is created, right before returning.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::Attempt
+ConcurrentAvlTree<TKey, Compare, Allocator>::attemptAdd(K &&key,
+                                                        NodeBase *node,
+                                                        uint64_t version) {
+  int dir = direction(key, node);
+  if (dir == 0) {
+    return attemptRevive(node);
+  }
+
+  while (true) {
+    NodeBase *child = node->child(dir);
+    if (node->m_Version.load() != version) {
+      return Attempt::kRetry;
+    }
+
+    if (child == nullptr) {
+      NodeBase *damaged = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(node->m_Mutex);
+        if (node->m_Version.load() != version) {
+          return Attempt::kRetry;
+        }
+        if (node->child(dir) != nullptr) {
+          continue;
+        }
+        node->setChild(dir, createNode(node, std::forward<K>(key)));
+        damaged = fixHeightLocked(node);
+      }
+      fixHeightAndRebalance(damaged);
+      return Attempt::kYes;
+    }
+
+    uint64_t childVersion = child->m_Version.load();
+    if (isShrinkingOrUnlinked(childVersion)) {
+      waitUntilShrinkCompleted(child, childVersion);
+    } else if (child == node->child(dir)) {
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+      Attempt res = attemptAdd(std::forward<K>(key), child, childVersion);
+      if (res != Attempt::kRetry) {
+        return res;
+      }
+    }
+  }
+}
+
+// An equal routing node is simply marked as present again.
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::Attempt
+ConcurrentAvlTree<TKey, Compare, Allocator>::attemptRevive(NodeBase *node) {
+  if (node->m_Present.load()) {
+    return Attempt::kNo;
+  }
+  std::lock_guard<std::mutex> lock(node->m_Mutex);
+  if (isUnlinked(node->m_Version.load())) {
+    return Attempt::kRetry;
+  }
+  if (node->m_Present.load()) {
+    return Attempt::kNo;
+  }
+  node->m_Present.store(true);
+  return Attempt::kYes;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool ConcurrentAvlTree<TKey, Compare, Allocator>::remove(const K &key) {
+  bool res = false;
+  {
+    epoch::Guard guard;
+    while (true) {
+      NodeBase *root = m_Holder.m_RightChild.load();
+      if (root == nullptr) {
+        break;
+      }
+      uint64_t version = root->m_Version.load();
+      if (isShrinkingOrUnlinked(version)) {
+        waitUntilShrinkCompleted(root, version);
+      } else if (root == m_Holder.m_RightChild.load()) {
+        Attempt attempt = attemptRemove(key, &m_Holder, root, version);
+        if (attempt != Attempt::kRetry) {
+          res = attempt == Attempt::kYes;
+          break;
+        }
+      }
+    }
+  }
+  collectRetired();
+  return res;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::Attempt
+ConcurrentAvlTree<TKey, Compare, Allocator>::attemptRemove(const K &key,
+                                                           NodeBase *parent,
+                                                           NodeBase *node,
+                                                           uint64_t version) {
+  int dir = direction(key, node);
+  if (dir == 0) {
+    return attemptRemoveNode(parent, node);
+  }
+
+  while (true) {
+    NodeBase *child = node->child(dir);
+    if (node->m_Version.load() != version) {
+      return Attempt::kRetry;
+    }
+    if (child == nullptr) {
+      return Attempt::kNo;
+    }
+
+    uint64_t childVersion = child->m_Version.load();
+    if (isShrinkingOrUnlinked(childVersion)) {
+      waitUntilShrinkCompleted(child, childVersion);
+    } else if (child == node->child(dir)) {
+      if (node->m_Version.load() != version) {
+        return Attempt::kRetry;
+      }
+      Attempt res = attemptRemove(key, node, child, childVersion);
+      if (res != Attempt::kRetry) {
+        return res;
+      }
+    }
+  }
+}
+
+// A node with at most one child is unlinked under the locks of its parent and
+// itself, a node with two children becomes a routing node.
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::Attempt
+ConcurrentAvlTree<TKey, Compare, Allocator>::attemptRemoveNode(
+    NodeBase *parent, NodeBase *node) {
+  if (!node->m_Present.load()) {
+    return Attempt::kNo;
+  }
+
+  if (node->m_LeftChild.load() == nullptr ||
+      node->m_RightChild.load() == nullptr) {
+    NodeBase *damaged = nullptr;
+    {
+      std::lock_guard<std::mutex> parentLock(parent->m_Mutex);
+      if (isUnlinked(parent->m_Version.load()) ||
+          node->m_Parent.load() != parent) {
+        return Attempt::kRetry;
+      }
+      {
+        std::lock_guard<std::mutex> lock(node->m_Mutex);
+        if (!node->m_Present.load()) {
+          return Attempt::kNo;
+        }
+        if (!attemptUnlinkLocked(parent, node)) {
+          return Attempt::kRetry;
+        }
+      }
+      damaged = fixHeightLocked(parent);
+    }
+    fixHeightAndRebalance(damaged);
+    return Attempt::kYes;
+  }
+
+  std::lock_guard<std::mutex> lock(node->m_Mutex);
+  if (isUnlinked(node->m_Version.load())) {
+    return Attempt::kRetry;
+  }
+  if (!node->m_Present.load()) {
+    return Attempt::kNo;
+  }
+  // A child may have gone meanwhile, then the node can be unlinked instead.
+  if (node->m_LeftChild.load() == nullptr ||
+      node->m_RightChild.load() == nullptr) {
+    return Attempt::kRetry;
+  }
+  node->m_Present.store(false);
+  return Attempt::kYes;
+}
+
+// Replaces node by its only child. Both node and parent are locked.
+template <typename TKey, typename Compare, typename Allocator>
+bool ConcurrentAvlTree<TKey, Compare, Allocator>::attemptUnlinkLocked(
+    NodeBase *parent, NodeBase *node) {
+  NodeBase *parentLeft = parent->m_LeftChild.load();
+  NodeBase *parentRight = parent->m_RightChild.load();
+  if (parentLeft != node && parentRight != node) {
+    return false;
+  }
+  NodeBase *left = node->m_LeftChild.load();
+  NodeBase *right = node->m_RightChild.load();
+  if (left != nullptr && right != nullptr) {
+    return false;
+  }
+
+  NodeBase *splice = left != nullptr ? left : right;
+  if (parentLeft == node) {
+    parent->m_LeftChild.store(splice);
+  } else {
+    parent->m_RightChild.store(splice);
+  }
+  if (splice != nullptr) {
+    splice->m_Parent.store(parent);
+  }
+  node->m_Version.store(kUnlinked);
+  node->m_Present.store(false);
+  m_Retired.retire(node);
+  return true;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+int ConcurrentAvlTree<TKey, Compare, Allocator>::nodeCondition(
+    NodeBase *node) {
+  NodeBase *left = node->m_LeftChild.load();
+  NodeBase *right = node->m_RightChild.load();
+  if ((left == nullptr || right == nullptr) && !node->m_Present.load()) {
+    return kUnlinkRequired;
+  }
+
+  int leftHeight = height(left);
+  int rightHeight = height(right);
+  int balance = leftHeight - rightHeight;
+  if (balance < -1 || balance > 1) {
+    return kRebalanceRequired;
+  }
+  int newHeight = 1 + std::max(leftHeight, rightHeight);
+  return newHeight != node->m_Height.load() ? newHeight : kNothingRequired;
+}
+
+// Walks up from node fixing heights, rotating and unlinking routing nodes
+// until nothing is left to do. The holder has no parent and stops the walk.
+template <typename TKey, typename Compare, typename Allocator>
+void ConcurrentAvlTree<TKey, Compare, Allocator>::fixHeightAndRebalance(
+    NodeBase *node) {
+  while (node != nullptr && node->m_Parent.load() != nullptr) {
+    int condition = nodeCondition(node);
+    if (condition == kNothingRequired ||
+        isUnlinked(node->m_Version.load())) {
+      return;
+    }
+
+    if (condition != kUnlinkRequired && condition != kRebalanceRequired) {
+      std::lock_guard<std::mutex> lock(node->m_Mutex);
+      node = fixHeightLocked(node);
+    } else {
+      NodeBase *parent = node->m_Parent.load();
+      std::lock_guard<std::mutex> parentLock(parent->m_Mutex);
+      if (!isUnlinked(parent->m_Version.load()) &&
+          node->m_Parent.load() == parent) {
+        // node may have been unlinked since, its parent link is left as is.
+        std::lock_guard<std::mutex> lock(node->m_Mutex);
+        if (!isUnlinked(node->m_Version.load())) {
+          node = rebalanceLocked(parent, node);
+        }
+      }
+    }
+  }
+}
+
+// Returns the next node to look at: node itself if it needs more than a new
+// height, its parent if the height changed, nullptr if nothing did.
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::NodeBase *
+ConcurrentAvlTree<TKey, Compare, Allocator>::fixHeightLocked(NodeBase *node) {
+  int condition = nodeCondition(node);
+  if (condition == kRebalanceRequired || condition == kUnlinkRequired) {
+    return node;
+  }
+  if (condition == kNothingRequired) {
+    return nullptr;
+  }
+  node->m_Height.store(condition);
+  return node->m_Parent.load();
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::NodeBase *
+ConcurrentAvlTree<TKey, Compare, Allocator>::rebalanceLocked(NodeBase *parent,
+                                                             NodeBase *node) {
+  NodeBase *left = node->m_LeftChild.load();
+  NodeBase *right = node->m_RightChild.load();
+  if ((left == nullptr || right == nullptr) && !node->m_Present.load()) {
+    return attemptUnlinkLocked(parent, node) ? fixHeightLocked(parent) : node;
+  }
+
+  int leftHeight = height(left);
+  int rightHeight = height(right);
+  int balance = leftHeight - rightHeight;
+  if (balance > 1) {
+    return rebalanceToRightLocked(parent, node, left, rightHeight);
+  }
+  if (balance < -1) {
+    return rebalanceToLeftLocked(parent, node, right, leftHeight);
+  }
+  int newHeight = 1 + std::max(leftHeight, rightHeight);
+  if (newHeight != node->m_Height.load()) {
+    node->m_Height.store(newHeight);
+    return fixHeightLocked(parent);
+  }
+  return nullptr;
+}
+
+// The left subtree is too high. If its inner grandchild is the higher one,
+// a double rotation is done, or the left child is rotated on its own first.
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::NodeBase *
+ConcurrentAvlTree<TKey, Compare, Allocator>::rebalanceToRightLocked(
+    NodeBase *parent, NodeBase *node, NodeBase *left, int rightHeight) {
+  std::lock_guard<std::mutex> leftLock(left->m_Mutex);
+  if (left->m_Height.load() - rightHeight <= 1) {
+    return node;
+  }
+  NodeBase *leftRight = left->m_RightChild.load();
+  int leftLeftHeight = height(left->m_LeftChild.load());
+  int leftRightHeight = height(leftRight);
+  if (leftLeftHeight >= leftRightHeight) {
+    return rotateRightLocked(parent, node, left, rightHeight, leftLeftHeight,
+                             leftRight, leftRightHeight);
+  }
+
+  {
+    std::lock_guard<std::mutex> leftRightLock(leftRight->m_Mutex);
+    leftRightHeight = leftRight->m_Height.load();
+    if (leftLeftHeight >= leftRightHeight) {
+      return rotateRightLocked(parent, node, left, rightHeight,
+                               leftLeftHeight, leftRight, leftRightHeight);
+    }
+    int leftRightLeftHeight = height(leftRight->m_LeftChild.load());
+    int balance = leftLeftHeight - leftRightLeftHeight;
+    if (balance >= -1 && balance <= 1 &&
+        !((leftLeftHeight == 0 || leftRightLeftHeight == 0) &&
+          !left->m_Present.load())) {
+      return rotateRightOverLeftLocked(parent, node, left, rightHeight,
+                                       leftLeftHeight, leftRight,
+                                       leftRightLeftHeight);
+    }
+  }
+  return rebalanceToLeftLocked(node, left, leftRight, leftLeftHeight);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::NodeBase *
+ConcurrentAvlTree<TKey, Compare, Allocator>::rebalanceToLeftLocked(
+    NodeBase *parent, NodeBase *node, NodeBase *right, int leftHeight) {
+  std::lock_guard<std::mutex> rightLock(right->m_Mutex);
+  if (leftHeight - right->m_Height.load() >= -1) {
+    return node;
+  }
+  NodeBase *rightLeft = right->m_LeftChild.load();
+  int rightLeftHeight = height(rightLeft);
+  int rightRightHeight = height(right->m_RightChild.load());
+  if (rightRightHeight >= rightLeftHeight) {
+    return rotateLeftLocked(parent, node, leftHeight, right, rightLeft,
+                            rightLeftHeight, rightRightHeight);
+  }
+
+  {
+    std::lock_guard<std::mutex> rightLeftLock(rightLeft->m_Mutex);
+    rightLeftHeight = rightLeft->m_Height.load();
+    if (rightRightHeight >= rightLeftHeight) {
+      return rotateLeftLocked(parent, node, leftHeight, right, rightLeft,
+                              rightLeftHeight, rightRightHeight);
+    }
+    int rightLeftRightHeight = height(rightLeft->m_RightChild.load());
+    int balance = rightRightHeight - rightLeftRightHeight;
+    if (balance >= -1 && balance <= 1 &&
+        !((rightRightHeight == 0 || rightLeftRightHeight == 0) &&
+          !right->m_Present.load())) {
+      return rotateLeftOverRightLocked(parent, node, leftHeight, right,
+                                       rightLeft, rightRightHeight,
+                                       rightLeftRightHeight);
+    }
+  }
+  return rebalanceToRightLocked(node, right, rightLeft, rightRightHeight);
+}
+
+// The rotations mark the node that moves down as shrinking for their
+// duration. They return the node that may still need work, as fixHeightLocked
+// does.
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::NodeBase *
+ConcurrentAvlTree<TKey, Compare, Allocator>::rotateRightLocked(
+    NodeBase *parent, NodeBase *node, NodeBase *left, int rightHeight,
+    int leftLeftHeight, NodeBase *leftRight, int leftRightHeight) {
+  uint64_t version = node->m_Version.load();
+  NodeBase *parentLeft = parent->m_LeftChild.load();
+  node->m_Version.store(version | kShrinking);
+
+  node->m_LeftChild.store(leftRight);
+  if (leftRight != nullptr) {
+    leftRight->m_Parent.store(node);
+  }
+  left->m_RightChild.store(node);
+  node->m_Parent.store(left);
+  if (parentLeft == node) {
+    parent->m_LeftChild.store(left);
+  } else {
+    parent->m_RightChild.store(left);
+  }
+  left->m_Parent.store(parent);
+
+  int nodeHeight = 1 + std::max(leftRightHeight, rightHeight);
+  node->m_Height.store(nodeHeight);
+  left->m_Height.store(1 + std::max(leftLeftHeight, nodeHeight));
+  node->m_Version.store(version + kShrinkCount);
+
+  int nodeBalance = leftRightHeight - rightHeight;
+  if (nodeBalance < -1 || nodeBalance > 1) {
+    return node;
+  }
+  if ((leftRight == nullptr || rightHeight == 0) && !node->m_Present.load()) {
+    return node;
+  }
+  int leftBalance = leftLeftHeight - nodeHeight;
+  if (leftBalance < -1 || leftBalance > 1) {
+    return left;
+  }
+  if (leftLeftHeight == 0 && !left->m_Present.load()) {
+    return left;
+  }
+  return fixHeightLocked(parent);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::NodeBase *
+ConcurrentAvlTree<TKey, Compare, Allocator>::rotateLeftLocked(
+    NodeBase *parent, NodeBase *node, int leftHeight, NodeBase *right,
+    NodeBase *rightLeft, int rightLeftHeight, int rightRightHeight) {
+  uint64_t version = node->m_Version.load();
+  NodeBase *parentLeft = parent->m_LeftChild.load();
+  node->m_Version.store(version | kShrinking);
+
+  node->m_RightChild.store(rightLeft);
+  if (rightLeft != nullptr) {
+    rightLeft->m_Parent.store(node);
+  }
+  right->m_LeftChild.store(node);
+  node->m_Parent.store(right);
+  if (parentLeft == node) {
+    parent->m_LeftChild.store(right);
+  } else {
+    parent->m_RightChild.store(right);
+  }
+  right->m_Parent.store(parent);
+
+  int nodeHeight = 1 + std::max(leftHeight, rightLeftHeight);
+  node->m_Height.store(nodeHeight);
+  right->m_Height.store(1 + std::max(nodeHeight, rightRightHeight));
+  node->m_Version.store(version + kShrinkCount);
+
+  int nodeBalance = rightLeftHeight - leftHeight;
+  if (nodeBalance < -1 || nodeBalance > 1) {
+    return node;
+  }
+  if ((rightLeft == nullptr || leftHeight == 0) && !node->m_Present.load()) {
+    return node;
+  }
+  int rightBalance = rightRightHeight - nodeHeight;
+  if (rightBalance < -1 || rightBalance > 1) {
+    return right;
+  }
+  if (rightRightHeight == 0 && !right->m_Present.load()) {
+    return right;
+  }
+  return fixHeightLocked(parent);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::NodeBase *
+ConcurrentAvlTree<TKey, Compare, Allocator>::rotateRightOverLeftLocked(
+    NodeBase *parent, NodeBase *node, NodeBase *left, int rightHeight,
+    int leftLeftHeight, NodeBase *leftRight, int leftRightLeftHeight) {
+  uint64_t version = node->m_Version.load();
+  uint64_t leftVersion = left->m_Version.load();
+  NodeBase *parentLeft = parent->m_LeftChild.load();
+  NodeBase *leftRightLeft = leftRight->m_LeftChild.load();
+  NodeBase *leftRightRight = leftRight->m_RightChild.load();
+  int leftRightRightHeight = height(leftRightRight);
+  node->m_Version.store(version | kShrinking);
+  left->m_Version.store(leftVersion | kShrinking);
+
+  node->m_LeftChild.store(leftRightRight);
+  if (leftRightRight != nullptr) {
+    leftRightRight->m_Parent.store(node);
+  }
+  left->m_RightChild.store(leftRightLeft);
+  if (leftRightLeft != nullptr) {
+    leftRightLeft->m_Parent.store(left);
+  }
+  leftRight->m_LeftChild.store(left);
+  left->m_Parent.store(leftRight);
+  leftRight->m_RightChild.store(node);
+  node->m_Parent.store(leftRight);
+  if (parentLeft == node) {
+    parent->m_LeftChild.store(leftRight);
+  } else {
+    parent->m_RightChild.store(leftRight);
+  }
+  leftRight->m_Parent.store(parent);
+
+  int nodeHeight = 1 + std::max(leftRightRightHeight, rightHeight);
+  node->m_Height.store(nodeHeight);
+  int leftHeight = 1 + std::max(leftLeftHeight, leftRightLeftHeight);
+  left->m_Height.store(leftHeight);
+  leftRight->m_Height.store(1 + std::max(leftHeight, nodeHeight));
+  node->m_Version.store(version + kShrinkCount);
+  left->m_Version.store(leftVersion + kShrinkCount);
+
+  int nodeBalance = leftRightRightHeight - rightHeight;
+  if (nodeBalance < -1 || nodeBalance > 1) {
+    return node;
+  }
+  if ((leftRightRight == nullptr || rightHeight == 0) &&
+      !node->m_Present.load()) {
+    return node;
+  }
+  int leftRightBalance = leftHeight - nodeHeight;
+  if (leftRightBalance < -1 || leftRightBalance > 1) {
+    return leftRight;
+  }
+  return fixHeightLocked(parent);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename ConcurrentAvlTree<TKey, Compare, Allocator>::NodeBase *
+ConcurrentAvlTree<TKey, Compare, Allocator>::rotateLeftOverRightLocked(
+    NodeBase *parent, NodeBase *node, int leftHeight, NodeBase *right,
+    NodeBase *rightLeft, int rightRightHeight, int rightLeftRightHeight) {
+  uint64_t version = node->m_Version.load();
+  uint64_t rightVersion = right->m_Version.load();
+  NodeBase *parentLeft = parent->m_LeftChild.load();
+  NodeBase *rightLeftLeft = rightLeft->m_LeftChild.load();
+  NodeBase *rightLeftRight = rightLeft->m_RightChild.load();
+  int rightLeftLeftHeight = height(rightLeftLeft);
+  node->m_Version.store(version | kShrinking);
+  right->m_Version.store(rightVersion | kShrinking);
+
+  node->m_RightChild.store(rightLeftLeft);
+  if (rightLeftLeft != nullptr) {
+    rightLeftLeft->m_Parent.store(node);
+  }
+  right->m_LeftChild.store(rightLeftRight);
+  if (rightLeftRight != nullptr) {
+    rightLeftRight->m_Parent.store(right);
+  }
+  rightLeft->m_RightChild.store(right);
+  right->m_Parent.store(rightLeft);
+  rightLeft->m_LeftChild.store(node);
+  node->m_Parent.store(rightLeft);
+  if (parentLeft == node) {
+    parent->m_LeftChild.store(rightLeft);
+  } else {
+    parent->m_RightChild.store(rightLeft);
+  }
+  rightLeft->m_Parent.store(parent);
+
+  int nodeHeight = 1 + std::max(leftHeight, rightLeftLeftHeight);
+  node->m_Height.store(nodeHeight);
+  int rightHeight = 1 + std::max(rightLeftRightHeight, rightRightHeight);
+  right->m_Height.store(rightHeight);
+  rightLeft->m_Height.store(1 + std::max(nodeHeight, rightHeight));
+  node->m_Version.store(version + kShrinkCount);
+  right->m_Version.store(rightVersion + kShrinkCount);
+
+  int nodeBalance = rightLeftLeftHeight - leftHeight;
+  if (nodeBalance < -1 || nodeBalance > 1) {
+    return node;
+  }
+  if ((rightLeftLeft == nullptr || leftHeight == 0) &&
+      !node->m_Present.load()) {
+    return node;
+  }
+  int rightLeftBalance = rightHeight - nodeHeight;
+  if (rightLeftBalance < -1 || rightLeftBalance > 1) {
+    return rightLeft;
+  }
+  return fixHeightLocked(parent);
+}
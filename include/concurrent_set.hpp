@@ -0,0 +1,75 @@
+#pragma once
+
+#include "concurrent_avltree.hpp"
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <optional>
+#include <utility>
+
+// Ordered set that any number of threads can use at once without outside
+// locking, stored in a ConcurrentAvlTree. contains and lower_bound take no
+// locks and never wait for writers unless a rotation is in progress right on
+// their path; insert and erase lock a few nodes near the key, so writers to
+// different parts of the tree do not block each other.
+//
+// There are no iterators: an iterator could not stay valid while other
+// threads erase. insert and erase report whether they changed the set, and
+// lower_bound returns a copy of the key.
+template <typename T, typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class ConcurrentSet {
+public:
+  typedef ConcurrentAvlTree<T, Compare, Allocator> tree_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  ConcurrentSet() : m_Tree() {}
+  explicit ConcurrentSet(const Compare &comp,
+                         const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {}
+  explicit ConcurrentSet(const Allocator &alloc) : m_Tree(Compare(), alloc) {}
+  template <typename InputIterator>
+  ConcurrentSet(InputIterator first, InputIterator last,
+                const Compare &comp = Compare(),
+                const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {
+    for (; first != last; ++first) {
+      m_Tree.add(*first);
+    }
+  }
+  ConcurrentSet(std::initializer_list<T> initList,
+                const Compare &comp = Compare(),
+                const Allocator &alloc = Allocator())
+      : ConcurrentSet(initList.begin(), initList.end(), comp, alloc) {}
+
+  bool insert(const T &key) { return m_Tree.add(key); }
+  bool insert(T &&key) { return m_Tree.add(std::move(key)); }
+  bool erase(const T &key) { return m_Tree.remove(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool erase(const K &key) {
+    return m_Tree.remove(key);
+  }
+  bool contains(const T &key) const { return m_Tree.exists(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool contains(const K &key) const {
+    return m_Tree.exists(key);
+  }
+  // The smallest element not less than key, or nothing.
+  std::optional<T> lower_bound(const T &key) const {
+    return m_Tree.lowerBound(key);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  std::optional<T> lower_bound(const K &key) const {
+    return m_Tree.lowerBound(key);
+  }
+
+  key_compare key_comp() const { return m_Tree.key_comp(); }
+  allocator_type get_allocator() const { return m_Tree.get_allocator(); }
+
+private:
+  tree_type m_Tree;
+};
@@ -0,0 +1,751 @@
+#pragma once
+
+#include "page_cache.hpp"
+#include "simd_search.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename TTree> class DiskBTreeConstIterator;
+
+// Start of every tree page. Leaves are linked into a list in key order
+// through m_Next, free pages into the free list.
+struct DiskNodeHeader {
+  uint16_t m_Count;
+  uint8_t m_IsLeaf;
+  uint8_t m_Padding[5];
+  uint64_t m_Next;
+};
+
+// Page 0 of the file.
+struct DiskTreeMeta {
+  char m_Magic[8];
+  uint32_t m_Version;
+  uint32_t m_PageSize;
+  uint32_t m_KeySize;
+  uint32_t m_KeyAlign;
+  uint64_t m_Root;
+  uint64_t m_Size;
+  uint64_t m_PagesNum;
+  uint64_t m_FreePage;
+};
+
+// B+ tree of trivially copyable keys stored in the pages of a file and read
+// through a PageCache, for sets larger than memory. The layout and the
+// algorithms are those of BTree with page ids in place of pointers: a lookup
+// reads one page per level, and the pages near the root stay in the cache.
+//
+// Pages freed by merges are reused through a free list, the file never
+// shrinks except on clear. The tree is written to the file by flush and on
+// destruction and is opened again from there by the next DiskBTree on the
+// same path, which has to use the same TKey, Compare and PageSize.
+template <typename TKey, typename Compare = std::less<TKey>,
+          size_t PageSize = 4096>
+class DiskBTree {
+  static_assert(std::is_trivially_copyable<TKey>::value,
+                "DiskBTree: keys have to be trivially copyable");
+  static_assert(alignof(TKey) <= alignof(DiskNodeHeader),
+                "DiskBTree: keys are over-aligned");
+
+public:
+  static constexpr uint64_t kNoPage = PageCache::kNoPage;
+  static constexpr size_t kLeafSlots =
+      (PageSize - sizeof(DiskNodeHeader)) / sizeof(TKey);
+  // Children are 8-byte page ids after the keys, the slack covers padding.
+  static constexpr size_t kInnerSlots =
+      (PageSize - sizeof(DiskNodeHeader) - 2 * sizeof(uint64_t)) /
+      (sizeof(TKey) + sizeof(uint64_t));
+  static_assert(PageSize >= 512 && (PageSize & (PageSize - 1)) == 0,
+                "DiskBTree: PageSize has to be a power of two, at least 512");
+  static_assert(kInnerSlots >= 4, "DiskBTree: PageSize is too small");
+  static_assert(kLeafSlots < UINT16_MAX, "DiskBTree: PageSize is too big");
+
+  typedef DiskBTreeConstIterator<DiskBTree> const_iterator;
+  typedef TKey key_type;
+  typedef Compare key_compare;
+
+  // Opens the tree stored in path or creates an empty one if the file is
+  // missing or empty, with a cache of cacheBytes, at least
+  // PageCache::kMinFramesNum pages. Throws std::runtime_error if the file
+  // holds something else.
+  DiskBTree(const std::string &path, size_t cacheBytes,
+            const Compare &comp = Compare());
+  DiskBTree(const DiskBTree &) = delete;
+  DiskBTree &operator=(const DiskBTree &) = delete;
+  // Flushes the tree, errors are ignored: call flush to see them.
+  ~DiskBTree();
+
+  void add(const TKey &key);
+  template <typename K> bool exists(const K &) const;
+  template <typename K> void remove(const K &);
+  void clear();
+  template <typename InputIterator>
+  void assignSorted(InputIterator first, InputIterator last);
+  void flush();
+  size_t size() const { return m_Size; }
+  key_compare key_comp() const { return m_Compare; }
+  const PageCache &cache() const { return m_Cache; }
+
+  const_iterator begin() const;
+  const_iterator end() const { return const_iterator(); }
+  template <typename K> const_iterator find(const K &) const;
+  template <typename K> const_iterator lower_bound(const K &) const;
+  template <typename K> const_iterator upper_bound(const K &) const;
+
+private:
+  friend class DiskBTreeConstIterator<DiskBTree>;
+
+  static constexpr uint32_t kVersion = 1;
+  static constexpr char kMagic[8] = {'S', 'E', 'T', 'D', 'I', 'S', 'K', '\0'};
+  static constexpr size_t kMinLeafKeys = kLeafSlots / 2;
+  static constexpr size_t kMinInnerKeys = kInnerSlots / 2;
+  static constexpr size_t kChildrenOffset =
+      (sizeof(DiskNodeHeader) + kInnerSlots * sizeof(TKey) + 7) / 8 * 8;
+  static_assert(kChildrenOffset + (kInnerSlots + 1) * sizeof(uint64_t) <=
+                    PageSize,
+                "DiskBTree: inner node does not fit into a page");
+  static constexpr size_t kLinearSearchKeys = 32;
+  // Leaves read ahead by a scan that finds them in consecutive pages.
+  static constexpr size_t kReadAheadPages = 64;
+
+  // The cache changes on lookups too.
+  mutable PageCache m_Cache;
+  uint64_t m_Root;
+  size_t m_Size;
+  uint64_t m_PagesNum;
+  uint64_t m_FreePage;
+  Compare m_Compare;
+
+  static DiskNodeHeader *header(const PageRef &page) {
+    return reinterpret_cast<DiskNodeHeader *>(page.data());
+  }
+  static TKey *keys(const PageRef &page) {
+    return reinterpret_cast<TKey *>(page.data() + sizeof(DiskNodeHeader));
+  }
+  static uint64_t *children(const PageRef &page) {
+    return reinterpret_cast<uint64_t *>(page.data() + kChildrenOffset);
+  }
+  // Pages hold hundreds of keys: a binary search narrows them down to a few
+  // cache lines, which simd_search::lowerBound finishes.
+  template <typename K>
+  size_t searchNode(const PageRef &page, const K &key) const {
+    const TKey *nodeKeys = keys(page);
+    size_t first = 0;
+    size_t count = header(page)->m_Count;
+    while (count > kLinearSearchKeys) {
+      size_t half = count / 2;
+      if (m_Compare(nodeKeys[first + half], key)) {
+        first += half + 1;
+        count -= half + 1;
+      } else {
+        count = half;
+      }
+    }
+    return first + simd_search::lowerBound(nodeKeys + first, count, key,
+                                           m_Compare);
+  }
+
+  void writeMeta();
+  PageRef createPage(bool isLeaf);
+  void freePage(PageRef &page);
+  PageRef pinNextLeaf(const PageRef &leaf) const;
+  uint64_t insert(uint64_t pageId, const TKey &key,
+                  std::optional<TKey> &separator, bool &inserted);
+  template <typename K> bool remove(uint64_t pageId, const K &key);
+  void fixUnderflow(const PageRef &node, size_t pos);
+  void borrowFromLeft(const PageRef &node, size_t pos);
+  void borrowFromRight(const PageRef &node, size_t pos);
+  void merge(const PageRef &node, size_t pos);
+  template <typename K> std::pair<PageRef, size_t> findLeaf(const K &) const;
+  const_iterator makeIterator(PageRef leaf, size_t pos) const;
+
+  template <typename T>
+  static void insertAt(T *items, size_t count, size_t pos, const T &item) {
+    std::memmove(items + pos + 1, items + pos, (count - pos) * sizeof(T));
+    std::memcpy(items + pos, &item, sizeof(T));
+  }
+  template <typename T>
+  static void eraseAt(T *items, size_t count, size_t pos) {
+    std::memmove(items + pos, items + pos + 1, (count - pos - 1) * sizeof(T));
+  }
+};
+
+template <typename TKey, typename Compare, size_t PageSize>
+DiskBTree<TKey, Compare, PageSize>::DiskBTree(const std::string &path,
+                                              size_t cacheBytes,
+                                              const Compare &comp)
+    : m_Cache(path, PageSize, cacheBytes / PageSize), m_Root(kNoPage),
+      m_Size(0), m_PagesNum(1), m_FreePage(kNoPage), m_Compare(comp) {
+  if (m_Cache.openedFileBytes() == 0) {
+    writeMeta();
+    return;
+  }
+  if (m_Cache.filePagesNum() == 0) {
+    throw std::runtime_error("DiskBTree: " + path + " is not a disk tree");
+  }
+  DiskTreeMeta meta;
+  std::memcpy(&meta, m_Cache.pin(0).data(), sizeof(meta));
+  if (std::memcmp(meta.m_Magic, kMagic, sizeof(kMagic)) != 0 ||
+      meta.m_Version != kVersion) {
+    throw std::runtime_error("DiskBTree: " + path + " is not a disk tree");
+  }
+  if (meta.m_PageSize != PageSize || meta.m_KeySize != sizeof(TKey) ||
+      meta.m_KeyAlign != alignof(TKey)) {
+    throw std::runtime_error("DiskBTree: " + path +
+                             " has a different key type or page size");
+  }
+  m_Root = meta.m_Root;
+  m_Size = meta.m_Size;
+  m_PagesNum = meta.m_PagesNum;
+  m_FreePage = meta.m_FreePage;
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+DiskBTree<TKey, Compare, PageSize>::~DiskBTree() {
+  try {
+    writeMeta();
+  } catch (...) {
+  }
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+void DiskBTree<TKey, Compare, PageSize>::flush() {
+  writeMeta();
+  m_Cache.flush();
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+void DiskBTree<TKey, Compare, PageSize>::writeMeta() {
+  DiskTreeMeta meta;
+  std::memcpy(meta.m_Magic, kMagic, sizeof(kMagic));
+  meta.m_Version = kVersion;
+  meta.m_PageSize = PageSize;
+  meta.m_KeySize = sizeof(TKey);
+  meta.m_KeyAlign = alignof(TKey);
+  meta.m_Root = m_Root;
+  meta.m_Size = m_Size;
+  meta.m_PagesNum = m_PagesNum;
+  meta.m_FreePage = m_FreePage;
+  PageRef page = m_Cache.pinNew(0);
+  std::memcpy(page.data(), &meta, sizeof(meta));
+}
+
+// Takes a page from the free list, or a new one at the end of the file.
+template <typename TKey, typename Compare, size_t PageSize>
+PageRef DiskBTree<TKey, Compare, PageSize>::createPage(bool isLeaf) {
+  uint64_t pageId = m_FreePage;
+  uint64_t nextFree = kNoPage;
+  if (pageId != kNoPage) {
+    nextFree = header(m_Cache.pin(pageId))->m_Next;
+  } else {
+    pageId = m_PagesNum;
+  }
+  PageRef page = m_Cache.pinNew(pageId);
+  if (pageId == m_PagesNum) {
+    ++m_PagesNum;
+  } else {
+    m_FreePage = nextFree;
+  }
+  header(page)->m_IsLeaf = isLeaf;
+  header(page)->m_Next = kNoPage;
+  return page;
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+void DiskBTree<TKey, Compare, PageSize>::freePage(PageRef &page) {
+  header(page)->m_Count = 0;
+  header(page)->m_Next = m_FreePage;
+  page.markDirty();
+  m_FreePage = page.id();
+  page.reset();
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+void DiskBTree<TKey, Compare, PageSize>::clear() {
+  m_Cache.truncate(1);
+  m_Root = kNoPage;
+  m_Size = 0;
+  m_PagesNum = 1;
+  m_FreePage = kNoPage;
+  writeMeta();
+}
+
+// The next leaf of a scan. Leaves written in order, by assignSorted or by
+// inserts of growing keys, lie in consecutive pages, and a scan over them
+// reads them kReadAheadPages at a time.
+template <typename TKey, typename Compare, size_t PageSize>
+PageRef
+DiskBTree<TKey, Compare, PageSize>::pinNextLeaf(const PageRef &leaf) const {
+  uint64_t next = header(leaf)->m_Next;
+  if (next == kNoPage) {
+    return PageRef();
+  }
+  if (next == leaf.id() + 1 && !m_Cache.contains(next)) {
+    m_Cache.prefetch(next, kReadAheadPages);
+  }
+  return m_Cache.pin(next);
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+void DiskBTree<TKey, Compare, PageSize>::add(const TKey &key) {
+  if (m_Root == kNoPage) {
+    m_Root = createPage(true).id();
+  }
+  std::optional<TKey> separator;
+  bool inserted = false;
+  uint64_t right = insert(m_Root, key, separator, inserted);
+  if (right != kNoPage) {
+    PageRef root = createPage(false);
+    keys(root)[0] = *separator;
+    header(root)->m_Count = 1;
+    children(root)[0] = m_Root;
+    children(root)[1] = right;
+    m_Root = root.id();
+  }
+  if (inserted) {
+    ++m_Size;
+  }
+}
+
+// Same as BTree::insert: returns the id of the new right half of a split
+// node, or kNoPage.
+template <typename TKey, typename Compare, size_t PageSize>
+uint64_t DiskBTree<TKey, Compare, PageSize>::insert(
+    uint64_t pageId, const TKey &key, std::optional<TKey> &separator,
+    bool &inserted) {
+  PageRef node = m_Cache.pin(pageId);
+  size_t pos = searchNode(node, key);
+  size_t count = header(node)->m_Count;
+  if (header(node)->m_IsLeaf) {
+    if (pos < count && !m_Compare(key, keys(node)[pos])) {
+      return kNoPage;
+    }
+    inserted = true;
+    node.markDirty();
+    if (count < kLeafSlots) {
+      insertAt(keys(node), header(node)->m_Count++, pos, key);
+      return kNoPage;
+    }
+
+    PageRef right = createPage(true);
+    size_t half = count / 2;
+    std::memcpy(keys(right), keys(node) + half, (count - half) * sizeof(TKey));
+    header(right)->m_Count = count - half;
+    header(node)->m_Count = half;
+    header(right)->m_Next = header(node)->m_Next;
+    header(node)->m_Next = right.id();
+    if (pos <= half) {
+      insertAt(keys(node), header(node)->m_Count++, pos, key);
+    } else {
+      insertAt(keys(right), header(right)->m_Count++, pos - half, key);
+    }
+    separator.emplace(keys(node)[header(node)->m_Count - 1]);
+    return right.id();
+  }
+
+  uint64_t child = insert(children(node)[pos], key, separator, inserted);
+  if (child == kNoPage) {
+    return kNoPage;
+  }
+  node.markDirty();
+  if (count < kInnerSlots) {
+    insertAt(keys(node), count, pos, *separator);
+    insertAt(children(node), count + 1, pos + 1, child);
+    ++header(node)->m_Count;
+    return kNoPage;
+  }
+
+  // Keys [0, half) stay, key half moves up, keys (half, count) go right.
+  PageRef right = createPage(false);
+  size_t half = count / 2;
+  std::memcpy(keys(right), keys(node) + half + 1,
+              (count - half - 1) * sizeof(TKey));
+  std::memcpy(children(right), children(node) + half + 1,
+              (count - half) * sizeof(uint64_t));
+  header(right)->m_Count = count - half - 1;
+  TKey middle = keys(node)[half];
+  header(node)->m_Count = half;
+
+  const PageRef &target = pos > half ? right : node;
+  if (pos > half) {
+    pos -= half + 1;
+  }
+  insertAt(keys(target), header(target)->m_Count, pos, *separator);
+  insertAt(children(target), header(target)->m_Count + 1, pos + 1, child);
+  ++header(target)->m_Count;
+  separator.emplace(middle);
+  return right.id();
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+template <typename K>
+void DiskBTree<TKey, Compare, PageSize>::remove(const K &key) {
+  if (m_Root == kNoPage || !remove(m_Root, key)) {
+    return;
+  }
+  --m_Size;
+  PageRef root = m_Cache.pin(m_Root);
+  if (header(root)->m_Count > 0) {
+    return;
+  }
+  m_Root = header(root)->m_IsLeaf ? kNoPage : children(root)[0];
+  freePage(root);
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+template <typename K>
+bool DiskBTree<TKey, Compare, PageSize>::remove(uint64_t pageId,
+                                                const K &key) {
+  PageRef node = m_Cache.pin(pageId);
+  size_t pos = searchNode(node, key);
+  if (header(node)->m_IsLeaf) {
+    if (pos == header(node)->m_Count || m_Compare(key, keys(node)[pos])) {
+      return false;
+    }
+    node.markDirty();
+    eraseAt(keys(node), header(node)->m_Count--, pos);
+    return true;
+  }
+
+  if (!remove(children(node)[pos], key)) {
+    return false;
+  }
+  PageRef child = m_Cache.pin(children(node)[pos]);
+  if (header(child)->m_Count <
+      (header(child)->m_IsLeaf ? kMinLeafKeys : kMinInnerKeys)) {
+    child.reset();
+    fixUnderflow(node, pos);
+  }
+  return true;
+}
+
+// Same as BTree::fixUnderflow.
+template <typename TKey, typename Compare, size_t PageSize>
+void DiskBTree<TKey, Compare, PageSize>::fixUnderflow(const PageRef &node,
+                                                      size_t pos) {
+  node.markDirty();
+  size_t minKeys = header(m_Cache.pin(children(node)[pos]))->m_IsLeaf
+                       ? kMinLeafKeys
+                       : kMinInnerKeys;
+  if (pos > 0 &&
+      header(m_Cache.pin(children(node)[pos - 1]))->m_Count > minKeys) {
+    borrowFromLeft(node, pos);
+  } else if (pos < header(node)->m_Count &&
+             header(m_Cache.pin(children(node)[pos + 1]))->m_Count >
+                 minKeys) {
+    borrowFromRight(node, pos);
+  } else if (pos > 0) {
+    merge(node, pos - 1);
+  } else {
+    merge(node, pos);
+  }
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+void DiskBTree<TKey, Compare, PageSize>::borrowFromLeft(const PageRef &node,
+                                                        size_t pos) {
+  TKey &separator = keys(node)[pos - 1];
+  PageRef left = m_Cache.pin(children(node)[pos - 1]);
+  PageRef child = m_Cache.pin(children(node)[pos]);
+  left.markDirty();
+  child.markDirty();
+  DiskNodeHeader *leftHeader = header(left);
+  DiskNodeHeader *childHeader = header(child);
+  if (childHeader->m_IsLeaf) {
+    insertAt(keys(child), childHeader->m_Count++, 0,
+             keys(left)[--leftHeader->m_Count]);
+    separator = keys(left)[leftHeader->m_Count - 1];
+    return;
+  }
+  insertAt(keys(child), childHeader->m_Count, 0, separator);
+  insertAt(children(child), childHeader->m_Count + 1, 0,
+           children(left)[leftHeader->m_Count]);
+  ++childHeader->m_Count;
+  separator = keys(left)[--leftHeader->m_Count];
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+void DiskBTree<TKey, Compare, PageSize>::borrowFromRight(const PageRef &node,
+                                                         size_t pos) {
+  TKey &separator = keys(node)[pos];
+  PageRef child = m_Cache.pin(children(node)[pos]);
+  PageRef right = m_Cache.pin(children(node)[pos + 1]);
+  child.markDirty();
+  right.markDirty();
+  DiskNodeHeader *childHeader = header(child);
+  DiskNodeHeader *rightHeader = header(right);
+  if (childHeader->m_IsLeaf) {
+    keys(child)[childHeader->m_Count++] = keys(right)[0];
+    eraseAt(keys(right), rightHeader->m_Count--, 0);
+    separator = keys(child)[childHeader->m_Count - 1];
+    return;
+  }
+  keys(child)[childHeader->m_Count] = separator;
+  children(child)[++childHeader->m_Count] = children(right)[0];
+  separator = keys(right)[0];
+  eraseAt(keys(right), rightHeader->m_Count, 0);
+  eraseAt(children(right), rightHeader->m_Count + 1, 0);
+  --rightHeader->m_Count;
+}
+
+// Merges child pos + 1 of node into child pos.
+template <typename TKey, typename Compare, size_t PageSize>
+void DiskBTree<TKey, Compare, PageSize>::merge(const PageRef &node,
+                                               size_t pos) {
+  PageRef left = m_Cache.pin(children(node)[pos]);
+  PageRef right = m_Cache.pin(children(node)[pos + 1]);
+  left.markDirty();
+  DiskNodeHeader *leftHeader = header(left);
+  DiskNodeHeader *rightHeader = header(right);
+  if (leftHeader->m_IsLeaf) {
+    std::memcpy(keys(left) + leftHeader->m_Count, keys(right),
+                rightHeader->m_Count * sizeof(TKey));
+    leftHeader->m_Count += rightHeader->m_Count;
+    leftHeader->m_Next = rightHeader->m_Next;
+  } else {
+    keys(left)[leftHeader->m_Count] = keys(node)[pos];
+    std::memcpy(keys(left) + leftHeader->m_Count + 1, keys(right),
+                rightHeader->m_Count * sizeof(TKey));
+    std::memcpy(children(left) + leftHeader->m_Count + 1, children(right),
+                (rightHeader->m_Count + 1) * sizeof(uint64_t));
+    leftHeader->m_Count += rightHeader->m_Count + 1;
+  }
+  freePage(right);
+  size_t count = header(node)->m_Count;
+  eraseAt(keys(node), count, pos);
+  eraseAt(children(node), count + 1, pos + 1);
+  --header(node)->m_Count;
+}
+
+// Replaces the contents with the keys of the sorted range [first, last) in
+// linear time, writing the leaves into consecutive pages so that scans read
+// them sequentially. Only two pages are pinned at a time, and only the page
+// ids of a level are kept in memory. Equal keys are skipped, unsorted input
+// results in an empty tree and std::invalid_argument.
+template <typename TKey, typename Compare, size_t PageSize>
+template <typename InputIterator>
+void DiskBTree<TKey, Compare, PageSize>::assignSorted(InputIterator first,
+                                                      InputIterator last) {
+  clear();
+  if (first == last) {
+    return;
+  }
+  // Page ids of a level with the greatest key of each page.
+  std::vector<std::pair<uint64_t, TKey>> level;
+  PageRef prev;
+  PageRef leaf = createPage(true);
+  for (; first != last; ++first) {
+    const TKey &key = *first;
+    DiskNodeHeader *leafHeader = header(leaf);
+    if (leafHeader->m_Count == 0 && !prev) {
+      keys(leaf)[leafHeader->m_Count++] = key;
+      ++m_Size;
+      continue;
+    }
+    const TKey &lastKey = leafHeader->m_Count > 0
+                              ? keys(leaf)[leafHeader->m_Count - 1]
+                              : keys(prev)[header(prev)->m_Count - 1];
+    if (m_Compare(key, lastKey)) {
+      leaf.reset();
+      prev.reset();
+      clear();
+      throw std::invalid_argument(
+          "DiskBTree::assignSorted: input is not sorted");
+    }
+    if (!m_Compare(lastKey, key)) {
+      continue;
+    }
+    if (leafHeader->m_Count == kLeafSlots) {
+      level.emplace_back(leaf.id(), keys(leaf)[kLeafSlots - 1]);
+      prev = std::move(leaf);
+      leaf = createPage(true);
+      header(prev)->m_Next = leaf.id();
+      leafHeader = header(leaf);
+    }
+    keys(leaf)[leafHeader->m_Count++] = key;
+    ++m_Size;
+  }
+  // The last leaf takes keys from the one before it if it has too few.
+  if (prev && header(leaf)->m_Count < kMinLeafKeys) {
+    size_t total = header(prev)->m_Count + header(leaf)->m_Count;
+    size_t moved = header(prev)->m_Count - total / 2;
+    std::memmove(keys(leaf) + moved, keys(leaf),
+                 header(leaf)->m_Count * sizeof(TKey));
+    std::memcpy(keys(leaf), keys(prev) + total / 2, moved * sizeof(TKey));
+    header(prev)->m_Count = total / 2;
+    header(leaf)->m_Count += moved;
+    level.back().second = keys(prev)[total / 2 - 1];
+  }
+  level.emplace_back(leaf.id(), keys(leaf)[header(leaf)->m_Count - 1]);
+  prev.reset();
+  leaf.reset();
+
+  // Every upper level spreads the pages below evenly over the fewest inner
+  // nodes that can hold them.
+  while (level.size() > 1) {
+    size_t nodesNum = (level.size() + kInnerSlots) / (kInnerSlots + 1);
+    std::vector<std::pair<uint64_t, TKey>> upper;
+    upper.reserve(nodesNum);
+    size_t begin = 0;
+    for (size_t i = 0; i < nodesNum; ++i) {
+      size_t end = level.size() * (i + 1) / nodesNum;
+      PageRef inner = createPage(false);
+      for (size_t j = begin; j < end; ++j) {
+        children(inner)[j - begin] = level[j].first;
+        if (j + 1 < end) {
+          keys(inner)[j - begin] = level[j].second;
+        }
+      }
+      header(inner)->m_Count = end - begin - 1;
+      upper.emplace_back(inner.id(), level[end - 1].second);
+      begin = end;
+    }
+    level = std::move(upper);
+  }
+  m_Root = level[0].first;
+}
+
+// Returns the leaf where key would be and the position of its lower bound in
+// it, which may be the end of the leaf.
+template <typename TKey, typename Compare, size_t PageSize>
+template <typename K>
+std::pair<PageRef, size_t>
+DiskBTree<TKey, Compare, PageSize>::findLeaf(const K &key) const {
+  PageRef node = m_Cache.pin(m_Root);
+  while (!header(node)->m_IsLeaf) {
+    node = m_Cache.pin(children(node)[searchNode(node, key)]);
+  }
+  size_t pos = searchNode(node, key);
+  return {std::move(node), pos};
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+typename DiskBTree<TKey, Compare, PageSize>::const_iterator
+DiskBTree<TKey, Compare, PageSize>::makeIterator(PageRef leaf,
+                                                 size_t pos) const {
+  if (pos == header(leaf)->m_Count) {
+    leaf = pinNextLeaf(leaf);
+    pos = 0;
+  }
+  return leaf ? const_iterator(this, std::move(leaf), pos) : end();
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+template <typename K>
+bool DiskBTree<TKey, Compare, PageSize>::exists(const K &key) const {
+  if (m_Root == kNoPage) {
+    return false;
+  }
+  auto [leaf, pos] = findLeaf(key);
+  return pos < header(leaf)->m_Count && !m_Compare(key, keys(leaf)[pos]);
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+typename DiskBTree<TKey, Compare, PageSize>::const_iterator
+DiskBTree<TKey, Compare, PageSize>::begin() const {
+  if (m_Root == kNoPage) {
+    return end();
+  }
+  PageRef node = m_Cache.pin(m_Root);
+  while (!header(node)->m_IsLeaf) {
+    node = m_Cache.pin(children(node)[0]);
+  }
+  return const_iterator(this, std::move(node), 0);
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+template <typename K>
+typename DiskBTree<TKey, Compare, PageSize>::const_iterator
+DiskBTree<TKey, Compare, PageSize>::find(const K &key) const {
+  if (m_Root == kNoPage) {
+    return end();
+  }
+  auto [leaf, pos] = findLeaf(key);
+  if (pos == header(leaf)->m_Count || m_Compare(key, keys(leaf)[pos])) {
+    return end();
+  }
+  return const_iterator(this, std::move(leaf), pos);
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+template <typename K>
+typename DiskBTree<TKey, Compare, PageSize>::const_iterator
+DiskBTree<TKey, Compare, PageSize>::lower_bound(const K &key) const {
+  if (m_Root == kNoPage) {
+    return end();
+  }
+  auto [leaf, pos] = findLeaf(key);
+  return makeIterator(std::move(leaf), pos);
+}
+
+template <typename TKey, typename Compare, size_t PageSize>
+template <typename K>
+typename DiskBTree<TKey, Compare, PageSize>::const_iterator
+DiskBTree<TKey, Compare, PageSize>::upper_bound(const K &key) const {
+  if (m_Root == kNoPage) {
+    return end();
+  }
+  auto [leaf, pos] = findLeaf(key);
+  if (pos < header(leaf)->m_Count && !m_Compare(key, keys(leaf)[pos])) {
+    ++pos;
+  }
+  return makeIterator(std::move(leaf), pos);
+}
+
+// Forward iterator over the list of leaves. It pins the leaf it points into,
+// so a key it refers to stays in memory as long as the iterator lives; each
+// iterator takes a frame of the cache while it is not at end().
+template <typename TTree> class DiskBTreeConstIterator {
+public:
+  typedef typename TTree::key_type T;
+  typedef std::ptrdiff_t difference_type;
+  typedef T value_type;
+  typedef const T &reference;
+  typedef const T &const_reference;
+  typedef const T *pointer;
+  typedef const T *const_pointer;
+  typedef std::forward_iterator_tag iterator_category;
+
+  DiskBTreeConstIterator() : m_Tree(nullptr), m_Index(0) {}
+  const T &operator*() const { return TTree::keys(m_Leaf)[m_Index]; }
+  const T *operator->() const { return TTree::keys(m_Leaf) + m_Index; }
+
+  DiskBTreeConstIterator &operator++() {
+    if (++m_Index == TTree::header(m_Leaf)->m_Count) {
+      m_Leaf = m_Tree->pinNextLeaf(m_Leaf);
+      m_Index = 0;
+    }
+    return *this;
+  }
+  DiskBTreeConstIterator operator++(int) {
+    auto res = *this;
+    ++*this;
+    return res;
+  }
+
+  bool operator==(const DiskBTreeConstIterator &other) const {
+    return m_Leaf.id() == other.m_Leaf.id() && m_Index == other.m_Index;
+  }
+  bool operator!=(const DiskBTreeConstIterator &other) const {
+    return !(*this == other);
+  }
+
+  template <typename, typename, size_t> friend class DiskBTree;
+
+private:
+  DiskBTreeConstIterator(const TTree *tree, PageRef leaf, size_t index)
+      : m_Tree(tree), m_Leaf(std::move(leaf)), m_Index(index) {}
+
+  const TTree *m_Tree;
+  PageRef m_Leaf;
+  size_t m_Index;
+};
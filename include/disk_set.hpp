@@ -0,0 +1,120 @@
+#pragma once
+
+#include "disk_btree.hpp"
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+// Ordered set of trivially copyable keys kept in a file, for sets larger than
+// memory. Keys are stored in a DiskBTree of PageSize-byte pages, and at most
+// cacheBytes of them (at least PageCache::kMinFramesNum pages) are held in
+// memory, evicted in CLOCK order. The interface is the common part of Set and
+// BTreeSet with forward iterators, so code can switch with a typedef.
+//
+// The set is stored in the file by flush and on destruction and a DiskSet
+// opened on the same path later continues from there. Iterators pin a page
+// each and are invalidated by any change of the set; clear and assign_sorted
+// throw std::runtime_error while an iterator that is not end() exists. Not
+// thread-safe, lookups included. POSIX only.
+template <typename T, typename Compare = std::less<T>, size_t PageSize = 4096>
+class DiskSet {
+public:
+  typedef DiskBTree<T, Compare, PageSize> tree_type;
+  typedef typename tree_type::const_iterator const_iterator;
+  typedef const_iterator iterator;
+  typedef std::ptrdiff_t difference_type;
+  typedef Compare key_compare;
+
+  static constexpr size_t kDefaultCacheBytes = 64 << 20;
+
+  explicit DiskSet(const std::string &path,
+                   size_t cacheBytes = kDefaultCacheBytes,
+                   const Compare &comp = Compare())
+      : m_Tree(new tree_type(path, cacheBytes, comp)) {}
+  DiskSet(const DiskSet &) = delete;
+  DiskSet(DiskSet &&other) noexcept = default;
+  DiskSet &operator=(const DiskSet &) = delete;
+  DiskSet &operator=(DiskSet &&other) noexcept = default;
+
+  const_iterator begin() const { return m_Tree->begin(); }
+  const_iterator end() const { return m_Tree->end(); }
+  const_iterator find(const T &key) const { return m_Tree->find(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator find(const K &key) const {
+    return m_Tree->find(key);
+  }
+  const_iterator lower_bound(const T &key) const {
+    return m_Tree->lower_bound(key);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator lower_bound(const K &key) const {
+    return m_Tree->lower_bound(key);
+  }
+  const_iterator upper_bound(const T &key) const {
+    return m_Tree->upper_bound(key);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator upper_bound(const K &key) const {
+    return m_Tree->upper_bound(key);
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const T &key) const {
+    return {lower_bound(key), upper_bound(key)};
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K &key) const {
+    return {lower_bound(key), upper_bound(key)};
+  }
+  bool contains(const T &key) const { return m_Tree->exists(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool contains(const K &key) const {
+    return m_Tree->exists(key);
+  }
+
+  void insert(const T &key) { m_Tree->add(key); }
+  template <typename InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first) {
+      m_Tree->add(*first);
+    }
+  }
+  void erase(const T &key) { m_Tree->remove(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  void erase(const K &key) {
+    m_Tree->remove(key);
+  }
+  void clear() { m_Tree->clear(); }
+  // Replaces the contents with the elements of the sorted range [first,
+  // last) in linear time, laying the leaves out for sequential scans. Equal
+  // elements are allowed, unsorted input leaves the set empty and throws
+  // std::invalid_argument.
+  template <typename InputIterator>
+  void assign_sorted(InputIterator first, InputIterator last) {
+    m_Tree->assignSorted(first, last);
+  }
+  // Writes the changed pages and the tree root to the file.
+  void flush() { m_Tree->flush(); }
+
+  size_t size() const { return m_Tree->size(); }
+  bool empty() const { return m_Tree->size() == 0; }
+  key_compare key_comp() const { return m_Tree->key_comp(); }
+  const PageCache &page_cache() const { return m_Tree->cache(); }
+  void swap(DiskSet &other) noexcept { m_Tree.swap(other.m_Tree); }
+
+private:
+  // On the heap, so that moves keep iterators and the cache in place.
+  std::unique_ptr<tree_type> m_Tree;
+};
+
+template <typename T, typename Compare, size_t PageSize>
+void swap(DiskSet<T, Compare, PageSize> &lhs,
+          DiskSet<T, Compare, PageSize> &rhs) noexcept {
+  lhs.swap(rhs);
+}
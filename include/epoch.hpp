@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Epoch-based reclamation for the concurrent containers. A thread that reads
+// shared nodes pins itself with a Guard for the duration of the operation,
+// which costs a thread-local store and a fence, no read-modify-write. A writer
+// that unlinked a node retires it to a RetireList, tagged with the global
+// epoch, and the node is released once every thread pinned at that epoch or
+// earlier has left its critical section.
+namespace epoch {
+
+class Domain {
+public:
+  static constexpr uint64_t kInactive = UINT64_MAX;
+
+  // One domain serves every container in the process, so threads register
+  // once and containers do not need per-thread state of their own.
+  static Domain &instance() {
+    static Domain domain;
+    return domain;
+  }
+
+  void pin() {
+    Record &record = localRecord();
+    if (record.m_Depth++ == 0) {
+      record.m_Pinned.store(m_Epoch.load(std::memory_order_relaxed),
+                            std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+  void unpin() {
+    Record &record = localRecord();
+    if (--record.m_Depth == 0) {
+      record.m_Pinned.store(kInactive, std::memory_order_release);
+    }
+  }
+
+  // Called after a node has been unlinked. Returns the epoch to tag it with:
+  // threads pinned later than that can no longer reach the node.
+  uint64_t retireEpoch() { return m_Epoch.fetch_add(1); }
+  // Nodes tagged with an epoch less than the returned one can be released.
+  uint64_t safeEpoch() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t res = m_Epoch.load();
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (const Record *record : m_Records) {
+      res = std::min(res, record->m_Pinned.load(std::memory_order_acquire));
+    }
+    return res;
+  }
+
+private:
+  struct alignas(64) Record {
+    std::atomic<uint64_t> m_Pinned{kInactive};
+    unsigned m_Depth = 0;
+  };
+
+  // Registers the thread on its first pin and unregisters it on exit.
+  class Registration {
+  public:
+    explicit Registration(Domain &domain) : m_Domain(domain) {
+      std::lock_guard<std::mutex> lock(m_Domain.m_Mutex);
+      m_Domain.m_Records.push_back(&m_Record);
+    }
+    ~Registration() {
+      std::lock_guard<std::mutex> lock(m_Domain.m_Mutex);
+      auto &records = m_Domain.m_Records;
+      records.erase(std::find(records.begin(), records.end(), &m_Record));
+    }
+    Registration(const Registration &) = delete;
+    Registration &operator=(const Registration &) = delete;
+
+    Record m_Record;
+
+  private:
+    Domain &m_Domain;
+  };
+
+  Domain() = default;
+  Record &localRecord() {
+    static thread_local Registration registration(*this);
+    return registration.m_Record;
+  }
+
+  std::atomic<uint64_t> m_Epoch{1};
+  std::mutex m_Mutex;
+  std::vector<const Record *> m_Records;
+};
+
+// Pins the current thread for its lifetime. Guards nest.
+class Guard {
+public:
+  Guard() { Domain::instance().pin(); }
+  ~Guard() { Domain::instance().unpin(); }
+  Guard(const Guard &) = delete;
+  Guard &operator=(const Guard &) = delete;
+};
+
+// Unlinked nodes waiting until no reader can reach them. Safe to use from
+// several writers at once.
+template <typename TNode> class RetireList {
+public:
+  RetireList() = default;
+  RetireList(const RetireList &) = delete;
+  RetireList &operator=(const RetireList &) = delete;
+
+  void retire(TNode *node) {
+    uint64_t epoch = Domain::instance().retireEpoch();
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Nodes.emplace_back(epoch, node);
+    m_Size.store(m_Nodes.size(), std::memory_order_relaxed);
+  }
+  // Retires nodes unlinked together under a single epoch.
+  template <typename InputIterator>
+  void retire(InputIterator first, InputIterator last) {
+    if (first == last) {
+      return;
+    }
+    uint64_t epoch = Domain::instance().retireEpoch();
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (; first != last; ++first) {
+      m_Nodes.emplace_back(epoch, *first);
+    }
+    m_Size.store(m_Nodes.size(), std::memory_order_relaxed);
+  }
+
+  // Once at least threshold nodes are waiting, passes the ones no reader can
+  // reach any more to release.
+  template <typename Release> void collect(size_t threshold, Release release) {
+    if (m_Size.load(std::memory_order_relaxed) < threshold) {
+      return;
+    }
+    uint64_t safe = Domain::instance().safeEpoch();
+    std::vector<TNode *> released;
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      auto kept = std::partition(
+          m_Nodes.begin(), m_Nodes.end(),
+          [safe](const std::pair<uint64_t, TNode *> &retired) {
+            return retired.first >= safe;
+          });
+      for (auto it = kept; it != m_Nodes.end(); ++it) {
+        released.push_back(it->second);
+      }
+      m_Nodes.erase(kept, m_Nodes.end());
+      m_Size.store(m_Nodes.size(), std::memory_order_relaxed);
+    }
+    for (TNode *node : released) {
+      release(node);
+    }
+  }
+
+  // Releases everything, for when no other thread uses the container.
+  template <typename Release> void releaseAll(Release release) {
+    for (const auto &retired : m_Nodes) {
+      release(retired.second);
+    }
+    m_Nodes.clear();
+    m_Size.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  std::mutex m_Mutex;
+  std::vector<std::pair<uint64_t, TNode *>> m_Nodes;
+  std::atomic<size_t> m_Size{0};
+};
+
+} // namespace epoch
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+template <typename T> class FrozenSetConstIterator;
+
+// Read-only sorted set stored in one array in Eytzinger (BFS) order: slot k
+// (counting from 1) has its children in slots 2k and 2k + 1. A lookup reads
+// the array top-down with no data-dependent branches and prefetches the
+// slots four levels below the current one, so the next cache misses overlap
+// with the comparisons.
+//
+// Iteration is in sorted order through the implicit tree, O(1) amortized per
+// step. The contents never change after construction, so iterators stay valid
+// as long as the set lives.
+template <typename T, typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class FrozenSet {
+public:
+  typedef FrozenSetConstIterator<T> const_iterator;
+  typedef FrozenSetConstIterator<T> iterator;
+  typedef std::ptrdiff_t difference_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  explicit FrozenSet(const Compare &comp = Compare(),
+                     const Allocator &alloc = Allocator())
+      : m_Keys(nullptr), m_Size(0), m_Compare(comp), m_Alloc(alloc) {}
+  // The elements of [first, last) are sorted and deduplicated first.
+  template <typename InputIterator>
+  FrozenSet(InputIterator first, InputIterator last,
+            const Compare &comp = Compare(),
+            const Allocator &alloc = Allocator());
+  FrozenSet(std::initializer_list<T> initList, const Compare &comp = Compare(),
+            const Allocator &alloc = Allocator())
+      : FrozenSet(initList.begin(), initList.end(), comp, alloc) {}
+  FrozenSet(const FrozenSet &other);
+  FrozenSet(FrozenSet &&other) noexcept;
+  ~FrozenSet() { destroy(); }
+
+  const_iterator begin() const;
+  const_iterator end() const { return const_iterator(m_Keys, m_Size, 0); }
+  const_iterator find(const T &key) const { return findKey(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator find(const K &key) const {
+    return findKey(key);
+  }
+  const_iterator lower_bound(const T &key) const { return lowerBound(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator lower_bound(const K &key) const {
+    return lowerBound(key);
+  }
+  const_iterator upper_bound(const T &key) const { return upperBound(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator upper_bound(const K &key) const {
+    return upperBound(key);
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const T &key) const {
+    return {lowerBound(key), upperBound(key)};
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K &key) const {
+    return {lowerBound(key), upperBound(key)};
+  }
+  bool contains(const T &key) const { return findKey(key) != end(); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool contains(const K &key) const {
+    return findKey(key) != end();
+  }
+
+  size_t size() const { return m_Size; }
+  bool empty() const { return m_Size == 0; }
+  key_compare key_comp() const { return m_Compare; }
+  allocator_type get_allocator() const { return m_Alloc; }
+
+  FrozenSet &operator=(const FrozenSet &other);
+  FrozenSet &operator=(FrozenSet &&other);
+
+  template <typename, typename, typename, typename> friend class Set;
+
+private:
+  typedef std::allocator_traits<Allocator> AllocatorTraits;
+  static constexpr size_t kPrefetchLevels = 4;
+
+  T *m_Keys;
+  size_t m_Size;
+  Compare m_Compare;
+  Allocator m_Alloc;
+
+  // Builds the set from size sorted distinct elements starting at first.
+  template <typename InputIterator>
+  FrozenSet(InputIterator first, size_t size, const Compare &comp,
+            const Allocator &alloc);
+
+  template <typename InputIterator>
+  void build(InputIterator first, size_t size);
+  void destroy();
+  template <typename K> size_t lowerBoundSlot(const K &key) const;
+  template <typename K> const_iterator lowerBound(const K &key) const {
+    return const_iterator(m_Keys, m_Size, lowerBoundSlot(key));
+  }
+  template <typename K> const_iterator upperBound(const K &key) const;
+  template <typename K> const_iterator findKey(const K &key) const;
+};
+
+template <typename T, typename Compare, typename Allocator>
+template <typename InputIterator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(InputIterator first,
+                                            InputIterator last,
+                                            const Compare &comp,
+                                            const Allocator &alloc)
+    : FrozenSet(comp, alloc) {
+  std::vector<T> keys(first, last);
+  std::sort(keys.begin(), keys.end(), m_Compare);
+  keys.erase(std::unique(keys.begin(), keys.end(),
+                         [this](const T &lhs, const T &rhs) {
+                           return !m_Compare(lhs, rhs);
+                         }),
+             keys.end());
+  build(std::make_move_iterator(keys.begin()), keys.size());
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename InputIterator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(InputIterator first, size_t size,
+                                            const Compare &comp,
+                                            const Allocator &alloc)
+    : FrozenSet(comp, alloc) {
+  build(first, size);
+}
+
+template <typename T, typename Compare, typename Allocator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(const FrozenSet &other)
+    : FrozenSet(other.m_Compare,
+                AllocatorTraits::select_on_container_copy_construction(
+                    other.m_Alloc)) {
+  build(other.begin(), other.m_Size);
+}
+
+template <typename T, typename Compare, typename Allocator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(FrozenSet &&other) noexcept
+    : m_Keys(other.m_Keys), m_Size(other.m_Size),
+      m_Compare(std::move(other.m_Compare)), m_Alloc(std::move(other.m_Alloc)) {
+  other.m_Keys = nullptr;
+  other.m_Size = 0;
+}
+
+template <typename T, typename Compare, typename Allocator>
+FrozenSet<T, Compare, Allocator> &
+FrozenSet<T, Compare, Allocator>::operator=(const FrozenSet &other) {
+  if (this == &other) {
+    return *this;
+  }
+  destroy();
+  m_Compare = other.m_Compare;
+  if constexpr (AllocatorTraits::propagate_on_container_copy_assignment::
+                    value) {
+    m_Alloc = other.m_Alloc;
+  }
+  build(other.begin(), other.m_Size);
+  return *this;
+}
+
+// The array is taken over only if it can be freed with this allocator,
+// otherwise the keys are moved into a new one.
+template <typename T, typename Compare, typename Allocator>
+FrozenSet<T, Compare, Allocator> &
+FrozenSet<T, Compare, Allocator>::operator=(FrozenSet &&other) {
+  if (this == &other) {
+    return *this;
+  }
+  destroy();
+  m_Compare = std::move(other.m_Compare);
+  if constexpr (AllocatorTraits::propagate_on_container_move_assignment::
+                    value) {
+    m_Alloc = std::move(other.m_Alloc);
+  } else {
+    if (m_Alloc != other.m_Alloc) {
+      build(std::make_move_iterator(other.begin()), other.m_Size);
+      other.destroy();
+      return *this;
+    }
+  }
+  std::swap(m_Keys, other.m_Keys);
+  std::swap(m_Size, other.m_Size);
+  return *this;
+}
+
+// Visits the slots in sorted order and fills them one after another, so the
+// input is read once and the whole build is O(n).
+template <typename T, typename Compare, typename Allocator>
+template <typename InputIterator>
+void FrozenSet<T, Compare, Allocator>::build(InputIterator first,
+                                             size_t size) {
+  if (size == 0) {
+    return;
+  }
+  m_Keys = AllocatorTraits::allocate(m_Alloc, size);
+  const_iterator slot = const_iterator(m_Keys, size, 1);
+  while (2 * slot.m_Slot <= size) {
+    slot.m_Slot *= 2;
+  }
+  size_t constructed = 0;
+  try {
+    for (; constructed < size; ++constructed, ++first, ++slot) {
+      AllocatorTraits::construct(m_Alloc, m_Keys + slot.m_Slot - 1, *first);
+    }
+  } catch (...) {
+    // The constructed slots are not contiguous, walk them again.
+    slot = const_iterator(m_Keys, size, 1);
+    while (2 * slot.m_Slot <= size) {
+      slot.m_Slot *= 2;
+    }
+    for (; constructed > 0; --constructed, ++slot) {
+      AllocatorTraits::destroy(m_Alloc, m_Keys + slot.m_Slot - 1);
+    }
+    AllocatorTraits::deallocate(m_Alloc, m_Keys, size);
+    m_Keys = nullptr;
+    throw;
+  }
+  m_Size = size;
+}
+
+template <typename T, typename Compare, typename Allocator>
+void FrozenSet<T, Compare, Allocator>::destroy() {
+  if (m_Keys == nullptr) {
+    return;
+  }
+  for (size_t i = 0; i < m_Size; ++i) {
+    AllocatorTraits::destroy(m_Alloc, m_Keys + i);
+  }
+  AllocatorTraits::deallocate(m_Alloc, m_Keys, m_Size);
+  m_Keys = nullptr;
+  m_Size = 0;
+}
+
+template <typename T, typename Compare, typename Allocator>
+typename FrozenSet<T, Compare, Allocator>::const_iterator
+FrozenSet<T, Compare, Allocator>::begin() const {
+  if (m_Size == 0) {
+    return end();
+  }
+  size_t slot = 1;
+  while (2 * slot <= m_Size) {
+    slot *= 2;
+  }
+  return const_iterator(m_Keys, m_Size, slot);
+}
+
+// The descent records every comparison result in the bits of slot: going
+// right appends 1, going left appends 0. The lower bound is the last node
+// where the search went left, found by dropping the trailing ones and one
+// more bit. Slot 0 means that all keys are less than key.
+template <typename T, typename Compare, typename Allocator>
+template <typename K>
+size_t FrozenSet<T, Compare, Allocator>::lowerBoundSlot(const K &key) const {
+  size_t slot = 1;
+  while (slot <= m_Size) {
+    __builtin_prefetch(m_Keys +
+                       std::min(slot << kPrefetchLevels, m_Size) - 1);
+    slot = 2 * slot + (size_t)m_Compare(m_Keys[slot - 1], key);
+  }
+  return slot >> (__builtin_ctzll(~(unsigned long long)slot) + 1);
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename K>
+typename FrozenSet<T, Compare, Allocator>::const_iterator
+FrozenSet<T, Compare, Allocator>::upperBound(const K &key) const {
+  size_t slot = 1;
+  while (slot <= m_Size) {
+    __builtin_prefetch(m_Keys +
+                       std::min(slot << kPrefetchLevels, m_Size) - 1);
+    slot = 2 * slot + (size_t)!m_Compare(key, m_Keys[slot - 1]);
+  }
+  slot >>= __builtin_ctzll(~(unsigned long long)slot) + 1;
+  return const_iterator(m_Keys, m_Size, slot);
+}
+
+template <typename T, typename Compare, typename Allocator>
+template <typename K>
+typename FrozenSet<T, Compare, Allocator>::const_iterator
+FrozenSet<T, Compare, Allocator>::findKey(const K &key) const {
+  size_t slot = lowerBoundSlot(key);
+  if (slot == 0 || m_Compare(key, m_Keys[slot - 1])) {
+    return end();
+  }
+  return const_iterator(m_Keys, m_Size, slot);
+}
+
+// Walks the implicit tree in order. Slot 0 is end(), decrementing it gives
+// the rightmost slot.
+template <typename T> class FrozenSetConstIterator {
+public:
+  typedef std::ptrdiff_t difference_type;
+  typedef T value_type;
+  typedef const T &reference;
+  typedef const T &const_reference;
+  typedef const T *pointer;
+  typedef const T *const_pointer;
+  typedef std::bidirectional_iterator_tag iterator_category;
+
+  FrozenSetConstIterator() : m_Keys(nullptr), m_Size(0), m_Slot(0) {}
+  const T &operator*() const { return m_Keys[m_Slot - 1]; }
+  const T *operator->() const { return m_Keys + m_Slot - 1; }
+
+  FrozenSetConstIterator &operator++();
+  FrozenSetConstIterator operator++(int) {
+    auto res = *this;
+    ++*this;
+    return res;
+  }
+  FrozenSetConstIterator &operator--();
+  FrozenSetConstIterator operator--(int) {
+    auto res = *this;
+    --*this;
+    return res;
+  }
+
+  bool operator==(const FrozenSetConstIterator &other) const {
+    return m_Slot == other.m_Slot && m_Keys == other.m_Keys;
+  }
+  bool operator!=(const FrozenSetConstIterator &other) const {
+    return !(*this == other);
+  }
+
+  template <typename, typename, typename> friend class FrozenSet;
+
+private:
+  FrozenSetConstIterator(const T *keys, size_t size, size_t slot)
+      : m_Keys(keys), m_Size(size), m_Slot(slot) {}
+
+  const T *m_Keys;
+  size_t m_Size;
+  size_t m_Slot;
+};
+
+template <typename T>
+FrozenSetConstIterator<T> &FrozenSetConstIterator<T>::operator++() {
+  if (2 * m_Slot + 1 <= m_Size) {
+    m_Slot = 2 * m_Slot + 1;
+    while (2 * m_Slot <= m_Size) {
+      m_Slot *= 2;
+    }
+  } else {
+    m_Slot >>= __builtin_ctzll(~(unsigned long long)m_Slot) + 1;
+  }
+  return *this;
+}
+
+template <typename T>
+FrozenSetConstIterator<T> &FrozenSetConstIterator<T>::operator--() {
+  if (m_Slot == 0) {
+    m_Slot = 1;
+    while (2 * m_Slot + 1 <= m_Size) {
+      m_Slot = 2 * m_Slot + 1;
+    }
+  } else if (2 * m_Slot <= m_Size) {
+    m_Slot *= 2;
+    while (2 * m_Slot + 1 <= m_Size) {
+      m_Slot = 2 * m_Slot + 1;
+    }
+  } else {
+    m_Slot >>= __builtin_ctzll((unsigned long long)m_Slot) + 1;
+  }
+  return *this;
+}
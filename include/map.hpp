@@ -0,0 +1,295 @@
+#pragma once
+
+#include "avltree.hpp"
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+template <typename TValue> class MapIterator;
+
+// Ordered map on the same AvlTree as Set. Nodes store std::pair<const K, V>
+// and the tree compares them by key through ValueCompare, which also compares
+// keys with pairs, so lookups by key need no pair. Balancing, the threaded
+// list of nodes and the searches are those of Set, and one walk gives both
+// the order and the values.
+//
+// Values are mutable through iterators, keys are not. Iterators stay valid
+// until their element is erased. Stats is the stats policy of the tree, see
+// tree_stats.hpp.
+template <typename K, typename V, typename Compare = std::less<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename Stats = NoTreeStats>
+class Map {
+public:
+  typedef K key_type;
+  typedef V mapped_type;
+  typedef std::pair<const K, V> value_type;
+  typedef MapIterator<value_type> iterator;
+  typedef MapIterator<const value_type> const_iterator;
+  typedef std::ptrdiff_t difference_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  Map() : m_Tree() {}
+  explicit Map(const Compare &comp, const Allocator &alloc = Allocator())
+      : m_Tree(ValueCompare(comp), alloc) {}
+  explicit Map(const Allocator &alloc) : m_Tree(ValueCompare(), alloc) {}
+  template <typename InputIterator>
+  Map(InputIterator first, InputIterator last, const Compare &comp = Compare(),
+      const Allocator &alloc = Allocator())
+      : m_Tree(ValueCompare(comp), alloc) {
+    insert(first, last);
+  }
+  Map(std::initializer_list<value_type> initList,
+      const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+      : Map(initList.begin(), initList.end(), comp, alloc) {}
+  Map(const Map &other) : m_Tree(other.m_Tree) {}
+  Map(Map &&other) noexcept : m_Tree(std::move(other.m_Tree)) {}
+  ~Map() = default;
+
+  iterator begin() { return iterator(m_Tree.begin()); }
+  iterator end() { return iterator(m_Tree.end()); }
+  const_iterator begin() const { return const_iterator(m_Tree.begin()); }
+  const_iterator end() const { return const_iterator(m_Tree.end()); }
+  iterator find(const K &key) { return iterator(m_Tree.find(key)); }
+  const_iterator find(const K &key) const {
+    return const_iterator(m_Tree.find(key));
+  }
+  iterator lower_bound(const K &key) {
+    return iterator(m_Tree.lower_bound(key));
+  }
+  const_iterator lower_bound(const K &key) const {
+    return const_iterator(m_Tree.lower_bound(key));
+  }
+  iterator upper_bound(const K &key) {
+    return iterator(m_Tree.upper_bound(key));
+  }
+  const_iterator upper_bound(const K &key) const {
+    return const_iterator(m_Tree.upper_bound(key));
+  }
+  bool contains(const K &key) const { return m_Tree.exists(key); }
+
+  // The value of key. Throws std::out_of_range if there is no such key.
+  V &at(const K &key);
+  const V &at(const K &key) const;
+  // The value of key, inserting a value-initialized one if there is none.
+  V &operator[](const K &key) { return try_emplace(key).first->second; }
+  V &operator[](K &&key) {
+    return try_emplace(std::move(key)).first->second;
+  }
+
+  // Inserts value unless its key is present. Returns the iterator to the
+  // element with the key and whether value was inserted.
+  std::pair<iterator, bool> insert(const value_type &value) {
+    return wrap(m_Tree.tryEmplace(value.first, value));
+  }
+  std::pair<iterator, bool> insert(value_type &&value) {
+    return wrap(m_Tree.tryEmplace(value.first, std::move(value)));
+  }
+  template <typename InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first) {
+      insert(*first);
+    }
+  }
+  // Like insert, but the value is constructed from args, and only if the key
+  // is not present: otherwise args are left untouched.
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const K &key, Args &&...args) {
+    return wrap(m_Tree.tryEmplace(
+        key, std::piecewise_construct, std::forward_as_tuple(key),
+        std::forward_as_tuple(std::forward<Args>(args)...)));
+  }
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(K &&key, Args &&...args) {
+    return wrap(m_Tree.tryEmplace(
+        key, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+        std::forward_as_tuple(std::forward<Args>(args)...)));
+  }
+  // Inserts the value or assigns it to the one already there. The second
+  // member of the result tells whether it was inserted.
+  template <typename M>
+  std::pair<iterator, bool> insert_or_assign(const K &key, M &&value);
+  template <typename M>
+  std::pair<iterator, bool> insert_or_assign(K &&key, M &&value);
+  void erase(const K &key) { m_Tree.remove(key); }
+  void clear() { m_Tree.clear(); }
+  // Preallocates node storage for nodesNum elements.
+  void reserve(size_t nodesNum) { m_Tree.reserve(nodesNum); }
+
+  size_t size() const { return m_Tree.size(); }
+  bool empty() const { return m_Tree.size() == 0; }
+  key_compare key_comp() const { return m_Tree.key_comp().keyComp(); }
+  allocator_type get_allocator() const { return m_Tree.get_allocator(); }
+  // See Set::stats and Set::memory_usage. memory_usage counts the heap memory
+  // of the values as it is now; global_memory_usage counts only the keys,
+  // since values change in place.
+  TreeStats stats() const { return m_Tree.stats(); }
+  MemoryUsage memory_usage() const { return m_Tree.memoryUsage(); }
+  Map &operator=(const Map &other) {
+    if (this != &other) {
+      m_Tree = other.m_Tree;
+    }
+    return *this;
+  }
+  Map &operator=(Map &&other) {
+    m_Tree = std::move(other.m_Tree);
+    return *this;
+  }
+  void swap(Map &other) noexcept { m_Tree.swap(other.m_Tree); }
+
+private:
+  // Orders pairs by key and compares keys with pairs. It is transparent, so
+  // the tree searches by key directly.
+  class ValueCompare {
+  public:
+    typedef void is_transparent;
+
+    explicit ValueCompare(const Compare &comp = Compare()) : m_Compare(comp) {}
+
+    bool operator()(const value_type &lhs, const value_type &rhs) const {
+      return m_Compare(lhs.first, rhs.first);
+    }
+    bool operator()(const K &lhs, const value_type &rhs) const {
+      return m_Compare(lhs, rhs.first);
+    }
+    bool operator()(const value_type &lhs, const K &rhs) const {
+      return m_Compare(lhs.first, rhs);
+    }
+    Compare keyComp() const { return m_Compare; }
+
+  private:
+    Compare m_Compare;
+  };
+
+  typedef AvlTree<value_type, ValueCompare, Allocator, Stats> Tree;
+
+  static std::pair<iterator, bool>
+  wrap(std::pair<typename Tree::const_iterator, bool> result) {
+    return {iterator(result.first), result.second};
+  }
+
+  Tree m_Tree;
+};
+
+template <typename K, typename V, typename Compare, typename Allocator,
+          typename Stats>
+V &Map<K, V, Compare, Allocator, Stats>::at(const K &key) {
+  iterator it = find(key);
+  if (it == end()) {
+    throw std::out_of_range("Map::at: no such key");
+  }
+  return it->second;
+}
+
+template <typename K, typename V, typename Compare, typename Allocator,
+          typename Stats>
+const V &Map<K, V, Compare, Allocator, Stats>::at(const K &key) const {
+  const_iterator it = find(key);
+  if (it == end()) {
+    throw std::out_of_range("Map::at: no such key");
+  }
+  return it->second;
+}
+
+template <typename K, typename V, typename Compare, typename Allocator,
+          typename Stats>
+template <typename M>
+std::pair<typename Map<K, V, Compare, Allocator, Stats>::iterator, bool>
+Map<K, V, Compare, Allocator, Stats>::insert_or_assign(const K &key,
+                                                       M &&value) {
+  std::pair<iterator, bool> result = try_emplace(key, std::forward<M>(value));
+  if (!result.second) {
+    result.first->second = std::forward<M>(value);
+  }
+  return result;
+}
+
+template <typename K, typename V, typename Compare, typename Allocator,
+          typename Stats>
+template <typename M>
+std::pair<typename Map<K, V, Compare, Allocator, Stats>::iterator, bool>
+Map<K, V, Compare, Allocator, Stats>::insert_or_assign(K &&key, M &&value) {
+  std::pair<iterator, bool> result =
+      try_emplace(std::move(key), std::forward<M>(value));
+  if (!result.second) {
+    result.first->second = std::forward<M>(value);
+  }
+  return result;
+}
+
+template <typename K, typename V, typename Compare, typename Allocator,
+          typename Stats>
+void swap(Map<K, V, Compare, Allocator, Stats> &lhs,
+          Map<K, V, Compare, Allocator, Stats> &rhs) noexcept {
+  lhs.swap(rhs);
+}
+
+// Bidirectional iterator of Map over the tree iterator. TValue is the pair
+// for iterator and const pair for const_iterator; iterator converts to
+// const_iterator. The pairs live in nodes that are never const, so giving
+// access to the value through iterator is safe.
+template <typename TValue> class MapIterator {
+  typedef typename std::remove_const<TValue>::type NodeValue;
+
+public:
+  typedef std::ptrdiff_t difference_type;
+  typedef NodeValue value_type;
+  typedef TValue &reference;
+  typedef TValue *pointer;
+  typedef std::bidirectional_iterator_tag iterator_category;
+
+  MapIterator() : m_AvlTreeConstIterator() {}
+  template <typename TOther,
+            typename = typename std::enable_if<
+                std::is_same<const TOther, TValue>::value>::type>
+  MapIterator(const MapIterator<TOther> &other)
+      : m_AvlTreeConstIterator(other.m_AvlTreeConstIterator) {}
+
+  reference operator*() const {
+    return const_cast<reference>(*m_AvlTreeConstIterator);
+  }
+  pointer operator->() const { return &**this; }
+
+  MapIterator &operator++() {
+    ++m_AvlTreeConstIterator;
+    return *this;
+  }
+  MapIterator operator++(int) {
+    MapIterator res = *this;
+    ++m_AvlTreeConstIterator;
+    return res;
+  }
+  MapIterator &operator--() {
+    --m_AvlTreeConstIterator;
+    return *this;
+  }
+  MapIterator operator--(int) {
+    MapIterator res = *this;
+    --m_AvlTreeConstIterator;
+    return res;
+  }
+
+  friend bool operator==(const MapIterator &lhs, const MapIterator &rhs) {
+    return lhs.m_AvlTreeConstIterator == rhs.m_AvlTreeConstIterator;
+  }
+  friend bool operator!=(const MapIterator &lhs, const MapIterator &rhs) {
+    return lhs.m_AvlTreeConstIterator != rhs.m_AvlTreeConstIterator;
+  }
+
+  template <typename, typename, typename, typename, typename>
+  friend class Map;
+  template <typename> friend class MapIterator;
+
+private:
+  explicit MapIterator(AvlTreeConstIterator<NodeValue> iterator)
+      : m_AvlTreeConstIterator(iterator) {}
+
+  AvlTreeConstIterator<NodeValue> m_AvlTreeConstIterator;
+};
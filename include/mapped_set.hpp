@@ -0,0 +1,210 @@
+#pragma once
+
+#include "snapshot.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only sorted set served directly from a snapshot written by Set::save.
+// The file is mapped into memory and the keys are used where they lie, so
+// opening takes O(1) whatever the size and only the pages a lookup touches
+// are ever read from disk. Lookups are binary searches over the sorted array
+// and iterators are plain pointers into the mapping.
+//
+// Opening checks the header only. verify reads the whole file to check the
+// checksum and the order of the keys under Compare, which lookups rely on.
+// The mapping is private and read-only: the file must not be truncated while
+// it is mapped. POSIX only.
+template <typename T, typename Compare = std::less<T>> class MappedSet {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "MappedSet: keys have to be trivially copyable");
+
+public:
+  typedef const T *const_iterator;
+  typedef const_iterator iterator;
+  typedef std::ptrdiff_t difference_type;
+  typedef Compare key_compare;
+
+  // Maps the snapshot at path. Throws std::system_error if the file cannot
+  // be opened or mapped and std::runtime_error if it is not a snapshot of T.
+  explicit MappedSet(const std::string &path,
+                     const Compare &comp = Compare());
+  MappedSet(const MappedSet &other) = delete;
+  MappedSet(MappedSet &&other) noexcept
+      : m_Data(other.m_Data), m_DataSize(other.m_DataSize),
+        m_Keys(other.m_Keys), m_Size(other.m_Size),
+        m_Compare(std::move(other.m_Compare)) {
+    other.m_Data = nullptr;
+    other.m_DataSize = 0;
+    other.m_Keys = nullptr;
+    other.m_Size = 0;
+  }
+  ~MappedSet() { unmap(); }
+  MappedSet &operator=(const MappedSet &other) = delete;
+  MappedSet &operator=(MappedSet &&other) noexcept {
+    MappedSet tmp(std::move(other));
+    swap(tmp);
+    return *this;
+  }
+
+  const_iterator begin() const { return m_Keys; }
+  const_iterator end() const { return m_Keys + m_Size; }
+  const_iterator find(const T &key) const { return findKey(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator find(const K &key) const {
+    return findKey(key);
+  }
+  const_iterator lower_bound(const T &key) const {
+    return std::lower_bound(begin(), end(), key, m_Compare);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator lower_bound(const K &key) const {
+    return std::lower_bound(begin(), end(), key, m_Compare);
+  }
+  const_iterator upper_bound(const T &key) const {
+    return std::upper_bound(begin(), end(), key, m_Compare);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator upper_bound(const K &key) const {
+    return std::upper_bound(begin(), end(), key, m_Compare);
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const T &key) const {
+    return {lower_bound(key), upper_bound(key)};
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K &key) const {
+    return {lower_bound(key), upper_bound(key)};
+  }
+  bool contains(const T &key) const { return findKey(key) != end(); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool contains(const K &key) const {
+    return findKey(key) != end();
+  }
+
+  // Whether the keys match the checksum and are strictly increasing. O(n).
+  bool verify() const;
+
+  size_t size() const { return m_Size; }
+  bool empty() const { return m_Size == 0; }
+  key_compare key_comp() const { return m_Compare; }
+  void swap(MappedSet &other) noexcept {
+    std::swap(m_Data, other.m_Data);
+    std::swap(m_DataSize, other.m_DataSize);
+    std::swap(m_Keys, other.m_Keys);
+    std::swap(m_Size, other.m_Size);
+    std::swap(m_Compare, other.m_Compare);
+  }
+
+private:
+  template <typename K> const_iterator findKey(const K &key) const;
+  void unmap();
+
+  void *m_Data;
+  size_t m_DataSize;
+  const T *m_Keys;
+  size_t m_Size;
+  Compare m_Compare;
+};
+
+template <typename T, typename Compare>
+MappedSet<T, Compare>::MappedSet(const std::string &path,
+                                 const Compare &comp)
+    : m_Data(nullptr), m_DataSize(0), m_Keys(nullptr), m_Size(0),
+      m_Compare(comp) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "MappedSet: cannot open " + path);
+  }
+  struct stat fileStat;
+  if (::fstat(fd, &fileStat) != 0) {
+    int error = errno;
+    ::close(fd);
+    throw std::system_error(error, std::generic_category(),
+                            "MappedSet: cannot stat " + path);
+  }
+  size_t fileSize = static_cast<size_t>(fileStat.st_size);
+  if (fileSize < snapshot::kKeysOffset) {
+    ::close(fd);
+    throw std::runtime_error("MappedSet: not a set snapshot");
+  }
+  void *data = ::mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file open by itself.
+  int error = errno;
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    throw std::system_error(error, std::generic_category(),
+                            "MappedSet: cannot map " + path);
+  }
+  m_Data = data;
+  m_DataSize = fileSize;
+
+  try {
+    const snapshot::Header &header =
+        *static_cast<const snapshot::Header *>(m_Data);
+    snapshot::checkHeader<T>(header, fileSize, "MappedSet");
+    m_Size = header.m_KeysNum;
+  } catch (...) {
+    unmap();
+    throw;
+  }
+  m_Keys = reinterpret_cast<const T *>(static_cast<const char *>(m_Data) +
+                                       snapshot::kKeysOffset);
+}
+
+template <typename T, typename Compare>
+bool MappedSet<T, Compare>::verify() const {
+  if (m_Data == nullptr) {
+    return true;
+  }
+  snapshot::Checksum checksum;
+  checksum.update(m_Keys, m_Size * sizeof(T));
+  const snapshot::Header &header =
+      *static_cast<const snapshot::Header *>(m_Data);
+  if (checksum.value() != header.m_Checksum) {
+    return false;
+  }
+  return std::adjacent_find(begin(), end(), [this](const T &lhs,
+                                                   const T &rhs) {
+           return !m_Compare(lhs, rhs);
+         }) == end();
+}
+
+template <typename T, typename Compare>
+template <typename K>
+typename MappedSet<T, Compare>::const_iterator
+MappedSet<T, Compare>::findKey(const K &key) const {
+  const_iterator it = std::lower_bound(begin(), end(), key, m_Compare);
+  if (it == end() || m_Compare(key, *it)) {
+    return end();
+  }
+  return it;
+}
+
+template <typename T, typename Compare> void MappedSet<T, Compare>::unmap() {
+  if (m_Data != nullptr) {
+    ::munmap(m_Data, m_DataSize);
+    m_Data = nullptr;
+  }
+}
+
+template <typename T, typename Compare>
+void swap(MappedSet<T, Compare> &lhs, MappedSet<T, Compare> &rhs) noexcept {
+  lhs.swap(rhs);
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Memory held by one set, see Set::memory_usage.
+struct MemoryUsage {
+  size_t m_NodesNum = 0;
+  // sizeof a node: the key with the links, height, size and subtree ends.
+  size_t m_BytesPerNode = 0;
+  // Storage taken from the allocator for nodes, including free slots and
+  // slab headers.
+  size_t m_NodeBytes = 0;
+  // Estimated malloc bookkeeping and rounding on top of m_NodeBytes, zero for
+  // allocators other than std::allocator.
+  size_t m_AllocatorOverheadBytes = 0;
+  // Dynamic memory owned by the keys with its allocator overhead, see
+  // KeyMemoryUsage.
+  size_t m_KeyHeapBytes = 0;
+  // All of the above and the set object itself.
+  size_t m_TotalBytes = 0;
+};
+
+// Memory held by all the sets of the process together, see
+// global_memory_usage.
+struct GlobalMemoryUsage {
+  size_t m_NodeBytes = 0;
+  size_t m_AllocatorOverheadBytes = 0;
+  size_t m_KeyHeapBytes = 0;
+  size_t m_TotalBytes = 0;
+};
+
+// What malloc takes for a block of bytes beyond the bytes themselves, as
+// glibc does it: an 8-byte header rounded up to 16 with a minimum of 32, and
+// whole pages for blocks over the mmap threshold (128 KiB by default).
+inline size_t mallocOverhead(size_t bytes) {
+  const size_t kMmapThreshold = 128 << 10;
+  const size_t kPageSize = 4096;
+  size_t chunk = bytes >= kMmapThreshold
+                     ? (bytes + 16 + kPageSize - 1) / kPageSize * kPageSize
+                     : std::max<size_t>(32, (bytes + 8 + 15) / 16 * 16);
+  return chunk - bytes;
+}
+
+// Whether mallocOverhead applies to the blocks of Allocator.
+template <typename Allocator>
+constexpr bool kUsesMalloc = std::is_same<
+    typename std::allocator_traits<Allocator>::template rebind_alloc<char>,
+    std::allocator<char>>::value;
+
+// A block of bytes from Allocator together with the allocator overhead.
+template <typename Allocator> size_t blockBytes(size_t bytes) {
+  return kUsesMalloc<Allocator> ? bytes + mallocOverhead(bytes) : bytes;
+}
+
+// Customization point for the dynamic memory a key owns beyond sizeof(T),
+// zero unless specialized. Specializations for strings, vectors and pairs are
+// below; keys owning other memory need one of their own, preferably counting
+// the allocator overhead of the blocks too (see blockBytes). The result must
+// not change while the key is in a set.
+template <typename T> struct KeyMemoryUsage {
+  static size_t heapBytes(const T &) { return 0; }
+};
+
+// Short strings are kept in the object itself and own nothing.
+template <typename Char, typename Traits, typename Allocator>
+struct KeyMemoryUsage<std::basic_string<Char, Traits, Allocator>> {
+  typedef std::basic_string<Char, Traits, Allocator> String;
+
+  static size_t heapBytes(const String &key) {
+    const char *data = reinterpret_cast<const char *>(key.data());
+    const char *object = reinterpret_cast<const char *>(&key);
+    std::less<const char *> less;
+    if (!less(data, object) && less(data, object + sizeof(key))) {
+      return 0;
+    }
+    return blockBytes<Allocator>((key.capacity() + 1) * sizeof(Char));
+  }
+};
+
+template <typename T, typename Allocator>
+struct KeyMemoryUsage<std::vector<T, Allocator>> {
+  static size_t heapBytes(const std::vector<T, Allocator> &key) {
+    size_t result = 0;
+    if (key.capacity() != 0) {
+      result = blockBytes<Allocator>(key.capacity() * sizeof(T));
+    }
+    for (const T &element : key) {
+      result += KeyMemoryUsage<T>::heapBytes(element);
+    }
+    return result;
+  }
+};
+
+template <typename First, typename Second>
+struct KeyMemoryUsage<std::pair<First, Second>> {
+  static size_t heapBytes(const std::pair<First, Second> &key) {
+    return KeyMemoryUsage<typename std::remove_const<First>::type>::heapBytes(
+               key.first) +
+           KeyMemoryUsage<Second>::heapBytes(key.second);
+  }
+};
+
+template <typename T> size_t keyHeapBytes(const T &key) {
+  return KeyMemoryUsage<T>::heapBytes(key);
+}
+
+// The part of keyHeapBytes the process-wide counters track for a node. It is
+// added when the node is made and subtracted when it is destroyed, so it must
+// not change in between. The values of Map nodes, pairs with a const first
+// member, change in place, so only the key is tracked for them.
+template <typename T> size_t trackedKeyHeapBytes(const T &key) {
+  return keyHeapBytes(key);
+}
+
+template <typename K, typename V>
+size_t trackedKeyHeapBytes(const std::pair<const K, V> &value) {
+  return keyHeapBytes(value.first);
+}
+
+// Process-wide counters behind global_memory_usage. Node pools report their
+// slabs and Set reports the heap memory of its keys as they come and go, so
+// reading them is O(1). Updates are relaxed atomic additions, once per slab
+// and once per key owning memory.
+class MemoryCounters {
+public:
+  static void addNodeBytes(size_t bytes, size_t overhead) {
+    counters().m_NodeBytes.fetch_add(bytes, std::memory_order_relaxed);
+    counters().m_Overhead.fetch_add(overhead, std::memory_order_relaxed);
+  }
+  static void removeNodeBytes(size_t bytes, size_t overhead) {
+    counters().m_NodeBytes.fetch_sub(bytes, std::memory_order_relaxed);
+    counters().m_Overhead.fetch_sub(overhead, std::memory_order_relaxed);
+  }
+  static void addKeyHeapBytes(size_t bytes) {
+    if (bytes != 0) {
+      counters().m_KeyHeap.fetch_add(bytes, std::memory_order_relaxed);
+    }
+  }
+  static void removeKeyHeapBytes(size_t bytes) {
+    if (bytes != 0) {
+      counters().m_KeyHeap.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+  }
+  static GlobalMemoryUsage snapshot() {
+    GlobalMemoryUsage result;
+    const Counters &source = counters();
+    result.m_NodeBytes = source.m_NodeBytes.load(std::memory_order_relaxed);
+    result.m_AllocatorOverheadBytes =
+        source.m_Overhead.load(std::memory_order_relaxed);
+    result.m_KeyHeapBytes = source.m_KeyHeap.load(std::memory_order_relaxed);
+    result.m_TotalBytes = result.m_NodeBytes +
+                          result.m_AllocatorOverheadBytes +
+                          result.m_KeyHeapBytes;
+    return result;
+  }
+
+private:
+  struct Counters {
+    std::atomic<size_t> m_NodeBytes{0};
+    std::atomic<size_t> m_Overhead{0};
+    std::atomic<size_t> m_KeyHeap{0};
+  };
+
+  static Counters &counters() {
+    static Counters counters;
+    return counters;
+  }
+};
+
+// Memory held by all the sets of the process at the moment, for exporting as
+// a metric. Node storage is counted for every container built on NodePool
+// (Set, BTreeSet and RcuSet), the heap memory of keys for the containers on
+// AvlTree; for Map that of the keys only, not of the values.
+inline GlobalMemoryUsage global_memory_usage() {
+  return MemoryCounters::snapshot();
+}
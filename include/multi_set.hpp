@@ -0,0 +1,289 @@
+#pragma once
+
+#include "avltree.hpp"
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+// A key of MultiSet with the number of its copies, the node of the tree.
+template <typename T> struct MultiSetEntry {
+  template <typename... Args>
+  explicit MultiSetEntry(std::in_place_t, Args &&...args)
+      : m_Key(std::forward<Args>(args)...), m_Count(1) {}
+
+  T m_Key;
+  size_t m_Count;
+};
+
+// An entry stands for all its copies in the subtree sizes.
+template <typename T> struct KeyWeight<MultiSetEntry<T>> {
+  static constexpr bool kUnit = false;
+  static size_t of(const MultiSetEntry<T> &entry) { return entry.m_Count; }
+};
+
+template <typename T> struct KeyMemoryUsage<MultiSetEntry<T>> {
+  static size_t heapBytes(const MultiSetEntry<T> &entry) {
+    return KeyMemoryUsage<T>::heapBytes(entry.m_Key);
+  }
+};
+
+template <typename T> class MultiSetConstIterator;
+
+// Ordered multiset on the AvlTree of Set. Equal elements share one node that
+// counts them, so a key inserted many times takes one node and one search
+// instead of a node per copy, and no sequence numbers are needed to tell the
+// copies apart. The subtree sizes count copies (see KeyWeight), so size(),
+// nth, rank and count_range work with elements in O(log n) however many of
+// them are equal. insert, erase_one and count are O(log n) too.
+//
+// Iteration yields every element as many times as it was inserted, the copies
+// of an element are not distinguishable. Iterators stay valid until their
+// element is erased, but erasing any copy of a key invalidates the iterators
+// to its last copy.
+template <typename T, typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>,
+          typename Stats = NoTreeStats>
+class MultiSet {
+public:
+  typedef T key_type;
+  typedef T value_type;
+  typedef MultiSetConstIterator<T> const_iterator;
+  typedef MultiSetConstIterator<T> iterator;
+  typedef std::ptrdiff_t difference_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  MultiSet() : m_Tree() {}
+  explicit MultiSet(const Compare &comp, const Allocator &alloc = Allocator())
+      : m_Tree(EntryCompare(comp), alloc) {}
+  explicit MultiSet(const Allocator &alloc) : m_Tree(EntryCompare(), alloc) {}
+  template <typename InputIterator>
+  MultiSet(InputIterator first, InputIterator last,
+           const Compare &comp = Compare(),
+           const Allocator &alloc = Allocator())
+      : m_Tree(EntryCompare(comp), alloc) {
+    insert(first, last);
+  }
+  MultiSet(std::initializer_list<T> initList, const Compare &comp = Compare(),
+           const Allocator &alloc = Allocator())
+      : MultiSet(initList.begin(), initList.end(), comp, alloc) {}
+  MultiSet(const MultiSet &other) : m_Tree(other.m_Tree) {}
+  MultiSet(MultiSet &&other) noexcept : m_Tree(std::move(other.m_Tree)) {}
+  ~MultiSet() = default;
+
+  const_iterator begin() const { return const_iterator(m_Tree.begin(), 0); }
+  const_iterator end() const { return const_iterator(m_Tree.end(), 0); }
+  // The first copy of key or end().
+  const_iterator find(const T &key) const {
+    return const_iterator(m_Tree.find(key), 0);
+  }
+  const_iterator lower_bound(const T &key) const {
+    return const_iterator(m_Tree.lower_bound(key), 0);
+  }
+  const_iterator upper_bound(const T &key) const {
+    return const_iterator(m_Tree.upper_bound(key), 0);
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const T &key) const {
+    return {lower_bound(key), upper_bound(key)};
+  }
+  bool contains(const T &key) const { return m_Tree.exists(key); }
+  // Number of copies of key.
+  size_t count(const T &key) const;
+  // Number of elements in [lo, hi), copies included.
+  size_t count_range(const T &lo, const T &hi) const;
+
+  // Adds a copy of key and returns the iterator to it, the last of its
+  // copies. Only the first copy of a key allocates a node.
+  const_iterator insert(const T &key) {
+    return lastCopy(m_Tree.addOrUpdate(key, increment, std::in_place, key));
+  }
+  const_iterator insert(T &&key) {
+    return lastCopy(
+        m_Tree.addOrUpdate(key, increment, std::in_place, std::move(key)));
+  }
+  template <typename InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first) {
+      insert(*first);
+    }
+  }
+  void insert(std::initializer_list<T> initList) {
+    insert(initList.begin(), initList.end());
+  }
+  // Removes one copy of key. Returns false if there was none.
+  bool erase_one(const T &key) {
+    return m_Tree.updateOrRemove(
+        key, [](MultiSetEntry<T> &entry) { return --entry.m_Count != 0; });
+  }
+  // Removes all copies of key and returns their number.
+  size_t erase(const T &key);
+  void clear() { m_Tree.clear(); }
+  // Preallocates node storage for nodesNum distinct keys.
+  void reserve(size_t nodesNum) { m_Tree.reserve(nodesNum); }
+
+  // Order statistics over the elements, copies included: nth returns the k-th
+  // smallest element or end(), rank returns the number of elements less than
+  // key, index_of returns the position of it (size() for end()).
+  const_iterator nth(size_t k) const {
+    size_t copy = 0;
+    typename Tree::const_iterator it = m_Tree.select(k, copy);
+    return const_iterator(it, copy);
+  }
+  size_t rank(const T &key) const { return m_Tree.rank(key); }
+  size_t index_of(const_iterator it) const {
+    return m_Tree.rank(it.m_AvlTreeConstIterator) + it.m_Copy;
+  }
+
+  // Number of elements, copies included.
+  size_t size() const { return m_Tree.size(); }
+  bool empty() const { return m_Tree.size() == 0; }
+  key_compare key_comp() const { return m_Tree.key_comp().keyComp(); }
+  allocator_type get_allocator() const { return m_Tree.get_allocator(); }
+  // See Set::stats and Set::memory_usage. Nodes are counted in O(n) here.
+  TreeStats stats() const { return m_Tree.stats(); }
+  MemoryUsage memory_usage() const { return m_Tree.memoryUsage(); }
+  MultiSet &operator=(const MultiSet &other) {
+    if (this != &other) {
+      m_Tree = other.m_Tree;
+    }
+    return *this;
+  }
+  MultiSet &operator=(MultiSet &&other) {
+    m_Tree = std::move(other.m_Tree);
+    return *this;
+  }
+  void swap(MultiSet &other) noexcept { m_Tree.swap(other.m_Tree); }
+
+private:
+  // Orders entries by key and compares keys with entries. It is transparent,
+  // so the tree searches by key directly.
+  class EntryCompare {
+  public:
+    typedef void is_transparent;
+
+    explicit EntryCompare(const Compare &comp = Compare()) : m_Compare(comp) {}
+
+    bool operator()(const MultiSetEntry<T> &lhs,
+                    const MultiSetEntry<T> &rhs) const {
+      return m_Compare(lhs.m_Key, rhs.m_Key);
+    }
+    bool operator()(const T &lhs, const MultiSetEntry<T> &rhs) const {
+      return m_Compare(lhs, rhs.m_Key);
+    }
+    bool operator()(const MultiSetEntry<T> &lhs, const T &rhs) const {
+      return m_Compare(lhs.m_Key, rhs);
+    }
+    Compare keyComp() const { return m_Compare; }
+
+  private:
+    Compare m_Compare;
+  };
+
+  typedef AvlTree<MultiSetEntry<T>, EntryCompare, Allocator, Stats> Tree;
+
+  static void increment(MultiSetEntry<T> &entry) { ++entry.m_Count; }
+  static const_iterator lastCopy(typename Tree::const_iterator it) {
+    return const_iterator(it, (*it).m_Count - 1);
+  }
+
+  Tree m_Tree;
+};
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
+size_t MultiSet<T, Compare, Allocator, Stats>::count(const T &key) const {
+  typename Tree::const_iterator it = m_Tree.find(key);
+  return it == m_Tree.end() ? 0 : (*it).m_Count;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
+size_t MultiSet<T, Compare, Allocator, Stats>::count_range(const T &lo,
+                                                          const T &hi) const {
+  if (!key_comp()(lo, hi)) {
+    return 0;
+  }
+  return m_Tree.rank(hi) - m_Tree.rank(lo);
+}
+
+// The count is read and the node removed in the same descent.
+template <typename T, typename Compare, typename Allocator, typename Stats>
+size_t MultiSet<T, Compare, Allocator, Stats>::erase(const T &key) {
+  size_t result = 0;
+  m_Tree.updateOrRemove(key, [&result](const MultiSetEntry<T> &entry) {
+    result = entry.m_Count;
+    return false;
+  });
+  return result;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
+void swap(MultiSet<T, Compare, Allocator, Stats> &lhs,
+          MultiSet<T, Compare, Allocator, Stats> &rhs) noexcept {
+  lhs.swap(rhs);
+}
+
+// Bidirectional iterator of MultiSet: the tree iterator to an entry and the
+// number of the copy of its key, so moving over the copies of a key does not
+// leave the node.
+template <typename T> class MultiSetConstIterator {
+public:
+  typedef std::ptrdiff_t difference_type;
+  typedef T value_type;
+  typedef const T &reference;
+  typedef const T *pointer;
+  typedef std::bidirectional_iterator_tag iterator_category;
+
+  MultiSetConstIterator() : m_AvlTreeConstIterator(), m_Copy(0) {}
+
+  reference operator*() const { return (*m_AvlTreeConstIterator).m_Key; }
+  pointer operator->() const { return &**this; }
+
+  MultiSetConstIterator &operator++() {
+    if (++m_Copy == (*m_AvlTreeConstIterator).m_Count) {
+      ++m_AvlTreeConstIterator;
+      m_Copy = 0;
+    }
+    return *this;
+  }
+  MultiSetConstIterator operator++(int) {
+    MultiSetConstIterator res = *this;
+    ++*this;
+    return res;
+  }
+  MultiSetConstIterator &operator--() {
+    if (m_Copy > 0) {
+      --m_Copy;
+    } else {
+      --m_AvlTreeConstIterator;
+      m_Copy = (*m_AvlTreeConstIterator).m_Count - 1;
+    }
+    return *this;
+  }
+  MultiSetConstIterator operator--(int) {
+    MultiSetConstIterator res = *this;
+    --*this;
+    return res;
+  }
+
+  friend bool operator==(const MultiSetConstIterator &lhs,
+                         const MultiSetConstIterator &rhs) {
+    return lhs.m_AvlTreeConstIterator == rhs.m_AvlTreeConstIterator &&
+           lhs.m_Copy == rhs.m_Copy;
+  }
+  friend bool operator!=(const MultiSetConstIterator &lhs,
+                         const MultiSetConstIterator &rhs) {
+    return !(lhs == rhs);
+  }
+
+  template <typename, typename, typename, typename> friend class MultiSet;
+
+private:
+  MultiSetConstIterator(AvlTreeConstIterator<MultiSetEntry<T>> iterator,
+                        size_t copy)
+      : m_AvlTreeConstIterator(iterator), m_Copy(copy) {}
+
+  AvlTreeConstIterator<MultiSetEntry<T>> m_AvlTreeConstIterator;
+  size_t m_Copy;
+};
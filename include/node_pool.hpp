@@ -0,0 +1,242 @@
+#pragma once
+
+#include "memory_usage.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// Fixed-size block allocator for tree nodes. Storage is requested from the
+// underlying allocator in slabs, freed nodes are kept in an intrusive free list
+// for reuse and all slabs are handed back to the allocator at once by
+// release(). The pool only manages raw storage: constructing and destroying
+// the nodes is up to the caller. Slabs are counted in MemoryCounters.
+template <typename TNode, typename Allocator> class NodePool {
+public:
+  explicit NodePool(const Allocator &alloc = Allocator())
+      : m_Alloc(alloc), m_Slabs(nullptr), m_FreeList(nullptr),
+        m_Cursor(nullptr), m_SlabEnd(nullptr), m_Capacity(0) {}
+  NodePool(const NodePool &) = delete;
+  NodePool(NodePool &&other) noexcept;
+  NodePool &operator=(const NodePool &) = delete;
+  NodePool &operator=(NodePool &&other) noexcept;
+  ~NodePool() { release(); }
+
+  TNode *allocate();
+  void deallocate(TNode *node);
+  void reserve(size_t nodesNum);
+  void release();
+  void swap(NodePool &other) noexcept;
+  void splice(NodePool &other);
+
+  size_t capacity() const { return m_Capacity; }
+  // Bytes of all slabs and the estimated allocator overhead on top of them,
+  // see mallocOverhead. O(number of slabs).
+  size_t bytes() const;
+  size_t overheadBytes() const;
+  Allocator get_allocator() const { return Allocator(m_Alloc); }
+  // Replaces the underlying allocator. Only allowed while nothing is
+  // allocated from the pool.
+  void reset(const Allocator &alloc);
+
+private:
+  static constexpr size_t kMinSlabSize = 16;
+  static constexpr size_t kMaxSlabSize = 1 << 14;
+
+  // The first slot of every slab stores the slab header, the rest hold nodes.
+  union Slot {
+    Slot *m_Next;
+    struct {
+      Slot *m_NextSlab;
+      size_t m_SlotsNum;
+    } m_Header;
+    typename std::aligned_storage<sizeof(TNode), alignof(TNode)>::type
+        m_Storage;
+  };
+
+  typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Slot>
+      SlotAllocator;
+  typedef std::allocator_traits<SlotAllocator> SlotAllocatorTraits;
+
+  void addSlab(size_t nodesNum);
+  static size_t slabBytes(const Slot *slab) {
+    return slab->m_Header.m_SlotsNum * sizeof(Slot);
+  }
+  static size_t slabOverhead(const Slot *slab) {
+    return kUsesMalloc<Allocator> ? mallocOverhead(slabBytes(slab)) : 0;
+  }
+
+  SlotAllocator m_Alloc;
+  Slot *m_Slabs;
+  Slot *m_FreeList;
+  Slot *m_Cursor;
+  Slot *m_SlabEnd;
+  size_t m_Capacity;
+};
+
+template <typename TNode, typename Allocator>
+NodePool<TNode, Allocator>::NodePool(NodePool &&other) noexcept
+    : m_Alloc(std::move(other.m_Alloc)), m_Slabs(other.m_Slabs),
+      m_FreeList(other.m_FreeList), m_Cursor(other.m_Cursor),
+      m_SlabEnd(other.m_SlabEnd), m_Capacity(other.m_Capacity) {
+  other.m_Slabs = nullptr;
+  other.m_FreeList = nullptr;
+  other.m_Cursor = nullptr;
+  other.m_SlabEnd = nullptr;
+  other.m_Capacity = 0;
+}
+
+// Takes the allocator along with the slabs, so it is only usable for
+// allocators that propagate on move assignment.
+template <typename TNode, typename Allocator>
+NodePool<TNode, Allocator> &
+NodePool<TNode, Allocator>::operator=(NodePool &&other) noexcept {
+  if (this == &other) {
+    return *this;
+  }
+  release();
+  m_Alloc = std::move(other.m_Alloc);
+  std::swap(m_Slabs, other.m_Slabs);
+  std::swap(m_FreeList, other.m_FreeList);
+  std::swap(m_Cursor, other.m_Cursor);
+  std::swap(m_SlabEnd, other.m_SlabEnd);
+  std::swap(m_Capacity, other.m_Capacity);
+  return *this;
+}
+
+template <typename TNode, typename Allocator>
+TNode *NodePool<TNode, Allocator>::allocate() {
+  if (m_FreeList != nullptr) {
+    Slot *slot = m_FreeList;
+    m_FreeList = slot->m_Next;
+    return reinterpret_cast<TNode *>(slot);
+  }
+
+  if (m_Cursor == m_SlabEnd) {
+    addSlab(std::min(std::max(m_Capacity, kMinSlabSize), kMaxSlabSize));
+  }
+
+  return reinterpret_cast<TNode *>(m_Cursor++);
+}
+
+template <typename TNode, typename Allocator>
+void NodePool<TNode, Allocator>::deallocate(TNode *node) {
+  Slot *slot = reinterpret_cast<Slot *>(node);
+  slot->m_Next = m_FreeList;
+  m_FreeList = slot;
+}
+
+template <typename TNode, typename Allocator>
+void NodePool<TNode, Allocator>::reserve(size_t nodesNum) {
+  if (nodesNum > m_Capacity) {
+    addSlab(nodesNum - m_Capacity);
+  }
+}
+
+template <typename TNode, typename Allocator>
+size_t NodePool<TNode, Allocator>::bytes() const {
+  size_t result = 0;
+  for (const Slot *slab = m_Slabs; slab != nullptr;
+       slab = slab->m_Header.m_NextSlab) {
+    result += slabBytes(slab);
+  }
+  return result;
+}
+
+template <typename TNode, typename Allocator>
+size_t NodePool<TNode, Allocator>::overheadBytes() const {
+  size_t result = 0;
+  for (const Slot *slab = m_Slabs; slab != nullptr;
+       slab = slab->m_Header.m_NextSlab) {
+    result += slabOverhead(slab);
+  }
+  return result;
+}
+
+template <typename TNode, typename Allocator>
+void NodePool<TNode, Allocator>::release() {
+  while (m_Slabs != nullptr) {
+    Slot *nextSlab = m_Slabs->m_Header.m_NextSlab;
+    MemoryCounters::removeNodeBytes(slabBytes(m_Slabs), slabOverhead(m_Slabs));
+    SlotAllocatorTraits::deallocate(m_Alloc, m_Slabs,
+                                    m_Slabs->m_Header.m_SlotsNum);
+    m_Slabs = nextSlab;
+  }
+
+  m_FreeList = nullptr;
+  m_Cursor = nullptr;
+  m_SlabEnd = nullptr;
+  m_Capacity = 0;
+}
+
+// As for standard containers, the allocators are exchanged only if they
+// propagate on swap and must compare equal otherwise.
+template <typename TNode, typename Allocator>
+void NodePool<TNode, Allocator>::swap(NodePool &other) noexcept {
+  using std::swap;
+  if constexpr (SlotAllocatorTraits::propagate_on_container_swap::value) {
+    swap(m_Alloc, other.m_Alloc);
+  }
+  swap(m_Slabs, other.m_Slabs);
+  swap(m_FreeList, other.m_FreeList);
+  swap(m_Cursor, other.m_Cursor);
+  swap(m_SlabEnd, other.m_SlabEnd);
+  swap(m_Capacity, other.m_Capacity);
+}
+
+// Takes over all slabs of other, so nodes allocated from it can be used and
+// freed as nodes of this pool. The allocators must compare equal.
+template <typename TNode, typename Allocator>
+void NodePool<TNode, Allocator>::splice(NodePool &other) {
+  if (this == &other || other.m_Slabs == nullptr) {
+    return;
+  }
+
+  while (other.m_Cursor != other.m_SlabEnd) {
+    deallocate(reinterpret_cast<TNode *>(other.m_Cursor++));
+  }
+  while (other.m_FreeList != nullptr) {
+    Slot *slot = other.m_FreeList;
+    other.m_FreeList = slot->m_Next;
+    deallocate(reinterpret_cast<TNode *>(slot));
+  }
+
+  Slot *lastSlab = other.m_Slabs;
+  while (lastSlab->m_Header.m_NextSlab != nullptr) {
+    lastSlab = lastSlab->m_Header.m_NextSlab;
+  }
+  lastSlab->m_Header.m_NextSlab = m_Slabs;
+  m_Slabs = other.m_Slabs;
+  m_Capacity += other.m_Capacity;
+
+  other.m_Slabs = nullptr;
+  other.m_Cursor = nullptr;
+  other.m_SlabEnd = nullptr;
+  other.m_Capacity = 0;
+}
+
+template <typename TNode, typename Allocator>
+void NodePool<TNode, Allocator>::reset(const Allocator &alloc) {
+  release();
+  m_Alloc = SlotAllocator(alloc);
+}
+
+template <typename TNode, typename Allocator>
+void NodePool<TNode, Allocator>::addSlab(size_t nodesNum) {
+  size_t slotsNum = nodesNum + 1;
+  Slot *slab = SlotAllocatorTraits::allocate(m_Alloc, slotsNum);
+  slab->m_Header.m_NextSlab = m_Slabs;
+  slab->m_Header.m_SlotsNum = slotsNum;
+  m_Slabs = slab;
+  MemoryCounters::addNodeBytes(slabBytes(slab), slabOverhead(slab));
+
+  // Unused slots of the current slab are kept on the free list.
+  while (m_Cursor != m_SlabEnd) {
+    deallocate(reinterpret_cast<TNode *>(m_Cursor++));
+  }
+
+  m_Cursor = slab + 1;
+  m_SlabEnd = slab + slotsNum;
+  m_Capacity += nodesNum;
+}
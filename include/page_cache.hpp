@@ -0,0 +1,479 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+class PageCache;
+
+// Pin of a page in a PageCache. The page stays in memory, at the same
+// address, as long as a PageRef to it exists.
+class PageRef {
+public:
+  PageRef() : m_Cache(nullptr), m_Frame(0) {}
+  PageRef(const PageRef &other);
+  PageRef(PageRef &&other) noexcept
+      : m_Cache(other.m_Cache), m_Frame(other.m_Frame) {
+    other.m_Cache = nullptr;
+  }
+  ~PageRef() { reset(); }
+  PageRef &operator=(PageRef other) noexcept {
+    std::swap(m_Cache, other.m_Cache);
+    std::swap(m_Frame, other.m_Frame);
+    return *this;
+  }
+
+  explicit operator bool() const { return m_Cache != nullptr; }
+  // Id of the page, PageCache::kNoPage for an empty PageRef.
+  uint64_t id() const;
+  char *data() const;
+  // The page is written back to the file before it leaves the cache.
+  void markDirty() const;
+  void reset();
+
+private:
+  friend class PageCache;
+
+  PageRef(PageCache *cache, size_t frame) : m_Cache(cache), m_Frame(frame) {}
+
+  PageCache *m_Cache;
+  size_t m_Frame;
+};
+
+// Fixed-size pages of a file cached in a fixed number of frames. Pages are
+// pinned through PageRef while in use; unpinned pages are evicted in CLOCK
+// order when a frame is needed, changed ones are written back first. All
+// reads and writes of the file go through the cache and use one system call
+// per run of consecutive pages where possible.
+//
+// Not thread-safe. POSIX only.
+class PageCache {
+public:
+  static constexpr uint64_t kNoPage = UINT64_MAX;
+  // Enough for a root-to-leaf path of a tree, its siblings and a few
+  // iterators.
+  static constexpr size_t kMinFramesNum = 16;
+
+  // Opens path, creating it if needed, with at least kMinFramesNum frames of
+  // pageSize bytes. pageSize has to be a power of two of at least 512, the
+  // frames are aligned to it. Throws std::invalid_argument otherwise and
+  // std::system_error if the file cannot be opened.
+  PageCache(const std::string &path, size_t pageSize, size_t framesNum);
+  PageCache(const PageCache &) = delete;
+  PageCache &operator=(const PageCache &) = delete;
+  // Writes back the changed pages, errors are ignored: call flush to see
+  // them.
+  ~PageCache();
+
+  size_t pageSize() const { return m_PageSize; }
+  size_t framesNum() const { return m_Frames.size(); }
+  // Pages in the file, not counting new pages that are only in the cache.
+  uint64_t filePagesNum() const { return m_FilePagesNum; }
+  // Size of the file when it was opened, a partial last page included.
+  uint64_t openedFileBytes() const { return m_OpenedFileBytes; }
+  bool contains(uint64_t pageId) const { return findFrame(pageId) != kNoFrame; }
+  // Pins the page, reading it if it is not cached.
+  PageRef pin(uint64_t pageId);
+  // Pins the page without reading it, zero-filled and dirty: for new pages
+  // and pages that are going to be overwritten.
+  PageRef pinNew(uint64_t pageId);
+  // Reads the pages of [first, first + count) that are in the file but not in
+  // the cache, one system call per run. At most a quarter of the frames is
+  // used; the pages are the first to go if they are not pinned soon.
+  void prefetch(uint64_t first, size_t count);
+  // Writes back the changed pages in page order.
+  void flush();
+  // Drops the pages from pagesNum on, which must not be pinned, and cuts the
+  // file to pagesNum pages.
+  void truncate(uint64_t pagesNum);
+
+  // System calls that read or wrote pages so far.
+  uint64_t readsNum() const { return m_ReadsNum; }
+  uint64_t writesNum() const { return m_WritesNum; }
+
+private:
+  friend class PageRef;
+
+  struct Frame {
+    uint64_t m_PageId;
+    uint32_t m_PinsNum;
+    bool m_Dirty;
+    bool m_Referenced;
+  };
+
+  // Most pages written or read in one system call.
+  static constexpr size_t kMaxRunPages = 64;
+  static constexpr size_t kNoFrame = SIZE_MAX;
+
+  // Open addressing table from page ids to frames with linear probing, at
+  // most half full. It is looked up on every pin, once per tree level.
+  struct IndexSlot {
+    uint64_t m_PageId;
+    size_t m_Frame;
+  };
+
+  char *frameData(size_t frame) const {
+    return m_Data + frame * m_PageSize;
+  }
+  size_t indexSlot(uint64_t pageId) const {
+    return (pageId * 0x9e3779b97f4a7c15ULL) >> m_IndexShift;
+  }
+  size_t findFrame(uint64_t pageId) const;
+  void addToIndex(uint64_t pageId, size_t frame);
+  void removeFromIndex(uint64_t pageId);
+  size_t takeFrame();
+  void writeRun(const size_t *frames, size_t count);
+  void readRun(uint64_t first, const size_t *frames, size_t count);
+  void transfer(bool write, uint64_t first, const size_t *frames,
+                size_t count);
+
+  int m_Fd;
+  size_t m_PageSize;
+  uint64_t m_FilePagesNum;
+  uint64_t m_OpenedFileBytes;
+  char *m_Data;
+  std::vector<Frame> m_Frames;
+  std::vector<IndexSlot> m_Index;
+  unsigned m_IndexShift;
+  size_t m_Hand;
+  uint64_t m_ReadsNum;
+  uint64_t m_WritesNum;
+};
+
+inline PageRef::PageRef(const PageRef &other)
+    : m_Cache(other.m_Cache), m_Frame(other.m_Frame) {
+  if (m_Cache != nullptr) {
+    ++m_Cache->m_Frames[m_Frame].m_PinsNum;
+  }
+}
+
+inline uint64_t PageRef::id() const {
+  return m_Cache == nullptr ? PageCache::kNoPage
+                            : m_Cache->m_Frames[m_Frame].m_PageId;
+}
+
+inline char *PageRef::data() const { return m_Cache->frameData(m_Frame); }
+
+inline void PageRef::markDirty() const {
+  m_Cache->m_Frames[m_Frame].m_Dirty = true;
+}
+
+inline void PageRef::reset() {
+  if (m_Cache != nullptr) {
+    --m_Cache->m_Frames[m_Frame].m_PinsNum;
+    m_Cache = nullptr;
+  }
+}
+
+inline PageCache::PageCache(const std::string &path, size_t pageSize,
+                            size_t framesNum)
+    : m_Fd(-1), m_PageSize(pageSize), m_FilePagesNum(0),
+      m_OpenedFileBytes(0), m_Data(nullptr),
+      m_Frames(std::max(framesNum, kMinFramesNum),
+               Frame{kNoPage, 0, false, false}),
+      m_IndexShift(64), m_Hand(0), m_ReadsNum(0), m_WritesNum(0) {
+  size_t indexSize = 1;
+  while (indexSize < 2 * m_Frames.size()) {
+    indexSize *= 2;
+    --m_IndexShift;
+  }
+  m_Index.assign(indexSize, IndexSlot{kNoPage, kNoFrame});
+  if (pageSize < 512 || (pageSize & (pageSize - 1)) != 0) {
+    throw std::invalid_argument(
+        "PageCache: page size has to be a power of two of at least 512");
+  }
+  m_Fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (m_Fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "PageCache: cannot open " + path);
+  }
+  struct stat fileStat;
+  if (::fstat(m_Fd, &fileStat) != 0) {
+    int error = errno;
+    ::close(m_Fd);
+    throw std::system_error(error, std::generic_category(),
+                            "PageCache: cannot stat " + path);
+  }
+  m_OpenedFileBytes = static_cast<uint64_t>(fileStat.st_size);
+  m_FilePagesNum = m_OpenedFileBytes / m_PageSize;
+  try {
+    m_Data = static_cast<char *>(::operator new(
+        m_Frames.size() * m_PageSize, std::align_val_t(m_PageSize)));
+  } catch (...) {
+    ::close(m_Fd);
+    throw;
+  }
+}
+
+inline PageCache::~PageCache() {
+  try {
+    flush();
+  } catch (...) {
+  }
+  ::operator delete(m_Data, std::align_val_t(m_PageSize));
+  ::close(m_Fd);
+}
+
+inline PageRef PageCache::pin(uint64_t pageId) {
+  size_t cached = findFrame(pageId);
+  if (cached != kNoFrame) {
+    ++m_Frames[cached].m_PinsNum;
+    m_Frames[cached].m_Referenced = true;
+    return PageRef(this, cached);
+  }
+  if (pageId >= m_FilePagesNum) {
+    throw std::runtime_error("PageCache: page " + std::to_string(pageId) +
+                             " is past the end of the file");
+  }
+  size_t frame = takeFrame();
+  readRun(pageId, &frame, 1);
+  m_Frames[frame] = Frame{pageId, 1, false, true};
+  addToIndex(pageId, frame);
+  return PageRef(this, frame);
+}
+
+inline PageRef PageCache::pinNew(uint64_t pageId) {
+  PageRef page;
+  size_t cached = findFrame(pageId);
+  if (cached != kNoFrame) {
+    ++m_Frames[cached].m_PinsNum;
+    page = PageRef(this, cached);
+  } else {
+    size_t frame = takeFrame();
+    m_Frames[frame] = Frame{pageId, 1, false, false};
+    addToIndex(pageId, frame);
+    page = PageRef(this, frame);
+  }
+  m_Frames[page.m_Frame].m_Dirty = true;
+  m_Frames[page.m_Frame].m_Referenced = true;
+  std::memset(page.data(), 0, m_PageSize);
+  return page;
+}
+
+inline void PageCache::prefetch(uint64_t first, size_t count) {
+  count = std::min(count, m_Frames.size() / 4);
+  uint64_t last = std::min(first + count, m_FilePagesNum);
+  std::vector<size_t> frames;
+  // Frames taken for the current run stay pinned until it is read, so that
+  // taking the next one cannot evict them.
+  auto readFrames = [&](uint64_t runFirst) {
+    try {
+      readRun(runFirst, frames.data(), frames.size());
+    } catch (...) {
+      for (size_t frame : frames) {
+        m_Frames[frame] = Frame{kNoPage, 0, false, false};
+      }
+      throw;
+    }
+    for (size_t i = 0; i < frames.size(); ++i) {
+      m_Frames[frames[i]] = Frame{runFirst + i, 0, false, false};
+      addToIndex(runFirst + i, frames[i]);
+    }
+    frames.clear();
+  };
+  uint64_t runFirst = first;
+  for (uint64_t pageId = first; pageId < last; ++pageId) {
+    if (contains(pageId)) {
+      if (!frames.empty()) {
+        readFrames(runFirst);
+      }
+      continue;
+    }
+    if (frames.size() == kMaxRunPages) {
+      readFrames(runFirst);
+    }
+    if (frames.empty()) {
+      runFirst = pageId;
+    }
+    size_t frame = takeFrame();
+    m_Frames[frame].m_PinsNum = 1;
+    frames.push_back(frame);
+  }
+  if (!frames.empty()) {
+    readFrames(runFirst);
+  }
+}
+
+inline void PageCache::flush() {
+  std::vector<size_t> dirty;
+  for (size_t frame = 0; frame < m_Frames.size(); ++frame) {
+    if (m_Frames[frame].m_Dirty) {
+      dirty.push_back(frame);
+    }
+  }
+  std::sort(dirty.begin(), dirty.end(), [this](size_t lhs, size_t rhs) {
+    return m_Frames[lhs].m_PageId < m_Frames[rhs].m_PageId;
+  });
+  for (size_t begin = 0, end = 0; begin < dirty.size(); begin = end) {
+    end = begin + 1;
+    while (end < dirty.size() && end - begin < kMaxRunPages &&
+           m_Frames[dirty[end]].m_PageId ==
+               m_Frames[dirty[end - 1]].m_PageId + 1) {
+      ++end;
+    }
+    writeRun(dirty.data() + begin, end - begin);
+  }
+}
+
+inline void PageCache::truncate(uint64_t pagesNum) {
+  for (size_t frame = 0; frame < m_Frames.size(); ++frame) {
+    if (m_Frames[frame].m_PageId != kNoPage &&
+        m_Frames[frame].m_PageId >= pagesNum &&
+        m_Frames[frame].m_PinsNum > 0) {
+      throw std::runtime_error("PageCache::truncate: page is pinned");
+    }
+  }
+  for (size_t frame = 0; frame < m_Frames.size(); ++frame) {
+    if (m_Frames[frame].m_PageId != kNoPage &&
+        m_Frames[frame].m_PageId >= pagesNum) {
+      removeFromIndex(m_Frames[frame].m_PageId);
+      m_Frames[frame] = Frame{kNoPage, 0, false, false};
+    }
+  }
+  if (::ftruncate(m_Fd, static_cast<off_t>(pagesNum * m_PageSize)) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "PageCache: cannot truncate the file");
+  }
+  m_FilePagesNum = std::min(m_FilePagesNum, pagesNum);
+}
+
+inline size_t PageCache::findFrame(uint64_t pageId) const {
+  size_t mask = m_Index.size() - 1;
+  for (size_t slot = indexSlot(pageId);; slot = (slot + 1) & mask) {
+    if (m_Index[slot].m_PageId == pageId) {
+      return m_Index[slot].m_Frame;
+    }
+    if (m_Index[slot].m_PageId == kNoPage) {
+      return kNoFrame;
+    }
+  }
+}
+
+inline void PageCache::addToIndex(uint64_t pageId, size_t frame) {
+  size_t mask = m_Index.size() - 1;
+  size_t slot = indexSlot(pageId);
+  while (m_Index[slot].m_PageId != kNoPage) {
+    slot = (slot + 1) & mask;
+  }
+  m_Index[slot] = IndexSlot{pageId, frame};
+}
+
+// Later entries of the probe run are moved back into the hole, so that
+// lookups can stop at the first empty slot.
+inline void PageCache::removeFromIndex(uint64_t pageId) {
+  size_t mask = m_Index.size() - 1;
+  size_t hole = indexSlot(pageId);
+  while (m_Index[hole].m_PageId != pageId) {
+    hole = (hole + 1) & mask;
+  }
+  for (size_t slot = (hole + 1) & mask; m_Index[slot].m_PageId != kNoPage;
+       slot = (slot + 1) & mask) {
+    size_t home = indexSlot(m_Index[slot].m_PageId);
+    // The entry may fill the hole if its home is not in (hole, slot].
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      m_Index[hole] = m_Index[slot];
+      hole = slot;
+    }
+  }
+  m_Index[hole] = IndexSlot{kNoPage, kNoFrame};
+}
+
+// Returns an empty frame: a free one or the next unpinned one the CLOCK hand
+// finds without the referenced bit, written back if it was changed.
+inline size_t PageCache::takeFrame() {
+  for (size_t steps = 0; steps < 2 * m_Frames.size(); ++steps) {
+    size_t frame = m_Hand;
+    m_Hand = (m_Hand + 1) % m_Frames.size();
+    Frame &candidate = m_Frames[frame];
+    if (candidate.m_PageId == kNoPage) {
+      if (candidate.m_PinsNum == 0) {
+        return frame;
+      }
+      continue;
+    }
+    if (candidate.m_PinsNum > 0) {
+      continue;
+    }
+    if (candidate.m_Referenced) {
+      candidate.m_Referenced = false;
+      continue;
+    }
+    if (candidate.m_Dirty) {
+      writeRun(&frame, 1);
+    }
+    removeFromIndex(candidate.m_PageId);
+    candidate = Frame{kNoPage, 0, false, false};
+    return frame;
+  }
+  throw std::runtime_error("PageCache: all pages are pinned");
+}
+
+// Writes the pages of frames, which have consecutive ids, with one call.
+inline void PageCache::writeRun(const size_t *frames, size_t count) {
+  uint64_t first = m_Frames[frames[0]].m_PageId;
+  transfer(true, first, frames, count);
+  for (size_t i = 0; i < count; ++i) {
+    m_Frames[frames[i]].m_Dirty = false;
+  }
+  m_FilePagesNum = std::max<uint64_t>(m_FilePagesNum, first + count);
+}
+
+// Reads count pages starting with page first into frames with one call.
+inline void PageCache::readRun(uint64_t first, const size_t *frames,
+                               size_t count) {
+  transfer(false, first, frames, count);
+}
+
+// preadv and pwritev may transfer less than asked, the rest is done by
+// further calls.
+inline void PageCache::transfer(bool write, uint64_t first,
+                                const size_t *frames, size_t count) {
+  iovec iov[kMaxRunPages];
+  for (size_t i = 0; i < count; ++i) {
+    iov[i].iov_base = frameData(frames[i]);
+    iov[i].iov_len = m_PageSize;
+  }
+  off_t offset = static_cast<off_t>(first * m_PageSize);
+  size_t iovFirst = 0;
+  while (iovFirst < count) {
+    int iovNum = static_cast<int>(count - iovFirst);
+    ssize_t done = write ? ::pwritev(m_Fd, iov + iovFirst, iovNum, offset)
+                         : ::preadv(m_Fd, iov + iovFirst, iovNum, offset);
+    ++(write ? m_WritesNum : m_ReadsNum);
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(),
+                              write ? "PageCache: cannot write a page"
+                                    : "PageCache: cannot read a page");
+    }
+    if (done == 0) {
+      throw std::runtime_error("PageCache: unexpected end of the file");
+    }
+    offset += done;
+    for (size_t left = static_cast<size_t>(done); left > 0;) {
+      size_t step = std::min(left, iov[iovFirst].iov_len);
+      iov[iovFirst].iov_base =
+          static_cast<char *>(iov[iovFirst].iov_base) + step;
+      iov[iovFirst].iov_len -= step;
+      left -= step;
+      if (iov[iovFirst].iov_len == 0) {
+        ++iovFirst;
+      }
+    }
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <exception>
+#include <system_error>
+#include <thread>
+
+// Fork-join helpers for the bulk operations of the trees. Work is split
+// recursively and every fork hands half of its thread budget to a new thread,
+// so an operation started with threadsNum threads never runs more than
+// threadsNum of them at once and creates threadsNum - 1 in total.
+namespace parallel {
+
+// Runs left and right, left on a new thread if threadsNum > 1. Returns once
+// both are done. An exception from either is rethrown after both have
+// finished.
+template <typename Left, typename Right>
+void forkJoin(size_t threadsNum, Left left, Right right) {
+  if (threadsNum <= 1) {
+    left();
+    right();
+    return;
+  }
+
+  std::exception_ptr leftError;
+  std::thread thread;
+  try {
+    thread = std::thread([&left, &leftError] {
+      try {
+        left();
+      } catch (...) {
+        leftError = std::current_exception();
+      }
+    });
+  } catch (const std::system_error &) {
+    // No thread to spare, the work is done here.
+    left();
+    right();
+    return;
+  }
+
+  try {
+    right();
+  } catch (...) {
+    thread.join();
+    throw;
+  }
+  thread.join();
+  if (leftError) {
+    std::rethrow_exception(leftError);
+  }
+}
+
+// Threads for the left and the right part of a fork.
+inline size_t leftThreads(size_t threadsNum) { return threadsNum / 2; }
+inline size_t rightThreads(size_t threadsNum) {
+  return threadsNum - threadsNum / 2;
+}
+
+} // namespace parallel
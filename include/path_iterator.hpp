@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+
+// Bidirectional iterator over a binary search tree without parent or thread
+// links, as used by trees whose nodes are shared between versions. It keeps
+// the path from the root to the current node, so each step is O(1)
+// amortized; end() has an empty path.
+//
+// TNode needs m_Key, m_LeftChild and m_RightChild members.
+template <typename T, typename TNode> class PathIterator {
+public:
+  typedef std::ptrdiff_t difference_type;
+  typedef T value_type;
+  typedef const T &reference;
+  typedef const T &const_reference;
+  typedef const T *pointer;
+  typedef const T *const_pointer;
+  typedef std::bidirectional_iterator_tag iterator_category;
+
+  PathIterator() : m_Root(nullptr), m_Depth(0) {}
+  const T &operator*() const { return m_Path[m_Depth - 1]->m_Key; }
+  const T *operator->() const { return &m_Path[m_Depth - 1]->m_Key; }
+
+  PathIterator &operator++();
+  PathIterator operator++(int) {
+    auto res = *this;
+    ++*this;
+    return res;
+  }
+  PathIterator &operator--();
+  PathIterator operator--(int) {
+    auto res = *this;
+    --*this;
+    return res;
+  }
+
+  bool operator==(const PathIterator &other) const {
+    return node() == other.node();
+  }
+  bool operator!=(const PathIterator &other) const {
+    return !(*this == other);
+  }
+
+  template <typename, typename, typename> friend class RcuAvlTree;
+  template <typename, typename, typename> friend class PersistentAvlTree;
+
+private:
+  // An AVL tree 64 levels deep has more than 10^13 nodes.
+  static constexpr size_t kMaxDepth = 64;
+
+  explicit PathIterator(const TNode *root) : m_Root(root), m_Depth(0) {}
+  const TNode *node() const {
+    return m_Depth == 0 ? nullptr : m_Path[m_Depth - 1];
+  }
+  void push(const TNode *node) { m_Path[m_Depth++] = node; }
+  void pushLeftmost(const TNode *node);
+  void pushRightmost(const TNode *node);
+
+  const TNode *m_Root;
+  size_t m_Depth;
+  const TNode *m_Path[kMaxDepth];
+};
+
+template <typename T, typename TNode>
+void PathIterator<T, TNode>::pushLeftmost(const TNode *node) {
+  for (; node != nullptr; node = node->m_LeftChild) {
+    push(node);
+  }
+}
+
+template <typename T, typename TNode>
+void PathIterator<T, TNode>::pushRightmost(const TNode *node) {
+  for (; node != nullptr; node = node->m_RightChild) {
+    push(node);
+  }
+}
+
+// Without a right subtree the next node is the closest ancestor reached from
+// its left child.
+template <typename T, typename TNode>
+PathIterator<T, TNode> &PathIterator<T, TNode>::operator++() {
+  const TNode *current = m_Path[m_Depth - 1];
+  if (current->m_RightChild != nullptr) {
+    pushLeftmost(current->m_RightChild);
+    return *this;
+  }
+  const TNode *child = nullptr;
+  do {
+    child = m_Path[--m_Depth];
+  } while (m_Depth > 0 && m_Path[m_Depth - 1]->m_RightChild == child);
+  return *this;
+}
+
+template <typename T, typename TNode>
+PathIterator<T, TNode> &PathIterator<T, TNode>::operator--() {
+  if (m_Depth == 0) {
+    pushRightmost(m_Root);
+    return *this;
+  }
+  const TNode *current = m_Path[m_Depth - 1];
+  if (current->m_LeftChild != nullptr) {
+    pushRightmost(current->m_LeftChild);
+    return *this;
+  }
+  const TNode *child = nullptr;
+  do {
+    child = m_Path[--m_Depth];
+  } while (m_Depth > 0 && m_Path[m_Depth - 1]->m_LeftChild == child);
+  return *this;
+}
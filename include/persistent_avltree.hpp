@@ -0,0 +1,526 @@
+#pragma once
+
+#include "path_iterator.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+
+template <typename TKey, typename Compare, typename Allocator>
+class PersistentAvlTree;
+
+template <typename TKey> class PersistentTreeNode {
+public:
+  template <typename... Args>
+  explicit PersistentTreeNode(std::in_place_t, Args &&...args)
+      : m_Key(std::forward<Args>(args)...), m_Height(1), m_LeftChild(nullptr),
+        m_RightChild(nullptr), m_RefCount(1) {}
+  template <typename, typename, typename> friend class PersistentAvlTree;
+  template <typename, typename> friend class PathIterator;
+
+protected:
+  TKey m_Key;
+  int m_Height;
+  PersistentTreeNode<TKey> *m_LeftChild;
+  PersistentTreeNode<TKey> *m_RightChild;
+  // Number of trees and nodes pointing to the node.
+  std::atomic<size_t> m_RefCount;
+};
+
+// AVL tree whose copies share nodes. Copying takes O(1): the copy points to
+// the same root and bumps its reference count. A change copies only the shared
+// nodes on the path it touches, O(log n) of them, and changes the nodes the
+// tree owns alone in place, so a tree that is not shared is updated like an
+// ordinary one.
+//
+// Reference counts are atomic, so copies may be used and destroyed on
+// different threads. As with other containers, a single tree must not be
+// changed while another thread uses it.
+//
+// Nodes are not threaded, because a thread link would tie every node to its
+// neighbours in all versions, so iterators keep the path from the root. Any
+// change invalidates iterators into the tree, including copy assignment.
+// Nodes come straight from Allocator, since they are shared between trees
+// and released by whichever tree drops them last. Trees only share nodes if
+// their allocators compare equal.
+template <typename TKey, typename Compare = std::less<TKey>,
+          typename Allocator = std::allocator<TKey>>
+class PersistentAvlTree {
+public:
+  typedef PathIterator<TKey, PersistentTreeNode<TKey>> const_iterator;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  explicit PersistentAvlTree(const Compare &comp = Compare(),
+                             const Allocator &alloc = Allocator())
+      : m_Root(nullptr), m_Size(0), m_Compare(comp), m_Alloc(alloc) {}
+  PersistentAvlTree(const PersistentAvlTree &other);
+  PersistentAvlTree(PersistentAvlTree &&other) noexcept;
+  ~PersistentAvlTree() { release(m_Root); }
+  PersistentAvlTree &operator=(const PersistentAvlTree &other);
+  PersistentAvlTree &operator=(PersistentAvlTree &&other);
+
+  // add and remove return whether the tree has changed. If they throw, the
+  // tree stays as it was.
+  template <typename K> bool add(K &&key);
+  template <typename K> bool remove(const K &key);
+  void clear();
+  void swap(PersistentAvlTree &other) noexcept;
+
+  const_iterator begin() const;
+  const_iterator end() const { return const_iterator(m_Root); }
+  template <typename K> const_iterator find(const K &key) const;
+  template <typename K> const_iterator lowerBound(const K &key) const {
+    return bound(key, false);
+  }
+  template <typename K> const_iterator upperBound(const K &key) const {
+    return bound(key, true);
+  }
+  template <typename K> bool exists(const K &key) const;
+  // Whether the trees share their root, so a copy has not been changed since.
+  bool sharesWith(const PersistentAvlTree &other) const {
+    return m_Root == other.m_Root;
+  }
+
+  size_t size() const { return m_Size; }
+  key_compare key_comp() const { return m_Compare; }
+  allocator_type get_allocator() const { return allocator_type(m_Alloc); }
+
+private:
+  typedef PersistentTreeNode<TKey> Node;
+  typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Node>
+      NodeAllocator;
+  typedef std::allocator_traits<NodeAllocator> NodeAllocatorTraits;
+
+  // An AVL tree 64 levels deep has more than 10^13 nodes.
+  static constexpr size_t kMaxHeight = 64;
+
+  Node *m_Root;
+  size_t m_Size;
+  Compare m_Compare;
+  NodeAllocator m_Alloc;
+
+  template <typename... Args> Node *createNode(Args &&...);
+  void destroyNode(Node *);
+  void release(Node *);
+  static Node *share(Node *node) {
+    if (node != nullptr) {
+      node->m_RefCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    return node;
+  }
+  Node *copy(const Node *);
+  Node *unique(Node *&);
+  void rebalancePath(Node **path[], size_t depth);
+  Node *balance(Node *);
+  static Node *rotateRight(Node *);
+  static Node *rotateLeft(Node *);
+  static void fixHeight(Node *node) {
+    node->m_Height =
+        std::max(height(node->m_LeftChild), height(node->m_RightChild)) + 1;
+  }
+  static int height(const Node *node) {
+    return node == nullptr ? 0 : node->m_Height;
+  }
+
+  template <typename K> const_iterator bound(const K &, bool) const;
+};
+
+// Nodes are shared only if the new allocator can release the other's nodes.
+template <typename TKey, typename Compare, typename Allocator>
+PersistentAvlTree<TKey, Compare, Allocator>::PersistentAvlTree(
+    const PersistentAvlTree &other)
+    : m_Root(nullptr), m_Size(other.m_Size), m_Compare(other.m_Compare),
+      m_Alloc(NodeAllocatorTraits::select_on_container_copy_construction(
+          other.m_Alloc)) {
+  m_Root = m_Alloc == other.m_Alloc ? share(other.m_Root) : copy(other.m_Root);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+PersistentAvlTree<TKey, Compare, Allocator>::PersistentAvlTree(
+    PersistentAvlTree &&other) noexcept
+    : m_Root(other.m_Root), m_Size(other.m_Size),
+      m_Compare(std::move(other.m_Compare)), m_Alloc(std::move(other.m_Alloc)) {
+  other.m_Root = nullptr;
+  other.m_Size = 0;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+PersistentAvlTree<TKey, Compare, Allocator> &
+PersistentAvlTree<TKey, Compare, Allocator>::operator=(
+    const PersistentAvlTree &other) {
+  if (this == &other) {
+    return *this;
+  }
+  clear();
+  if constexpr (NodeAllocatorTraits::propagate_on_container_copy_assignment::
+                    value) {
+    m_Alloc = other.m_Alloc;
+  }
+  m_Root = m_Alloc == other.m_Alloc ? share(other.m_Root) : copy(other.m_Root);
+  m_Size = other.m_Size;
+  m_Compare = other.m_Compare;
+  return *this;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+PersistentAvlTree<TKey, Compare, Allocator> &
+PersistentAvlTree<TKey, Compare, Allocator>::operator=(
+    PersistentAvlTree &&other) {
+  if (this == &other) {
+    return *this;
+  }
+  if constexpr (!NodeAllocatorTraits::propagate_on_container_move_assignment::
+                    value) {
+    if (m_Alloc != other.m_Alloc) {
+      *this = static_cast<const PersistentAvlTree &>(other);
+      other.clear();
+      return *this;
+    }
+  }
+  clear();
+  if constexpr (NodeAllocatorTraits::propagate_on_container_move_assignment::
+                    value) {
+    m_Alloc = std::move(other.m_Alloc);
+  }
+  m_Compare = std::move(other.m_Compare);
+  std::swap(m_Root, other.m_Root);
+  std::swap(m_Size, other.m_Size);
+  return *this;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void PersistentAvlTree<TKey, Compare, Allocator>::swap(
+    PersistentAvlTree &other) noexcept {
+  using std::swap;
+  if constexpr (NodeAllocatorTraits::propagate_on_container_swap::value) {
+    swap(m_Alloc, other.m_Alloc);
+  }
+  swap(m_Root, other.m_Root);
+  swap(m_Size, other.m_Size);
+  swap(m_Compare, other.m_Compare);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename... Args>
+typename PersistentAvlTree<TKey, Compare, Allocator>::Node *
+PersistentAvlTree<TKey, Compare, Allocator>::createNode(Args &&...args) {
+  Node *node = NodeAllocatorTraits::allocate(m_Alloc, 1);
+  try {
+    NodeAllocatorTraits::construct(m_Alloc, node, std::in_place,
+                                   std::forward<Args>(args)...);
+  } catch (...) {
+    NodeAllocatorTraits::deallocate(m_Alloc, node, 1);
+    throw;
+  }
+  return node;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void PersistentAvlTree<TKey, Compare, Allocator>::destroyNode(Node *node) {
+  NodeAllocatorTraits::destroy(m_Alloc, node);
+  NodeAllocatorTraits::deallocate(m_Alloc, node, 1);
+}
+
+// Drops one reference to node and frees whatever nobody points to any more.
+template <typename TKey, typename Compare, typename Allocator>
+void PersistentAvlTree<TKey, Compare, Allocator>::release(Node *node) {
+  while (node != nullptr &&
+         node->m_RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    release(node->m_LeftChild);
+    Node *right = node->m_RightChild;
+    destroyNode(node);
+    node = right;
+  }
+}
+
+// Deep copy into nodes of this tree's allocator.
+template <typename TKey, typename Compare, typename Allocator>
+typename PersistentAvlTree<TKey, Compare, Allocator>::Node *
+PersistentAvlTree<TKey, Compare, Allocator>::copy(const Node *node) {
+  if (node == nullptr) {
+    return nullptr;
+  }
+  Node *res = createNode(node->m_Key);
+  res->m_Height = node->m_Height;
+  try {
+    res->m_LeftChild = copy(node->m_LeftChild);
+    res->m_RightChild = copy(node->m_RightChild);
+  } catch (...) {
+    release(res);
+    throw;
+  }
+  return res;
+}
+
+// Makes the node at link owned by this tree alone, copying it if it is
+// shared. The node holding link has to be owned alone already.
+template <typename TKey, typename Compare, typename Allocator>
+typename PersistentAvlTree<TKey, Compare, Allocator>::Node *
+PersistentAvlTree<TKey, Compare, Allocator>::unique(Node *&link) {
+  Node *node = link;
+  if (node->m_RefCount.load(std::memory_order_acquire) == 1) {
+    return node;
+  }
+  Node *res = createNode(node->m_Key);
+  res->m_Height = node->m_Height;
+  res->m_LeftChild = share(node->m_LeftChild);
+  res->m_RightChild = share(node->m_RightChild);
+  link = res;
+  // The other owners may have dropped the node in the meantime.
+  release(node);
+  return res;
+}
+
+// Changes are made only after the search, so a tree that does not change is
+// not copied. The new node is created before any copy, so a throwing key
+// constructor leaves nothing to undo; a failing copy replaces a shared node
+// with an equal one and leaves the tree as it was. Rotations after an insert
+// only involve nodes on the path, so rebalancing does not copy and cannot
+// throw.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool PersistentAvlTree<TKey, Compare, Allocator>::add(K &&key) {
+  bool dirs[kMaxHeight];
+  size_t depth = 0;
+  for (Node *node = m_Root; node != nullptr; ++depth) {
+    if (m_Compare(key, node->m_Key)) {
+      dirs[depth] = false;
+      node = node->m_LeftChild;
+    } else if (m_Compare(node->m_Key, key)) {
+      dirs[depth] = true;
+      node = node->m_RightChild;
+    } else {
+      return false;
+    }
+  }
+
+  Node *newNode = createNode(std::forward<K>(key));
+  Node **path[kMaxHeight];
+  Node **link = &m_Root;
+  try {
+    for (size_t i = 0; i < depth; ++i) {
+      path[i] = link;
+      Node *node = unique(*link);
+      link = dirs[i] ? &node->m_RightChild : &node->m_LeftChild;
+    }
+  } catch (...) {
+    destroyNode(newNode);
+    throw;
+  }
+  *link = newNode;
+  ++m_Size;
+  rebalancePath(path, depth);
+  return true;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool PersistentAvlTree<TKey, Compare, Allocator>::remove(const K &key) {
+  bool dirs[kMaxHeight];
+  size_t depth = 0;
+  Node *target = m_Root;
+  while (target != nullptr) {
+    if (m_Compare(key, target->m_Key)) {
+      dirs[depth++] = false;
+      target = target->m_LeftChild;
+    } else if (m_Compare(target->m_Key, key)) {
+      dirs[depth++] = true;
+      target = target->m_RightChild;
+    } else {
+      break;
+    }
+  }
+  if (target == nullptr) {
+    return false;
+  }
+  // A node with two children is replaced by its successor.
+  size_t targetDepth = depth;
+  if (target->m_LeftChild != nullptr && target->m_RightChild != nullptr) {
+    dirs[depth++] = true;
+    for (Node *node = target->m_RightChild; node->m_LeftChild != nullptr;
+         node = node->m_LeftChild) {
+      dirs[depth++] = false;
+    }
+  }
+
+  // Everything that can throw comes before the first change: the path, the
+  // successor that moves, and the heavier sibling of every path node with the
+  // inner child of it, which are all a rotation on the way up can change.
+  Node **path[kMaxHeight];
+  Node **link = &m_Root;
+  for (size_t i = 0; i < depth; ++i) {
+    path[i] = link;
+    Node *node = unique(*link);
+    link = dirs[i] ? &node->m_RightChild : &node->m_LeftChild;
+  }
+  path[depth] = link;
+  if (depth > targetDepth) {
+    unique(*link);
+  }
+  for (size_t i = 0; i < depth; ++i) {
+    Node *node = *path[i];
+    Node *&sibling = dirs[i] ? node->m_LeftChild : node->m_RightChild;
+    if (height(sibling) <= height(dirs[i] ? node->m_RightChild
+                                          : node->m_LeftChild)) {
+      continue;
+    }
+    Node *heavy = unique(sibling);
+    Node *&inner = dirs[i] ? heavy->m_RightChild : heavy->m_LeftChild;
+    if (height(inner) > height(dirs[i] ? heavy->m_LeftChild
+                                       : heavy->m_RightChild)) {
+      unique(inner);
+    }
+  }
+
+  target = *path[targetDepth];
+  if (depth == targetDepth) {
+    // The target itself may be shared, then it keeps its child.
+    *link = share(target->m_LeftChild != nullptr ? target->m_LeftChild
+                                                 : target->m_RightChild);
+    release(target);
+  } else {
+    Node *successor = *link;
+    *link = successor->m_RightChild;
+    successor->m_LeftChild = target->m_LeftChild;
+    successor->m_RightChild = target->m_RightChild;
+    successor->m_Height = target->m_Height;
+    *path[targetDepth] = successor;
+    path[targetDepth + 1] = &successor->m_RightChild;
+    destroyNode(target);
+  }
+  --m_Size;
+  rebalancePath(path, depth);
+  return true;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void PersistentAvlTree<TKey, Compare, Allocator>::clear() {
+  release(m_Root);
+  m_Root = nullptr;
+  m_Size = 0;
+}
+
+// Fixes the nodes at path[depth - 1] up to the root, all owned by this tree,
+// and stops at the first one whose height has not changed.
+template <typename TKey, typename Compare, typename Allocator>
+void PersistentAvlTree<TKey, Compare, Allocator>::rebalancePath(Node **path[],
+                                                                size_t depth) {
+  while (depth > 0) {
+    Node **link = path[--depth];
+    Node *node = *link;
+    int oldHeight = node->m_Height;
+    *link = balance(node);
+    if (*link == node && node->m_Height == oldHeight) {
+      return;
+    }
+  }
+}
+
+// Children are made unique only if a rotation changes them.
+template <typename TKey, typename Compare, typename Allocator>
+typename PersistentAvlTree<TKey, Compare, Allocator>::Node *
+PersistentAvlTree<TKey, Compare, Allocator>::balance(Node *node) {
+  fixHeight(node);
+  int balanceFactor = height(node->m_LeftChild) - height(node->m_RightChild);
+  if (balanceFactor > 1) {
+    Node *left = unique(node->m_LeftChild);
+    if (height(left->m_LeftChild) < height(left->m_RightChild)) {
+      unique(left->m_RightChild);
+      node->m_LeftChild = rotateLeft(left);
+    }
+    return rotateRight(node);
+  }
+  if (balanceFactor < -1) {
+    Node *right = unique(node->m_RightChild);
+    if (height(right->m_RightChild) < height(right->m_LeftChild)) {
+      unique(right->m_LeftChild);
+      node->m_RightChild = rotateRight(right);
+    }
+    return rotateLeft(node);
+  }
+  return node;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename PersistentAvlTree<TKey, Compare, Allocator>::Node *
+PersistentAvlTree<TKey, Compare, Allocator>::rotateRight(Node *node) {
+  Node *left = node->m_LeftChild;
+  node->m_LeftChild = left->m_RightChild;
+  left->m_RightChild = node;
+  fixHeight(node);
+  fixHeight(left);
+  return left;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename PersistentAvlTree<TKey, Compare, Allocator>::Node *
+PersistentAvlTree<TKey, Compare, Allocator>::rotateLeft(Node *node) {
+  Node *right = node->m_RightChild;
+  node->m_RightChild = right->m_LeftChild;
+  right->m_LeftChild = node;
+  fixHeight(node);
+  fixHeight(right);
+  return right;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename PersistentAvlTree<TKey, Compare, Allocator>::const_iterator
+PersistentAvlTree<TKey, Compare, Allocator>::begin() const {
+  const_iterator res(m_Root);
+  res.pushLeftmost(m_Root);
+  return res;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename PersistentAvlTree<TKey, Compare, Allocator>::const_iterator
+PersistentAvlTree<TKey, Compare, Allocator>::find(const K &key) const {
+  const_iterator res = lowerBound(key);
+  if (res != end() && !m_Compare(key, *res)) {
+    return res;
+  }
+  return end();
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool PersistentAvlTree<TKey, Compare, Allocator>::exists(const K &key) const {
+  const Node *node = m_Root;
+  while (node != nullptr) {
+    if (m_Compare(key, node->m_Key)) {
+      node = node->m_LeftChild;
+    } else if (m_Compare(node->m_Key, key)) {
+      node = node->m_RightChild;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The path is cut back to the last node that bounds key.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename PersistentAvlTree<TKey, Compare, Allocator>::const_iterator
+PersistentAvlTree<TKey, Compare, Allocator>::bound(const K &key,
+                                                   bool upper) const {
+  const_iterator res(m_Root);
+  size_t boundDepth = 0;
+  const Node *node = m_Root;
+  while (node != nullptr) {
+    res.push(node);
+    bool isBound =
+        upper ? m_Compare(key, node->m_Key) : !m_Compare(node->m_Key, key);
+    if (isBound) {
+      boundDepth = res.m_Depth;
+      node = node->m_LeftChild;
+    } else {
+      node = node->m_RightChild;
+    }
+  }
+  res.m_Depth = boundDepth;
+  return res;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "persistent_avltree.hpp"
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <utility>
+
+// Ordered set with O(1) copies, stored in a PersistentAvlTree. A copy is an
+// independent set: changing either one copies the O(log n) shared nodes on
+// the changed path and leaves the other as it was. Copies are cheap enough to
+// hand out as immutable views, one per reader, while the original keeps
+// changing.
+//
+// Iterators are invalidated by any change of the set they point into.
+template <typename T, typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class PersistentSet {
+public:
+  typedef PersistentAvlTree<T, Compare, Allocator> tree_type;
+  typedef typename tree_type::const_iterator const_iterator;
+  typedef const_iterator iterator;
+  typedef std::ptrdiff_t difference_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  PersistentSet() : m_Tree() {}
+  explicit PersistentSet(const Compare &comp,
+                         const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {}
+  explicit PersistentSet(const Allocator &alloc) : m_Tree(Compare(), alloc) {}
+  template <typename InputIterator>
+  PersistentSet(InputIterator first, InputIterator last,
+                const Compare &comp = Compare(),
+                const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {
+    insert(first, last);
+  }
+  PersistentSet(std::initializer_list<T> initList,
+                const Compare &comp = Compare(),
+                const Allocator &alloc = Allocator())
+      : PersistentSet(initList.begin(), initList.end(), comp, alloc) {}
+  PersistentSet(const PersistentSet &other) = default;
+  PersistentSet(PersistentSet &&other) noexcept = default;
+  ~PersistentSet() = default;
+  PersistentSet &operator=(const PersistentSet &other) = default;
+  PersistentSet &operator=(PersistentSet &&other) = default;
+
+  const_iterator begin() const { return m_Tree.begin(); }
+  const_iterator end() const { return m_Tree.end(); }
+  const_iterator find(const T &key) const { return m_Tree.find(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator find(const K &key) const {
+    return m_Tree.find(key);
+  }
+  const_iterator lower_bound(const T &key) const {
+    return m_Tree.lowerBound(key);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator lower_bound(const K &key) const {
+    return m_Tree.lowerBound(key);
+  }
+  const_iterator upper_bound(const T &key) const {
+    return m_Tree.upperBound(key);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator upper_bound(const K &key) const {
+    return m_Tree.upperBound(key);
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const T &key) const {
+    return {m_Tree.lowerBound(key), m_Tree.upperBound(key)};
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K &key) const {
+    return {m_Tree.lowerBound(key), m_Tree.upperBound(key)};
+  }
+  bool contains(const T &key) const { return m_Tree.exists(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool contains(const K &key) const {
+    return m_Tree.exists(key);
+  }
+
+  void insert(const T &key) { m_Tree.add(key); }
+  void insert(T &&key) { m_Tree.add(std::move(key)); }
+  template <typename InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first) {
+      m_Tree.add(*first);
+    }
+  }
+  void insert(std::initializer_list<T> initList) {
+    insert(initList.begin(), initList.end());
+  }
+  void erase(const T &key) { m_Tree.remove(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  void erase(const K &key) {
+    m_Tree.remove(key);
+  }
+  void clear() { m_Tree.clear(); }
+
+  size_t size() const { return m_Tree.size(); }
+  bool empty() const { return m_Tree.size() == 0; }
+  // Whether other is a copy of this set and neither has changed since.
+  bool shares_with(const PersistentSet &other) const {
+    return m_Tree.sharesWith(other.m_Tree);
+  }
+  key_compare key_comp() const { return m_Tree.key_comp(); }
+  allocator_type get_allocator() const { return m_Tree.get_allocator(); }
+  void swap(PersistentSet &other) noexcept { m_Tree.swap(other.m_Tree); }
+
+private:
+  tree_type m_Tree;
+};
+
+template <typename T, typename Compare, typename Allocator>
+void swap(PersistentSet<T, Compare, Allocator> &lhs,
+          PersistentSet<T, Compare, Allocator> &rhs) noexcept {
+  lhs.swap(rhs);
+}
@@ -0,0 +1,493 @@
+#pragma once
+
+#include "epoch.hpp"
+#include "node_pool.hpp"
+#include "path_iterator.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+template <typename TKey, typename Compare, typename Allocator>
+class RcuAvlTree;
+
+template <typename TKey> class RcuTreeNode {
+public:
+  template <typename... Args>
+  explicit RcuTreeNode(uint64_t stamp, Args &&...args)
+      : m_Key(std::forward<Args>(args)...), m_Height(1), m_LeftChild(nullptr),
+        m_RightChild(nullptr), m_TreeSize(1), m_Stamp(stamp) {}
+  template <typename, typename, typename> friend class RcuAvlTree;
+  template <typename, typename> friend class PathIterator;
+
+protected:
+  TKey m_Key;
+  int m_Height;
+  RcuTreeNode<TKey> *m_LeftChild;
+  RcuTreeNode<TKey> *m_RightChild;
+  size_t m_TreeSize;
+  // Write that created the node. Nodes of earlier writes may be shared with
+  // published versions and are never changed.
+  uint64_t m_Stamp;
+};
+
+// AVL tree with one writer and any number of readers, in the style of
+// read-copy-update. A write never changes a published node: it copies the
+// path from the root to the changed place, rebalances the copies and
+// publishes the new root with a single atomic store. Every published root is
+// an immutable version of the tree.
+//
+// A reader loads the current version under an epoch::Guard and can then
+// search and iterate it as long as it stays pinned, with no locks and no
+// atomic read-modify-write, and it never waits for the writer. Nodes that a
+// write replaced are retired through epoch-based reclamation, see epoch.hpp.
+//
+// Writers are serialized by a mutex. Nodes are not threaded, because a
+// thread link would tie every node to its neighbours and a write would have
+// to copy them all, so iterators keep the path from the root instead.
+template <typename TKey, typename Compare = std::less<TKey>,
+          typename Allocator = std::allocator<TKey>>
+class RcuAvlTree {
+public:
+  typedef PathIterator<TKey, RcuTreeNode<TKey>> const_iterator;
+  typedef const RcuTreeNode<TKey> *version_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  explicit RcuAvlTree(const Compare &comp = Compare(),
+                      const Allocator &alloc = Allocator())
+      : m_Root(nullptr), m_Stamp(0), m_Compare(comp), m_Pool(alloc) {}
+  RcuAvlTree(const RcuAvlTree &) = delete;
+  RcuAvlTree &operator=(const RcuAvlTree &) = delete;
+  ~RcuAvlTree();
+
+  // Writer side. add and remove return whether the tree has changed. If a
+  // write throws, the published version stays as it was.
+  template <typename K> bool add(K &&key);
+  template <typename K> bool remove(const K &key);
+  void clear();
+
+  // Reader side. The version has to be loaded and used while the thread is
+  // pinned by an epoch::Guard.
+  version_type current() const {
+    return m_Root.load(std::memory_order_acquire);
+  }
+  const_iterator begin(version_type version) const;
+  const_iterator end(version_type version) const {
+    return const_iterator(version);
+  }
+  template <typename K>
+  const_iterator find(version_type version, const K &key) const;
+  template <typename K>
+  const_iterator lowerBound(version_type version, const K &key) const {
+    return bound(version, key, false);
+  }
+  template <typename K>
+  const_iterator upperBound(version_type version, const K &key) const {
+    return bound(version, key, true);
+  }
+  template <typename K> bool exists(version_type version, const K &key) const;
+  static size_t size(version_type version) {
+    return version == nullptr ? 0 : version->m_TreeSize;
+  }
+
+  key_compare key_comp() const { return m_Compare; }
+  allocator_type get_allocator() const { return m_Pool.get_allocator(); }
+
+private:
+  typedef RcuTreeNode<TKey> Node;
+
+  static constexpr size_t kRetireBatch = 64;
+
+  std::atomic<Node *> m_Root;
+  std::mutex m_WriterMutex;
+  // The rest is used only by the writer holding m_WriterMutex.
+  uint64_t m_Stamp;
+  Compare m_Compare;
+  NodePool<Node, Allocator> m_Pool;
+  // Nodes created and replaced by the current write.
+  std::vector<Node *> m_Created;
+  std::vector<Node *> m_Replaced;
+  epoch::RetireList<Node> m_Retired;
+
+  template <typename... Args> Node *createNode(Args &&...);
+  void destroyNode(Node *);
+  void destroySubtree(Node *);
+  void collectSubtree(Node *);
+  Node *own(Node *);
+  void publish(Node *);
+  void rollback();
+
+  template <typename K> Node *insert(Node *, K &&, bool &);
+  template <typename K> Node *erase(Node *, const K &, bool &);
+  Node *eraseMin(Node *, Node *&);
+  Node *balance(Node *);
+  static Node *rotateRight(Node *);
+  static Node *rotateLeft(Node *);
+  static void fixNode(Node *);
+  static int height(const Node *node) {
+    return node == nullptr ? 0 : node->m_Height;
+  }
+  static size_t treeSize(const Node *node) {
+    return node == nullptr ? 0 : node->m_TreeSize;
+  }
+
+  template <typename K>
+  const_iterator bound(version_type, const K &, bool) const;
+};
+
+template <typename TKey, typename Compare, typename Allocator>
+RcuAvlTree<TKey, Compare, Allocator>::~RcuAvlTree() {
+  destroySubtree(m_Root.load(std::memory_order_relaxed));
+  m_Retired.releaseAll([this](Node *node) { destroyNode(node); });
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename... Args>
+typename RcuAvlTree<TKey, Compare, Allocator>::Node *
+RcuAvlTree<TKey, Compare, Allocator>::createNode(Args &&...args) {
+  Node *node = m_Pool.allocate();
+  try {
+    ::new (static_cast<void *>(node))
+        Node(m_Stamp, std::forward<Args>(args)...);
+  } catch (...) {
+    m_Pool.deallocate(node);
+    throw;
+  }
+  try {
+    m_Created.push_back(node);
+  } catch (...) {
+    destroyNode(node);
+    throw;
+  }
+  return node;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void RcuAvlTree<TKey, Compare, Allocator>::destroyNode(Node *node) {
+  node->~Node();
+  m_Pool.deallocate(node);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void RcuAvlTree<TKey, Compare, Allocator>::destroySubtree(Node *node) {
+  if (node == nullptr) {
+    return;
+  }
+  destroySubtree(node->m_LeftChild);
+  destroySubtree(node->m_RightChild);
+  destroyNode(node);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void RcuAvlTree<TKey, Compare, Allocator>::collectSubtree(Node *node) {
+  if (node == nullptr) {
+    return;
+  }
+  collectSubtree(node->m_LeftChild);
+  collectSubtree(node->m_RightChild);
+  m_Replaced.push_back(node);
+}
+
+// Returns a node of the current write with the same contents, which the write
+// is free to change. A published node is copied and retired on publish.
+template <typename TKey, typename Compare, typename Allocator>
+typename RcuAvlTree<TKey, Compare, Allocator>::Node *
+RcuAvlTree<TKey, Compare, Allocator>::own(Node *node) {
+  if (node->m_Stamp == m_Stamp) {
+    return node;
+  }
+  Node *copy = createNode(node->m_Key);
+  copy->m_Height = node->m_Height;
+  copy->m_LeftChild = node->m_LeftChild;
+  copy->m_RightChild = node->m_RightChild;
+  copy->m_TreeSize = node->m_TreeSize;
+  m_Replaced.push_back(node);
+  return copy;
+}
+
+// Readers that load the root after the store see the new version, the ones
+// that loaded it before are pinned at an epoch no later than the one the
+// replaced nodes are tagged with.
+template <typename TKey, typename Compare, typename Allocator>
+void RcuAvlTree<TKey, Compare, Allocator>::publish(Node *root) {
+  m_Root.store(root, std::memory_order_release);
+  m_Created.clear();
+  m_Retired.retire(m_Replaced.begin(), m_Replaced.end());
+  m_Replaced.clear();
+  m_Retired.collect(kRetireBatch, [this](Node *node) { destroyNode(node); });
+}
+
+// Published nodes have not been changed, so dropping the nodes of the
+// current write restores the tree.
+template <typename TKey, typename Compare, typename Allocator>
+void RcuAvlTree<TKey, Compare, Allocator>::rollback() {
+  for (Node *node : m_Created) {
+    destroyNode(node);
+  }
+  m_Created.clear();
+  m_Replaced.clear();
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool RcuAvlTree<TKey, Compare, Allocator>::add(K &&key) {
+  std::lock_guard<std::mutex> lock(m_WriterMutex);
+  ++m_Stamp;
+  bool added = false;
+  Node *root = nullptr;
+  try {
+    root = insert(m_Root.load(std::memory_order_relaxed), std::forward<K>(key),
+                  added);
+  } catch (...) {
+    rollback();
+    throw;
+  }
+  if (added) {
+    publish(root);
+  }
+  return added;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool RcuAvlTree<TKey, Compare, Allocator>::remove(const K &key) {
+  std::lock_guard<std::mutex> lock(m_WriterMutex);
+  ++m_Stamp;
+  bool removed = false;
+  Node *root = nullptr;
+  try {
+    root = erase(m_Root.load(std::memory_order_relaxed), key, removed);
+  } catch (...) {
+    rollback();
+    throw;
+  }
+  if (removed) {
+    publish(root);
+  }
+  return removed;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void RcuAvlTree<TKey, Compare, Allocator>::clear() {
+  std::lock_guard<std::mutex> lock(m_WriterMutex);
+  try {
+    collectSubtree(m_Root.load(std::memory_order_relaxed));
+  } catch (...) {
+    rollback();
+    throw;
+  }
+  publish(nullptr);
+}
+
+// The insert and erase helpers return the new root of the subtree, or node
+// itself if nothing has changed.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename RcuAvlTree<TKey, Compare, Allocator>::Node *
+RcuAvlTree<TKey, Compare, Allocator>::insert(Node *node, K &&key,
+                                             bool &added) {
+  if (node == nullptr) {
+    added = true;
+    return createNode(std::forward<K>(key));
+  }
+  if (m_Compare(key, node->m_Key)) {
+    Node *left = insert(node->m_LeftChild, std::forward<K>(key), added);
+    if (!added) {
+      return node;
+    }
+    node = own(node);
+    node->m_LeftChild = left;
+  } else if (m_Compare(node->m_Key, key)) {
+    Node *right = insert(node->m_RightChild, std::forward<K>(key), added);
+    if (!added) {
+      return node;
+    }
+    node = own(node);
+    node->m_RightChild = right;
+  } else {
+    return node;
+  }
+  return balance(node);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename RcuAvlTree<TKey, Compare, Allocator>::Node *
+RcuAvlTree<TKey, Compare, Allocator>::erase(Node *node, const K &key,
+                                            bool &removed) {
+  if (node == nullptr) {
+    return nullptr;
+  }
+  if (m_Compare(key, node->m_Key)) {
+    Node *left = erase(node->m_LeftChild, key, removed);
+    if (!removed) {
+      return node;
+    }
+    node = own(node);
+    node->m_LeftChild = left;
+    return balance(node);
+  }
+  if (m_Compare(node->m_Key, key)) {
+    Node *right = erase(node->m_RightChild, key, removed);
+    if (!removed) {
+      return node;
+    }
+    node = own(node);
+    node->m_RightChild = right;
+    return balance(node);
+  }
+
+  removed = true;
+  m_Replaced.push_back(node);
+  if (node->m_LeftChild == nullptr) {
+    return node->m_RightChild;
+  }
+  if (node->m_RightChild == nullptr) {
+    return node->m_LeftChild;
+  }
+  // The successor takes the place of the node.
+  Node *successor = nullptr;
+  Node *right = eraseMin(node->m_RightChild, successor);
+  successor = own(successor);
+  successor->m_LeftChild = node->m_LeftChild;
+  successor->m_RightChild = right;
+  return balance(successor);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename RcuAvlTree<TKey, Compare, Allocator>::Node *
+RcuAvlTree<TKey, Compare, Allocator>::eraseMin(Node *node, Node *&min) {
+  if (node->m_LeftChild == nullptr) {
+    min = node;
+    return node->m_RightChild;
+  }
+  Node *left = eraseMin(node->m_LeftChild, min);
+  node = own(node);
+  node->m_LeftChild = left;
+  return balance(node);
+}
+
+// node belongs to the current write. Children are copied only if a rotation
+// changes them.
+template <typename TKey, typename Compare, typename Allocator>
+typename RcuAvlTree<TKey, Compare, Allocator>::Node *
+RcuAvlTree<TKey, Compare, Allocator>::balance(Node *node) {
+  fixNode(node);
+  int balanceFactor = height(node->m_LeftChild) - height(node->m_RightChild);
+  if (balanceFactor > 1) {
+    Node *left = own(node->m_LeftChild);
+    node->m_LeftChild = left;
+    if (height(left->m_LeftChild) < height(left->m_RightChild)) {
+      left->m_RightChild = own(left->m_RightChild);
+      node->m_LeftChild = rotateLeft(left);
+    }
+    return rotateRight(node);
+  }
+  if (balanceFactor < -1) {
+    Node *right = own(node->m_RightChild);
+    node->m_RightChild = right;
+    if (height(right->m_RightChild) < height(right->m_LeftChild)) {
+      right->m_LeftChild = own(right->m_LeftChild);
+      node->m_RightChild = rotateRight(right);
+    }
+    return rotateLeft(node);
+  }
+  return node;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename RcuAvlTree<TKey, Compare, Allocator>::Node *
+RcuAvlTree<TKey, Compare, Allocator>::rotateRight(Node *node) {
+  Node *left = node->m_LeftChild;
+  node->m_LeftChild = left->m_RightChild;
+  left->m_RightChild = node;
+  fixNode(node);
+  fixNode(left);
+  return left;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename RcuAvlTree<TKey, Compare, Allocator>::Node *
+RcuAvlTree<TKey, Compare, Allocator>::rotateLeft(Node *node) {
+  Node *right = node->m_RightChild;
+  node->m_RightChild = right->m_LeftChild;
+  right->m_LeftChild = node;
+  fixNode(node);
+  fixNode(right);
+  return right;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+void RcuAvlTree<TKey, Compare, Allocator>::fixNode(Node *node) {
+  node->m_Height =
+      std::max(height(node->m_LeftChild), height(node->m_RightChild)) + 1;
+  node->m_TreeSize =
+      treeSize(node->m_LeftChild) + treeSize(node->m_RightChild) + 1;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+typename RcuAvlTree<TKey, Compare, Allocator>::const_iterator
+RcuAvlTree<TKey, Compare, Allocator>::begin(version_type version) const {
+  const_iterator res(version);
+  res.pushLeftmost(version);
+  return res;
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename RcuAvlTree<TKey, Compare, Allocator>::const_iterator
+RcuAvlTree<TKey, Compare, Allocator>::find(version_type version,
+                                           const K &key) const {
+  const_iterator res = lowerBound(version, key);
+  if (res != end(version) && !m_Compare(key, *res)) {
+    return res;
+  }
+  return end(version);
+}
+
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+bool RcuAvlTree<TKey, Compare, Allocator>::exists(version_type version,
+                                                  const K &key) const {
+  const Node *node = version;
+  while (node != nullptr) {
+    if (m_Compare(key, node->m_Key)) {
+      node = node->m_LeftChild;
+    } else if (m_Compare(node->m_Key, key)) {
+      node = node->m_RightChild;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The path is cut back to the last node that bounds key.
+template <typename TKey, typename Compare, typename Allocator>
+template <typename K>
+typename RcuAvlTree<TKey, Compare, Allocator>::const_iterator
+RcuAvlTree<TKey, Compare, Allocator>::bound(version_type version,
+                                            const K &key, bool upper) const {
+  const_iterator res(version);
+  size_t boundDepth = 0;
+  const Node *node = version;
+  while (node != nullptr) {
+    res.push(node);
+    bool isBound =
+        upper ? m_Compare(key, node->m_Key) : !m_Compare(node->m_Key, key);
+    if (isBound) {
+      boundDepth = res.m_Depth;
+      node = node->m_LeftChild;
+    } else {
+      node = node->m_RightChild;
+    }
+  }
+  res.m_Depth = boundDepth;
+  return res;
+}
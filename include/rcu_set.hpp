@@ -0,0 +1,118 @@
+#pragma once
+
+#include "rcu_avltree.hpp"
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <utility>
+
+template <typename T, typename Compare, typename Allocator> class RcuSet;
+
+// Consistent read-only view of an RcuSet as it was when the snapshot was
+// taken. Writes made later are not visible, and the nodes the snapshot uses
+// are kept alive until it is destroyed. A snapshot pins its thread, so it has
+// to be destroyed on the thread that took it, and should not be held for long:
+// while it lives, nodes retired by the writer are not released.
+template <typename T, typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class RcuSnapshot {
+public:
+  typedef RcuAvlTree<T, Compare, Allocator> tree_type;
+  typedef typename tree_type::const_iterator const_iterator;
+  typedef const_iterator iterator;
+
+  RcuSnapshot(const RcuSnapshot &) = delete;
+  RcuSnapshot &operator=(const RcuSnapshot &) = delete;
+
+  const_iterator begin() const { return m_Tree.begin(m_Version); }
+  const_iterator end() const { return m_Tree.end(m_Version); }
+  template <typename K> const_iterator find(const K &key) const {
+    return m_Tree.find(m_Version, key);
+  }
+  template <typename K> const_iterator lower_bound(const K &key) const {
+    return m_Tree.lowerBound(m_Version, key);
+  }
+  template <typename K> const_iterator upper_bound(const K &key) const {
+    return m_Tree.upperBound(m_Version, key);
+  }
+  template <typename K> bool contains(const K &key) const {
+    return m_Tree.exists(m_Version, key);
+  }
+  size_t size() const { return tree_type::size(m_Version); }
+  bool empty() const { return m_Version == nullptr; }
+
+  friend RcuSet<T, Compare, Allocator>;
+
+private:
+  // The guard comes first: the thread has to be pinned before the version is
+  // loaded.
+  explicit RcuSnapshot(const tree_type &tree)
+      : m_Guard(), m_Tree(tree), m_Version(tree.current()) {}
+
+  epoch::Guard m_Guard;
+  const tree_type &m_Tree;
+  typename tree_type::version_type m_Version;
+};
+
+// Ordered set for one writer thread and many reader threads, stored in an
+// RcuAvlTree. Readers iterate snapshots: taking one costs a thread-local
+// store, a fence and an atomic load, and reading it never blocks and is never
+// slowed down by the writer, however often it writes. Each write copies
+// O(log n) nodes, so writes cost more than in Set.
+//
+// Writes are serialized, so several threads may write, but they then wait for
+// each other.
+template <typename T, typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>>
+class RcuSet {
+public:
+  typedef RcuAvlTree<T, Compare, Allocator> tree_type;
+  typedef RcuSnapshot<T, Compare, Allocator> snapshot_type;
+  typedef typename tree_type::const_iterator const_iterator;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
+
+  RcuSet() : m_Tree() {}
+  explicit RcuSet(const Compare &comp, const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {}
+  explicit RcuSet(const Allocator &alloc) : m_Tree(Compare(), alloc) {}
+  template <typename InputIterator>
+  RcuSet(InputIterator first, InputIterator last,
+         const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {
+    for (; first != last; ++first) {
+      m_Tree.add(*first);
+    }
+  }
+  RcuSet(std::initializer_list<T> initList, const Compare &comp = Compare(),
+         const Allocator &alloc = Allocator())
+      : RcuSet(initList.begin(), initList.end(), comp, alloc) {}
+
+  // Every change is published at once, so a snapshot sees either all of it or
+  // nothing.
+  bool insert(const T &key) { return m_Tree.add(key); }
+  bool insert(T &&key) { return m_Tree.add(std::move(key)); }
+  bool erase(const T &key) { return m_Tree.remove(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool erase(const K &key) {
+    return m_Tree.remove(key);
+  }
+  void clear() { m_Tree.clear(); }
+
+  snapshot_type snapshot() const { return snapshot_type(m_Tree); }
+  bool contains(const T &key) const { return snapshot().contains(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool contains(const K &key) const {
+    return snapshot().contains(key);
+  }
+  size_t size() const { return snapshot().size(); }
+  bool empty() const { return snapshot().empty(); }
+
+  key_compare key_comp() const { return m_Tree.key_comp(); }
+  allocator_type get_allocator() const { return m_Tree.get_allocator(); }
+
+private:
+  tree_type m_Tree;
+};
@@ -1,11 +1,20 @@
 #pragma once
 
 #include "avltree.hpp"
+#include "frozen_set.hpp"
+#include "snapshot.hpp"
 #include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <random>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
 
 // Необходимо реализовать упрощённую версию упорядоченного множества из STL
 // Set<T>. Асимптотики всех операций должны быть аналогичными std::set.
@@ -50,62 +59,509 @@
 // помощью программы, указанной выше). Без покрытия тестами каждый пункт
 // оценивается в 50% стоимости.
 template <typename T> class SetConstIterator;
+template <typename T> class SetRange;
 
-template <typename T> class Set {
+// Elements are ordered by Compare. If Compare is transparent (defines
+// is_transparent, like std::less<>), find, lower_bound, contains and erase
+// also accept keys of any type comparable with T without converting them.
+//
+// Stats chooses what the underlying tree counts for stats(): nothing by
+// default, at no cost, CountingTreeStats per set, or ThreadWideTreeStats per
+// thread over all the sets using it, see tree_stats.hpp.
+template <typename T, typename Compare = std::less<T>,
+          typename Allocator = std::allocator<T>,
+          typename Stats = NoTreeStats>
+class Set {
 public:
   typedef SetConstIterator<T> const_iterator;
   typedef SetConstIterator<T> iterator;
+  typedef std::ptrdiff_t difference_type;
+  typedef Compare key_compare;
+  typedef Allocator allocator_type;
 
   Set() : m_Tree() {}
+  explicit Set(const Compare &comp, const Allocator &alloc = Allocator())
+      : m_Tree(comp, alloc) {}
+  explicit Set(const Allocator &alloc) : m_Tree(alloc) {}
   template <typename InputIterator>
-  Set(InputIterator first, InputIterator last);
-  explicit Set(std::initializer_list<T> initList);
-  Set(const Set<T> &other) : m_Tree(other.m_Tree) {}
+  Set(InputIterator first, InputIterator last, const Compare &comp = Compare(),
+      const Allocator &alloc = Allocator());
+  template <typename InputIterator>
+  Set(InputIterator first, InputIterator last, const Allocator &alloc)
+      : Set(first, last, Compare(), alloc) {}
+  explicit Set(std::initializer_list<T> initList,
+               const Compare &comp = Compare(),
+               const Allocator &alloc = Allocator());
+  Set(std::initializer_list<T> initList, const Allocator &alloc)
+      : Set(initList, Compare(), alloc) {}
+  Set(const Set &other) : m_Tree(other.m_Tree) {}
+  Set(Set &&other) noexcept : m_Tree(std::move(other.m_Tree)) {}
   ~Set() = default;
 
   const_iterator begin() const { return SetConstIterator<T>(m_Tree.begin()); }
   const_iterator end() const { return SetConstIterator<T>(m_Tree.end()); }
-  const_iterator find(T key) const {
+  const_iterator find(const T &key) const {
+    return SetConstIterator<T>(m_Tree.find(key));
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator find(const K &key) const {
     return SetConstIterator<T>(m_Tree.find(key));
   }
-  const_iterator lower_bound(T key) const {
+  const_iterator lower_bound(const T &key) const {
     return SetConstIterator<T>(m_Tree.lower_bound(key));
   }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator lower_bound(const K &key) const {
+    return SetConstIterator<T>(m_Tree.lower_bound(key));
+  }
+  const_iterator upper_bound(const T &key) const {
+    return SetConstIterator<T>(m_Tree.upper_bound(key));
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  const_iterator upper_bound(const K &key) const {
+    return SetConstIterator<T>(m_Tree.upper_bound(key));
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const T &key) const {
+    return {lower_bound(key), upper_bound(key)};
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K &key) const {
+    return {lower_bound(key), upper_bound(key)};
+  }
 
-  void insert(T key) { m_Tree.add(key); }
-  void erase(T key) { m_Tree.remove(key); }
-  bool contains(T key) const { return m_Tree.exists(key); }
+  // Number of elements in [lo, hi), O(log n) using the subtree sizes.
+  size_t count_range(const T &lo, const T &hi) const {
+    return countRange(lo, hi);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  size_t count_range(const K &lo, const K &hi) const {
+    return countRange(lo, hi);
+  }
+  // View of the elements in [lo, hi). Both bounds are found once, iterating
+  // the view does not compare keys.
+  SetRange<T> range(const T &lo, const T &hi) const {
+    return makeRange(lo, hi);
+  }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  SetRange<T> range(const K &lo, const K &hi) const {
+    return makeRange(lo, hi);
+  }
+
+  // Batch versions of lower_bound and contains: the results for the keys of
+  // [first, last) are written to out in the same order. The searches run
+  // interleaved so their cache misses overlap; sorted keys are looked up by
+  // walking forward from the previous answer.
+  template <typename ForwardIterator, typename OutputIterator>
+  OutputIterator lower_bound_many(ForwardIterator first, ForwardIterator last,
+                                  OutputIterator out) const {
+    m_Tree.lowerBoundMany(first, last,
+                          [&out](AvlTreeConstIterator<T> it, bool) {
+                            *out++ = SetConstIterator<T>(it);
+                          });
+    return out;
+  }
+  template <typename ForwardIterator, typename OutputIterator>
+  OutputIterator contains_many(ForwardIterator first, ForwardIterator last,
+                               OutputIterator out) const {
+    m_Tree.lowerBoundMany(
+        first, last,
+        [&out](AvlTreeConstIterator<T>, bool found) { *out++ = found; });
+    return out;
+  }
+
+  void insert(const T &key) { m_Tree.add(key); }
+  void insert(T &&key) { m_Tree.add(std::move(key)); }
+  // Inserts the elements of [first, last) as one batch: they are sorted,
+  // deduplicated and merged into the tree in a single pass, which is cheaper
+  // than inserting them one by one. insert_sorted_batch skips the sort and
+  // throws std::invalid_argument if the batch is not sorted.
+  template <typename InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    m_Tree.addMany(first, last);
+  }
+  void insert(std::initializer_list<T> initList) {
+    m_Tree.addMany(initList.begin(), initList.end());
+  }
+  template <typename InputIterator>
+  void insert_sorted_batch(InputIterator first, InputIterator last) {
+    m_Tree.addSorted(first, last);
+  }
+  // Constructs the element in place from args.
+  template <typename... Args> void emplace(Args &&...args) {
+    m_Tree.emplace(std::forward<Args>(args)...);
+  }
+  // Hinted insertion with the semantics of std::set: the returned iterator
+  // points to the inserted element or to the equal one that prevented it.
+  // Only a hint at end() for a key greater than all the others, or at begin()
+  // for a key less than all the others, saves the search: then a single
+  // comparison is made.
+  const_iterator insert(const_iterator hint, const T &key) {
+    return SetConstIterator<T>(
+        m_Tree.addHint(hint.m_AvlTreeConstIterator, key));
+  }
+  const_iterator insert(const_iterator hint, T &&key) {
+    return SetConstIterator<T>(
+        m_Tree.addHint(hint.m_AvlTreeConstIterator, std::move(key)));
+  }
+  template <typename... Args>
+  const_iterator emplace_hint(const_iterator hint, Args &&...args) {
+    return SetConstIterator<T>(m_Tree.emplaceHint(
+        hint.m_AvlTreeConstIterator, std::forward<Args>(args)...));
+  }
+  // Appends key, which has to be greater than all the elements, otherwise
+  // std::invalid_argument is thrown. Increasing keys are appended with one
+  // comparison each and amortized O(1) rotations.
+  void push_back_sorted(const T &key) { m_Tree.addLast(key); }
+  void push_back_sorted(T &&key) { m_Tree.addLast(std::move(key)); }
+  void erase(const T &key) { m_Tree.remove(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  void erase(const K &key) {
+    m_Tree.remove(key);
+  }
+  bool contains(const T &key) const { return m_Tree.exists(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  bool contains(const K &key) const {
+    return m_Tree.exists(key);
+  }
   void clear() { return m_Tree.clear(); }
 
+  // Order statistics, all in O(log n) using the subtree sizes.
+  // nth returns the k-th smallest element or end(), rank returns the number of
+  // elements less than key, index_of returns the position of it (size() for
+  // end()), advance and distance are O(log n) versions of std::next and
+  // std::distance, sample returns a uniformly chosen element (end() if the
+  // set is empty).
+  const_iterator nth(size_t k) const {
+    return SetConstIterator<T>(m_Tree.select(k));
+  }
+  size_t rank(const T &key) const { return m_Tree.rank(key); }
+  template <typename K, typename C = Compare,
+            typename = typename C::is_transparent>
+  size_t rank(const K &key) const {
+    return m_Tree.rank(key);
+  }
+  size_t index_of(const_iterator it) const {
+    return m_Tree.rank(it.m_AvlTreeConstIterator);
+  }
+  const_iterator advance(const_iterator it, difference_type n) const {
+    return nth(index_of(it) + n);
+  }
+  difference_type distance(const_iterator first, const_iterator last) const {
+    return (difference_type)index_of(last) - (difference_type)index_of(first);
+  }
+  template <typename URBG> const_iterator sample(URBG &gen) const;
+
+  // In-place set algebra on top of tree split and join. Nodes of both sets are
+  // reused, and for sets of sizes m <= n the work is O(m log(n / m + 1)).
+  // The rvalue overloads take over the nodes of other and leave it empty, the
+  // others work on a copy of other. Both sets must use the same ordering.
+  // With threadsNum > 1 the parts left after each split are processed in
+  // parallel, by up to threadsNum threads in total. The parallel tasks only
+  // relink nodes and never allocate, but they call Compare concurrently.
+  void union_with(Set &&other, size_t threadsNum = 1) {
+    m_Tree.unionWith(std::move(other.m_Tree), threadsNum);
+  }
+  void union_with(const Set &other, size_t threadsNum = 1) {
+    union_with(Set(other), threadsNum);
+  }
+  void intersect_with(Set &&other, size_t threadsNum = 1) {
+    m_Tree.intersectWith(std::move(other.m_Tree), threadsNum);
+  }
+  void intersect_with(const Set &other, size_t threadsNum = 1) {
+    intersect_with(Set(other), threadsNum);
+  }
+  void difference_with(Set &&other, size_t threadsNum = 1) {
+    m_Tree.differenceWith(std::move(other.m_Tree), threadsNum);
+  }
+  void difference_with(const Set &other, size_t threadsNum = 1) {
+    difference_with(Set(other), threadsNum);
+  }
+  void symmetric_difference_with(Set &&other, size_t threadsNum = 1) {
+    m_Tree.symmetricDifferenceWith(std::move(other.m_Tree), threadsNum);
+  }
+  void symmetric_difference_with(const Set &other, size_t threadsNum = 1) {
+    symmetric_difference_with(Set(other), threadsNum);
+  }
+  // Moves the elements not less than key into the returned set. The smaller
+  // of the two parts is copied, so this takes O(log n) plus the size of that
+  // part, up to O(n) when splitting near the middle. If copying an element
+  // throws, the set is left unchanged.
+  Set split_off(const T &key);
+  // Appends the elements of other, which all have to be greater than the
+  // elements of this set, otherwise std::invalid_argument is thrown.
+  void join(Set &&other) { m_Tree.concat(std::move(other.m_Tree)); }
+  // Replaces the contents with the elements of the sorted range [first, last)
+  // in linear time. Equal elements are allowed, unsorted input leaves the set
+  // empty and throws std::invalid_argument.
+  template <typename InputIterator>
+  void assign_sorted(InputIterator first, InputIterator last) {
+    m_Tree.assignSorted(first, last);
+  }
+  // Replaces the contents with the elements of [first, last), sorting and
+  // building with up to threadsNum threads. Those threads allocate nodes
+  // concurrently, so with allocators other than std::allocator, which may not
+  // be thread-safe (e.g. std::pmr ones), the build uses one thread.
+  template <typename InputIterator>
+  void assign_parallel(InputIterator first, InputIterator last,
+                       size_t threadsNum) {
+    m_Tree.assignParallel(first, last, threadsNum);
+  }
+  template <typename InputIterator>
+  static Set from_sorted(InputIterator first, InputIterator last,
+                         const Compare &comp = Compare(),
+                         const Allocator &alloc = Allocator());
+  // Read-only copy for lookup-heavy use, see FrozenSet. It is built in O(n)
+  // by walking the threaded list of nodes in order.
+  FrozenSet<T, Compare, Allocator> freeze() const {
+    return FrozenSet<T, Compare, Allocator>(begin(), size(), key_comp(),
+                                            get_allocator());
+  }
+  // Writes the elements to path as a binary snapshot, see snapshot.hpp. The
+  // snapshot is read back by load or served in place by MappedSet. T has to
+  // be trivially copyable. Throws std::runtime_error if the file cannot be
+  // written.
+  void save(const std::string &path) const;
+  // Replaces the contents with the snapshot at path in linear time. Throws
+  // std::runtime_error, leaving the set as it was, if the file cannot be read
+  // or is not an intact snapshot of T. Keys out of order for this comparator
+  // leave the set empty and throw std::invalid_argument.
+  void load(const std::string &path);
+  // Preallocates node storage for nodesNum elements.
+  void reserve(size_t nodesNum) { m_Tree.reserve(nodesNum); }
+  // The counters of Stats, the height of the tree and the number of nodes at
+  // each depth. Walks the whole tree, O(n).
+  TreeStats stats() const { return m_Tree.stats(); }
+  // Nodes, bytes per node and the bytes held in total: the set, its node
+  // storage with the estimated allocator overhead and the heap memory of the
+  // keys, see memory_usage.hpp. O(n) for keys with destructors, otherwise
+  // only the slabs of node storage are walked.
+  MemoryUsage memory_usage() const { return m_Tree.memoryUsage(); }
+
   size_t size() const;
   bool empty() const;
-  Set<T> &operator=(const Set<T> &other);
+  key_compare key_comp() const { return m_Tree.key_comp(); }
+  allocator_type get_allocator() const { return m_Tree.get_allocator(); }
+  Set &operator=(const Set &other);
+  Set &operator=(Set &&other);
+  void swap(Set &other) noexcept { m_Tree.swap(other.m_Tree); }
 
 private:
-  AvlTree<T> m_Tree;
+  explicit Set(AvlTree<T, Compare, Allocator, Stats> &&tree)
+      : m_Tree(std::move(tree)) {}
+
+  AvlTree<T, Compare, Allocator, Stats> m_Tree;
+
+  template <typename K> size_t countRange(const K &lo, const K &hi) const;
+  template <typename K> SetRange<T> makeRange(const K &lo, const K &hi) const;
 };
 
-template <typename T>
+// Sorted input (or its sorted prefix) is built into the tree in linear time.
+template <typename T, typename Compare, typename Allocator, typename Stats>
+template <typename InputIterator>
+Set<T, Compare, Allocator, Stats>::Set(InputIterator first, InputIterator last,
+                                       const Compare &comp,
+                                       const Allocator &alloc)
+    : m_Tree(comp, alloc) {
+  m_Tree.assign(first, last);
+}
+template <typename T, typename Compare, typename Allocator, typename Stats>
+Set<T, Compare, Allocator, Stats>::Set(std::initializer_list<T> initList,
+                                       const Compare &comp,
+                                       const Allocator &alloc)
+    : Set(initList.begin(), initList.end(), comp, alloc) {}
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
 template <typename InputIterator>
-Set<T>::Set(InputIterator first, InputIterator last) : m_Tree() {
-  while (first != last) {
-    m_Tree.add(*first);
-    ++first;
+Set<T, Compare, Allocator, Stats>
+Set<T, Compare, Allocator, Stats>::from_sorted(InputIterator first,
+                                               InputIterator last,
+                                               const Compare &comp,
+                                               const Allocator &alloc) {
+  Set<T, Compare, Allocator, Stats> result(comp, alloc);
+  result.assign_sorted(first, last);
+  return result;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
+void Set<T, Compare, Allocator, Stats>::save(const std::string &path) const {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Set::save: keys have to be trivially copyable");
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Set::save: cannot open " + path);
+  }
+  // The header goes first with a zero checksum and is rewritten at the end.
+  const char zeros[snapshot::kKeysOffset] = {};
+  out.write(zeros, sizeof(zeros));
+
+  // Keys are copied into a buffer to write them in large blocks.
+  constexpr size_t kBufferKeysNum = 4096;
+  std::unique_ptr<char[]> buffer(new char[kBufferKeysNum * sizeof(T)]);
+  snapshot::Checksum checksum;
+  size_t bufferedNum = 0;
+  auto flush = [&] {
+    checksum.update(buffer.get(), bufferedNum * sizeof(T));
+    out.write(buffer.get(), bufferedNum * sizeof(T));
+    bufferedNum = 0;
+  };
+  for (const T &key : *this) {
+    std::memcpy(buffer.get() + bufferedNum * sizeof(T), &key, sizeof(T));
+    if (++bufferedNum == kBufferKeysNum) {
+      flush();
+    }
+  }
+  flush();
+
+  snapshot::Header header = snapshot::makeHeader<T>(size(), checksum.value());
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.flush();
+  if (!out) {
+    throw std::runtime_error("Set::save: cannot write " + path);
   }
 }
-template <typename T>
-Set<T>::Set(std::initializer_list<T> initList)
-    : Set(initList.begin(), initList.end()) {}
 
-template <typename T> Set<T> &Set<T>::operator=(const Set<T> &other) {
+template <typename T, typename Compare, typename Allocator, typename Stats>
+void Set<T, Compare, Allocator, Stats>::load(const std::string &path) {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Set::load: keys have to be trivially copyable");
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in) {
+    throw std::runtime_error("Set::load: cannot open " + path);
+  }
+  uint64_t fileSize = static_cast<uint64_t>(in.tellg());
+  snapshot::Header header = {};
+  in.seekg(0);
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  snapshot::checkHeader<T>(header, in ? fileSize : 0, "Set::load");
+
+  // Storage of T without constructing the keys, they come from the file.
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+  size_t keysNum = header.m_KeysNum;
+  std::unique_ptr<Storage[]> keys(new Storage[keysNum]);
+  in.seekg(snapshot::kKeysOffset);
+  in.read(reinterpret_cast<char *>(keys.get()), keysNum * sizeof(T));
+  if (!in) {
+    throw std::runtime_error("Set::load: cannot read " + path);
+  }
+  snapshot::Checksum checksum;
+  checksum.update(keys.get(), keysNum * sizeof(T));
+  if (checksum.value() != header.m_Checksum) {
+    throw std::runtime_error("Set::load: snapshot checksum mismatch");
+  }
+
+  const T *first = reinterpret_cast<const T *>(keys.get());
+  m_Tree.assignSorted(first, first + keysNum);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+size_t Set<T, Compare, Allocator, Stats>::countRange(const K &lo,
+                                                     const K &hi) const {
+  if (!m_Tree.key_comp()(lo, hi)) {
+    return 0;
+  }
+  return m_Tree.rank(hi) - m_Tree.rank(lo);
+}
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
+template <typename K>
+SetRange<T> Set<T, Compare, Allocator, Stats>::makeRange(const K &lo,
+                                                         const K &hi) const {
+  const_iterator first = lower_bound(lo);
+  if (!m_Tree.key_comp()(lo, hi)) {
+    return SetRange<T>(first, first, 0);
+  }
+  return SetRange<T>(first, lower_bound(hi), countRange(lo, hi));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
+template <typename URBG>
+typename Set<T, Compare, Allocator, Stats>::const_iterator
+Set<T, Compare, Allocator, Stats>::sample(URBG &gen) const {
+  if (empty()) {
+    return end();
+  }
+  std::uniform_int_distribution<size_t> distribution(0, size() - 1);
+  return nth(distribution(gen));
+}
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
+Set<T, Compare, Allocator, Stats>
+Set<T, Compare, Allocator, Stats>::split_off(const T &key) {
+  return Set(m_Tree.splitOff(key));
+}
+
+// Non-destructive versions of the set operations, both arguments are copied.
+template <typename T, typename Compare, typename Allocator, typename Stats>
+Set<T, Compare, Allocator, Stats>
+set_union(const Set<T, Compare, Allocator, Stats> &lhs,
+          const Set<T, Compare, Allocator, Stats> &rhs) {
+  Set<T, Compare, Allocator, Stats> result(lhs);
+  result.union_with(rhs);
+  return result;
+}
+template <typename T, typename Compare, typename Allocator, typename Stats>
+Set<T, Compare, Allocator, Stats>
+set_intersection(const Set<T, Compare, Allocator, Stats> &lhs,
+                 const Set<T, Compare, Allocator, Stats> &rhs) {
+  Set<T, Compare, Allocator, Stats> result(lhs);
+  result.intersect_with(rhs);
+  return result;
+}
+template <typename T, typename Compare, typename Allocator, typename Stats>
+Set<T, Compare, Allocator, Stats>
+set_difference(const Set<T, Compare, Allocator, Stats> &lhs,
+               const Set<T, Compare, Allocator, Stats> &rhs) {
+  Set<T, Compare, Allocator, Stats> result(lhs);
+  result.difference_with(rhs);
+  return result;
+}
+template <typename T, typename Compare, typename Allocator, typename Stats>
+Set<T, Compare, Allocator, Stats>
+set_symmetric_difference(const Set<T, Compare, Allocator, Stats> &lhs,
+                         const Set<T, Compare, Allocator, Stats> &rhs) {
+  Set<T, Compare, Allocator, Stats> result(lhs);
+  result.symmetric_difference_with(rhs);
+  return result;
+}
+
+template <typename T, typename Compare, typename Allocator, typename Stats>
+Set<T, Compare, Allocator, Stats> &
+Set<T, Compare, Allocator, Stats>::operator=(const Set &other) {
   if (this == &other) {
     return *this;
   }
-  m_Tree = AvlTree<T>(other.m_Tree);
+  m_Tree = other.m_Tree;
+  return *this;
+}
+template <typename T, typename Compare, typename Allocator, typename Stats>
+Set<T, Compare, Allocator, Stats> &
+Set<T, Compare, Allocator, Stats>::operator=(Set &&other) {
+  m_Tree = std::move(other.m_Tree);
   return *this;
 }
-template <typename T> size_t Set<T>::size() const { return m_Tree.size(); }
-template <typename T> bool Set<T>::empty() const { return size() == 0; }
+template <typename T, typename Compare, typename Allocator, typename Stats>
+void swap(Set<T, Compare, Allocator, Stats> &lhs,
+          Set<T, Compare, Allocator, Stats> &rhs) noexcept {
+  lhs.swap(rhs);
+}
+template <typename T, typename Compare, typename Allocator, typename Stats>
+size_t Set<T, Compare, Allocator, Stats>::size() const {
+  return m_Tree.size();
+}
+template <typename T, typename Compare, typename Allocator, typename Stats>
+bool Set<T, Compare, Allocator, Stats>::empty() const {
+  return size() == 0;
+}
 
 template <typename T> class SetConstIterator {
 public:
@@ -133,7 +589,7 @@ public:
     return m_AvlTreeConstIterator != other.m_AvlTreeConstIterator;
   }
 
-  friend Set<T>;
+  template <typename, typename, typename, typename> friend class Set;
 
 protected:
   SetConstIterator(AvlTreeConstIterator<T> iterator)
@@ -163,4 +619,27 @@ template <typename T> SetConstIterator<T> SetConstIterator<T>::operator--(int) {
   auto res = *this;
   --m_AvlTreeConstIterator;
   return res;
-}
\ No newline at end of file
+}
+
+// Half-open range of set elements returned by Set::range. It stays valid as
+// long as the set is not modified.
+template <typename T> class SetRange {
+public:
+  typedef SetConstIterator<T> const_iterator;
+  typedef SetConstIterator<T> iterator;
+
+  const_iterator begin() const { return m_Begin; }
+  const_iterator end() const { return m_End; }
+  size_t size() const { return m_Size; }
+  bool empty() const { return m_Size == 0; }
+
+  template <typename, typename, typename, typename> friend class Set;
+
+private:
+  SetRange(const_iterator first, const_iterator last, size_t size)
+      : m_Begin(first), m_End(last), m_Size(size) {}
+
+  const_iterator m_Begin;
+  const_iterator m_End;
+  size_t m_Size;
+};
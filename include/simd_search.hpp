@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// In-node search for B-tree nodes. For arithmetic keys ordered by std::less the
+// number of keys less than the searched one is counted with vector
+// compare-and-movemask instead of branching on every key: SSE2 for 32-bit
+// integers, floats and doubles, SSE4.2 for 64-bit integers and AVX2 for all of
+// them when the compiler targets it. Other keys use std::lower_bound.
+namespace simd_search {
+
+template <typename T, typename Compare, typename K>
+constexpr bool isVectorizable() {
+  return std::is_same<T, K>::value && std::is_arithmetic<T>::value &&
+         !std::is_same<T, bool>::value &&
+         (std::is_same<Compare, std::less<T>>::value ||
+          std::is_same<Compare, std::less<>>::value) &&
+         (sizeof(T) == 4 || sizeof(T) == 8);
+}
+
+template <typename T> size_t countLessScalar(const T *keys, size_t count,
+                                             const T &key) {
+  size_t res = 0;
+  for (size_t i = 0; i < count; ++i) {
+    res += keys[i] < key;
+  }
+  return res;
+}
+
+#if defined(__SSE2__)
+// Unsigned 32-bit keys are compared as signed ones with the sign bit flipped.
+template <typename T> size_t countLess32(const T *keys, size_t count, T key) {
+  const int32_t kFlip = std::is_signed<T>::value ? 0 : INT32_MIN;
+  size_t res = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i key8 = _mm256_set1_epi32((int32_t)key ^ kFlip);
+  const __m256i flip8 = _mm256_set1_epi32(kFlip);
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)),
+        flip8);
+    res += __builtin_popcount(
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(key8, v))));
+  }
+#endif
+  const __m128i key4 = _mm_set1_epi32((int32_t)key ^ kFlip);
+  const __m128i flip4 = _mm_set1_epi32(kFlip);
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i)), flip4);
+    res += __builtin_popcount(
+        _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(key4, v))));
+  }
+  return res + countLessScalar(keys + i, count - i, key);
+}
+
+template <typename T> size_t countLess64(const T *keys, size_t count, T key) {
+#if defined(__SSE4_2__)
+  const int64_t kFlip = std::is_signed<T>::value ? 0 : INT64_MIN;
+  size_t res = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i key4 = _mm256_set1_epi64x((int64_t)key ^ kFlip);
+  const __m256i flip4 = _mm256_set1_epi64x(kFlip);
+  for (; i + 4 <= count; i += 4) {
+    __m256i v = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)),
+        flip4);
+    res += __builtin_popcount(
+        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(key4, v))));
+  }
+#endif
+  const __m128i key2 = _mm_set1_epi64x((int64_t)key ^ kFlip);
+  const __m128i flip2 = _mm_set1_epi64x(kFlip);
+  for (; i + 2 <= count; i += 2) {
+    __m128i v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i)), flip2);
+    res += __builtin_popcount(
+        _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(key2, v))));
+  }
+  return res + countLessScalar(keys + i, count - i, key);
+#else
+  return countLessScalar(keys, count, key);
+#endif
+}
+
+inline size_t countLess(const float *keys, size_t count, float key) {
+  size_t res = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256 key8 = _mm256_set1_ps(key);
+  for (; i + 8 <= count; i += 8) {
+    res += __builtin_popcount(_mm256_movemask_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(keys + i), key8, _CMP_LT_OQ)));
+  }
+#endif
+  const __m128 key4 = _mm_set1_ps(key);
+  for (; i + 4 <= count; i += 4) {
+    res += __builtin_popcount(
+        _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(keys + i), key4)));
+  }
+  return res + countLessScalar(keys + i, count - i, key);
+}
+
+inline size_t countLess(const double *keys, size_t count, double key) {
+  size_t res = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256d key4 = _mm256_set1_pd(key);
+  for (; i + 4 <= count; i += 4) {
+    res += __builtin_popcount(_mm256_movemask_pd(
+        _mm256_cmp_pd(_mm256_loadu_pd(keys + i), key4, _CMP_LT_OQ)));
+  }
+#endif
+  const __m128d key2 = _mm_set1_pd(key);
+  for (; i + 2 <= count; i += 2) {
+    res += __builtin_popcount(
+        _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(keys + i), key2)));
+  }
+  return res + countLessScalar(keys + i, count - i, key);
+}
+
+template <typename T> size_t countLess(const T *keys, size_t count, T key) {
+  if constexpr (sizeof(T) == 4) {
+    return countLess32(keys, count, key);
+  } else {
+    return countLess64(keys, count, key);
+  }
+}
+#else
+template <typename T> size_t countLess(const T *keys, size_t count, T key) {
+  return countLessScalar(keys, count, key);
+}
+#endif
+
+// Index of the first of the sorted keys [keys, keys + count) that is not less
+// than key.
+template <typename T, typename Compare, typename K>
+size_t lowerBound(const T *keys, size_t count, const K &key,
+                  const Compare &comp) {
+  if constexpr (isVectorizable<T, Compare, K>()) {
+    return countLess(keys, count, key);
+  } else {
+    return std::lower_bound(keys, keys + count, key, comp) - keys;
+  }
+}
+
+} // namespace simd_search
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// Binary snapshot of a set of trivially copyable keys, written by Set::save
+// and read by Set::load and MappedSet. The file is a Header followed, at
+// offset kKeysOffset, by the keys in sorted order as they lie in memory:
+//
+//   offset 0   Header (40 bytes, padded with zeros to kKeysOffset)
+//   offset 64  keysNum keys of keySize bytes each
+//
+// Integers are in the byte order of the machine that wrote the file, which is
+// checked through m_ByteOrder, so snapshots are only portable between machines
+// with the same key layout. The checksum covers the keys.
+namespace snapshot {
+
+constexpr char kMagic[8] = {'S', 'E', 'T', 'S', 'N', 'A', 'P', '\0'};
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kByteOrderMark = 0x01020304;
+// Keys start on a cache line, which keeps them aligned in a mapping.
+constexpr size_t kKeysOffset = 64;
+
+struct Header {
+  char m_Magic[8];
+  uint32_t m_Version;
+  uint32_t m_ByteOrder;
+  uint32_t m_KeySize;
+  uint32_t m_KeyAlign;
+  uint64_t m_KeysNum;
+  uint64_t m_Checksum;
+};
+static_assert(sizeof(Header) <= kKeysOffset, "header does not fit");
+
+template <typename T> Header makeHeader(uint64_t keysNum, uint64_t checksum) {
+  static_assert(alignof(T) <= kKeysOffset, "keys are over-aligned");
+  Header header;
+  std::memcpy(header.m_Magic, kMagic, sizeof(kMagic));
+  header.m_Version = kVersion;
+  header.m_ByteOrder = kByteOrderMark;
+  header.m_KeySize = sizeof(T);
+  header.m_KeyAlign = alignof(T);
+  header.m_KeysNum = keysNum;
+  header.m_Checksum = checksum;
+  return header;
+}
+
+// Throws std::runtime_error, with where as the prefix of the message, unless
+// header describes an array of T that fits into a file of fileSize bytes.
+template <typename T>
+void checkHeader(const Header &header, uint64_t fileSize, const char *where) {
+  auto fail = [where](const char *reason) {
+    throw std::runtime_error(std::string(where) + ": " + reason);
+  };
+  if (fileSize < kKeysOffset ||
+      std::memcmp(header.m_Magic, kMagic, sizeof(kMagic)) != 0) {
+    fail("not a set snapshot");
+  }
+  if (header.m_Version != kVersion) {
+    fail("unsupported snapshot version");
+  }
+  if (header.m_ByteOrder != kByteOrderMark) {
+    fail("snapshot has a different byte order");
+  }
+  if (header.m_KeySize != sizeof(T) || header.m_KeyAlign != alignof(T)) {
+    fail("snapshot has a different key type");
+  }
+  if (header.m_KeysNum > (fileSize - kKeysOffset) / sizeof(T) ||
+      kKeysOffset + header.m_KeysNum * sizeof(T) != fileSize) {
+    fail("snapshot size does not match its header");
+  }
+}
+
+// 64-bit checksum of a byte stream, fed in pieces of any size. Works on whole
+// 8-byte words, so it runs at memory speed for large snapshots.
+class Checksum {
+public:
+  void update(const void *data, size_t size);
+  uint64_t value() const;
+
+private:
+  static constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15ULL;
+
+  void addWord(uint64_t word) {
+    m_Hash = (m_Hash ^ word) * kMultiplier;
+    m_Hash ^= m_Hash >> 32;
+  }
+
+  uint64_t m_Hash = 0xcbf29ce484222325ULL;
+  uint64_t m_Size = 0;
+  // Bytes of an unfinished word.
+  unsigned char m_Pending[8];
+};
+
+inline void Checksum::update(const void *data, size_t size) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  size_t pendingNum = m_Size % 8;
+  m_Size += size;
+  if (pendingNum != 0) {
+    size_t takenNum = std::min(size, 8 - pendingNum);
+    std::memcpy(m_Pending + pendingNum, bytes, takenNum);
+    bytes += takenNum;
+    size -= takenNum;
+    if (pendingNum + takenNum < 8) {
+      return;
+    }
+    uint64_t word;
+    std::memcpy(&word, m_Pending, 8);
+    addWord(word);
+  }
+  for (; size >= 8; bytes += 8, size -= 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes, 8);
+    addWord(word);
+  }
+  std::memcpy(m_Pending, bytes, size);
+}
+
+inline uint64_t Checksum::value() const {
+  uint64_t word = 0;
+  std::memcpy(&word, m_Pending, m_Size % 8);
+  Checksum res = *this;
+  res.addWord(word);
+  res.addWord(m_Size);
+  return res.m_Hash;
+}
+
+} // namespace snapshot
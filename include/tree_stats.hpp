@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// What a tree has done so far and what it looks like now, see Set::stats.
+struct TreeStats {
+  // Searches for a single key: lookups and the descents of insert and erase.
+  size_t m_Lookups = 0;
+  // Key comparisons made by these searches.
+  size_t m_Comparisons = 0;
+  size_t m_Rotations = 0;
+  // Recomputations of the height, size and neighbours of a node.
+  size_t m_FixNodes = 0;
+  size_t m_Allocations = 0;
+  size_t m_Deallocations = 0;
+  int m_Height = 0;
+  // m_DepthHistogram[d] is the number of nodes at depth d, the root is at 0.
+  std::vector<size_t> m_DepthHistogram;
+};
+
+// Stats policies of AvlTree. The tree calls the hooks from const methods and,
+// during parallel set operations, from several threads at once. When a tree
+// takes over the nodes of another one (moves, swaps, set operations and the
+// parallel build), it calls absorb with the policy of the donor, so the nodes
+// are deallocated by the tree that counted their allocation.
+
+// Counts nothing, the hooks compile away. The default.
+struct NoTreeStats {
+  void onLookup(size_t) const {}
+  void onRotation() const {}
+  void onFixNode() const {}
+  void onAllocation() const {}
+  void onDeallocation(size_t) const {}
+  void absorb(const NoTreeStats &) const {}
+  void collect(TreeStats &) const {}
+};
+
+// Counts per tree. The counters are relaxed atomics, so lookups from several
+// threads are still safe, at the price of an atomic increment per event. They
+// belong to the tree object: copies start from zero, moves and absorb take the
+// counts of the donor over and leave it at zero.
+class CountingTreeStats {
+public:
+  CountingTreeStats() = default;
+  CountingTreeStats(const CountingTreeStats &) {}
+  CountingTreeStats &operator=(const CountingTreeStats &) { return *this; }
+
+  void onLookup(size_t comparisons) const {
+    add(m_Lookups, 1);
+    add(m_Comparisons, comparisons);
+  }
+  void onRotation() const { add(m_Rotations, 1); }
+  void onFixNode() const { add(m_FixNodes, 1); }
+  void onAllocation() const { add(m_Allocations, 1); }
+  void onDeallocation(size_t nodesNum) const {
+    add(m_Deallocations, nodesNum);
+  }
+  void absorb(const CountingTreeStats &donor) const {
+    if (this == &donor) {
+      return;
+    }
+    take(m_Lookups, donor.m_Lookups);
+    take(m_Comparisons, donor.m_Comparisons);
+    take(m_Rotations, donor.m_Rotations);
+    take(m_FixNodes, donor.m_FixNodes);
+    take(m_Allocations, donor.m_Allocations);
+    take(m_Deallocations, donor.m_Deallocations);
+  }
+  void collect(TreeStats &stats) const {
+    stats.m_Lookups = m_Lookups.load(std::memory_order_relaxed);
+    stats.m_Comparisons = m_Comparisons.load(std::memory_order_relaxed);
+    stats.m_Rotations = m_Rotations.load(std::memory_order_relaxed);
+    stats.m_FixNodes = m_FixNodes.load(std::memory_order_relaxed);
+    stats.m_Allocations = m_Allocations.load(std::memory_order_relaxed);
+    stats.m_Deallocations = m_Deallocations.load(std::memory_order_relaxed);
+  }
+
+private:
+  static void add(std::atomic<size_t> &counter, size_t value) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+  static void take(std::atomic<size_t> &counter, std::atomic<size_t> &donor) {
+    add(counter, donor.exchange(0, std::memory_order_relaxed));
+  }
+
+  mutable std::atomic<size_t> m_Lookups{0};
+  mutable std::atomic<size_t> m_Comparisons{0};
+  mutable std::atomic<size_t> m_Rotations{0};
+  mutable std::atomic<size_t> m_FixNodes{0};
+  mutable std::atomic<size_t> m_Allocations{0};
+  mutable std::atomic<size_t> m_Deallocations{0};
+};
+
+// Counts per thread, not per tree: every thread has plain counters of its own,
+// shared by all the trees with this policy, and stats() of any such tree
+// reports the totals of the calling thread for all of them. Nothing is atomic,
+// so it suits hot lookups from many threads. Work done by the tasks of
+// parallel operations is counted in the threads running them.
+class ThreadWideTreeStats {
+public:
+  void onLookup(size_t comparisons) const {
+    Counters &counters = threadCounters();
+    ++counters.m_Lookups;
+    counters.m_Comparisons += comparisons;
+  }
+  void onRotation() const { ++threadCounters().m_Rotations; }
+  void onFixNode() const { ++threadCounters().m_FixNodes; }
+  void onAllocation() const { ++threadCounters().m_Allocations; }
+  void onDeallocation(size_t nodesNum) const {
+    threadCounters().m_Deallocations += nodesNum;
+  }
+  // The counters are not the tree's, so there is nothing to take over.
+  void absorb(const ThreadWideTreeStats &) const {}
+  void collect(TreeStats &stats) const {
+    const Counters &counters = threadCounters();
+    stats.m_Lookups = counters.m_Lookups;
+    stats.m_Comparisons = counters.m_Comparisons;
+    stats.m_Rotations = counters.m_Rotations;
+    stats.m_FixNodes = counters.m_FixNodes;
+    stats.m_Allocations = counters.m_Allocations;
+    stats.m_Deallocations = counters.m_Deallocations;
+  }
+
+private:
+  struct Counters {
+    size_t m_Lookups = 0;
+    size_t m_Comparisons = 0;
+    size_t m_Rotations = 0;
+    size_t m_FixNodes = 0;
+    size_t m_Allocations = 0;
+    size_t m_Deallocations = 0;
+  };
+
+  static Counters &threadCounters() {
+    static thread_local Counters counters;
+    return counters;
+  }
+};
@@ -0,0 +1,364 @@
+#include "btree_set.hpp"
+#include "set.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Benchmarks of the sets and std::set for every operation, key type and key
+// distribution, at sizes 10^2, 10^3, ... up to --setlib_max_size (10^6 by
+// default, up to 10^8 with enough memory). Benchmark names are
+// operation/set/key/distribution/size, e.g. find/Set/int/zipfian/1000000, and
+// --benchmark_filter takes regular expressions over them. The
+// run_setlib_bench target writes the results as JSON.
+
+namespace {
+
+struct Key64 {
+  uint64_t m_Id;
+  char m_Payload[56];
+
+  bool operator<(const Key64 &other) const { return m_Id < other.m_Id; }
+};
+
+// Maps ranks to keys of each type, preserving the order.
+template <typename T> struct KeyTraits;
+
+template <> struct KeyTraits<int> {
+  static constexpr const char *kName = "int";
+  static int make(uint64_t rank) { return static_cast<int>(rank); }
+};
+
+template <> struct KeyTraits<uint64_t> {
+  static constexpr const char *kName = "uint64";
+  static uint64_t make(uint64_t rank) { return rank; }
+};
+
+// Longer than the small string buffer, so every key is on the heap.
+template <> struct KeyTraits<std::string> {
+  static constexpr const char *kName = "string";
+  static std::string make(uint64_t rank) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "key:%020llu",
+                  static_cast<unsigned long long>(rank));
+    return buffer;
+  }
+};
+
+template <> struct KeyTraits<Key64> {
+  static constexpr const char *kName = "key64";
+  static Key64 make(uint64_t rank) {
+    Key64 key;
+    key.m_Id = rank;
+    std::memset(key.m_Payload, static_cast<int>(rank & 0xff),
+                sizeof(key.m_Payload));
+    return key;
+  }
+};
+
+enum class Distribution { kUniform, kSorted, kReverse, kZipfian };
+
+const char *distributionName(Distribution distribution) {
+  switch (distribution) {
+  case Distribution::kUniform:
+    return "uniform";
+  case Distribution::kSorted:
+    return "sorted";
+  case Distribution::kReverse:
+    return "reverse";
+  case Distribution::kZipfian:
+    return "zipfian";
+  }
+  return "";
+}
+
+// Zipfian ranks in [0, n) with exponent 0.99, generated as in YCSB (Gray et
+// al., "Quickly generating billion-record synthetic databases"). The hot ranks
+// are scattered over the range by a bijection, so they are not neighbours.
+class ZipfianGenerator {
+public:
+  ZipfianGenerator(uint64_t n, uint64_t seed)
+      : m_N(n), m_Gen(seed), m_Zetan(zeta(n)) {
+    double zeta2 = 1 + std::pow(0.5, kTheta);
+    m_Alpha = 1 / (1 - kTheta);
+    m_Eta = (1 - std::pow(2.0 / n, 1 - kTheta)) / (1 - zeta2 / m_Zetan);
+  }
+
+  uint64_t operator()() {
+    double u = std::uniform_real_distribution<double>(0, 1)(m_Gen);
+    double uz = u * m_Zetan;
+    uint64_t rank;
+    if (uz < 1) {
+      rank = 0;
+    } else if (uz < 1 + std::pow(0.5, kTheta)) {
+      rank = 1;
+    } else {
+      rank = static_cast<uint64_t>(m_N *
+                                   std::pow(m_Eta * u - m_Eta + 1, m_Alpha));
+    }
+    // The multiplier is a prime greater than the sizes benchmarked, so this is
+    // a bijection.
+    return std::min(rank, m_N - 1) * 2654435761ULL % m_N;
+  }
+
+private:
+  static constexpr double kTheta = 0.99;
+
+  // O(n), so the sums are computed once per n.
+  static double zeta(uint64_t n) {
+    static std::map<uint64_t, double> sums;
+    auto it = sums.find(n);
+    if (it != sums.end()) {
+      return it->second;
+    }
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; ++i) {
+      sum += 1 / std::pow(static_cast<double>(i), kTheta);
+    }
+    return sums[n] = sum;
+  }
+
+  uint64_t m_N;
+  std::mt19937_64 m_Gen;
+  double m_Zetan;
+  double m_Alpha;
+  double m_Eta;
+};
+
+// count keys of ranks in [0, n) multiplied by scale, in the order of the
+// distribution. Uniform is a random permutation when count == n; sorted and
+// reverse spread count ranks evenly over the range. Seeds are fixed, so runs
+// are comparable.
+template <typename T>
+std::vector<T> makeKeys(Distribution distribution, uint64_t n, size_t count,
+                        uint64_t scale) {
+  std::vector<T> keys;
+  keys.reserve(count);
+  std::mt19937_64 gen(42);
+  switch (distribution) {
+  case Distribution::kUniform:
+    if (count == n) {
+      for (uint64_t i = 0; i < n; ++i) {
+        keys.push_back(KeyTraits<T>::make(i * scale));
+      }
+      std::shuffle(keys.begin(), keys.end(), gen);
+    } else {
+      for (size_t i = 0; i < count; ++i) {
+        keys.push_back(KeyTraits<T>::make(gen() % n * scale));
+      }
+    }
+    break;
+  case Distribution::kSorted:
+  case Distribution::kReverse:
+    for (size_t i = 0; i < count; ++i) {
+      keys.push_back(KeyTraits<T>::make(i * n / count * scale));
+    }
+    if (distribution == Distribution::kReverse) {
+      std::reverse(keys.begin(), keys.end());
+    }
+    break;
+  case Distribution::kZipfian: {
+    ZipfianGenerator zipfian(n, 42);
+    for (size_t i = 0; i < count; ++i) {
+      keys.push_back(KeyTraits<T>::make(zipfian() * scale));
+    }
+    break;
+  }
+  }
+  return keys;
+}
+
+template <typename TSet>
+using KeyOf = typename std::decay<decltype(
+    *std::declval<const TSet &>().begin())>::type;
+
+// The set of the n keys of even ranks, so that half of the lookups of ranks
+// in [0, 2n) miss.
+template <typename TSet> TSet makeSet(uint64_t n) {
+  TSet set;
+  for (uint64_t i = 0; i < n; ++i) {
+    set.insert(KeyTraits<KeyOf<TSet>>::make(2 * i));
+  }
+  return set;
+}
+
+// Lookups cycle through this many keys.
+const size_t kQueriesNum = 1 << 16;
+
+template <typename TSet>
+void insertBenchmark(benchmark::State &state, Distribution distribution) {
+  typedef KeyOf<TSet> T;
+  uint64_t n = state.range(0);
+  std::vector<T> keys = makeKeys<T>(distribution, n, n, 1);
+  std::optional<TSet> set;
+  for (auto _ : state) {
+    set.emplace();
+    for (const T &key : keys) {
+      set->insert(key);
+    }
+    state.PauseTiming();
+    state.counters["set_size"] = static_cast<double>(set->size());
+    set.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename TSet>
+void eraseBenchmark(benchmark::State &state, Distribution distribution) {
+  typedef KeyOf<TSet> T;
+  uint64_t n = state.range(0);
+  std::vector<T> keys = makeKeys<T>(distribution, n, n, 2);
+  const TSet full = makeSet<TSet>(n);
+  std::optional<TSet> set;
+  for (auto _ : state) {
+    state.PauseTiming();
+    set.emplace(full);
+    state.ResumeTiming();
+    for (const T &key : keys) {
+      set->erase(key);
+    }
+    state.PauseTiming();
+    set.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename TSet>
+void findBenchmark(benchmark::State &state, Distribution distribution) {
+  typedef KeyOf<TSet> T;
+  uint64_t n = state.range(0);
+  std::vector<T> queries = makeKeys<T>(distribution, 2 * n, kQueriesNum, 1);
+  const TSet set = makeSet<TSet>(n);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(set.find(queries[i++ % kQueriesNum]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <typename TSet>
+void lowerBoundBenchmark(benchmark::State &state, Distribution distribution) {
+  typedef KeyOf<TSet> T;
+  uint64_t n = state.range(0);
+  std::vector<T> queries = makeKeys<T>(distribution, 2 * n, kQueriesNum, 1);
+  const TSet set = makeSet<TSet>(n);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(set.lower_bound(queries[i++ % kQueriesNum]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <typename TSet> void iterationBenchmark(benchmark::State &state) {
+  uint64_t n = state.range(0);
+  const TSet set = makeSet<TSet>(n);
+  for (auto _ : state) {
+    for (const auto &key : set) {
+      benchmark::DoNotOptimize(&key);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename TSet> void copyBenchmark(benchmark::State &state) {
+  uint64_t n = state.range(0);
+  const TSet set = makeSet<TSet>(n);
+  std::optional<TSet> copy;
+  for (auto _ : state) {
+    copy.emplace(set);
+    benchmark::DoNotOptimize(&*copy);
+    state.PauseTiming();
+    copy.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+void addSizes(benchmark::internal::Benchmark *benchmark, uint64_t maxSize) {
+  for (uint64_t n = 100; n <= maxSize; n *= 10) {
+    benchmark->Arg(static_cast<int64_t>(n));
+  }
+}
+
+template <typename TSet>
+void registerSet(const std::string &setName, uint64_t maxSize) {
+  typedef KeyOf<TSet> T;
+  std::string suffix = "/" + setName + "/" + KeyTraits<T>::kName;
+  for (Distribution distribution :
+       {Distribution::kUniform, Distribution::kSorted, Distribution::kReverse,
+        Distribution::kZipfian}) {
+    std::string name = suffix + "/" + distributionName(distribution);
+    addSizes(benchmark::RegisterBenchmark(("insert" + name).c_str(),
+                                          insertBenchmark<TSet>, distribution),
+             maxSize);
+    addSizes(benchmark::RegisterBenchmark(("erase" + name).c_str(),
+                                          eraseBenchmark<TSet>, distribution),
+             maxSize);
+    addSizes(benchmark::RegisterBenchmark(("find" + name).c_str(),
+                                          findBenchmark<TSet>, distribution),
+             maxSize);
+    addSizes(benchmark::RegisterBenchmark(("lower_bound" + name).c_str(),
+                                          lowerBoundBenchmark<TSet>,
+                                          distribution),
+             maxSize);
+  }
+  // The order of insertion does not change what these two do.
+  addSizes(benchmark::RegisterBenchmark(("iteration" + suffix).c_str(),
+                                        iterationBenchmark<TSet>),
+           maxSize);
+  addSizes(benchmark::RegisterBenchmark(("copy" + suffix).c_str(),
+                                        copyBenchmark<TSet>),
+           maxSize);
+}
+
+template <typename T> void registerKey(uint64_t maxSize) {
+  registerSet<Set<T>>("Set", maxSize);
+  registerSet<BTreeSet<T>>("BTreeSet", maxSize);
+  registerSet<std::set<T>>("std::set", maxSize);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  uint64_t maxSize = 1000000;
+  const std::string kMaxSizeFlag = "--setlib_max_size=";
+  int argsNum = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.compare(0, kMaxSizeFlag.size(), kMaxSizeFlag) == 0) {
+      maxSize =
+          static_cast<uint64_t>(std::stod(arg.substr(kMaxSizeFlag.size())));
+    } else {
+      argv[argsNum++] = argv[i];
+    }
+  }
+  argc = argsNum;
+
+  registerKey<int>(maxSize);
+  registerKey<uint64_t>(maxSize);
+  registerKey<std::string>(maxSize);
+  registerKey<Key64>(maxSize);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
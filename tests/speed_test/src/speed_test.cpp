@@ -1,19 +1,41 @@
+#include "btree_set.hpp"
+#include "compact_set.hpp"
+#include "concurrent_set.hpp"
+#include "disk_set.hpp"
+#include "map.hpp"
+#include "mapped_set.hpp"
+#include "multi_set.hpp"
+#include "persistent_set.hpp"
+#include "rcu_set.hpp"
 #include "set.hpp"
 
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <malloc.h>
+#include <map>
+#include <mutex>
 #include <random>
 #include <set>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <time.h>
 #include <vector>
 
 #define TEST_DATA_ELEMENTS_NUM 1e6
 #define TEST_PERFORMANCE_DECREASE_COEFF 3
 
+// Runs myFunc on TMySet and stdFunc on TStdSet for every element of the same
+// random data and expects the first to be at most decreaseCoef times slower.
+template <typename TMySet = Set<int>, typename TStdSet = std::set<int>,
+          typename MyFunc, typename StdFunc>
 void speedTestFramework(
-    void (*myFunc)(Set<int> &, int), void (*stdFunc)(std::set<int> &, int),
+    MyFunc myFunc, StdFunc stdFunc,
     const size_t elementsNum = TEST_DATA_ELEMENTS_NUM,
     unsigned int decreaseCoef = TEST_PERFORMANCE_DECREASE_COEFF) {
   static const size_t kMaxElement = elementsNum / 3;
@@ -22,8 +44,8 @@ void speedTestFramework(
   std::mt19937 gen(42);
   std::for_each(data.begin(), data.end(),
                 [&](int &a) { a = gen() % kMaxElement; });
-  Set<int> mySet(data.begin(), data.end());
-  std::set<int> stdSet(data.begin(), data.end());
+  TMySet mySet(data.begin(), data.end());
+  TStdSet stdSet(data.begin(), data.end());
   int myStart = clock();
   for (auto it = data.begin(); it != data.end(); ++it) {
     myFunc(mySet, *it);
@@ -58,9 +80,680 @@ TEST(speedTest, iteratorSpeedTest) {
   static const size_t kElementsNum = 1e6;
   static const size_t kIteratorShift = 100;
   speedTestFramework(
-      [](Set<int> &set, int value) { std::next(set.begin(), kIteratorShift); },
+      [](Set<int> &set, int value) {
+        (void)std::next(set.begin(), kIteratorShift);
+      },
       [](std::set<int> &set, int value) {
-        std::next(set.begin(), kIteratorShift);
+        (void)std::next(set.begin(), kIteratorShift);
+      },
+      kElementsNum);
+}
+TEST(speedTest, advanceSpeedTest) {
+  static const size_t kElementsNum = 1e4;
+  static const size_t kIteratorShift = 1000;
+  speedTestFramework(
+      [](Set<int> &set, int value) {
+        (void)set.advance(set.begin(), kIteratorShift);
+      },
+      [](std::set<int> &set, int value) {
+        (void)std::next(set.begin(), kIteratorShift);
+      },
+      kElementsNum, 1);
+}
+
+// The compact layout against the pointer-based one.
+TEST(compactLayoutSpeedTest, findSpeedTest) {
+  speedTestFramework<CompactSet<int>, Set<int>>(
+      [](CompactSet<int> &set, int value) { set.find(value); },
+      [](Set<int> &set, int value) { set.find(value); });
+}
+
+TEST(compactLayoutSpeedTest, insertEraseSpeedTest) {
+  speedTestFramework<CompactSet<int>, Set<int>>(
+      [](CompactSet<int> &set, int value) {
+        set.erase(value);
+        set.insert(value + 1);
+      },
+      [](Set<int> &set, int value) {
+        set.erase(value);
+        set.insert(value + 1);
+      });
+}
+
+// Without the threaded list every step may climb several parent links, so
+// iteration is allowed to be slower. Whole walks are measured, about 2x slower
+// here, rather than short walks from begin(), which are dominated by the
+// descent to the first node and vary more between runs.
+TEST(compactLayoutSpeedTest, iteratorSpeedTest) {
+  static const size_t kElementsNum = 1e5;
+  static const int kPassesNum = 30;
+  static const unsigned int kDecreaseCoef = 6;
+  std::mt19937 gen(42);
+  std::vector<int> data(kElementsNum);
+  for (int &el : data) {
+    el = (int)(gen() % (kElementsNum / 3));
+  }
+  CompactSet<int> compactSet(data.begin(), data.end());
+  Set<int> set(data.begin(), data.end());
+
+  long long compactSum = 0;
+  int compactStart = clock();
+  for (int pass = 0; pass < kPassesNum; ++pass) {
+    for (int el : compactSet) {
+      compactSum += el;
+    }
+  }
+  int compactEnd = clock();
+
+  long long sum = 0;
+  int start = clock();
+  for (int pass = 0; pass < kPassesNum; ++pass) {
+    for (int el : set) {
+      sum += el;
+    }
+  }
+  int end = clock();
+
+  EXPECT_EQ(sum, compactSum);
+  EXPECT_LE(compactEnd - compactStart, kDecreaseCoef * (end - start));
+}
+
+// The B-tree against the AVL tree.
+TEST(btreeSpeedTest, findSpeedTest) {
+  speedTestFramework<BTreeSet<int>, Set<int>>(
+      [](BTreeSet<int> &set, int value) { set.find(value); },
+      [](Set<int> &set, int value) { set.find(value); }, 1e6, 1);
+}
+
+TEST(btreeSpeedTest, insertEraseSpeedTest) {
+  speedTestFramework<BTreeSet<int>, Set<int>>(
+      [](BTreeSet<int> &set, int value) {
+        set.erase(value);
+        set.insert(value + 1);
+      },
+      [](Set<int> &set, int value) {
+        set.erase(value);
+        set.insert(value + 1);
+      });
+}
+
+TEST(btreeSpeedTest, iteratorSpeedTest) {
+  static const size_t kElementsNum = 1e5;
+  speedTestFramework<BTreeSet<int>, Set<int>>(
+      [](BTreeSet<int> &set, int value) {
+        (void)std::next(set.begin(), 100);
+      },
+      [](Set<int> &set, int value) { (void)std::next(set.begin(), 100); },
+      kElementsNum);
+}
+
+// The Eytzinger snapshot against the tree it was frozen from.
+TEST(frozenSetSpeedTest, findSpeedTest) {
+  speedTestFramework<FrozenSet<int>, Set<int>>(
+      [](FrozenSet<int> &set, int value) { set.find(value); },
+      [](Set<int> &set, int value) { set.find(value); }, 1e6, 1);
+}
+
+TEST(frozenSetSpeedTest, iteratorSpeedTest) {
+  static const size_t kElementsNum = 1e5;
+  speedTestFramework<FrozenSet<int>, Set<int>>(
+      [](FrozenSet<int> &set, int value) {
+        (void)std::next(set.begin(), 100);
+      },
+      [](Set<int> &set, int value) { (void)std::next(set.begin(), 100); },
+      kElementsNum);
+}
+
+// contains_many against a loop of contains calls on the same keys, in random
+// and in sorted order.
+TEST(batchLookupSpeedTest, containsManySpeedTest) {
+  static const size_t kElementsNum = 1e6;
+  std::vector<int> data(kElementsNum);
+  std::mt19937 gen(42);
+  std::for_each(data.begin(), data.end(),
+                [&](int &a) { a = gen() % (2 * kElementsNum); });
+  Set<int> set(data.begin(), data.end());
+  std::vector<char> batchResult(kElementsNum);
+  std::vector<char> loopResult(kElementsNum);
+
+  for (bool sorted : {false, true}) {
+    if (sorted) {
+      std::sort(data.begin(), data.end());
+    }
+    int batchStart = clock();
+    set.contains_many(data.begin(), data.end(), batchResult.begin());
+    int batchEnd = clock();
+
+    int loopStart = clock();
+    for (size_t i = 0; i < kElementsNum; ++i) {
+      loopResult[i] = set.contains(data[i]);
+    }
+    int loopEnd = clock();
+
+    EXPECT_EQ(loopResult, batchResult);
+    EXPECT_LE(batchEnd - batchStart, loopEnd - loopStart);
+  }
+}
+
+// Appends save comparisons rather than pointer hops, so the keys are strings
+// with a long common prefix, like formatted timestamps.
+TEST(hintedInsertSpeedTest, appendSpeedTest) {
+  static const int kElementsNum = 2e5;
+  std::vector<std::string> data(kElementsNum);
+  for (int i = 0; i < kElementsNum; ++i) {
+    std::string number = std::to_string(i);
+    data[i] = "2024-01-01T" + std::string(9 - number.size(), '0') + number;
+  }
+
+  int hintedStart = clock();
+  Set<std::string> hinted;
+  for (const std::string &key : data) {
+    hinted.insert(hinted.end(), key);
+  }
+  int hintedEnd = clock();
+
+  int plainStart = clock();
+  Set<std::string> plain;
+  for (const std::string &key : data) {
+    plain.insert(key);
+  }
+  int plainEnd = clock();
+
+  EXPECT_EQ(plain.size(), hinted.size());
+  EXPECT_LE(hintedEnd - hintedStart, plainEnd - plainStart);
+}
+
+// Runs threadsNum threads doing 90% lookups, 5% inserts and 5% erases on
+// set and returns the operations per second. Wall time is measured, clock()
+// would add up the time of all the threads.
+template <typename TSet>
+double concurrentThroughput(TSet &set, unsigned threadsNum, int keysNum,
+                            int opsPerThread) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < threadsNum; ++t) {
+    threads.emplace_back([&set, t, keysNum, opsPerThread] {
+      std::mt19937 gen(t);
+      for (int i = 0; i < opsPerThread; ++i) {
+        int key = (int)(gen() % keysNum);
+        unsigned op = gen() % 20;
+        if (op == 0) {
+          set.insert(key);
+        } else if (op == 1) {
+          set.erase(key);
+        } else {
+          set.contains(key);
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+  return threadsNum * opsPerThread / time.count();
+}
+
+// Set<int> behind one mutex, the way it has to be shared without
+// ConcurrentSet.
+class LockedSet {
+public:
+  void insert(int key) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Set.insert(key);
+  }
+  void erase(int key) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Set.erase(key);
+  }
+  bool contains(int key) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Set.contains(key);
+  }
+
+private:
+  std::mutex m_Mutex;
+  Set<int> m_Set;
+};
+
+// Prints the throughput for 1, 2, 4, ... threads up to the number of cores.
+// On a machine with several cores ConcurrentSet has to get faster with more
+// threads. The locked Set is the upper bound while the threads fit on one core
+// and the mutex is never contended; there ConcurrentSet, which validates
+// three loads per level and whose atomics are calls at -O0, may be up to
+// twice the usual coefficient slower.
+TEST(concurrentSetSpeedTest, throughputSpeedTest) {
+  static const int kKeysNum = 100000;
+  static const int kOpsPerThread = 200000;
+  unsigned maxThreadsNum = std::max(4u, std::thread::hardware_concurrency());
+  ConcurrentSet<int> concurrentSet;
+  LockedSet lockedSet;
+  for (int key = 0; key < kKeysNum; key += 2) {
+    concurrentSet.insert(key);
+    lockedSet.insert(key);
+  }
+
+  double singleThreadThroughput = 0;
+  for (unsigned threadsNum = 1; threadsNum <= maxThreadsNum; threadsNum *= 2) {
+    double concurrent = concurrentThroughput(concurrentSet, threadsNum,
+                                             kKeysNum, kOpsPerThread);
+    double locked =
+        concurrentThroughput(lockedSet, threadsNum, kKeysNum, kOpsPerThread);
+    std::cout << threadsNum << " threads: ConcurrentSet " << (long)concurrent
+              << " ops/s, locked Set " << (long)locked << " ops/s"
+              << std::endl;
+    EXPECT_LE(locked, 2 * TEST_PERFORMANCE_DECREASE_COEFF * concurrent);
+    if (threadsNum == 1) {
+      singleThreadThroughput = concurrent;
+    } else if (threadsNum <= std::thread::hardware_concurrency()) {
+      EXPECT_LE(singleThreadThroughput, concurrent);
+    }
+  }
+}
+
+// Lookups per second of CPU time, averaged over the reader threads. Each
+// lookup takes a snapshot and walks a few keys from the lower bound. Thread
+// CPU time leaves out the time the readers spend descheduled while the writer
+// runs on the same core.
+double rcuReaderThroughput(RcuSet<int> &set, unsigned readersNum, int keysNum,
+                           bool writing) {
+  static const int kLookupsPerThread = 200000;
+  std::atomic<bool> done(false);
+  std::thread writer;
+  if (writing) {
+    writer = std::thread([&set, &done, keysNum] {
+      std::mt19937 gen(0);
+      while (!done.load()) {
+        int key = (int)(gen() % keysNum) | 1;
+        if (!set.insert(key)) {
+          set.erase(key);
+        }
+      }
+    });
+  }
+
+  std::vector<double> throughputs(readersNum);
+  std::vector<std::thread> readers;
+  for (unsigned t = 0; t < readersNum; ++t) {
+    readers.emplace_back([&set, &throughputs, t, keysNum] {
+      std::mt19937 gen(t + 1);
+      timespec start, end;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+      for (int i = 0; i < kLookupsPerThread; ++i) {
+        auto snapshot = set.snapshot();
+        auto it = snapshot.lower_bound((int)(gen() % keysNum));
+        for (int step = 0; step < 4 && it != snapshot.end(); ++step) {
+          ++it;
+        }
+      }
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+      double time = (double)(end.tv_sec - start.tv_sec) +
+                    (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+      throughputs[t] = kLookupsPerThread / time;
+    });
+  }
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+  done = true;
+  if (writer.joinable()) {
+    writer.join();
+  }
+  double res = 0;
+  for (double throughput : throughputs) {
+    res += throughput;
+  }
+  return res / readersNum;
+}
+
+// Readers of an RcuSet never wait for the writer, so a writer that keeps
+// inserting and erasing must not slow them down noticeably.
+TEST(rcuSetSpeedTest, readersUnderWritesSpeedTest) {
+  static const int kKeysNum = 100000;
+  static const unsigned kReadersNum = 2;
+  RcuSet<int> set;
+  for (int key = 0; key < kKeysNum; key += 2) {
+    set.insert(key);
+  }
+
+  double idle = rcuReaderThroughput(set, kReadersNum, kKeysNum, false);
+  double busy = rcuReaderThroughput(set, kReadersNum, kKeysNum, true);
+  std::cout << "RcuSet readers: " << (long)idle << " lookups/s idle writer, "
+            << (long)busy << " lookups/s busy writer" << std::endl;
+  EXPECT_LE(idle, 2 * busy);
+}
+
+// The persistent tree against the mutable one. Iterators keep the path from
+// the root instead of following threads, which has to stay within the usual
+// coefficient.
+TEST(persistentSetSpeedTest, findSpeedTest) {
+  speedTestFramework<PersistentSet<int>, Set<int>>(
+      [](PersistentSet<int> &set, int value) { set.find(value); },
+      [](Set<int> &set, int value) { set.find(value); });
+}
+
+TEST(persistentSetSpeedTest, insertEraseSpeedTest) {
+  speedTestFramework<PersistentSet<int>, Set<int>>(
+      [](PersistentSet<int> &set, int value) {
+        set.erase(value);
+        set.insert(value + 1);
+      },
+      [](Set<int> &set, int value) {
+        set.erase(value);
+        set.insert(value + 1);
+      });
+}
+
+TEST(persistentSetSpeedTest, iteratorSpeedTest) {
+  static const size_t kElementsNum = 1e5;
+  speedTestFramework<PersistentSet<int>, Set<int>>(
+      [](PersistentSet<int> &set, int value) {
+        (void)std::next(set.begin(), 100);
       },
+      [](Set<int> &set, int value) { (void)std::next(set.begin(), 100); },
       kElementsNum);
-}
\ No newline at end of file
+}
+
+// Copies that are changed a little, the way views are handed out while the
+// original keeps changing: O(log n) per copy against a deep copy.
+TEST(persistentSetSpeedTest, copySpeedTest) {
+  static const int kKeysNum = 100000;
+  static const int kCopiesNum = 200;
+  PersistentSet<int> persistentSet;
+  Set<int> set;
+  for (int key = 0; key < kKeysNum; ++key) {
+    persistentSet.insert(key);
+    set.insert(key);
+  }
+
+  int persistentStart = clock();
+  for (int i = 0; i < kCopiesNum; ++i) {
+    PersistentSet<int> copy = persistentSet;
+    copy.insert(kKeysNum + i);
+    persistentSet.erase(i);
+  }
+  int persistentEnd = clock();
+
+  int start = clock();
+  for (int i = 0; i < kCopiesNum; ++i) {
+    Set<int> copy = set;
+    copy.insert(kKeysNum + i);
+    set.erase(i);
+  }
+  int end = clock();
+
+  EXPECT_LE(TEST_PERFORMANCE_DECREASE_COEFF * (persistentEnd - persistentStart),
+            end - start);
+}
+
+// Prints the time of the parallel build and of a parallel union for 1, 2,
+// 4, ... threads, up to the number of cores but at least 4. Up to the number
+// of cores, more threads must not be slower than one. Beyond it they may be
+// slower by no more than the usual coefficient. How close to linear the
+// speedup is depends on the machine and is not asserted; it has only been run
+// on a single core, where the thread counts above one are all oversubscribed.
+TEST(parallelBulkSpeedTest, buildAndUnionSpeedTest) {
+  static const size_t kElementsNum = 2e6;
+  unsigned maxThreadsNum = std::max(4u, std::thread::hardware_concurrency());
+  std::mt19937 gen(42);
+  std::vector<int> data(kElementsNum);
+  for (int &el : data) {
+    el = (int)gen();
+  }
+  std::vector<int> otherData(kElementsNum);
+  for (int &el : otherData) {
+    el = (int)gen();
+  }
+
+  double singleThreadTime = 0;
+  for (unsigned threadsNum = 1; threadsNum <= maxThreadsNum; threadsNum *= 2) {
+    Set<int> set;
+    Set<int> other;
+    auto start = std::chrono::steady_clock::now();
+    set.assign_parallel(data.begin(), data.end(), threadsNum);
+    other.assign_parallel(otherData.begin(), otherData.end(), threadsNum);
+    set.union_with(std::move(other), threadsNum);
+    std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start;
+    std::cout << threadsNum << " threads: " << time.count() << " s"
+              << std::endl;
+    if (threadsNum == 1) {
+      singleThreadTime = time.count();
+    } else if (threadsNum <= std::thread::hardware_concurrency()) {
+      EXPECT_LE(time.count(), singleThreadTime);
+    } else {
+      EXPECT_LE(time.count(),
+                TEST_PERFORMANCE_DECREASE_COEFF * singleThreadTime);
+    }
+  }
+}
+
+// Loading a snapshot has to beat rebuilding the set key by key, and lookups
+// served from the mapping may not be slower than lookups in the set by more
+// than the usual coefficient.
+TEST(snapshotSpeedTest, loadAndMappedFindSpeedTest) {
+  std::mt19937 gen(42);
+  std::vector<int> data(TEST_DATA_ELEMENTS_NUM);
+  for (int &el : data) {
+    el = (int)gen();
+  }
+  std::string path = testing::TempDir() + "set_snapshot_speed_test.bin";
+  Set<int>(data.begin(), data.end()).save(path);
+
+  int insertStart = clock();
+  Set<int> inserted;
+  for (int el : data) {
+    inserted.insert(el);
+  }
+  int insertEnd = clock();
+
+  int loadStart = clock();
+  Set<int> loaded;
+  loaded.load(path);
+  int loadEnd = clock();
+  EXPECT_EQ(inserted.size(), loaded.size());
+  EXPECT_LE(TEST_PERFORMANCE_DECREASE_COEFF * (loadEnd - loadStart),
+            insertEnd - insertStart);
+
+  MappedSet<int> mapped(path);
+  std::shuffle(data.begin(), data.end(), gen);
+  size_t found = 0;
+  int mappedStart = clock();
+  for (int el : data) {
+    found += mapped.contains(el);
+  }
+  int mappedEnd = clock();
+  int start = clock();
+  for (int el : data) {
+    found -= loaded.contains(el);
+  }
+  int end = clock();
+  EXPECT_EQ(0u, found);
+  EXPECT_LE(mappedEnd - mappedStart,
+            TEST_PERFORMANCE_DECREASE_COEFF * (end - start));
+  std::remove(path.c_str());
+}
+
+// With the whole set in the cache lookups may not be slower than in std::set
+// by more than the usual coefficient. A scan of a set sixteen times the cache
+// has to read pages in large runs to keep up with a scan of std::set.
+TEST(diskSetSpeedTest, findAndScanSpeedTest) {
+  std::mt19937 gen(42);
+  std::vector<int> data(TEST_DATA_ELEMENTS_NUM);
+  for (int &el : data) {
+    el = (int)gen();
+  }
+  std::set<int> stdSet(data.begin(), data.end());
+  std::string path = testing::TempDir() + "disk_set_speed_test.bin";
+  std::remove(path.c_str());
+  {
+    DiskSet<int> set(path);
+    set.assign_sorted(stdSet.begin(), stdSet.end());
+    std::shuffle(data.begin(), data.end(), gen);
+    size_t found = 0;
+    int diskStart = clock();
+    for (int el : data) {
+      found += set.contains(el);
+    }
+    int diskEnd = clock();
+    int start = clock();
+    for (int el : data) {
+      found -= stdSet.count(el);
+    }
+    int end = clock();
+    EXPECT_EQ(0u, found);
+    EXPECT_LE(diskEnd - diskStart,
+              TEST_PERFORMANCE_DECREASE_COEFF * (end - start));
+  }
+
+  DiskSet<int> set(path, stdSet.size() * sizeof(int) / 16);
+  long long diskSum = 0;
+  int diskStart = clock();
+  for (int el : set) {
+    diskSum += el;
+  }
+  int diskEnd = clock();
+  long long sum = 0;
+  int start = clock();
+  for (int el : stdSet) {
+    sum += el;
+  }
+  int end = clock();
+  EXPECT_EQ(sum, diskSum);
+  EXPECT_LE(diskEnd - diskStart,
+            TEST_PERFORMANCE_DECREASE_COEFF * (end - start));
+  std::remove(path.c_str());
+}
+
+// Bytes malloc has given out and not got back, small blocks and mmapped ones.
+static size_t heapInUse() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+// memory_usage against the real heap, and its O(n) walk over the keys against
+// a walk over std::set.
+TEST(memoryUsageSpeedTest, reportedVsHeapSpeedTest) {
+  std::mt19937 gen(42);
+  std::vector<std::string> data(TEST_DATA_ELEMENTS_NUM / 5);
+  for (std::string &el : data) {
+    el = "key:" + std::to_string(gen()) + std::string(32, 'x');
+  }
+  std::set<std::string> stdSet(data.begin(), data.end());
+
+  size_t heapBefore = heapInUse();
+  Set<std::string> set;
+  for (const std::string &el : data) {
+    set.insert(el);
+  }
+  size_t heap = heapInUse() - heapBefore;
+
+  int myStart = clock();
+  MemoryUsage usage = set.memory_usage();
+  int myEnd = clock();
+  size_t stdBytes = 0;
+  int stdStart = clock();
+  for (const std::string &el : stdSet) {
+    stdBytes += el.capacity();
+  }
+  int stdEnd = clock();
+
+  size_t reported = usage.m_TotalBytes - sizeof(set);
+  EXPECT_EQ(stdSet.size(), usage.m_NodesNum);
+  EXPECT_GT(stdBytes, 0u);
+  EXPECT_LE(reported, heap + heap / 50);
+  EXPECT_GE(reported, heap - heap / 50);
+  EXPECT_LE(myEnd - myStart,
+            TEST_PERFORMANCE_DECREASE_COEFF * (stdEnd - stdStart));
+
+  heapBefore = heapInUse();
+  Set<int> intSet;
+  for (int i = 0; i < TEST_DATA_ELEMENTS_NUM; ++i) {
+    intSet.insert((int)gen());
+  }
+  heap = heapInUse() - heapBefore;
+  reported = intSet.memory_usage().m_TotalBytes - sizeof(intSet);
+  EXPECT_LE(reported, heap + heap / 50);
+  EXPECT_GE(reported, heap - heap / 50);
+}
+
+TEST(mapSpeedTest, updateSpeedTest) {
+  const size_t kMaxElement = TEST_DATA_ELEMENTS_NUM / 3;
+  std::mt19937 gen(42);
+  std::vector<int> data(TEST_DATA_ELEMENTS_NUM);
+  for (int &el : data) {
+    el = (int)(gen() % kMaxElement);
+  }
+  Map<int, long long> map;
+  int myStart = clock();
+  for (int el : data) {
+    map[el] += el;
+  }
+  for (int el : data) {
+    map.find(el)->second -= 1;
+  }
+  int myEnd = clock();
+
+  std::map<int, long long> stdMap;
+  int stdStart = clock();
+  for (int el : data) {
+    stdMap[el] += el;
+  }
+  for (int el : data) {
+    stdMap.find(el)->second -= 1;
+  }
+  int stdEnd = clock();
+
+  EXPECT_TRUE(std::equal(map.begin(), map.end(), stdMap.begin()));
+  EXPECT_LE(myEnd - myStart,
+            TEST_PERFORMANCE_DECREASE_COEFF * (stdEnd - stdStart));
+}
+
+// Heavily duplicated keys: one node per distinct key against a node per copy
+// in std::multiset and in the Set<pair<T, sequence number>> emulation.
+// std::multiset cannot count a range in O(log n), so it only inserts.
+TEST(multiSetSpeedTest, duplicatesSpeedTest) {
+  const size_t kMaxElement = 1000;
+  std::mt19937 gen(42);
+  std::vector<int> data(TEST_DATA_ELEMENTS_NUM);
+  for (int &el : data) {
+    el = (int)(gen() % kMaxElement);
+  }
+  MultiSet<int> set;
+  int myInsertStart = clock();
+  for (int el : data) {
+    set.insert(el);
+  }
+  int myInsertEnd = clock();
+  size_t myCounted = 0;
+  int myCountStart = clock();
+  for (int el : data) {
+    myCounted += set.count_range(el, el + 10);
+  }
+  int myCountEnd = clock();
+
+  std::multiset<int> stdSet;
+  int stdInsertStart = clock();
+  for (int el : data) {
+    stdSet.insert(el);
+  }
+  int stdInsertEnd = clock();
+
+  Set<std::pair<int, size_t>> pairSet;
+  for (size_t i = 0; i < data.size(); ++i) {
+    pairSet.insert({data[i], i});
+  }
+  size_t pairCounted = 0;
+  int pairCountStart = clock();
+  for (int el : data) {
+    pairCounted += pairSet.count_range(std::make_pair(el, (size_t)0),
+                                       std::make_pair(el + 10, (size_t)0));
+  }
+  int pairCountEnd = clock();
+
+  EXPECT_TRUE(std::equal(set.begin(), set.end(), stdSet.begin()));
+  EXPECT_EQ(pairCounted, myCounted);
+  EXPECT_LE(myInsertEnd - myInsertStart,
+            TEST_PERFORMANCE_DECREASE_COEFF * (stdInsertEnd - stdInsertStart));
+  EXPECT_LE(myCountEnd - myCountStart, pairCountEnd - pairCountStart);
+}
@@ -1,11 +1,32 @@
+#include "btree_set.hpp"
+#include "compact_set.hpp"
+#include "concurrent_set.hpp"
+#include "disk_set.hpp"
+#include "map.hpp"
+#include "mapped_set.hpp"
+#include "multi_set.hpp"
+#include "persistent_set.hpp"
+#include "rcu_set.hpp"
 #include "set.hpp"
 
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <memory_resource>
 #include <random>
 #include <set>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <time.h>
 #include <vector>
 
@@ -255,3 +276,1997 @@ TEST(integrationTest, randomElementsTest) {
   EXPECT_EQ(stdSet.size(), mySet.size());
   EXPECT_EQ(stdSet.empty(), mySet.empty());
 }
+
+static size_t allocationsNum = 0;
+static size_t allocatedBytes = 0;
+
+template <typename T> struct CountingAllocator {
+  typedef T value_type;
+
+  CountingAllocator() = default;
+  template <typename U> CountingAllocator(const CountingAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    ++allocationsNum;
+    allocatedBytes += n * sizeof(T);
+    return std::allocator<T>().allocate(n);
+  }
+  void deallocate(T *p, size_t n) {
+    allocatedBytes -= n * sizeof(T);
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U> bool operator==(const CountingAllocator<U> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const CountingAllocator<U> &) const {
+    return false;
+  }
+};
+
+TEST(allocator, customAllocatorTest) {
+  static const size_t kElementsNum = 10000;
+  allocationsNum = 0;
+  {
+    Set<int, std::less<int>, CountingAllocator<int>> set;
+    for (size_t i = 0; i < kElementsNum; ++i) {
+      set.insert((int)i);
+    }
+    for (size_t i = 0; i < kElementsNum; i += 2) {
+      set.erase((int)i);
+    }
+    for (size_t i = 0; i < kElementsNum; i += 2) {
+      set.insert((int)i);
+    }
+
+    EXPECT_EQ(kElementsNum, set.size());
+    EXPECT_LT(allocationsNum, kElementsNum / 100);
+    EXPECT_NE(0, allocatedBytes);
+  }
+  EXPECT_EQ(0, allocatedBytes);
+}
+
+TEST(allocator, reserveTest) {
+  static const size_t kElementsNum = 1000;
+  Set<int, std::less<int>, CountingAllocator<int>> set;
+  set.reserve(kElementsNum);
+
+  allocationsNum = 0;
+  for (size_t i = 0; i < kElementsNum; ++i) {
+    set.insert((int)i);
+  }
+  EXPECT_EQ(0, allocationsNum);
+
+  set.clear();
+  EXPECT_EQ(0, allocatedBytes);
+  EXPECT_EQ(true, set.empty());
+}
+
+TEST(allocator, polymorphicAllocatorTest) {
+  std::pmr::monotonic_buffer_resource resource;
+  Set<std::pmr::string, std::less<std::pmr::string>,
+      std::pmr::polymorphic_allocator<std::pmr::string>>
+      set(&resource);
+  EXPECT_EQ(&resource, set.get_allocator().resource());
+
+  for (int i = 0; i < 100; ++i) {
+    set.insert(std::pmr::string(std::to_string(i)));
+  }
+  EXPECT_EQ(100, set.size());
+  EXPECT_EQ(true, set.contains(std::pmr::string("42")));
+
+  auto copy = set;
+  EXPECT_EQ(set.size(), copy.size());
+  EXPECT_NE(&resource, copy.get_allocator().resource());
+}
+
+TEST(allocator, clearAndReuseTest) {
+  Set<std::string> set;
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 1000; ++i) {
+      set.insert(std::string(32, 'a') + std::to_string(i));
+    }
+    EXPECT_EQ(1000, set.size());
+    set.clear();
+    EXPECT_EQ(0, set.size());
+  }
+}
+
+struct CopyCountingKey {
+  static size_t copiesNum;
+
+  explicit CopyCountingKey(int value) : m_Value(value) {}
+  CopyCountingKey(int first, int second) : m_Value(first * 10 + second) {}
+  CopyCountingKey(const CopyCountingKey &other) : m_Value(other.m_Value) {
+    ++copiesNum;
+  }
+  CopyCountingKey(CopyCountingKey &&other) = default;
+  CopyCountingKey &operator=(const CopyCountingKey &other) {
+    ++copiesNum;
+    m_Value = other.m_Value;
+    return *this;
+  }
+  CopyCountingKey &operator=(CopyCountingKey &&other) = default;
+
+  bool operator<(const CopyCountingKey &other) const {
+    return m_Value < other.m_Value;
+  }
+
+  int m_Value;
+};
+
+size_t CopyCountingKey::copiesNum = 0;
+
+TEST(moveSemantics, rvalueInsertTest) {
+  Set<CopyCountingKey> set;
+  CopyCountingKey::copiesNum = 0;
+  for (int i = 0; i < 1000; ++i) {
+    set.insert(CopyCountingKey(i));
+  }
+  EXPECT_EQ(1000, set.size());
+  EXPECT_EQ(0, CopyCountingKey::copiesNum);
+}
+
+TEST(moveSemantics, emplaceTest) {
+  Set<CopyCountingKey> set;
+  CopyCountingKey::copiesNum = 0;
+  set.emplace(4, 2);
+  set.emplace(1, 7);
+  set.emplace(4, 2);
+
+  EXPECT_EQ(2, set.size());
+  EXPECT_EQ(17, set.begin()->m_Value);
+  EXPECT_EQ(42, (++set.begin())->m_Value);
+  EXPECT_EQ(0, CopyCountingKey::copiesNum);
+}
+
+TEST(moveSemantics, moveConstructorTest) {
+  Set<std::string> setA{"a", "b", "c"};
+  Set<std::string> setB(std::move(setA));
+
+  EXPECT_EQ(3, setB.size());
+  EXPECT_EQ(true, setB.contains("b"));
+  EXPECT_EQ(true, setA.empty());
+
+  setA.insert("d");
+  EXPECT_EQ(1, setA.size());
+}
+
+TEST(moveSemantics, moveAssignmentTest) {
+  Set<int> setA{1, 2, 3}, setB{4, 5};
+  setA = std::move(setB);
+
+  EXPECT_EQ(2, setA.size());
+  EXPECT_EQ(4, *setA.begin());
+  EXPECT_EQ(true, setB.empty());
+}
+
+TEST(moveSemantics, moveAssignmentDifferentResourcesTest) {
+  std::pmr::monotonic_buffer_resource resourceA, resourceB;
+  typedef Set<int, std::less<int>, std::pmr::polymorphic_allocator<int>>
+      PmrSet;
+  PmrSet setA({1, 2, 3}, &resourceA);
+  PmrSet setB({4, 5}, &resourceB);
+  setA = std::move(setB);
+
+  EXPECT_EQ(&resourceA, setA.get_allocator().resource());
+  EXPECT_EQ(2, setA.size());
+  EXPECT_EQ(5, *--setA.end());
+}
+
+TEST(moveSemantics, swapTest) {
+  Set<int> setA{1, 2, 3}, setB{4, 5};
+  swap(setA, setB);
+
+  EXPECT_EQ(2, setA.size());
+  EXPECT_EQ(3, setB.size());
+  EXPECT_EQ(4, *setA.begin());
+  EXPECT_EQ(1, *setB.begin());
+}
+
+TEST(comparator, customComparatorTest) {
+  Set<int, std::greater<int>> set{3, 1, 4, 1, 5, 9, 2, 6};
+  std::vector<int> expected{9, 6, 5, 4, 3, 2, 1};
+
+  EXPECT_EQ(true, std::equal(set.begin(), set.end(), expected.begin(),
+                             expected.end()));
+  EXPECT_EQ(4, *set.lower_bound(4));
+  EXPECT_EQ(3, *set.lower_bound(3));
+  EXPECT_EQ(6, *set.lower_bound(7));
+  EXPECT_EQ(set.end(), set.lower_bound(0));
+  EXPECT_EQ(set.end(), set.find(7));
+
+  set.erase(9);
+  EXPECT_EQ(6, *set.begin());
+}
+
+struct ModuloLess {
+  explicit ModuloLess(int modulo = 10) : m_Modulo(modulo) {}
+  bool operator()(int lhs, int rhs) const {
+    return lhs % m_Modulo < rhs % m_Modulo;
+  }
+  int m_Modulo;
+};
+
+TEST(comparator, statefulComparatorTest) {
+  Set<int, ModuloLess> set({11, 25, 7, 14}, ModuloLess(5));
+  EXPECT_EQ(5, set.key_comp().m_Modulo);
+  EXPECT_EQ(4, set.size());
+  EXPECT_EQ(true, set.contains(16));
+  EXPECT_EQ(25, *set.begin());
+
+  set.insert(20);
+  EXPECT_EQ(4, set.size());
+
+  Set<int, ModuloLess> copy(set);
+  EXPECT_EQ(5, copy.key_comp().m_Modulo);
+  EXPECT_EQ(true, copy.contains(12));
+}
+
+TEST(comparator, heterogeneousLookupTest) {
+  Set<std::string, std::less<>> set{"apple", "banana", "cherry"};
+  std::string_view key = "banana";
+
+  EXPECT_EQ(true, set.contains(key));
+  EXPECT_EQ("banana", *set.find(key));
+  EXPECT_EQ("cherry", *set.lower_bound(std::string_view("c")));
+  EXPECT_EQ(set.end(), set.find(std::string_view("date")));
+
+  set.erase(key);
+  EXPECT_EQ(false, set.contains(key));
+  EXPECT_EQ(2, set.size());
+  EXPECT_EQ(true, set.contains("apple"));
+}
+
+struct CountingLess {
+  static size_t comparisonsNum;
+  bool operator()(int lhs, int rhs) const {
+    ++comparisonsNum;
+    return lhs < rhs;
+  }
+};
+
+size_t CountingLess::comparisonsNum = 0;
+
+TEST(sortedConstruction, rangeConstructorTest) {
+  std::vector<int> data{1, 1, 2, 3, 3, 3, 5, 8, 13, 13, 21};
+  std::set<int> stdSet(data.begin(), data.end());
+  Set<int> set(data.begin(), data.end());
+
+  EXPECT_EQ(stdSet.size(), set.size());
+  EXPECT_EQ(true,
+            std::equal(set.begin(), set.end(), stdSet.begin(), stdSet.end()));
+  EXPECT_EQ(21, *--set.end());
+  EXPECT_EQ(1, *--(++set.begin()));
+}
+
+TEST(sortedConstruction, partiallySortedRangeTest) {
+  std::vector<int> data{1, 2, 3, 4, 5, 6, 7, 8, 0, 9, 4, -1};
+  std::set<int> stdSet(data.begin(), data.end());
+  Set<int> set(data.begin(), data.end());
+
+  EXPECT_EQ(stdSet.size(), set.size());
+  EXPECT_EQ(true,
+            std::equal(set.begin(), set.end(), stdSet.begin(), stdSet.end()));
+}
+
+TEST(sortedConstruction, linearComparisonsTest) {
+  static const size_t kElementsNum = 100000;
+  std::vector<int> data(kElementsNum);
+  for (size_t i = 0; i < kElementsNum; ++i) {
+    data[i] = (int)i;
+  }
+
+  CountingLess::comparisonsNum = 0;
+  auto set = Set<int, CountingLess>::from_sorted(data.begin(), data.end());
+  EXPECT_EQ(kElementsNum, set.size());
+  EXPECT_LE(CountingLess::comparisonsNum, 2 * kElementsNum);
+
+  int i = 0;
+  for (auto it = set.begin(); it != set.end(); ++it) {
+    EXPECT_EQ(i++, *it);
+  }
+  EXPECT_EQ(kElementsNum, i);
+
+  for (size_t i = 0; i < kElementsNum; i += 2) {
+    set.erase((int)i);
+  }
+  EXPECT_EQ(kElementsNum / 2, set.size());
+  EXPECT_EQ(1, *set.begin());
+}
+
+TEST(sortedConstruction, inputIteratorTest) {
+  std::istringstream input("1 2 2 4 8 16");
+  auto set = Set<int>::from_sorted(std::istream_iterator<int>(input),
+                                   std::istream_iterator<int>());
+
+  std::vector<int> expected{1, 2, 4, 8, 16};
+  EXPECT_EQ(true, std::equal(set.begin(), set.end(), expected.begin(),
+                             expected.end()));
+}
+
+TEST(sortedConstruction, assignSortedTest) {
+  Set<std::string> set{"x", "y"};
+  std::vector<std::string> data{"a", "b", "c"};
+  set.assign_sorted(data.begin(), data.end());
+
+  EXPECT_EQ(3, set.size());
+  EXPECT_EQ(false, set.contains("x"));
+  EXPECT_EQ("a", *set.begin());
+
+  std::vector<std::string> unsorted{"a", "c", "b"};
+  EXPECT_THROW(set.assign_sorted(unsorted.begin(), unsorted.end()),
+               std::invalid_argument);
+  EXPECT_EQ(true, set.empty());
+}
+
+TEST(orderStatistics, nthTest) {
+  Set<int> set{10, 20, 30, 40, 50};
+
+  EXPECT_EQ(10, *set.nth(0));
+  EXPECT_EQ(30, *set.nth(2));
+  EXPECT_EQ(50, *set.nth(4));
+  EXPECT_EQ(set.end(), set.nth(5));
+  EXPECT_EQ(40, *--set.nth(4));
+}
+
+TEST(orderStatistics, rankTest) {
+  Set<int> set{10, 20, 30, 40, 50};
+
+  EXPECT_EQ(0, set.rank(5));
+  EXPECT_EQ(0, set.rank(10));
+  EXPECT_EQ(2, set.rank(25));
+  EXPECT_EQ(2, set.rank(30));
+  EXPECT_EQ(5, set.rank(60));
+
+  EXPECT_EQ(3, set.index_of(set.find(40)));
+  EXPECT_EQ(set.size(), set.index_of(set.end()));
+}
+
+TEST(orderStatistics, advanceAndDistanceTest) {
+  static const size_t kElementsNum = 10000;
+  std::mt19937 gen(42);
+  std::set<int> stdSet;
+  for (size_t i = 0; i < kElementsNum; ++i) {
+    stdSet.insert(gen() % (kElementsNum * 10));
+  }
+  Set<int> set(stdSet.begin(), stdSet.end());
+
+  for (size_t i = 0; i < 100; ++i) {
+    size_t from = gen() % stdSet.size();
+    size_t to = gen() % (stdSet.size() + 1);
+    auto stdFrom = std::next(stdSet.begin(), from);
+    auto stdTo = std::next(stdSet.begin(), to);
+    auto myFrom = set.nth(from);
+
+    EXPECT_EQ(*stdFrom, *myFrom);
+    EXPECT_EQ(std::distance(stdSet.begin(), stdFrom),
+              set.distance(set.begin(), myFrom));
+    EXPECT_EQ((std::ptrdiff_t)to - (std::ptrdiff_t)from,
+              set.distance(myFrom, set.advance(myFrom, to - from)));
+    if (stdTo == stdSet.end()) {
+      EXPECT_EQ(set.end(), set.advance(myFrom, to - from));
+    } else {
+      EXPECT_EQ(*stdTo, *set.advance(myFrom, to - from));
+    }
+  }
+}
+
+TEST(orderStatistics, sampleTest) {
+  static const size_t kElementsNum = 10;
+  static const size_t kSamplesNum = 100000;
+  Set<int> set;
+  std::mt19937 gen(42);
+  EXPECT_EQ(set.end(), set.sample(gen));
+
+  for (size_t i = 0; i < kElementsNum; ++i) {
+    set.insert((int)i);
+  }
+
+  std::vector<size_t> hits(kElementsNum);
+  for (size_t i = 0; i < kSamplesNum; ++i) {
+    ++hits[*set.sample(gen)];
+  }
+  for (size_t count : hits) {
+    EXPECT_NEAR(kSamplesNum / kElementsNum, count, kSamplesNum / 100);
+  }
+}
+
+TEST(rangeQueries, upperBoundTest) {
+  Set<int> set{-1, 0, 1, 2, 4, 5};
+  EXPECT_EQ(-1, *set.upper_bound(-2));
+  EXPECT_EQ(0, *set.upper_bound(-1));
+  EXPECT_EQ(4, *set.upper_bound(3));
+  EXPECT_EQ(set.end(), set.upper_bound(5));
+  EXPECT_EQ(5, *--set.upper_bound(5));
+}
+
+TEST(rangeQueries, equalRangeTest) {
+  Set<int> set{1, 3, 5};
+
+  auto range = set.equal_range(3);
+  EXPECT_EQ(3, *range.first);
+  EXPECT_EQ(5, *range.second);
+
+  range = set.equal_range(4);
+  EXPECT_EQ(range.first, range.second);
+  EXPECT_EQ(5, *range.first);
+}
+
+TEST(rangeQueries, countRangeTest) {
+  static const size_t kElementsNum = 10000;
+  static const int kMaxElement = 50000;
+  std::mt19937 gen(42);
+  std::set<int> stdSet;
+  for (size_t i = 0; i < kElementsNum; ++i) {
+    stdSet.insert(gen() % kMaxElement);
+  }
+  Set<int> set(stdSet.begin(), stdSet.end());
+
+  for (size_t i = 0; i < 100; ++i) {
+    int lo = gen() % kMaxElement;
+    int hi = gen() % kMaxElement;
+    size_t expected = 0;
+    if (lo < hi) {
+      expected = std::distance(stdSet.lower_bound(lo), stdSet.lower_bound(hi));
+    }
+    EXPECT_EQ(expected, set.count_range(lo, hi));
+  }
+}
+
+TEST(rangeQueries, rangeViewTest) {
+  Set<int> set{1, 2, 3, 5, 8, 13, 21};
+
+  auto range = set.range(2, 13);
+  std::vector<int> expected{2, 3, 5, 8};
+  EXPECT_EQ(4, range.size());
+  EXPECT_EQ(true, std::equal(range.begin(), range.end(), expected.begin(),
+                             expected.end()));
+
+  EXPECT_EQ(true, set.range(9, 12).empty());
+  EXPECT_EQ(true, set.range(13, 2).empty());
+  EXPECT_EQ(2, set.range(13, 100).size());
+
+  int sum = 0;
+  for (int el : set.range(0, 4)) {
+    sum += el;
+  }
+  EXPECT_EQ(6, sum);
+}
+
+template <typename TSet>
+void expectSameElements(const std::set<int> &expected, const TSet &set) {
+  EXPECT_EQ(expected.size(), set.size());
+  EXPECT_EQ(true, std::equal(set.begin(), set.end(), expected.begin(),
+                             expected.end()));
+  auto it = set.end();
+  for (auto stdIt = expected.rbegin(); stdIt != expected.rend(); ++stdIt) {
+    EXPECT_EQ(*stdIt, *--it);
+  }
+  EXPECT_EQ(set.begin(), it);
+  size_t i = 0;
+  for (int el : expected) {
+    EXPECT_EQ(el, *set.nth(i++));
+  }
+}
+
+std::set<int> randomStdSet(std::mt19937 &gen, size_t elementsNum,
+                           int maxElement) {
+  std::set<int> result;
+  for (size_t i = 0; i < elementsNum; ++i) {
+    result.insert(gen() % maxElement);
+  }
+  return result;
+}
+
+TEST(setAlgebra, operationsTest) {
+  std::mt19937 gen(42);
+  const std::vector<std::pair<size_t, size_t>> sizes{
+      {0, 100}, {100, 0}, {1, 1000}, {1000, 10}, {2000, 2000}, {500, 3000}};
+
+  for (auto size : sizes) {
+    std::set<int> stdA = randomStdSet(gen, size.first, 5000);
+    std::set<int> stdB = randomStdSet(gen, size.second, 5000);
+    Set<int> a(stdA.begin(), stdA.end());
+    Set<int> b(stdB.begin(), stdB.end());
+
+    std::set<int> expected;
+    std::set_union(stdA.begin(), stdA.end(), stdB.begin(), stdB.end(),
+                   std::inserter(expected, expected.end()));
+    expectSameElements(expected, set_union(a, b));
+
+    expected.clear();
+    std::set_intersection(stdA.begin(), stdA.end(), stdB.begin(), stdB.end(),
+                          std::inserter(expected, expected.end()));
+    expectSameElements(expected, set_intersection(a, b));
+
+    expected.clear();
+    std::set_difference(stdA.begin(), stdA.end(), stdB.begin(), stdB.end(),
+                        std::inserter(expected, expected.end()));
+    expectSameElements(expected, set_difference(a, b));
+
+    expected.clear();
+    std::set_symmetric_difference(stdA.begin(), stdA.end(), stdB.begin(),
+                                  stdB.end(),
+                                  std::inserter(expected, expected.end()));
+    expectSameElements(expected, set_symmetric_difference(a, b));
+
+    expectSameElements(stdA, a);
+    expectSameElements(stdB, b);
+  }
+}
+
+TEST(setAlgebra, destructiveOperationsTest) {
+  std::mt19937 gen(7);
+  std::set<int> stdA = randomStdSet(gen, 3000, 10000);
+  std::set<int> stdB = randomStdSet(gen, 300, 10000);
+  Set<int> a(stdA.begin(), stdA.end());
+  Set<int> b(stdB.begin(), stdB.end());
+
+  a.union_with(std::move(b));
+  EXPECT_EQ(true, b.empty());
+  stdA.insert(stdB.begin(), stdB.end());
+  expectSameElements(stdA, a);
+
+  a.insert(-1);
+  a.erase(*stdB.begin());
+  stdA.insert(-1);
+  stdA.erase(*stdB.begin());
+  expectSameElements(stdA, a);
+
+  Set<int> c(stdB.begin(), stdB.end());
+  a.difference_with(c);
+  for (int el : stdB) {
+    stdA.erase(el);
+  }
+  expectSameElements(stdA, a);
+  expectSameElements(stdB, c);
+}
+
+TEST(setAlgebra, differentResourcesTest) {
+  std::pmr::monotonic_buffer_resource resourceA, resourceB;
+  typedef Set<int, std::less<int>, std::pmr::polymorphic_allocator<int>>
+      PmrSet;
+  PmrSet a({1, 3, 5, 7}, &resourceA);
+  PmrSet b({3, 4, 5, 6}, &resourceB);
+
+  a.intersect_with(std::move(b));
+  expectSameElements({3, 5}, a);
+  EXPECT_EQ(true, b.empty());
+}
+
+TEST(setAlgebra, splitAndJoinTest) {
+  std::mt19937 gen(1);
+  std::set<int> stdSet = randomStdSet(gen, 1000, 5000);
+  for (int key : {-1, 100, 2500, 4900, 6000}) {
+    Set<int> set(stdSet.begin(), stdSet.end());
+    Set<int> right = set.split_off(key);
+
+    std::set<int> expectedLeft(stdSet.begin(), stdSet.lower_bound(key));
+    std::set<int> expectedRight(stdSet.lower_bound(key), stdSet.end());
+    expectSameElements(expectedLeft, set);
+    expectSameElements(expectedRight, right);
+
+    set.join(std::move(right));
+    expectSameElements(stdSet, set);
+  }
+
+  Set<int> a{1, 2, 3}, b{3, 4};
+  EXPECT_THROW(a.join(std::move(b)), std::invalid_argument);
+  EXPECT_EQ(3, a.size());
+}
+
+// Copies throw once copiesLeft runs out. liveNum tells whether every key
+// made was destroyed.
+struct ThrowingCopyKey {
+  static int copiesLeft;
+  static int liveNum;
+
+  explicit ThrowingCopyKey(int value) : m_Value(value) { ++liveNum; }
+  ThrowingCopyKey(const ThrowingCopyKey &other) : m_Value(other.m_Value) {
+    if (copiesLeft-- == 0) {
+      throw std::runtime_error("copy");
+    }
+    ++liveNum;
+  }
+  ~ThrowingCopyKey() { --liveNum; }
+
+  bool operator<(const ThrowingCopyKey &other) const {
+    return m_Value < other.m_Value;
+  }
+
+  int m_Value;
+};
+
+int ThrowingCopyKey::copiesLeft = 0;
+int ThrowingCopyKey::liveNum = 0;
+
+TEST(setAlgebra, splitOffThrowingCopyTest) {
+  for (int key : {100, 900}) {
+    {
+      ThrowingCopyKey::copiesLeft = 1 << 20;
+      Set<ThrowingCopyKey> set;
+      for (int i = 0; i < 1000; ++i) {
+        set.insert(ThrowingCopyKey(i));
+      }
+      ThrowingCopyKey::copiesLeft = 50;
+      EXPECT_THROW(set.split_off(ThrowingCopyKey(key)), std::runtime_error);
+      ASSERT_EQ(1000u, set.size());
+      int expected = 0;
+      for (const ThrowingCopyKey &el : set) {
+        EXPECT_EQ(expected++, el.m_Value);
+      }
+      EXPECT_EQ(1000, ThrowingCopyKey::liveNum);
+
+      ThrowingCopyKey::copiesLeft = 1 << 20;
+      Set<ThrowingCopyKey> right = set.split_off(ThrowingCopyKey(key));
+      EXPECT_EQ((size_t)key, set.size());
+      EXPECT_EQ(1000u - key, right.size());
+      EXPECT_EQ(key, right.begin()->m_Value);
+    }
+    EXPECT_EQ(0, ThrowingCopyKey::liveNum);
+  }
+}
+
+TEST(compactLayout, nodeSizeTest) {
+  EXPECT_EQ(16, CompactSet<int>::kBytesPerElement);
+  EXPECT_EQ(24, CompactSet<long long>::kBytesPerElement);
+
+  CompactSet<int> set;
+  set.reserve(1000);
+  EXPECT_EQ(1000, set.capacity());
+  for (int i = 0; i < 1000; ++i) {
+    set.insert(i);
+  }
+  EXPECT_EQ(1000, set.capacity());
+}
+
+TEST(compactLayout, randomOperationsTest) {
+  std::mt19937 gen(3);
+  CompactSet<int> set;
+  std::set<int> stdSet;
+  for (int i = 0; i < 20000; ++i) {
+    int key = (int)(gen() % 2000);
+    if (gen() % 3 == 0) {
+      set.erase(key);
+      stdSet.erase(key);
+    } else {
+      set.insert(key);
+      stdSet.insert(key);
+    }
+  }
+
+  EXPECT_EQ(stdSet.size(), set.size());
+  EXPECT_EQ(true,
+            std::equal(set.begin(), set.end(), stdSet.begin(), stdSet.end()));
+  auto it = set.end();
+  for (auto stdIt = stdSet.rbegin(); stdIt != stdSet.rend(); ++stdIt) {
+    EXPECT_EQ(*stdIt, *--it);
+  }
+  EXPECT_EQ(set.begin(), it);
+
+  for (int key = -1; key <= 2001; ++key) {
+    EXPECT_EQ(stdSet.count(key) == 1, set.contains(key));
+    auto lower = set.lower_bound(key);
+    auto upper = set.upper_bound(key);
+    EXPECT_EQ(stdSet.lower_bound(key) == stdSet.end(), lower == set.end());
+    EXPECT_EQ(stdSet.upper_bound(key) == stdSet.end(), upper == set.end());
+    if (lower != set.end()) {
+      EXPECT_EQ(*stdSet.lower_bound(key), *lower);
+    }
+    if (upper != set.end()) {
+      EXPECT_EQ(*stdSet.upper_bound(key), *upper);
+    }
+  }
+
+  for (int key : std::set<int>(stdSet)) {
+    set.erase(key);
+  }
+  EXPECT_EQ(true, set.empty());
+  EXPECT_EQ(set.begin(), set.end());
+}
+
+TEST(compactLayout, stringKeysTest) {
+  CompactSet<std::string, std::less<>> set{"pear", "apple", "plum", "apple"};
+  EXPECT_EQ(3, set.size());
+  EXPECT_EQ("apple", *set.begin());
+  EXPECT_EQ(true, set.contains(std::string_view("plum")));
+  set.erase(std::string_view("pear"));
+  EXPECT_EQ("plum", *set.find("plum"));
+  EXPECT_EQ(set.end(), set.find("pear"));
+}
+
+template <typename TStdSet, typename TSet>
+void expectSameAsStdSet(const TStdSet &expected, const TSet &set) {
+  EXPECT_EQ(expected.size(), set.size());
+  EXPECT_EQ(true, std::equal(set.begin(), set.end(), expected.begin(),
+                             expected.end()));
+  auto it = set.end();
+  for (auto stdIt = expected.rbegin(); stdIt != expected.rend(); ++stdIt) {
+    EXPECT_EQ(*stdIt, *--it);
+  }
+  EXPECT_EQ(set.begin(), it);
+}
+
+template <typename TSet> void randomOperations(unsigned int seed) {
+  std::mt19937 gen(seed);
+  TSet set;
+  std::set<int, typename TSet::key_compare> stdSet;
+  for (int i = 0; i < 50000; ++i) {
+    int key = (int)(gen() % 4000) - 2000;
+    if (gen() % 5 < 2) {
+      set.erase(key);
+      stdSet.erase(key);
+    } else {
+      set.insert(key);
+      stdSet.insert(key);
+    }
+  }
+  expectSameAsStdSet(stdSet, set);
+
+  for (int key = -2001; key <= 2001; ++key) {
+    EXPECT_EQ(stdSet.count(key) == 1, set.contains(key));
+    auto lower = set.lower_bound(key);
+    auto upper = set.upper_bound(key);
+    EXPECT_EQ(stdSet.lower_bound(key) == stdSet.end(), lower == set.end());
+    EXPECT_EQ(stdSet.upper_bound(key) == stdSet.end(), upper == set.end());
+    if (lower != set.end()) {
+      EXPECT_EQ(*stdSet.lower_bound(key), *lower);
+    }
+    if (upper != set.end()) {
+      EXPECT_EQ(*stdSet.upper_bound(key), *upper);
+    }
+  }
+
+  TSet copy(set);
+  for (int key : std::set<int>(stdSet.begin(), stdSet.end())) {
+    set.erase(key);
+  }
+  EXPECT_EQ(true, set.empty());
+  EXPECT_EQ(set.begin(), set.end());
+  expectSameAsStdSet(stdSet, copy);
+}
+
+TEST(btreeSet, randomOperationsTest) {
+  randomOperations<BTreeSet<int>>(1);
+  randomOperations<BTreeSet<int, std::less<>>>(2);
+  // Tiny nodes give a deep tree with many splits and merges.
+  randomOperations<BTreeSet<int, std::less<int>, std::allocator<int>, 48>>(3);
+  randomOperations<BTreeSet<int, std::greater<int>>>(4);
+}
+
+TEST(btreeSet, vectorSearchKeyTypesTest) {
+  BTreeSet<unsigned int> unsignedSet{3000000000u, 1, 2000000000u};
+  EXPECT_EQ(2000000000u, *unsignedSet.lower_bound(5));
+  EXPECT_EQ(3000000000u, *unsignedSet.upper_bound(2000000000u));
+
+  BTreeSet<long long> longSet;
+  BTreeSet<double> doubleSet;
+  for (int i = -500; i < 500; ++i) {
+    longSet.insert((long long)i * 10000000000LL);
+    doubleSet.insert(i * 0.5);
+  }
+  EXPECT_EQ(-4990000000000LL, *longSet.lower_bound(-4999999999999LL));
+  EXPECT_EQ(1000, longSet.size());
+  EXPECT_EQ(-0.5, *--doubleSet.lower_bound(0.0));
+  EXPECT_EQ(0.5, *doubleSet.upper_bound(0.25));
+}
+
+TEST(btreeSet, stringKeysTest) {
+  BTreeSet<std::string, std::less<>, std::allocator<std::string>, 64> set;
+  for (int i = 0; i < 1000; ++i) {
+    set.emplace(std::to_string(i));
+  }
+  EXPECT_EQ(1000, set.size());
+  EXPECT_EQ(true, set.contains(std::string_view("999")));
+  for (int i = 0; i < 1000; i += 2) {
+    set.erase(std::to_string(i));
+  }
+  EXPECT_EQ(500, set.size());
+  EXPECT_EQ("1", *set.begin());
+  EXPECT_EQ("999", *--set.end());
+
+  auto copy = set;
+  set = std::move(copy);
+  EXPECT_EQ(500, set.size());
+}
+
+// Generic code written against the common interface works with both
+// containers.
+template <typename TSet> std::vector<int> evenElements(const TSet &set) {
+  std::vector<int> result;
+  for (auto it = set.lower_bound(0); it != set.end(); ++it) {
+    if (*it % 2 == 0) {
+      result.push_back(*it);
+    }
+  }
+  return result;
+}
+
+TEST(btreeSet, typedefSwitchTest) {
+  typedef Set<int> AvlSet;
+  typedef BTreeSet<int> FlatSet;
+  AvlSet avlSet{-2, 1, 2, 3, 4, 6};
+  FlatSet flatSet{-2, 1, 2, 3, 4, 6};
+  EXPECT_EQ(evenElements(avlSet), evenElements(flatSet));
+}
+
+TEST(frozenSet, freezeTest) {
+  std::mt19937 gen(5);
+  for (size_t elementsNum : {0, 1, 2, 7, 8, 100, 1023, 1024, 5000}) {
+    std::set<int> stdSet = randomStdSet(gen, elementsNum, 20000);
+    Set<int> set(stdSet.begin(), stdSet.end());
+    FrozenSet<int> frozen = set.freeze();
+    expectSameAsStdSet(stdSet, frozen);
+
+    for (int key = -1; key <= 20001; key += 7) {
+      EXPECT_EQ(stdSet.count(key) == 1, frozen.contains(key));
+      auto lower = frozen.lower_bound(key);
+      auto upper = frozen.upper_bound(key);
+      EXPECT_EQ(stdSet.lower_bound(key) == stdSet.end(), lower == frozen.end());
+      EXPECT_EQ(stdSet.upper_bound(key) == stdSet.end(), upper == frozen.end());
+      if (lower != frozen.end()) {
+        EXPECT_EQ(*stdSet.lower_bound(key), *lower);
+      }
+      if (upper != frozen.end()) {
+        EXPECT_EQ(*stdSet.upper_bound(key), *upper);
+      }
+    }
+  }
+}
+
+TEST(frozenSet, constructionTest) {
+  FrozenSet<int, std::greater<int>> frozen{3, 1, 4, 1, 5, 9, 2, 6};
+  EXPECT_EQ(7, frozen.size());
+  EXPECT_EQ(9, *frozen.begin());
+  EXPECT_EQ(3, *frozen.lower_bound(3));
+  EXPECT_EQ(2, *frozen.upper_bound(3));
+
+  FrozenSet<int, std::greater<int>> copy(frozen);
+  EXPECT_EQ(true,
+            std::equal(copy.begin(), copy.end(), frozen.begin(), frozen.end()));
+  FrozenSet<int, std::greater<int>> moved;
+  moved = std::move(copy);
+  EXPECT_EQ(7, moved.size());
+  EXPECT_EQ(true, copy.empty());
+
+  Set<std::string, std::less<>> set{"pear", "apple", "plum"};
+  auto frozenStrings = set.freeze();
+  set.clear();
+  EXPECT_EQ(true, frozenStrings.contains(std::string_view("plum")));
+  EXPECT_EQ("pear", *frozenStrings.find(std::string_view("pear")));
+  EXPECT_EQ(frozenStrings.end(), frozenStrings.find("cherry"));
+}
+
+TEST(batchLookup, containsManyTest) {
+  std::mt19937 gen(11);
+  std::set<int> stdSet = randomStdSet(gen, 3000, 10000);
+  Set<int> set(stdSet.begin(), stdSet.end());
+  std::vector<int> keys;
+  for (int i = 0; i < 2000; ++i) {
+    keys.push_back((int)(gen() % 10002) - 1);
+  }
+
+  for (bool sorted : {false, true}) {
+    if (sorted) {
+      std::sort(keys.begin(), keys.end());
+    }
+    std::vector<char> found(keys.size());
+    EXPECT_EQ(found.end(),
+              set.contains_many(keys.begin(), keys.end(), found.begin()));
+    std::vector<Set<int>::const_iterator> bounds;
+    set.lower_bound_many(keys.begin(), keys.end(), std::back_inserter(bounds));
+    EXPECT_EQ(keys.size(), bounds.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      EXPECT_EQ(stdSet.count(keys[i]), (size_t)found[i]);
+      EXPECT_EQ(set.lower_bound(keys[i]), bounds[i]);
+    }
+  }
+
+  Set<int> empty;
+  std::vector<char> found(keys.size(), true);
+  empty.contains_many(keys.begin(), keys.end(), found.begin());
+  EXPECT_EQ(keys.size(), (size_t)std::count(found.begin(), found.end(), 0));
+}
+
+TEST(batchInsert, insertRangeTest) {
+  std::mt19937 gen(13);
+  for (size_t batchSize : {0, 1, 10, 500, 5000, 40000}) {
+    std::set<int> stdSet = randomStdSet(gen, 10000, 100000);
+    Set<int> set(stdSet.begin(), stdSet.end());
+    std::vector<int> batch;
+    for (size_t i = 0; i < batchSize; ++i) {
+      batch.push_back(gen() % 100000);
+    }
+
+    set.insert(batch.begin(), batch.end());
+    stdSet.insert(batch.begin(), batch.end());
+    expectSameElements(stdSet, set);
+  }
+
+  Set<int> set{5, 1};
+  set.insert({3, 1, 4, 1, 5});
+  expectSameElements({1, 3, 4, 5}, set);
+}
+
+TEST(batchInsert, sortedBatchTest) {
+  Set<int> set{2, 4, 6};
+  std::vector<int> batch{1, 2, 2, 3, 7};
+  set.insert_sorted_batch(batch.begin(), batch.end());
+  expectSameElements({1, 2, 3, 4, 6, 7}, set);
+
+  std::vector<int> unsorted{9, 8};
+  EXPECT_THROW(set.insert_sorted_batch(unsorted.begin(), unsorted.end()),
+               std::invalid_argument);
+  expectSameElements({1, 2, 3, 4, 6, 7}, set);
+}
+
+TEST(batchInsert, fewerComparisonsTest) {
+  static const int kElementsNum = 100000;
+  static const int kBatchSize = 10000;
+  std::vector<int> data(kElementsNum);
+  for (int i = 0; i < kElementsNum; ++i) {
+    data[i] = 2 * i;
+  }
+  std::mt19937 gen(17);
+  std::vector<int> batch(kBatchSize);
+  for (int &key : batch) {
+    key = gen() % (2 * kElementsNum);
+  }
+
+  Set<int, CountingLess> oneByOne(data.begin(), data.end());
+  CountingLess::comparisonsNum = 0;
+  for (int key : batch) {
+    oneByOne.insert(key);
+  }
+  size_t oneByOneComparisons = CountingLess::comparisonsNum;
+
+  Set<int, CountingLess> batched(data.begin(), data.end());
+  CountingLess::comparisonsNum = 0;
+  batched.insert(batch.begin(), batch.end());
+  EXPECT_LE(CountingLess::comparisonsNum, oneByOneComparisons);
+  EXPECT_EQ(true, std::equal(batched.begin(), batched.end(), oneByOne.begin(),
+                             oneByOne.end()));
+
+  // Without the sort most of the comparisons are gone.
+  std::sort(batch.begin(), batch.end());
+  Set<int, CountingLess> sortedBatched(data.begin(), data.end());
+  CountingLess::comparisonsNum = 0;
+  sortedBatched.insert_sorted_batch(batch.begin(), batch.end());
+  EXPECT_LE(CountingLess::comparisonsNum, oneByOneComparisons / 2);
+  EXPECT_EQ(true, std::equal(sortedBatched.begin(), sortedBatched.end(),
+                             oneByOne.begin(), oneByOne.end()));
+}
+
+TEST(moveSemantics, eraseWithoutCopiesTest) {
+  Set<CopyCountingKey> set;
+  for (int i = 0; i < 1000; ++i) {
+    set.insert(CopyCountingKey(i));
+  }
+  CopyCountingKey::copiesNum = 0;
+  // From the middle outwards, so most of the erased nodes have two children.
+  for (int i = 0; i < 250; ++i) {
+    set.erase(CopyCountingKey(499 - i));
+    set.erase(CopyCountingKey(500 + i));
+  }
+
+  EXPECT_EQ(500, set.size());
+  EXPECT_EQ(0, CopyCountingKey::copiesNum);
+  int expected = 0;
+  for (auto it = set.begin(); it != set.end(); ++it) {
+    if (expected == 250) {
+      expected = 750;
+    }
+    EXPECT_EQ(expected++, it->m_Value);
+  }
+  EXPECT_EQ(1000, expected);
+}
+
+TEST(hintedInsert, hintedInsertTest) {
+  Set<int> set{10, 20, 30};
+  auto it = set.insert(set.end(), 40);
+  EXPECT_EQ(40, *it);
+  it = set.insert(set.begin(), 5);
+  EXPECT_EQ(5, *it);
+  // A wrong hint still inserts in the right place.
+  it = set.insert(set.begin(), 25);
+  EXPECT_EQ(25, *it);
+  EXPECT_EQ(30, *++it);
+  it = set.insert(set.end(), 20);
+  EXPECT_EQ(20, *it);
+  it = set.emplace_hint(set.end(), 50);
+  EXPECT_EQ(50, *it);
+  it = set.emplace_hint(set.find(30), 30);
+  EXPECT_EQ(30, *it);
+  expectSameElements({5, 10, 20, 25, 30, 40, 50}, set);
+}
+
+TEST(hintedInsert, appendComparisonsTest) {
+  static const int kElementsNum = 10000;
+  Set<int, CountingLess> hinted;
+  CountingLess::comparisonsNum = 0;
+  for (int i = 0; i < kElementsNum; ++i) {
+    hinted.insert(hinted.end(), i);
+  }
+  EXPECT_EQ(kElementsNum - 1, CountingLess::comparisonsNum);
+
+  Set<int, CountingLess> appended;
+  CountingLess::comparisonsNum = 0;
+  for (int i = 0; i < kElementsNum; ++i) {
+    appended.push_back_sorted(i);
+  }
+  EXPECT_EQ(kElementsNum - 1, CountingLess::comparisonsNum);
+  EXPECT_EQ(kElementsNum, appended.size());
+  EXPECT_EQ(0, *appended.begin());
+  EXPECT_EQ(kElementsNum - 1, *--appended.end());
+  EXPECT_EQ(kElementsNum / 2, *appended.nth(kElementsNum / 2));
+  EXPECT_EQ(true, std::equal(hinted.begin(), hinted.end(), appended.begin(),
+                             appended.end()));
+
+  EXPECT_THROW(appended.push_back_sorted(kElementsNum - 1),
+               std::invalid_argument);
+  EXPECT_EQ(kElementsNum, appended.size());
+}
+
+TEST(concurrentSet, singleThreadTest) {
+  std::mt19937 gen(5);
+  ConcurrentSet<int> set;
+  std::set<int> stdSet;
+  for (int i = 0; i < 20000; ++i) {
+    int key = (int)(gen() % 2000);
+    if (gen() % 3 == 0) {
+      EXPECT_EQ(stdSet.erase(key) == 1, set.erase(key));
+    } else {
+      EXPECT_EQ(stdSet.insert(key).second, set.insert(key));
+    }
+  }
+
+  for (int key = -1; key <= 2001; ++key) {
+    EXPECT_EQ(stdSet.count(key) == 1, set.contains(key));
+    auto lower = set.lower_bound(key);
+    auto stdLower = stdSet.lower_bound(key);
+    EXPECT_EQ(stdLower == stdSet.end(), !lower.has_value());
+    if (lower) {
+      EXPECT_EQ(*stdLower, *lower);
+    }
+  }
+}
+
+TEST(concurrentSet, parallelWritersTest) {
+  static const int kThreadsNum = 4;
+  static const int kKeysNum = 20000;
+  ConcurrentSet<int> set;
+  // Even keys are inserted up front and never erased. Every thread inserts
+  // and erases its own odd keys while looking up all of them.
+  for (int key = 0; key < kKeysNum; key += 2) {
+    set.insert(key);
+  }
+  std::vector<int> failures(kThreadsNum, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreadsNum; ++t) {
+    threads.emplace_back([&set, &failures, t] {
+      std::mt19937 gen(t);
+      for (int i = 0; i < 50000; ++i) {
+        int key = (int)(gen() % kKeysNum);
+        if (key % 2 == 0) {
+          failures[t] += !set.contains(key);
+          failures[t] += set.lower_bound(key) != key;
+        } else if (key / 2 % kThreadsNum == t) {
+          if (gen() % 2 == 0) {
+            set.insert(key);
+          } else {
+            set.erase(key);
+          }
+        } else {
+          auto lower = set.lower_bound(key);
+          failures[t] += lower && *lower != key && *lower != key + 1;
+        }
+      }
+      // Leaves keys 4k + 1 in and keys 4k + 3 out.
+      for (int key = 1; key < kKeysNum; key += 2) {
+        if (key / 2 % kThreadsNum == t && key % 4 == 1) {
+          set.insert(key);
+        } else if (key / 2 % kThreadsNum == t) {
+          set.erase(key);
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(std::vector<int>(kThreadsNum, 0), failures);
+  for (int key = 0; key < kKeysNum; ++key) {
+    EXPECT_EQ(key % 4 != 3, set.contains(key));
+  }
+}
+
+TEST(rcuSet, snapshotTest) {
+  std::mt19937 gen(7);
+  RcuSet<int> set;
+  std::set<int> stdSet;
+  for (int i = 0; i < 5000; ++i) {
+    int key = (int)(gen() % 1000);
+    if (gen() % 3 != 0) {
+      EXPECT_EQ(stdSet.insert(key).second, set.insert(key));
+    } else {
+      EXPECT_EQ(stdSet.erase(key) == 1, set.erase(key));
+    }
+  }
+
+  auto snapshot = set.snapshot();
+  std::vector<int> expected(stdSet.begin(), stdSet.end());
+  EXPECT_EQ(expected, std::vector<int>(snapshot.begin(), snapshot.end()));
+  std::vector<int> backward;
+  for (auto it = snapshot.end(); it != snapshot.begin();) {
+    backward.push_back(*--it);
+  }
+  std::reverse(backward.begin(), backward.end());
+  EXPECT_EQ(expected, backward);
+  EXPECT_EQ(stdSet.size(), snapshot.size());
+  for (int key = -1; key <= 1001; ++key) {
+    auto lower = snapshot.lower_bound(key);
+    auto stdLower = stdSet.lower_bound(key);
+    EXPECT_EQ(stdLower == stdSet.end(), lower == snapshot.end());
+    if (stdLower != stdSet.end()) {
+      EXPECT_EQ(*stdLower, *lower);
+    }
+    auto upper = snapshot.upper_bound(key);
+    auto stdUpper = stdSet.upper_bound(key);
+    EXPECT_EQ(stdUpper == stdSet.end(), upper == snapshot.end());
+    if (stdUpper != stdSet.end()) {
+      EXPECT_EQ(*stdUpper, *upper);
+    }
+    EXPECT_EQ(stdSet.count(key) == 1, snapshot.find(key) != snapshot.end());
+  }
+
+  // Writes made after the snapshot was taken are not visible in it.
+  set.clear();
+  set.insert(2000);
+  EXPECT_EQ(expected, std::vector<int>(snapshot.begin(), snapshot.end()));
+  EXPECT_EQ(1u, set.size());
+  EXPECT_TRUE(set.contains(2000));
+  EXPECT_FALSE(snapshot.contains(2000));
+}
+
+TEST(rcuSet, readersDuringWritesTest) {
+  static const int kReadersNum = 3;
+  static const int kKeysNum = 3000;
+  RcuSet<int> set;
+  std::atomic<bool> done(false);
+  std::vector<int> failures(kReadersNum, 0);
+  std::vector<std::thread> readers;
+  // The writer only appends the next key or erases the last one, so every
+  // snapshot has to hold 0, 1, ..., size() - 1.
+  for (int t = 0; t < kReadersNum; ++t) {
+    readers.emplace_back([&set, &done, &failures, t] {
+      while (!done.load()) {
+        auto snapshot = set.snapshot();
+        int expected = 0;
+        for (int key : snapshot) {
+          failures[t] += key != expected++;
+        }
+        failures[t] += (size_t)expected != snapshot.size();
+      }
+    });
+  }
+  for (int round = 0; round < 3; ++round) {
+    for (int key = 0; key < kKeysNum; ++key) {
+      set.insert(key);
+    }
+    for (int key = kKeysNum - 1; key >= 0; --key) {
+      set.erase(key);
+    }
+  }
+  done = true;
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+
+  EXPECT_EQ(std::vector<int>(kReadersNum, 0), failures);
+  EXPECT_TRUE(set.empty());
+}
+
+TEST(persistentSet, copyOnWriteTest) {
+  std::mt19937 gen(11);
+  std::vector<PersistentSet<int>> versions(1);
+  std::vector<std::set<int>> stdVersions(1);
+  // Every tenth step keeps a copy of the current version, which must not see
+  // any of the later changes.
+  for (int i = 0; i < 3000; ++i) {
+    if (i % 10 == 0) {
+      versions.push_back(versions.back());
+      stdVersions.push_back(stdVersions.back());
+      EXPECT_TRUE(versions.back().shares_with(versions[versions.size() - 2]));
+    }
+    int key = (int)(gen() % 500);
+    if (gen() % 3 != 0) {
+      versions.back().insert(key);
+      stdVersions.back().insert(key);
+    } else {
+      versions.back().erase(key);
+      stdVersions.back().erase(key);
+    }
+  }
+
+  for (size_t v = 0; v < versions.size(); ++v) {
+    const PersistentSet<int> &set = versions[v];
+    const std::set<int> &stdSet = stdVersions[v];
+    EXPECT_EQ(stdSet.size(), set.size());
+    EXPECT_EQ(std::vector<int>(stdSet.begin(), stdSet.end()),
+              std::vector<int>(set.begin(), set.end()));
+  }
+
+  const PersistentSet<int> &set = versions.back();
+  const std::set<int> &stdSet = stdVersions.back();
+  std::vector<int> backward;
+  for (auto it = set.end(); it != set.begin();) {
+    backward.push_back(*--it);
+  }
+  EXPECT_EQ(std::vector<int>(stdSet.rbegin(), stdSet.rend()), backward);
+  for (int key = -1; key <= 501; ++key) {
+    EXPECT_EQ(stdSet.count(key) == 1, set.contains(key));
+    auto lower = set.lower_bound(key);
+    auto stdLower = stdSet.lower_bound(key);
+    EXPECT_EQ(stdLower == stdSet.end(), lower == set.end());
+    if (stdLower != stdSet.end()) {
+      EXPECT_EQ(*stdLower, *lower);
+    }
+    auto upper = set.upper_bound(key);
+    auto stdUpper = stdSet.upper_bound(key);
+    EXPECT_EQ(stdUpper == stdSet.end(), upper == set.end());
+    if (stdUpper != stdSet.end()) {
+      EXPECT_EQ(*stdUpper, *upper);
+    }
+  }
+}
+
+TEST(persistentSet, copiesAcrossThreadsTest) {
+  PersistentSet<int> set;
+  for (int key = 0; key < 2000; ++key) {
+    set.insert(key);
+  }
+  // Each thread changes its own copy while the original is changed too, and
+  // the shared nodes are released by whichever copy drops them last.
+  std::vector<size_t> sizes(4);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([copy = set, &sizes, t]() mutable {
+      for (int key = t; key < 2000; key += 4) {
+        copy.erase(key);
+      }
+      sizes[t] = copy.size();
+    });
+  }
+  for (int key = 0; key < 2000; key += 2) {
+    set.erase(key);
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(std::vector<size_t>(4, 1500), sizes);
+  EXPECT_EQ(1000u, set.size());
+  EXPECT_EQ(1, *set.begin());
+}
+
+TEST(parallelBulk, assignParallelTest) {
+  std::mt19937 gen(17);
+  for (size_t threadsNum : {1, 2, 3, 8}) {
+    std::vector<int> data(100000);
+    for (int &el : data) {
+      el = (int)(gen() % 60000);
+    }
+    Set<int> set{-1};
+    set.assign_parallel(data.begin(), data.end(), threadsNum);
+    expectSameElements(std::set<int>(data.begin(), data.end()), set);
+
+    std::sort(data.begin(), data.end());
+    set.assign_parallel(data.begin(), data.end(), threadsNum);
+    expectSameElements(std::set<int>(data.begin(), data.end()), set);
+    set.insert(-1);
+    EXPECT_EQ(-1, *set.begin());
+  }
+}
+
+// Passes allocations on to its upstream and records whether any came from a
+// thread other than the one that created it.
+class ThreadCheckingResource : public std::pmr::memory_resource {
+public:
+  bool m_OtherThreadUsed = false;
+
+private:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    check();
+    return m_Upstream.allocate(bytes, alignment);
+  }
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    check();
+    m_Upstream.deallocate(p, bytes, alignment);
+  }
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+  void check() {
+    if (std::this_thread::get_id() != m_Owner) {
+      m_OtherThreadUsed = true;
+    }
+  }
+
+  std::thread::id m_Owner = std::this_thread::get_id();
+  std::pmr::unsynchronized_pool_resource m_Upstream;
+};
+
+TEST(parallelBulk, assignParallelPmrTest) {
+  std::vector<int> data(100000);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = (int)(i * 7 % data.size());
+  }
+  ThreadCheckingResource resource;
+  Set<int, std::less<int>, std::pmr::polymorphic_allocator<int>> set(
+      &resource);
+  set.assign_parallel(data.begin(), data.end(), 4);
+  expectSameElements(std::set<int>(data.begin(), data.end()), set);
+  EXPECT_FALSE(resource.m_OtherThreadUsed);
+
+  // With std::allocator the same input, well above the parallel grain of
+  // 2^14 keys, is built by several threads.
+  Set<int> plain;
+  plain.assign_parallel(data.begin(), data.end(), 4);
+  EXPECT_TRUE(std::equal(set.begin(), set.end(), plain.begin(), plain.end()));
+}
+
+TEST(parallelBulk, setOperationsTest) {
+  std::mt19937 gen(19);
+  std::set<int> stdA = randomStdSet(gen, 80000, 200000);
+  std::set<int> stdB = randomStdSet(gen, 60000, 200000);
+  const Set<int> a(stdA.begin(), stdA.end());
+  const Set<int> b(stdB.begin(), stdB.end());
+
+  for (size_t threadsNum : {2, 4}) {
+    std::set<int> expected;
+    std::set_union(stdA.begin(), stdA.end(), stdB.begin(), stdB.end(),
+                   std::inserter(expected, expected.end()));
+    Set<int> result(a);
+    result.union_with(b, threadsNum);
+    expectSameElements(expected, result);
+
+    expected.clear();
+    std::set_intersection(stdA.begin(), stdA.end(), stdB.begin(), stdB.end(),
+                          std::inserter(expected, expected.end()));
+    result = a;
+    result.intersect_with(b, threadsNum);
+    expectSameElements(expected, result);
+
+    expected.clear();
+    std::set_difference(stdA.begin(), stdA.end(), stdB.begin(), stdB.end(),
+                        std::inserter(expected, expected.end()));
+    result = a;
+    result.difference_with(b, threadsNum);
+    expectSameElements(expected, result);
+
+    expected.clear();
+    std::set_symmetric_difference(stdA.begin(), stdA.end(), stdB.begin(),
+                                  stdB.end(),
+                                  std::inserter(expected, expected.end()));
+    result = a;
+    result.symmetric_difference_with(b, threadsNum);
+    expectSameElements(expected, result);
+  }
+}
+
+TEST(snapshot, saveLoadTest) {
+  std::mt19937 gen(20);
+  std::set<int> stdSet = randomStdSet(gen, 30000, 100000);
+  const Set<int> set(stdSet.begin(), stdSet.end());
+  std::string path = testing::TempDir() + "set_snapshot_test.bin";
+  set.save(path);
+
+  Set<int> loaded{1, 2, 3};
+  loaded.load(path);
+  expectSameElements(stdSet, loaded);
+  loaded.insert(-1);
+  EXPECT_EQ(-1, *loaded.begin());
+
+  MappedSet<int> mapped(path);
+  ASSERT_TRUE(mapped.verify());
+  ASSERT_EQ(stdSet.size(), mapped.size());
+  EXPECT_TRUE(std::equal(stdSet.begin(), stdSet.end(), mapped.begin()));
+  for (int i = -1; i <= 100001; i += 7) {
+    EXPECT_EQ(stdSet.count(i) == 1, mapped.contains(i));
+    auto expected = stdSet.lower_bound(i);
+    auto it = mapped.lower_bound(i);
+    EXPECT_EQ(expected == stdSet.end(), it == mapped.end());
+    if (expected != stdSet.end()) {
+      EXPECT_EQ(*expected, *it);
+    }
+  }
+
+  Set<int>().save(path);
+  loaded.load(path);
+  EXPECT_TRUE(loaded.empty());
+  MappedSet<int> empty(path);
+  EXPECT_TRUE(empty.verify());
+  EXPECT_TRUE(empty.empty());
+  EXPECT_EQ(empty.end(), empty.find(1));
+  std::remove(path.c_str());
+}
+
+TEST(snapshot, damagedSnapshotTest) {
+  const Set<long long> set{1, 2, 3, 4, 5};
+  std::string path = testing::TempDir() + "set_snapshot_damaged_test.bin";
+  set.save(path);
+
+  // A snapshot of another key type is rejected.
+  Set<int> other{7};
+  EXPECT_THROW(other.load(path), std::runtime_error);
+  EXPECT_THROW(MappedSet<int>{path}, std::runtime_error);
+  expectSameElements(std::set<int>{7}, other);
+
+  // So is a snapshot with a damaged key, by load and by verify.
+  {
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(snapshot::kKeysOffset + 3 * sizeof(long long));
+    file.put(9);
+  }
+  Set<long long> loaded{7};
+  EXPECT_THROW(loaded.load(path), std::runtime_error);
+  expectSameElements(std::set<int>{7}, loaded);
+  EXPECT_FALSE(MappedSet<long long>(path).verify());
+
+  // And one whose size does not match its header.
+  {
+    std::ofstream file(path, std::ios::binary | std::ios::app);
+    file.put(0);
+  }
+  EXPECT_THROW(loaded.load(path), std::runtime_error);
+  EXPECT_THROW(MappedSet<long long>{path}, std::runtime_error);
+  std::remove(path.c_str());
+  EXPECT_THROW(loaded.load(path), std::runtime_error);
+  EXPECT_THROW(MappedSet<long long>{path}, std::system_error);
+}
+
+TEST(diskSet, randomOperationsTest) {
+  // Small pages make a deep tree, the cache holds a small part of it.
+  typedef DiskSet<int, std::less<int>, 512> SmallPageSet;
+  std::string path = testing::TempDir() + "disk_set_random_test.bin";
+  std::remove(path.c_str());
+  std::mt19937 gen(21);
+  std::set<int> stdSet;
+  {
+    SmallPageSet set(path, 0);
+    EXPECT_EQ(PageCache::kMinFramesNum, set.page_cache().framesNum());
+    EXPECT_TRUE(set.empty());
+    EXPECT_EQ(set.end(), set.begin());
+    for (int i = 0; i < 300000; ++i) {
+      int key = gen() % 200000;
+      if (gen() % 3 == 0) {
+        set.erase(key);
+        stdSet.erase(key);
+      } else {
+        set.insert(key);
+        stdSet.insert(key);
+      }
+    }
+    EXPECT_LE(50 * set.page_cache().framesNum() * 512,
+              stdSet.size() * sizeof(int));
+    ASSERT_EQ(stdSet.size(), set.size());
+    EXPECT_TRUE(std::equal(stdSet.begin(), stdSet.end(), set.begin(),
+                           set.end()));
+    for (int i = -1; i <= 200001; i += 13) {
+      EXPECT_EQ(stdSet.count(i) == 1, set.contains(i));
+      auto expected = stdSet.upper_bound(i);
+      auto it = set.upper_bound(i);
+      ASSERT_EQ(expected == stdSet.end(), it == set.end());
+      if (expected != stdSet.end()) {
+        EXPECT_EQ(*expected, *it);
+        EXPECT_EQ(*stdSet.lower_bound(i), *set.lower_bound(i));
+      }
+    }
+  }
+
+  // The set is back after reopening, and shrinks to nothing.
+  SmallPageSet set(path, 0);
+  ASSERT_EQ(stdSet.size(), set.size());
+  EXPECT_TRUE(std::equal(stdSet.begin(), stdSet.end(), set.begin(),
+                         set.end()));
+  for (int key : stdSet) {
+    set.erase(key);
+  }
+  EXPECT_TRUE(set.empty());
+  EXPECT_EQ(set.end(), set.begin());
+  set.insert(5);
+  EXPECT_EQ(5, *set.find(5));
+  std::remove(path.c_str());
+}
+
+TEST(diskSet, sequentialScanTest) {
+  const size_t kKeysNum = 500000;
+  const size_t kCacheBytes = 64 * 4096;
+  std::string path = testing::TempDir() + "disk_set_scan_test.bin";
+  std::remove(path.c_str());
+  {
+    DiskSet<long long> set(path, kCacheBytes);
+    std::vector<long long> keys(kKeysNum);
+    for (size_t i = 0; i < kKeysNum; ++i) {
+      keys[i] = 3 * (long long)i;
+    }
+    std::vector<long long> unsorted{1, 3, 2};
+    EXPECT_THROW(set.assign_sorted(unsorted.begin(), unsorted.end()),
+                 std::invalid_argument);
+    EXPECT_TRUE(set.empty());
+    set.insert(-5);
+    std::vector<long long> repeated{1, 1, 2};
+    set.assign_sorted(repeated.begin(), repeated.end());
+    EXPECT_EQ(2u, set.size());
+    set.assign_sorted(keys.begin(), keys.end());
+    EXPECT_EQ(kKeysNum, set.size());
+    EXPECT_LE(10 * kCacheBytes, kKeysNum * sizeof(long long));
+  }
+
+  // A scan of the reopened set reads many leaves per system call.
+  DiskSet<long long> set(path, kCacheBytes);
+  const PageCache &cache = set.page_cache();
+  size_t i = 0;
+  for (long long key : set) {
+    ASSERT_EQ(3 * (long long)i++, key);
+  }
+  EXPECT_EQ(kKeysNum, i);
+  EXPECT_LE(8 * cache.readsNum(), cache.filePagesNum());
+
+  EXPECT_EQ(30, *set.find(30));
+  EXPECT_EQ(set.end(), set.find(31));
+  EXPECT_EQ(33, *set.lower_bound(31));
+  set.erase(33);
+  EXPECT_EQ(36, *set.lower_bound(31));
+  auto it = set.begin();
+  EXPECT_THROW(set.clear(), std::runtime_error);
+  it = set.end();
+  set.clear();
+  EXPECT_TRUE(set.empty());
+  // Frames are aligned to the page size, so it has to be a power of two.
+  EXPECT_THROW(PageCache(path, 1536, 0), std::invalid_argument);
+  std::remove(path.c_str());
+
+  // A file shorter than a page is not taken for an empty tree.
+  {
+    std::ofstream out(path, std::ios::binary);
+    out << "not a tree";
+  }
+  EXPECT_THROW(DiskSet<long long>(path, kCacheBytes), std::runtime_error);
+  std::ifstream in(path, std::ios::binary);
+  std::string contents((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+  EXPECT_EQ("not a tree", contents);
+  std::remove(path.c_str());
+}
+
+TEST(treeStats, countingStatsTest) {
+  typedef Set<int, std::less<int>, std::allocator<int>, CountingTreeStats>
+      CountedSet;
+  CountedSet set;
+  for (int i = 0; i < 1000; ++i) {
+    set.insert(i);
+  }
+  TreeStats stats = set.stats();
+  EXPECT_EQ(1000u, stats.m_Lookups);
+  EXPECT_EQ(1000u, stats.m_Allocations);
+  EXPECT_EQ(0u, stats.m_Deallocations);
+  // Sorted insertion rotates on almost every insert.
+  EXPECT_GT(stats.m_Rotations, 900u);
+  EXPECT_GE(stats.m_FixNodes, 2 * stats.m_Rotations);
+  EXPECT_LE(stats.m_Height, 15);
+  ASSERT_EQ((size_t)stats.m_Height, stats.m_DepthHistogram.size());
+  EXPECT_EQ(1u, stats.m_DepthHistogram[0]);
+  size_t nodesNum = 0;
+  for (size_t depth = 0; depth < stats.m_DepthHistogram.size(); ++depth) {
+    EXPECT_LE(stats.m_DepthHistogram[depth], (size_t)1 << depth);
+    nodesNum += stats.m_DepthHistogram[depth];
+  }
+  EXPECT_EQ(set.size(), nodesNum);
+
+  for (int i = 0; i < 2000; i += 2) {
+    set.find(i);
+  }
+  TreeStats afterFinds = set.stats();
+  EXPECT_EQ(stats.m_Lookups + 1000, afterFinds.m_Lookups);
+  size_t comparisons = afterFinds.m_Comparisons - stats.m_Comparisons;
+  EXPECT_GE(comparisons, 1000u);
+  EXPECT_LE(comparisons, 1000u * (2 * stats.m_Height + 1));
+  EXPECT_EQ(stats.m_Rotations, afterFinds.m_Rotations);
+
+  // Batched lookups count one lookup per key, both the interleaved searches
+  // of unsorted keys and the list walk of sorted ones.
+  std::vector<int> unsortedKeys{500, 3, 1999, -1, 42};
+  std::vector<int> sortedKeys{0, 1, 2, 50, 998, 5000};
+  std::vector<bool> found;
+  set.contains_many(unsortedKeys.begin(), unsortedKeys.end(),
+                    std::back_inserter(found));
+  TreeStats afterUnsorted = set.stats();
+  EXPECT_EQ(afterFinds.m_Lookups + unsortedKeys.size(),
+            afterUnsorted.m_Lookups);
+  EXPECT_GE(afterUnsorted.m_Comparisons - afterFinds.m_Comparisons,
+            unsortedKeys.size());
+  set.contains_many(sortedKeys.begin(), sortedKeys.end(),
+                    std::back_inserter(found));
+  TreeStats afterSorted = set.stats();
+  EXPECT_EQ(afterUnsorted.m_Lookups + sortedKeys.size(),
+            afterSorted.m_Lookups);
+  EXPECT_GE(afterSorted.m_Comparisons - afterUnsorted.m_Comparisons,
+            sortedKeys.size());
+  EXPECT_EQ(std::vector<bool>({true, true, false, false, true, true, true,
+                               true, true, true, false}),
+            found);
+
+  for (int i = 0; i < 10; ++i) {
+    set.erase(i);
+  }
+  EXPECT_EQ(10u, set.stats().m_Deallocations);
+
+  // Counters stay with the set, a copy starts with its own allocations only.
+  CountedSet copy(set);
+  EXPECT_EQ(0u, copy.stats().m_Lookups);
+  EXPECT_EQ(copy.size(), copy.stats().m_Allocations);
+  copy.clear();
+  EXPECT_EQ(copy.stats().m_Allocations, copy.stats().m_Deallocations);
+  EXPECT_EQ(0, copy.stats().m_Height);
+  EXPECT_TRUE(copy.stats().m_DepthHistogram.empty());
+
+  // Without a policy only the shape is reported.
+  Set<int> plain(set.begin(), set.end());
+  EXPECT_TRUE(std::is_empty<NoTreeStats>::value);
+  EXPECT_EQ(0u, plain.stats().m_Allocations);
+  EXPECT_EQ(set.stats().m_Height, plain.stats().m_Height);
+}
+
+TEST(treeStats, threadWideStatsTest) {
+  typedef Set<int, std::less<int>, std::allocator<int>, ThreadWideTreeStats>
+      CountedSet;
+  CountedSet set{1, 2, 3, 4, 5};
+  std::vector<TreeStats> stats(2);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < stats.size(); ++t) {
+    threads.emplace_back([&set, &stats, t] {
+      for (size_t i = 0; i < 100 * (t + 1); ++i) {
+        set.contains((int)i);
+      }
+      stats[t] = set.stats();
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(100u, stats[0].m_Lookups);
+  EXPECT_EQ(200u, stats[1].m_Lookups);
+  EXPECT_EQ(0u, stats[0].m_Allocations);
+  EXPECT_EQ(3, stats[0].m_Height);
+
+  // The counters are those of the thread, shared by all its sets.
+  std::thread([] {
+    CountedSet first;
+    CountedSet second;
+    first.contains(1);
+    second.contains(1);
+    EXPECT_EQ(2u, first.stats().m_Lookups);
+    EXPECT_EQ(2u, second.stats().m_Lookups);
+  }).join();
+}
+
+// Nodes taken over from other trees are deallocated by the tree that took
+// them, so it has to count their allocations too.
+TEST(treeStats, countingStatsTransfersTest) {
+  typedef Set<int, std::less<int>, std::allocator<int>, CountingTreeStats>
+      CountedSet;
+  std::vector<int> keys(200000);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    keys[i] = (int)(i * 7 % keys.size());
+  }
+
+  CountedSet a(keys.begin(), keys.begin() + 100);
+  CountedSet b(keys.begin() + 100, keys.begin() + 200);
+  a.union_with(std::move(b));
+  EXPECT_EQ(200u, a.stats().m_Allocations);
+  EXPECT_EQ(0u, b.stats().m_Allocations);
+  CountedSet moved(std::move(a));
+  CountedSet other{-1};
+  moved.swap(other);
+  EXPECT_EQ(1u, moved.stats().m_Allocations);
+  other.clear();
+  TreeStats stats = other.stats();
+  EXPECT_EQ(200u, stats.m_Allocations);
+  EXPECT_EQ(200u, stats.m_Deallocations);
+
+  CountedSet parallel;
+  parallel.assign_parallel(keys.begin(), keys.end(), 4);
+  ASSERT_EQ(keys.size(), parallel.size());
+  EXPECT_EQ(keys.size(), parallel.stats().m_Allocations);
+  CountedSet right = parallel.split_off(150000);
+  CountedSet left = parallel.split_off(-1);
+  right.clear();
+  left.clear();
+  EXPECT_EQ(left.stats().m_Allocations, left.stats().m_Deallocations);
+  EXPECT_EQ(right.stats().m_Allocations, right.stats().m_Deallocations);
+  EXPECT_EQ(keys.size() + 50000,
+            left.stats().m_Allocations + right.stats().m_Allocations);
+}
+
+struct OwningKey {
+  int m_Id;
+  std::vector<char> m_Payload;
+
+  bool operator<(const OwningKey &other) const { return m_Id < other.m_Id; }
+};
+
+template <> struct KeyMemoryUsage<OwningKey> {
+  static size_t heapBytes(const OwningKey &key) {
+    return key.m_Payload.capacity();
+  }
+};
+
+TEST(memoryUsage, setMemoryUsageTest) {
+  GlobalMemoryUsage before = global_memory_usage();
+  {
+    Set<int> set;
+    MemoryUsage usage = set.memory_usage();
+    EXPECT_EQ(0u, usage.m_NodesNum);
+    EXPECT_EQ(0u, usage.m_NodeBytes);
+    EXPECT_EQ(sizeof(set), usage.m_TotalBytes);
+
+    for (int i = 0; i < 1000; ++i) {
+      set.insert(i);
+    }
+    usage = set.memory_usage();
+    EXPECT_EQ(1000u, usage.m_NodesNum);
+    EXPECT_EQ(sizeof(TreeNode<int>), usage.m_BytesPerNode);
+    EXPECT_GE(usage.m_NodeBytes, 1000 * usage.m_BytesPerNode);
+    EXPECT_LE(usage.m_NodeBytes, 2100 * usage.m_BytesPerNode);
+    EXPECT_GT(usage.m_AllocatorOverheadBytes, 0u);
+    EXPECT_EQ(0u, usage.m_KeyHeapBytes);
+    EXPECT_EQ(sizeof(set) + usage.m_NodeBytes + usage.m_AllocatorOverheadBytes,
+              usage.m_TotalBytes);
+
+    GlobalMemoryUsage global = global_memory_usage();
+    EXPECT_EQ(before.m_NodeBytes + usage.m_NodeBytes, global.m_NodeBytes);
+    EXPECT_EQ(before.m_AllocatorOverheadBytes + usage.m_AllocatorOverheadBytes,
+              global.m_AllocatorOverheadBytes);
+  }
+  EXPECT_EQ(before.m_TotalBytes, global_memory_usage().m_TotalBytes);
+
+  {
+    Set<std::string> set{"a", std::string(100, 'b'), std::string(200, 'c')};
+    EXPECT_EQ(0u, KeyMemoryUsage<std::string>::heapBytes(*set.begin()));
+    size_t expected = 0;
+    for (const std::string &key : set) {
+      expected += KeyMemoryUsage<std::string>::heapBytes(key);
+    }
+    EXPECT_GE(expected, 302u);
+    EXPECT_EQ(expected, set.memory_usage().m_KeyHeapBytes);
+    EXPECT_EQ(before.m_KeyHeapBytes + expected,
+              global_memory_usage().m_KeyHeapBytes);
+    set.erase(std::string(100, 'b'));
+    EXPECT_EQ(set.memory_usage().m_KeyHeapBytes,
+              global_memory_usage().m_KeyHeapBytes - before.m_KeyHeapBytes);
+  }
+
+  {
+    Set<OwningKey> set;
+    for (int i = 0; i < 10; ++i) {
+      set.insert(OwningKey{i, std::vector<char>(64)});
+    }
+    EXPECT_EQ(640u, set.memory_usage().m_KeyHeapBytes);
+    Set<OwningKey> copy(set);
+    EXPECT_EQ(before.m_KeyHeapBytes + 1280,
+              global_memory_usage().m_KeyHeapBytes);
+  }
+  EXPECT_EQ(before.m_TotalBytes, global_memory_usage().m_TotalBytes);
+}
+
+TEST(map, randomOperationsTest) {
+  std::mt19937 gen(23);
+  Map<int, int> map;
+  std::map<int, int> stdMap;
+  for (int i = 0; i < 20000; ++i) {
+    int key = (int)(gen() % 1000);
+    int value = (int)(gen() % 1000);
+    switch (gen() % 5) {
+    case 0:
+      map[key] += value;
+      stdMap[key] += value;
+      break;
+    case 1:
+      EXPECT_EQ(stdMap.try_emplace(key, value).second,
+                map.try_emplace(key, value).second);
+      break;
+    case 2:
+      EXPECT_EQ(stdMap.insert_or_assign(key, value).second,
+                map.insert_or_assign(key, value).second);
+      break;
+    case 3:
+      stdMap.erase(key);
+      map.erase(key);
+      break;
+    default: {
+      auto it = map.lower_bound(key);
+      auto stdIt = stdMap.lower_bound(key);
+      ASSERT_EQ(stdIt == stdMap.end(), it == map.end());
+      if (it != map.end()) {
+        EXPECT_EQ(stdIt->first, it->first);
+        EXPECT_EQ(stdIt->second, it->second);
+      }
+      EXPECT_EQ(stdMap.count(key) != 0, map.contains(key));
+    }
+    }
+  }
+  ASSERT_EQ(stdMap.size(), map.size());
+  EXPECT_TRUE(std::equal(map.begin(), map.end(), stdMap.begin()));
+  for (const auto &el : stdMap) {
+    EXPECT_EQ(el.second, map.at(el.first));
+  }
+  EXPECT_THROW(map.at(-1), std::out_of_range);
+}
+
+TEST(map, iteratorsTest) {
+  Map<std::string, int> map{{"b", 2}, {"a", 1}, {"c", 3}, {"a", 4}};
+  ASSERT_EQ(3u, map.size());
+  EXPECT_EQ(1, map.at("a"));
+  for (auto &el : map) {
+    el.second *= 10;
+  }
+  map.find("b")->second += 1;
+  const Map<std::string, int> &constMap = map;
+  std::vector<std::pair<const std::string, int>> expected{
+      {"a", 10}, {"b", 21}, {"c", 30}};
+  EXPECT_TRUE(
+      std::equal(constMap.begin(), constMap.end(), expected.begin()));
+  Map<std::string, int>::const_iterator it = map.end();
+  EXPECT_TRUE(it == constMap.end());
+  --it;
+  EXPECT_EQ("c", it->first);
+  EXPECT_EQ(map.upper_bound("b"), it);
+
+  // try_emplace leaves its arguments alone when the key is present.
+  Map<int, std::unique_ptr<int>> owners;
+  std::unique_ptr<int> value(new int(1));
+  EXPECT_TRUE(owners.try_emplace(1, std::move(value)).second);
+  EXPECT_EQ(nullptr, value);
+  value.reset(new int(2));
+  EXPECT_FALSE(owners.try_emplace(1, std::move(value)).second);
+  ASSERT_NE(nullptr, value);
+  EXPECT_EQ(1, *owners[1]);
+  EXPECT_FALSE(owners.insert_or_assign(1, std::move(value)).second);
+  EXPECT_EQ(2, *owners[1]);
+  EXPECT_EQ(nullptr, owners[2]);
+  EXPECT_EQ(2u, owners.size());
+
+  Map<std::string, int> copy(map);
+  copy["a"] = 0;
+  EXPECT_EQ(10, map["a"]);
+  copy.swap(map);
+  EXPECT_EQ(0, map["a"]);
+}
+
+TEST(map, valueMemoryUsageTest) {
+  GlobalMemoryUsage before = global_memory_usage();
+  {
+    Map<std::string, std::string> map;
+    std::string key(100, 'k');
+    map[key];
+    map[key] = std::string(1000, 'x');
+    map.insert_or_assign(std::string(200, 'l'), std::string(10, 'y'));
+    map.begin()->second.assign(5000, 'z');
+    MemoryUsage usage = map.memory_usage();
+    EXPECT_LE(100u + 200u + 5000u, usage.m_KeyHeapBytes);
+    GlobalMemoryUsage during = global_memory_usage();
+    EXPECT_LE(before.m_KeyHeapBytes + 300u, during.m_KeyHeapBytes);
+    EXPECT_GT(before.m_KeyHeapBytes + 1000u, during.m_KeyHeapBytes);
+    map.erase(key);
+  }
+  EXPECT_EQ(before.m_KeyHeapBytes, global_memory_usage().m_KeyHeapBytes);
+}
+
+TEST(multiSet, randomOperationsTest) {
+  std::mt19937 gen(25);
+  MultiSet<int> set;
+  std::multiset<int> stdSet;
+  for (int i = 0; i < 20000; ++i) {
+    int key = (int)(gen() % 100);
+    switch (gen() % 5) {
+    case 0:
+    case 1:
+      EXPECT_EQ(key, *set.insert(key));
+      stdSet.insert(key);
+      break;
+    case 2: {
+      auto stdIt = stdSet.find(key);
+      EXPECT_EQ(stdIt != stdSet.end(), set.erase_one(key));
+      if (stdIt != stdSet.end()) {
+        stdSet.erase(stdIt);
+      }
+      break;
+    }
+    case 3:
+      if (gen() % 10 == 0) {
+        EXPECT_EQ(stdSet.erase(key), set.erase(key));
+      }
+      break;
+    default: {
+      EXPECT_EQ(stdSet.count(key), set.count(key));
+      size_t rank = std::distance(stdSet.begin(), stdSet.lower_bound(key));
+      EXPECT_EQ(rank, set.rank(key));
+      EXPECT_EQ(rank, set.index_of(set.lower_bound(key)));
+      EXPECT_EQ(std::distance(stdSet.lower_bound(key), stdSet.end()),
+                std::distance(set.lower_bound(key), set.end()));
+      int hi = key + (int)(gen() % 20);
+      EXPECT_EQ((size_t)std::distance(stdSet.lower_bound(key),
+                                      stdSet.lower_bound(hi)),
+                set.count_range(key, hi));
+    }
+    }
+  }
+  ASSERT_EQ(stdSet.size(), set.size());
+  EXPECT_TRUE(std::equal(set.begin(), set.end(), stdSet.begin()));
+  EXPECT_TRUE(std::equal(stdSet.rbegin(), stdSet.rend(),
+                         std::make_reverse_iterator(set.end())));
+  auto stdIt = stdSet.begin();
+  for (size_t k = 0; k < stdSet.size(); ++k, ++stdIt) {
+    auto it = set.nth(k);
+    ASSERT_EQ(*stdIt, *it);
+    EXPECT_EQ(k, set.index_of(it));
+  }
+  EXPECT_EQ(set.end(), set.nth(set.size()));
+}
+
+TEST(multiSet, duplicatesTest) {
+  MultiSet<std::string> set{"b", "a", "b", "c", "b"};
+  ASSERT_EQ(5u, set.size());
+  EXPECT_EQ(3u, set.count("b"));
+  EXPECT_EQ(0u, set.count("d"));
+  std::vector<std::string> expected{"a", "b", "b", "b", "c"};
+  EXPECT_TRUE(std::equal(set.begin(), set.end(), expected.begin()));
+  auto range = set.equal_range("b");
+  EXPECT_EQ(3, std::distance(range.first, range.second));
+  EXPECT_EQ(set.nth(1), range.first);
+  EXPECT_EQ(set.nth(4), range.second);
+  auto it = set.end();
+  --it;
+  --it;
+  EXPECT_EQ("b", *it);
+  EXPECT_EQ(3u, set.index_of(it));
+
+  // Copies share one node.
+  for (int i = 0; i < 1000; ++i) {
+    set.insert("a");
+  }
+  EXPECT_EQ(1005u, set.size());
+  EXPECT_EQ(3u, set.memory_usage().m_NodesNum);
+  EXPECT_EQ(1001u, set.rank("b"));
+  EXPECT_EQ(4u, set.count_range("b", "d"));
+
+  EXPECT_TRUE(set.erase_one("c"));
+  EXPECT_FALSE(set.erase_one("c"));
+  EXPECT_FALSE(set.contains("c"));
+  EXPECT_EQ(3u, set.erase("b"));
+  EXPECT_EQ(0u, set.erase("b"));
+  EXPECT_EQ(1001u, set.size());
+
+  {
+    MultiSet<std::string, std::less<std::string>,
+             std::allocator<std::string>, CountingTreeStats>
+        counted{"x", "y", "x"};
+    counted.clear();
+    EXPECT_EQ(2u, counted.stats().m_Allocations);
+    EXPECT_EQ(2u, counted.stats().m_Deallocations);
+  }
+
+  MultiSet<std::string> copy(set);
+  copy.insert("a");
+  EXPECT_EQ(1001u, set.count("a"));
+  EXPECT_EQ(1002u, copy.count("a"));
+  copy.swap(set);
+  EXPECT_EQ(1002u, set.size());
+  set.clear();
+  EXPECT_TRUE(set.empty());
+  EXPECT_EQ(set.begin(), set.end());
+}